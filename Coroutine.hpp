@@ -0,0 +1,503 @@
+#ifndef MS_COROUTINE_HPP
+#define MS_COROUTINE_HPP
+
+/**
+ * Optional C++20 coroutine layer over TcpConnection, TcpClient and Timer. The
+ * library itself is C++11, only code including this needs -std=c++20:
+ *
+ *   CoTask Echo(CoTcpConnection *connection) {
+ *       for (;;) {
+ *           auto data = co_await connection->Read();
+ *
+ *           if (data.len == 0 || !co_await connection->Write(data.data, data.len))
+ *               co_return;
+ *       }
+ *   }
+ *
+ * Coroutines run in the loop thread, frames come from a per thread (so per
+ * loop) pool and awaiting a write allocates nothing. A connection is deleted
+ * by its owner once closed: a coroutine must stop using it once Read()
+ * returns no data or Write() false, and must not delete it itself.
+ */
+
+#if __cplusplus < 202002L || !__has_include(<coroutine>)
+#error "Coroutine.hpp needs C++20 coroutines"
+#endif
+
+#include <coroutine>
+#include <exception> // std::terminate()
+#include <new>
+#include <string>
+#include "TcpClient.hpp"
+#include "TcpConnection.hpp"
+#include "Timer.hpp"
+
+/**
+ * Free lists of coroutine frames by size (64 bytes steps), per thread.
+ */
+class CoFramePool {
+private:
+	static constexpr size_t ClassSize { 64 };
+	static constexpr size_t NumClasses { 16 };
+	// Free frames kept per size.
+	static constexpr size_t MaxFreeFrames { 64 };
+
+	struct FreeFrame {
+		FreeFrame *next;
+	};
+
+	struct Pool {
+		~Pool() {
+			for (auto *frame : this->freeFrames) {
+				while (frame) {
+					auto *next = frame->next;
+
+					::operator delete(frame);
+					frame = next;
+				}
+			}
+		}
+
+		FreeFrame *freeFrames[NumClasses] {};
+		size_t numFreeFrames[NumClasses] {};
+	};
+
+public:
+	static void* Alloc(size_t size);
+	static void Free(void *ptr, size_t size);
+
+private:
+	static Pool& GetPool();
+};
+
+/**
+ * Coroutine started at once and destroying itself once done. Nothing awaits
+ * it (fire and forget): it gets its results through awaitables.
+ */
+class CoTask {
+public:
+	struct promise_type {
+		CoTask get_return_object() noexcept {
+			return {};
+		}
+
+		std::suspend_never initial_suspend() noexcept {
+			return {};
+		}
+
+		std::suspend_never final_suspend() noexcept {
+			return {};
+		}
+
+		void return_void() noexcept {
+		}
+
+		// Like an exception in a UV callback.
+		void unhandled_exception() noexcept {
+			std::terminate();
+		}
+
+		static void* operator new(size_t size) {
+			return CoFramePool::Alloc(size);
+		}
+
+		static void operator delete(void *ptr, size_t size) {
+			CoFramePool::Free(ptr, size);
+		}
+	};
+};
+
+/**
+ * co_await CoSleep(ms) resumes the coroutine after ms.
+ */
+class CoSleep : public Timer::Listener {
+public:
+	explicit CoSleep(uint64_t timeout) :
+			timeout(timeout) {
+	}
+	CoSleep& operator=(const CoSleep&) = delete;
+	CoSleep(const CoSleep&) = delete;
+	virtual ~CoSleep() {
+		delete this->timer;
+	}
+
+public:
+	bool await_ready() const noexcept {
+		return false;
+	}
+
+	void await_suspend(std::coroutine_handle<> handle) {
+		this->handle = handle;
+		this->timer = new Timer(this);
+		this->timer->Start(this->timeout);
+	}
+
+	void await_resume() const noexcept {
+	}
+
+	/* Methods inherited from Timer::Listener. */
+public:
+	void OnTimer(Timer* /*timer*/) override {
+		this->handle.resume();
+	}
+
+private:
+	uint64_t timeout { 0 };
+	Timer *timer { nullptr };
+	std::coroutine_handle<> handle;
+};
+
+/**
+ * TcpConnection read and written by a coroutine. It can be given to the
+ * connections of a TcpServer (UserOnTcpConnectionAlloc()) and is the one of a
+ * CoTcpClient.
+ */
+class CoTcpConnection : public TcpConnection {
+public:
+	/* Data read, valid until the next Read(). No data once closed. */
+	struct ReadResult {
+		const uint8_t *data { nullptr };
+		size_t len { 0 };
+	};
+
+	class ReadAwaiter {
+	public:
+		explicit ReadAwaiter(CoTcpConnection *connection) :
+				connection(connection) {
+		}
+
+	public:
+		bool await_ready() const noexcept {
+			return this->connection->bufferDataLen != 0
+					|| this->connection->IsClosed();
+		}
+
+		void await_suspend(std::coroutine_handle<> handle) noexcept {
+			this->connection->reader = handle;
+		}
+
+		ReadResult await_resume() const noexcept {
+			return this->connection->TakeReadData();
+		}
+
+	private:
+		CoTcpConnection *connection { nullptr };
+	};
+
+	class WriteAwaiter : public TcpConnection::WriteListener {
+	public:
+		WriteAwaiter(CoTcpConnection *connection, const uint8_t *data,
+				size_t len) :
+				connection(connection), data(data), len(len) {
+		}
+
+	public:
+		bool await_ready() const noexcept {
+			return false;
+		}
+
+		bool await_suspend(std::coroutine_handle<> handle) {
+			this->handle = handle;
+			this->connection->LinkWriter(this);
+
+			this->writing = true;
+			this->connection->TcpConnection::Write(this->data, this->len, *this);
+			this->writing = false;
+
+			// Don't suspend if already written (or failed).
+			return !this->done;
+		}
+
+		bool await_resume() const noexcept {
+			return this->written;
+		}
+
+		/* Methods inherited from TcpConnection::WriteListener. */
+	public:
+		void OnTcpConnectionWritten(TcpConnection* /*connection*/,
+				bool written) override {
+			Complete(written);
+		}
+
+	private:
+		friend class CoTcpConnection;
+
+		void Complete(bool written) {
+			this->connection->UnlinkWriter(this);
+			this->written = written;
+			this->done = true;
+
+			if (!this->writing)
+				this->handle.resume();
+		}
+
+	private:
+		CoTcpConnection *connection { nullptr };
+		const uint8_t *data { nullptr };
+		size_t len { 0 };
+		std::coroutine_handle<> handle;
+		bool writing { false };
+		bool done { false };
+		bool written { false };
+		// Writes in flight, see LinkWriter().
+		WriteAwaiter *prev { nullptr };
+		WriteAwaiter *next { nullptr };
+	};
+
+public:
+	explicit CoTcpConnection(size_t bufferSize) :
+			TcpConnection(bufferSize) {
+		SetPauseReadingOnFullBuffer(true);
+	}
+
+public:
+	/**
+	 * Resumes with the data received since the previous Read(), which is
+	 * consumed then.
+	 */
+	ReadAwaiter Read() {
+		ConsumeReadData();
+
+		return ReadAwaiter(this);
+	}
+
+	/**
+	 * Resumes with whether the data was written. What cannot be written at
+	 * once is copied, so data may be reused after the co_await.
+	 */
+	WriteAwaiter Write(const uint8_t *data, size_t len) {
+		return WriteAwaiter(this, data, len);
+	}
+
+	WriteAwaiter Write(const std::string &data) {
+		return WriteAwaiter(this,
+				reinterpret_cast<const uint8_t*>(data.data()), data.size());
+	}
+
+private:
+	ReadResult TakeReadData() {
+		this->readLen = this->bufferDataLen;
+
+		return { this->readLen != 0 ? this->buffer : nullptr, this->readLen };
+	}
+
+	void ConsumeReadData() {
+		if (this->readLen == 0)
+			return;
+
+		// Keep what was received after it.
+		std::memmove(this->buffer, this->buffer + this->readLen,
+				this->bufferDataLen - this->readLen);
+
+		this->bufferDataLen -= this->readLen;
+		this->readLen = 0;
+
+		if (!IsClosed())
+			ResumeReading(ReadPauseReason::BUFFER_FULL);
+	}
+
+	void LinkWriter(WriteAwaiter *writer) {
+		writer->next = this->writers;
+
+		if (this->writers)
+			this->writers->prev = writer;
+
+		this->writers = writer;
+	}
+
+	void UnlinkWriter(WriteAwaiter *writer) {
+		if (writer->prev)
+			writer->prev->next = writer->next;
+		else
+			this->writers = writer->next;
+
+		if (writer->next)
+			writer->next->prev = writer->prev;
+
+		writer->prev = nullptr;
+		writer->next = nullptr;
+	}
+
+	/* Pure virtual methods inherited from TcpConnection. */
+protected:
+	void UserOnTcpConnectionRead() override {
+		if (!this->reader)
+			return;
+
+		auto reader = this->reader;
+
+		this->reader = nullptr;
+		reader.resume();
+	}
+
+	/* Virtual methods inherited from TcpConnection. */
+protected:
+	void UserOnTcpConnectionReset() override {
+		SetPauseReadingOnFullBuffer(true);
+
+		this->readLen = 0;
+	}
+
+	// The writes in flight are not notified once closed, fail them here.
+	void UserOnTcpConnectionClosed() override {
+		while (this->writers)
+			this->writers->Complete(false);
+
+		UserOnTcpConnectionRead();
+	}
+
+private:
+	std::coroutine_handle<> reader;
+	WriteAwaiter *writers { nullptr };
+	// Length of the data given by the last Read().
+	size_t readLen { 0 };
+};
+
+/**
+ * TcpClient connected by a coroutine:
+ *
+ *   CoTcpConnection *connection = co_await client->Connect(ip, port);
+ *
+ * The connection is nullptr if connecting failed. The client owns it and
+ * deletes it once closed. Not meant for a ReconnectPolicy.
+ */
+class CoTcpClient : public TcpClient {
+public:
+	class ConnectAwaiter {
+	public:
+		ConnectAwaiter(CoTcpClient *client, const std::string &ip, uint16_t port) :
+				client(client), ip(ip), port(port) {
+		}
+
+	public:
+		bool await_ready() const noexcept {
+			return false;
+		}
+
+		bool await_suspend(std::coroutine_handle<> handle) {
+			if (this->client->TcpClient::Connect(this->ip, this->port) != 0)
+				return false;
+
+			this->client->connecter = handle;
+
+			return true;
+		}
+
+		CoTcpConnection* await_resume() const noexcept {
+			return this->client->TakeConnection();
+		}
+
+	private:
+		CoTcpClient *client { nullptr };
+		std::string ip;
+		uint16_t port { 0 };
+	};
+
+public:
+	explicit CoTcpClient(size_t bufferSize = 65536) :
+			bufferSize(bufferSize) {
+	}
+
+public:
+	ConnectAwaiter Connect(const std::string &ip, uint16_t port) {
+		return ConnectAwaiter(this, ip, port);
+	}
+
+private:
+	CoTcpConnection* TakeConnection() {
+		auto *connection = this->connected;
+
+		this->connected = nullptr;
+
+		return connection;
+	}
+
+	void ResumeConnecter(CoTcpConnection *connection) {
+		if (!this->connecter)
+			return;
+
+		auto connecter = this->connecter;
+
+		this->connecter = nullptr;
+		this->connected = connection;
+		connecter.resume();
+	}
+
+	/* Pure virtual methods inherited from TcpClient. */
+protected:
+	void UserOnTcpConnectionAlloc(TcpConnection **connection) override {
+		*connection = new CoTcpConnection(this->bufferSize);
+	}
+
+	bool UserOnNewTcpConnection(TcpConnection *connection) override {
+		ResumeConnecter(static_cast<CoTcpConnection*>(connection));
+
+		return true;
+	}
+
+	void UserOnTcpConnectionClosed(TcpConnection* /*connection*/) override {
+	}
+
+	/* Virtual methods inherited from TcpClient. */
+protected:
+	void UserOnTcpConnectFailed(int /*error*/) override {
+		ResumeConnecter(nullptr);
+	}
+
+private:
+	size_t bufferSize { 0 };
+	std::coroutine_handle<> connecter;
+	CoTcpConnection *connected { nullptr };
+};
+
+/* Inline static methods. */
+
+inline CoFramePool::Pool& CoFramePool::GetPool() {
+	static thread_local Pool pool;
+
+	return pool;
+}
+
+inline void* CoFramePool::Alloc(size_t size) {
+	size_t sizeClass = (size - 1) / ClassSize;
+
+	if (sizeClass >= NumClasses)
+		return ::operator new(size);
+
+	Pool &pool = GetPool();
+	FreeFrame *frame = pool.freeFrames[sizeClass];
+
+	if (!frame)
+		return ::operator new((sizeClass + 1) * ClassSize);
+
+	pool.freeFrames[sizeClass] = frame->next;
+	pool.numFreeFrames[sizeClass]--;
+
+	return frame;
+}
+
+inline void CoFramePool::Free(void *ptr, size_t size) {
+	size_t sizeClass = (size - 1) / ClassSize;
+
+	if (sizeClass >= NumClasses) {
+		::operator delete(ptr);
+
+		return;
+	}
+
+	Pool &pool = GetPool();
+
+	if (pool.numFreeFrames[sizeClass] == MaxFreeFrames) {
+		::operator delete(ptr);
+
+		return;
+	}
+
+	auto *frame = static_cast<FreeFrame*>(ptr);
+
+	frame->next = pool.freeFrames[sizeClass];
+	pool.freeFrames[sizeClass] = frame;
+	pool.numFreeFrames[sizeClass]++;
+}
+
+#endif
@@ -4,6 +4,11 @@
 #include <stdint.h>
 #include <uv.h>
 
+/**
+ * The loop is per thread: every thread running a loop calls ClassInit() (and
+ * ClassDestroy()) and the classes using GetLoop() run on the loop of the
+ * thread they are created in.
+ */
 class DepLibUV {
 public:
 	static void ClassInit();
@@ -16,7 +21,7 @@ public:
 	static uint64_t GetTimeNs();
 
 private:
-	static uv_loop_t *loop;
+	static thread_local uv_loop_t *loop;
 };
 
 /* Inline static methods. */
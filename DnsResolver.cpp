@@ -0,0 +1,253 @@
+#define UV_CLASS "DnsResolver"
+// #define UV_LOG_DEV_LEVEL 3
+
+#include "DnsResolver.hpp"
+#include "DepLibUV.hpp"
+#include "Logger.hpp"
+#include "LibUVErrors.hpp"
+#include <algorithm> // std::find()
+
+/* Static methods for UV callbacks. */
+
+inline static void onGetAddrInfo(uv_getaddrinfo_t *req, int status,
+		struct addrinfo *res) {
+	DnsResolver::OnUvGetAddrInfo(
+			static_cast<DnsResolver::Query*>(req->data), status, res);
+}
+
+/* Static variables. */
+
+thread_local std::unordered_map<std::string, DnsResolver::CacheEntry> DnsResolver::cache;
+thread_local std::unordered_map<std::string, DnsResolver::Query*> DnsResolver::queries;
+thread_local std::unordered_map<uint64_t, DnsResolver::Query*> DnsResolver::pendingIds;
+thread_local uint64_t DnsResolver::nextId { 1 };
+uint64_t DnsResolver::cacheTtl { 30000 };
+uint64_t DnsResolver::negativeCacheTtl { 5000 };
+size_t DnsResolver::maxCacheEntries { 4096 };
+
+/* Static methods. */
+
+/**
+ * Resolves hostname into its IPv4 and IPv6 addresses and calls cb with them,
+ * or with a UV error code. If the answer is cached (or hostname is an IP) cb
+ * is called before returning and 0 is returned. Otherwise returns an id that
+ * can be given to Cancel(). Throws if the lookup cannot be started.
+ */
+uint64_t DnsResolver::Resolve(const std::string &hostname,
+		onResolveCallback *cb) {
+
+	int error;
+	std::vector<std::string> ips;
+
+	if (GetCached(hostname, error, ips)) {
+		(*cb)(error, ips);
+		delete cb;
+
+		return 0;
+	}
+
+	uint64_t id = DnsResolver::nextId++;
+	auto it = DnsResolver::queries.find(hostname);
+
+	// Join the query in flight.
+	if (it != DnsResolver::queries.end()) {
+		it->second->callbacks.emplace_back(id, cb);
+		DnsResolver::pendingIds[id] = it->second;
+
+		return id;
+	}
+
+	auto *query = new Query;
+	struct addrinfo hints = { };
+
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_ADDRCONFIG;
+
+	query->req.data = static_cast<void*>(query);
+	query->hostname = hostname;
+
+	int err = uv_getaddrinfo(DepLibUV::GetLoop(), &query->req,
+			static_cast<uv_getaddrinfo_cb>(onGetAddrInfo), hostname.c_str(),
+			nullptr, &hints);
+
+	if (err != 0) {
+		delete query;
+		delete cb;
+
+		UV_THROW_ERROR("uv_getaddrinfo() failed: %s", uv_strerror(err));
+	}
+
+	query->callbacks.emplace_back(id, cb);
+	DnsResolver::queries[hostname] = query;
+	DnsResolver::pendingIds[id] = query;
+
+	return id;
+}
+
+/**
+ * The callback of the given Resolve() will not be called. The lookup goes on
+ * and its answer is cached.
+ */
+void DnsResolver::Cancel(uint64_t id) {
+
+	auto it = DnsResolver::pendingIds.find(id);
+
+	if (it == DnsResolver::pendingIds.end())
+		return;
+
+	for (auto &callback : it->second->callbacks) {
+		if (callback.first == id) {
+			delete callback.second;
+			callback.second = nullptr;
+
+			break;
+		}
+	}
+
+	DnsResolver::pendingIds.erase(it);
+}
+
+/**
+ * Returns true and fills error and ips if hostname is an IP or its answer is
+ * cached.
+ */
+bool DnsResolver::GetCached(const std::string &hostname, int &error,
+		std::vector<std::string> &ips) {
+
+	unsigned char addr[sizeof(struct in6_addr)];
+
+	if (uv_inet_pton(AF_INET, hostname.c_str(), addr) == 0
+			|| uv_inet_pton(AF_INET6, hostname.c_str(), addr) == 0) {
+		error = 0;
+		ips.assign(1, hostname);
+
+		return true;
+	}
+
+	auto it = DnsResolver::cache.find(hostname);
+
+	if (it == DnsResolver::cache.end())
+		return false;
+
+	if (it->second.expiresAt <= DepLibUV::GetTimeMs()) {
+		DnsResolver::cache.erase(it);
+
+		return false;
+	}
+
+	error = it->second.error;
+	ips = it->second.ips;
+
+	return true;
+}
+
+/**
+ * Time (ms) answers and failures are cached, 0 disables caching them.
+ */
+void DnsResolver::SetCacheTtl(uint64_t cacheTtl, uint64_t negativeCacheTtl) {
+	DnsResolver::cacheTtl = cacheTtl;
+	DnsResolver::negativeCacheTtl = negativeCacheTtl;
+}
+
+void DnsResolver::SetMaxCacheEntries(size_t maxCacheEntries) {
+	DnsResolver::maxCacheEntries = maxCacheEntries;
+}
+
+void DnsResolver::ClearCache() {
+	DnsResolver::cache.clear();
+}
+
+void DnsResolver::AddCacheEntry(const std::string &hostname, int error,
+		std::vector<std::string> &ips) {
+
+	uint64_t ttl = (error == 0) ? DnsResolver::cacheTtl : DnsResolver::negativeCacheTtl;
+
+	if (ttl == 0 || DnsResolver::maxCacheEntries == 0)
+		return;
+
+	uint64_t now = DepLibUV::GetTimeMs();
+
+	if (DnsResolver::cache.size() >= DnsResolver::maxCacheEntries) {
+		// Drop the expired entries, or any entry if none.
+		for (auto it = DnsResolver::cache.begin(); it != DnsResolver::cache.end();) {
+			if (it->second.expiresAt <= now)
+				it = DnsResolver::cache.erase(it);
+			else
+				++it;
+		}
+
+		if (DnsResolver::cache.size() >= DnsResolver::maxCacheEntries)
+			DnsResolver::cache.erase(DnsResolver::cache.begin());
+	}
+
+	auto &entry = DnsResolver::cache[hostname];
+
+	entry.ips = ips;
+	entry.error = error;
+	entry.expiresAt = now + ttl;
+}
+
+inline void DnsResolver::OnUvGetAddrInfo(Query *query, int status,
+		struct addrinfo *res) {
+
+	std::vector<std::string> ips;
+
+	if (status == 0) {
+		for (auto *ai = res; ai != nullptr; ai = ai->ai_next) {
+			char ipBuffer[INET6_ADDRSTRLEN] = { 0 };
+			int err;
+
+			switch (ai->ai_family) {
+			case AF_INET:
+				err = uv_ip4_name(
+						reinterpret_cast<const struct sockaddr_in*>(ai->ai_addr),
+						ipBuffer, sizeof(ipBuffer));
+				break;
+
+			case AF_INET6:
+				err = uv_ip6_name(
+						reinterpret_cast<const struct sockaddr_in6*>(ai->ai_addr),
+						ipBuffer, sizeof(ipBuffer));
+				break;
+
+			default:
+				continue;
+			}
+
+			if (err != 0)
+				continue;
+
+			std::string ip { ipBuffer };
+
+			if (std::find(ips.begin(), ips.end(), ip) == ips.end())
+				ips.push_back(std::move(ip));
+		}
+
+		if (ips.empty())
+			status = UV_EAI_NODATA;
+	} else {
+		UV_DEBUG_DEV("cannot resolve %s: %s", query->hostname.c_str(),
+				uv_strerror(status));
+	}
+
+	uv_freeaddrinfo(res);
+
+	DnsResolver::queries.erase(query->hostname);
+
+	// Not an answer from the DNS.
+	if (status != UV_ECANCELED)
+		AddCacheEntry(query->hostname, status, ips);
+
+	for (auto &callback : query->callbacks) {
+		if (callback.second == nullptr)
+			continue;
+
+		DnsResolver::pendingIds.erase(callback.first);
+
+		(*callback.second)(status, ips);
+		delete callback.second;
+	}
+
+	delete query;
+}
@@ -0,0 +1,78 @@
+#ifndef MS_DNS_RESOLVER_HPP
+#define MS_DNS_RESOLVER_HPP
+
+#include <uv.h>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/**
+ * Asynchronous hostname resolution with uv_getaddrinfo() (run in the libuv
+ * thread pool) and an in-process cache.
+ *
+ * Answers are cached for cacheTtl ms and failures for negativeCacheTtl ms.
+ * Concurrent lookups of the same hostname share a single uv_getaddrinfo()
+ * request. IP literals are returned as they are.
+ *
+ * The cache and the queries belong to the calling thread (each loop thread
+ * has its own), the TTL and size settings are shared by all of them.
+ */
+class DnsResolver {
+public:
+	using onResolveCallback = const std::function<void(int error, const std::vector<std::string> &ips)>;
+
+	/* A uv_getaddrinfo() request in flight. */
+	struct Query {
+		uv_getaddrinfo_t req;
+		std::string hostname;
+		// Callbacks waiting for this query, by id (nullptr if cancelled).
+		std::vector<std::pair<uint64_t, onResolveCallback*>> callbacks;
+	};
+
+private:
+	struct CacheEntry {
+		std::vector<std::string> ips;
+		int error { 0 };
+		uint64_t expiresAt { 0 };
+	};
+
+public:
+	static uint64_t Resolve(const std::string &hostname, onResolveCallback *cb);
+	static void Cancel(uint64_t id);
+	static bool GetCached(const std::string &hostname, int &error,
+			std::vector<std::string> &ips);
+	static void SetCacheTtl(uint64_t cacheTtl, uint64_t negativeCacheTtl);
+	static void SetMaxCacheEntries(size_t maxCacheEntries);
+	static void ClearCache();
+	static size_t GetCacheSize();
+
+private:
+	static void AddCacheEntry(const std::string &hostname, int error,
+			std::vector<std::string> &ips);
+
+	/* Callbacks fired by UV events. */
+public:
+	static void OnUvGetAddrInfo(Query *query, int status,
+			struct addrinfo *res);
+
+private:
+	// Per thread, as the queries run on the loop of the calling thread.
+	static thread_local std::unordered_map<std::string, CacheEntry> cache;
+	static thread_local std::unordered_map<std::string, Query*> queries;
+	// Query of every pending callback id.
+	static thread_local std::unordered_map<uint64_t, Query*> pendingIds;
+	static thread_local uint64_t nextId;
+	static uint64_t cacheTtl;
+	static uint64_t negativeCacheTtl;
+	static size_t maxCacheEntries;
+};
+
+/* Inline static methods. */
+
+inline size_t DnsResolver::GetCacheSize() {
+	return DnsResolver::cache.size();
+}
+
+#endif
@@ -36,7 +36,7 @@ inline LibUVTypeError::LibUVTypeError(const char* description) : LibUVError(desc
 	{ \
 		UV_ERROR("throwing LibUVError: " desc, ##__VA_ARGS__); \
 		\
-		static char buffer[2000]; \
+		static thread_local char buffer[2000]; \
 		\
 		std::snprintf(buffer, 2000, desc, ##__VA_ARGS__); \
 		throw LibUVError(buffer); \
@@ -47,7 +47,7 @@ inline LibUVTypeError::LibUVTypeError(const char* description) : LibUVError(desc
 	{ \
 		UV_ERROR_STD("throwing LibUVError: " desc, ##__VA_ARGS__); \
 		\
-		static char buffer[2000]; \
+		static thread_local char buffer[2000]; \
 		\
 		std::snprintf(buffer, 2000, desc, ##__VA_ARGS__); \
 		throw LibUVError(buffer); \
@@ -58,7 +58,7 @@ inline LibUVTypeError::LibUVTypeError(const char* description) : LibUVError(desc
 	{ \
 		UV_ERROR("throwing LibUVTypeError: " desc, ##__VA_ARGS__); \
 		\
-		static char buffer[2000]; \
+		static thread_local char buffer[2000]; \
 		\
 		std::snprintf(buffer, 2000, desc, ##__VA_ARGS__); \
 		throw LibUVTypeError(buffer); \
@@ -69,7 +69,7 @@ inline LibUVTypeError::LibUVTypeError(const char* description) : LibUVError(desc
 	{ \
 		UV_ERROR_STD("throwing LibUVTypeError: " desc, ##__VA_ARGS__); \
 		\
-		static char buffer[2000]; \
+		static thread_local char buffer[2000]; \
 		\
 		std::snprintf(buffer, 2000, desc, ##__VA_ARGS__); \
 		throw LibUVTypeError(buffer); \
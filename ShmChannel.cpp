@@ -0,0 +1,524 @@
+/**
+ * NOTE: Like UnixStreamSocket this cannot log to the Channel.
+ */
+
+#define UV_CLASS "ShmChannel"
+// #define UV_LOG_DEV_LEVEL 3
+#include <uv.h>
+#include "ShmChannel.hpp"
+#include "DepLibUV.hpp"
+#include "Logger.hpp"
+#include "LibUVErrors.hpp"
+#include <algorithm> // std::min()
+#include <cerrno>
+#include <cstring> // std::memcpy(), std::strerror()
+#include <new> // placement new
+#include <fcntl.h> // fcntl()
+#include <sys/eventfd.h>
+#include <sys/mman.h> // memfd_create(), mmap()
+#include <sys/stat.h> // fstat()
+#include <unistd.h>
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+		"shared memory atomics must be lock free");
+
+static constexpr size_t MinCapacity { 4096 };
+// Max chunks read per wakeup so a fast producer does not starve the loop.
+static constexpr size_t MaxReadsPerPoll { 32 };
+
+/* Static methods for UV callbacks. */
+
+inline static void onPoll(uv_poll_t *handle, int status, int /*events*/) {
+	auto *channel = static_cast<ShmChannel*>(handle->data);
+
+	if (channel)
+		channel->OnUvPoll(status);
+}
+
+inline static void onClose(uv_handle_t *handle) {
+	delete handle;
+}
+
+inline static void signalFd(int fd) {
+	uint64_t value { 1 };
+
+	// Can only fail when the counter overflows, which is still a wakeup.
+	ssize_t ret = write(fd, &value, sizeof(value));
+	(void) ret;
+}
+
+inline static void drainFd(int fd) {
+	uint64_t value;
+
+	ssize_t ret = read(fd, &value, sizeof(value));
+	(void) ret;
+}
+
+/* Static. */
+
+/**
+ * The capacity of the ring is rounded up to a power of two (4096 at least).
+ * Throws if the memfd or an eventfd cannot be created.
+ */
+ShmChannel::Fds ShmChannel::CreateFds(size_t capacity) {
+	Fds fds;
+	size_t roundedCapacity { MinCapacity };
+
+	while (roundedCapacity < capacity)
+		roundedCapacity <<= 1;
+
+	size_t mapSize = sizeof(Header) + roundedCapacity;
+
+	fds.memFd = memfd_create("ShmChannel", MFD_CLOEXEC);
+	fds.dataFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	fds.spaceFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	int error = errno;
+
+	if (fds.memFd == -1 || fds.dataFd == -1 || fds.spaceFd == -1) {
+		CloseFds(fds);
+
+		UV_THROW_ERROR_STD("memfd_create() or eventfd() failed: %s",
+				std::strerror(error));
+	}
+
+	void *addr { MAP_FAILED };
+
+	if (ftruncate(fds.memFd, static_cast<off_t>(mapSize)) == 0)
+		addr = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED,
+				fds.memFd, 0);
+
+	if (addr == MAP_FAILED) {
+		error = errno;
+
+		CloseFds(fds);
+
+		UV_THROW_ERROR_STD("ftruncate() or mmap() failed: %s",
+				std::strerror(error));
+	}
+
+	auto *header = new (addr) Header();
+
+	header->head.store(0);
+	header->producerWaiting.store(0);
+	header->producerClosed.store(0);
+	header->tail.store(0);
+	// The consumer starts asleep, so the first write wakes it up.
+	header->consumerWaiting.store(1);
+	header->consumerClosed.store(0);
+	header->capacity = roundedCapacity;
+
+	munmap(addr, mapSize);
+
+	return fds;
+}
+
+/**
+ * Closes the fds of the caller, the ShmChannels keep their own.
+ */
+void ShmChannel::CloseFds(ShmChannel::Fds &fds) {
+	for (int *fd : { &fds.memFd, &fds.dataFd, &fds.spaceFd }) {
+		if (*fd != -1)
+			close(*fd);
+
+		*fd = -1;
+	}
+}
+
+/* Instance methods. */
+
+ShmChannel::ShmChannel(const ShmChannel::Fds &fds, size_t bufferSize,
+		ShmChannel::Role role) :
+		bufferSize(bufferSize), role(role) {
+
+	struct stat st;
+	int err;
+
+	if (fstat(fds.memFd, &st) != 0
+			|| static_cast<size_t>(st.st_size) <= sizeof(Header))
+		UV_THROW_ERROR_STD("invalid shared memory fd");
+
+	this->mapSize = static_cast<size_t>(st.st_size);
+
+	void *addr = mmap(nullptr, this->mapSize, PROT_READ | PROT_WRITE,
+			MAP_SHARED, fds.memFd, 0);
+
+	if (addr == MAP_FAILED)
+		UV_THROW_ERROR_STD("mmap() failed: %s", std::strerror(errno));
+
+	this->header = static_cast<Header*>(addr);
+	this->ring = static_cast<uint8_t*>(addr) + sizeof(Header);
+
+	if (this->header->capacity != this->mapSize - sizeof(Header)) {
+		munmap(addr, this->mapSize);
+
+		UV_THROW_ERROR_STD("invalid shared memory size");
+	}
+
+	this->dataFd = fcntl(fds.dataFd, F_DUPFD_CLOEXEC, 0);
+	this->spaceFd = fcntl(fds.spaceFd, F_DUPFD_CLOEXEC, 0);
+
+	this->uvHandle = new uv_poll_t;
+	this->uvHandle->data = static_cast<void*>(this);
+
+	// Each side sleeps on its own eventfd.
+	err = uv_poll_init(DepLibUV::GetLoop(), this->uvHandle,
+			role == ShmChannel::Role::CONSUMER ? this->dataFd : this->spaceFd);
+
+	if (err != 0) {
+		delete this->uvHandle;
+		this->uvHandle = nullptr;
+
+		Release();
+
+		UV_THROW_ERROR_STD("uv_poll_init() failed: %s", uv_strerror(err));
+	}
+
+	if (this->role == ShmChannel::Role::CONSUMER) {
+		// Start reading.
+		err = uv_poll_start(this->uvHandle, UV_READABLE,
+				static_cast<uv_poll_cb>(onPoll));
+
+		if (err != 0) {
+			Release();
+
+			UV_THROW_ERROR_STD("uv_poll_start() failed: %s", uv_strerror(err));
+		}
+	}
+
+	// NOTE: Don't allocate the buffer here. Instead wait for the first read.
+}
+
+ShmChannel::~ShmChannel() {
+
+	if (!this->closed)
+		Close();
+
+	// Data still pending after Close() is dropped.
+	Release();
+
+	delete[] this->buffer;
+}
+
+/**
+ * The data already in the ring is still read by the consumer. The producer
+ * also flushes its pending data first, while it is not deleted.
+ */
+void ShmChannel::Close() {
+
+	if (this->closed)
+		return;
+
+	this->closed = true;
+
+	if (this->role == ShmChannel::Role::PRODUCER && GetPendingSize() != 0
+			&& !this->hasError && !this->isClosedByPeer)
+		return;
+
+	Release();
+}
+
+/**
+ * Copies the data into the ring, or keeps it until there is room (producer
+ * only). Never blocks.
+ */
+void ShmChannel::Write(const uint8_t *data, size_t len) {
+
+	if (this->closed)
+		return;
+
+	if (len == 0)
+		return;
+
+	if (this->role != ShmChannel::Role::PRODUCER)
+		UV_THROW_ERROR_STD("not the producer");
+
+	if (this->header->consumerClosed.load(std::memory_order_acquire) != 0) {
+		UV_ERROR_STD("consumer closed, closing the channel");
+
+		this->isClosedByPeer = true;
+
+		Close();
+
+		// Notify the subclass.
+		UserOnShmChannelClosed();
+
+		return;
+	}
+
+	// Keep the order behind the pending data.
+	if (GetPendingSize() != 0) {
+		this->pending.insert(this->pending.end(), data, data + len);
+
+		return;
+	}
+
+	size_t written = WriteRing(data, len);
+
+	if (written == len)
+		return;
+
+	this->pending.insert(this->pending.end(), data + written, data + len);
+
+	if (FlushPending())
+		return;
+
+	int err = uv_poll_start(this->uvHandle, UV_READABLE,
+			static_cast<uv_poll_cb>(onPoll));
+
+	if (err != 0)
+		UV_ERROR_STD("uv_poll_start() failed: %s", uv_strerror(err));
+}
+
+/**
+ * Returns the number of bytes copied, then wakes up the consumer if asleep.
+ */
+size_t ShmChannel::WriteRing(const uint8_t *data, size_t len) {
+	uint64_t capacity = this->header->capacity;
+	uint64_t head = this->header->head.load(std::memory_order_relaxed);
+	uint64_t tail = this->header->tail.load(std::memory_order_acquire);
+	size_t size = static_cast<size_t>(
+			std::min<uint64_t>(len, capacity - (head - tail)));
+
+	if (size == 0)
+		return 0;
+
+	size_t offset = static_cast<size_t>(head & (capacity - 1));
+	size_t firstSize = std::min<size_t>(size, capacity - offset);
+
+	std::memcpy(this->ring + offset, data, firstSize);
+	std::memcpy(this->ring, data + firstSize, size - firstSize);
+
+	this->header->head.store(head + size, std::memory_order_release);
+
+	// Pairs with the one in Read(): either the consumer sees the new head or
+	// this sees it waiting.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	if (this->header->consumerWaiting.load(std::memory_order_relaxed) != 0
+			&& this->header->consumerWaiting.exchange(0) != 0)
+		signalFd(this->dataFd);
+
+	return size;
+}
+
+/**
+ * Returns true once all the pending data is in the ring. Otherwise the
+ * consumer is asked to wake this up when it makes room.
+ */
+bool ShmChannel::FlushPending() {
+
+	for (;;) {
+		size_t written = WriteRing(this->pending.data() + this->pendingOffset,
+				GetPendingSize());
+
+		this->pendingOffset += written;
+
+		if (GetPendingSize() == 0) {
+			this->pending.clear();
+			this->pendingOffset = 0;
+			this->header->producerWaiting.store(0, std::memory_order_relaxed);
+
+			return true;
+		}
+
+		if (this->pendingOffset >= this->pending.size() / 2) {
+			this->pending.erase(this->pending.begin(),
+					this->pending.begin() + this->pendingOffset);
+			this->pendingOffset = 0;
+		}
+
+		this->header->producerWaiting.store(1, std::memory_order_relaxed);
+
+		// Pairs with the one in Read(), then check the room again in case the
+		// consumer made it before seeing this waiting.
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+
+		uint64_t head = this->header->head.load(std::memory_order_relaxed);
+		uint64_t tail = this->header->tail.load(std::memory_order_acquire);
+
+		if (head - tail == this->header->capacity)
+			return false;
+	}
+}
+
+void ShmChannel::Read() {
+
+	for (size_t i = 0; i < MaxReadsPerPoll; ++i) {
+		uint64_t tail = this->header->tail.load(std::memory_order_relaxed);
+		uint64_t head = this->header->head.load(std::memory_order_acquire);
+
+		if (head == tail) {
+			// The producer sets it after its last write.
+			if (this->header->producerClosed.load(std::memory_order_acquire) != 0
+					&& this->header->head.load(std::memory_order_acquire) == tail) {
+				this->isClosedByPeer = true;
+
+				// Close local side of the channel.
+				Close();
+
+				// Notify the subclass.
+				UserOnShmChannelClosed();
+
+				return;
+			}
+
+			this->header->consumerWaiting.store(1, std::memory_order_relaxed);
+
+			// Pairs with the one in WriteRing().
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+
+			// Sleep until the producer wakes this up.
+			if (this->header->head.load(std::memory_order_acquire) == tail
+					&& this->header->producerClosed.load(std::memory_order_acquire) == 0)
+				return;
+
+			this->header->consumerWaiting.store(0, std::memory_order_relaxed);
+
+			continue;
+		}
+
+		// If this is the first read then allocate the receiving buffer now.
+		if (this->buffer == nullptr)
+			this->buffer = new uint8_t[this->bufferSize];
+
+		if (this->bufferDataLen >= this->bufferSize) {
+			UV_ERROR_STD("no available space in the buffer, closing the channel");
+
+			this->hasError = true;
+
+			Close();
+
+			// Notify the subclass.
+			UserOnShmChannelClosed();
+
+			return;
+		}
+
+		uint64_t capacity = this->header->capacity;
+		size_t size = static_cast<size_t>(std::min<uint64_t>(head - tail,
+				this->bufferSize - this->bufferDataLen));
+		size_t offset = static_cast<size_t>(tail & (capacity - 1));
+		size_t firstSize = std::min<size_t>(size, capacity - offset);
+		uint8_t *dst = this->buffer + this->bufferDataLen;
+
+		std::memcpy(dst, this->ring + offset, firstSize);
+		std::memcpy(dst + firstSize, this->ring, size - firstSize);
+
+		this->header->tail.store(tail + size, std::memory_order_release);
+
+		// Pairs with the one in FlushPending().
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+
+		if (this->header->producerWaiting.load(std::memory_order_relaxed) != 0
+				&& this->header->producerWaiting.exchange(0) != 0)
+			signalFd(this->spaceFd);
+
+		// Update the buffer data length.
+		this->bufferDataLen += size;
+
+		// Notify the subclass.
+		UserOnShmChannelRead();
+
+		if (this->closed)
+			return;
+	}
+
+	// More to read, poll again after the other handles.
+	signalFd(this->dataFd);
+}
+
+/**
+ * Tells the peer and frees everything but the read buffer. Called once closed
+ * and flushed, or when deleted.
+ */
+void ShmChannel::Release() {
+
+	if (this->header == nullptr)
+		return;
+
+	if (this->role == ShmChannel::Role::PRODUCER) {
+		this->header->producerClosed.store(1, std::memory_order_release);
+
+		signalFd(this->dataFd);
+	} else {
+		this->header->consumerClosed.store(1, std::memory_order_release);
+
+		signalFd(this->spaceFd);
+	}
+
+	if (this->uvHandle != nullptr) {
+		// Tell the UV handle that the ShmChannel has been closed.
+		this->uvHandle->data = nullptr;
+
+		uv_close(reinterpret_cast<uv_handle_t*>(this->uvHandle),
+				static_cast<uv_close_cb>(onClose));
+
+		this->uvHandle = nullptr;
+	}
+
+	// The poll is stopped by uv_close(), so the fds can be closed now.
+	close(this->dataFd);
+	close(this->spaceFd);
+	munmap(this->header, this->mapSize);
+
+	this->header = nullptr;
+	this->ring = nullptr;
+	this->dataFd = -1;
+	this->spaceFd = -1;
+	this->pending.clear();
+	this->pendingOffset = 0;
+}
+
+inline void ShmChannel::OnUvPoll(int status) {
+
+	if (status != 0) {
+		UV_ERROR_STD("poll error, closing the channel: %s", uv_strerror(status));
+
+		this->hasError = true;
+
+		Close();
+
+		// Notify the subclass.
+		UserOnShmChannelClosed();
+
+		return;
+	}
+
+	if (this->role == ShmChannel::Role::CONSUMER) {
+		drainFd(this->dataFd);
+
+		Read();
+
+		return;
+	}
+
+	drainFd(this->spaceFd);
+
+	if (this->header->consumerClosed.load(std::memory_order_acquire) != 0) {
+		this->isClosedByPeer = true;
+
+		// Already closed, pending data for nobody.
+		if (this->closed) {
+			Release();
+
+			return;
+		}
+
+		Close();
+
+		// Notify the subclass.
+		UserOnShmChannelClosed();
+
+		return;
+	}
+
+	if (!FlushPending())
+		return;
+
+	uv_poll_stop(this->uvHandle);
+
+	// Flushed after Close().
+	if (this->closed)
+		Release();
+}
@@ -0,0 +1,127 @@
+#ifndef MS_SHM_CHANNEL_HPP
+#define MS_SHM_CHANNEL_HPP
+
+#include <uv.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+/**
+ * Stream from a producer to a consumer process (or thread) over a ring buffer
+ * in shared memory (memfd), like a UnixStreamSocket with the same Role and
+ * read callback but no syscall per message. The side waiting for the other
+ * sleeps on an eventfd polled by the loop, and is woken up once per batch: a
+ * busy consumer reads all the data written meanwhile without a wakeup.
+ *
+ * One producer and one consumer only (SPSC).
+ */
+class ShmChannel {
+public:
+	enum class Role {
+		PRODUCER = 1, CONSUMER
+	};
+
+	/* Shared memory and eventfds of a channel. CreateFds() makes them and both
+	 * sides are built from them, e.g. inherited over fork() or sent with
+	 * SCM_RIGHTS. The ShmChannel does not take them, see CloseFds(). */
+	struct Fds {
+		int memFd { -1 };
+		// Wakes up the consumer.
+		int dataFd { -1 };
+		// Wakes up the producer.
+		int spaceFd { -1 };
+	};
+
+private:
+	/* Start of the shared memory, the ring follows. */
+	struct Header {
+		// Written by the producer.
+		alignas(64) std::atomic<uint64_t> head;
+		std::atomic<uint32_t> producerWaiting;
+		std::atomic<uint32_t> producerClosed;
+		// Written by the consumer.
+		alignas(64) std::atomic<uint64_t> tail;
+		std::atomic<uint32_t> consumerWaiting;
+		std::atomic<uint32_t> consumerClosed;
+		// Set once.
+		alignas(64) uint64_t capacity;
+	};
+
+public:
+	static Fds CreateFds(size_t capacity);
+	static void CloseFds(Fds &fds);
+
+public:
+	ShmChannel(const Fds &fds, size_t bufferSize, ShmChannel::Role role);
+	ShmChannel& operator=(const ShmChannel&) = delete;
+	ShmChannel(const ShmChannel&) = delete;
+	virtual ~ShmChannel();
+
+public:
+	void Close();
+	bool IsClosed() const;
+	void Write(const uint8_t *data, size_t len);
+	void Write(const std::string &data);
+	size_t GetCapacity() const;
+	size_t GetPendingSize() const;
+
+	/* Callbacks fired by UV events. */
+public:
+	void OnUvPoll(int status);
+
+	/* Pure virtual methods that must be implemented by the subclass. */
+protected:
+	virtual void UserOnShmChannelRead() = 0;
+	virtual void UserOnShmChannelClosed() = 0;
+
+private:
+	size_t WriteRing(const uint8_t *data, size_t len);
+	bool FlushPending();
+	void Read();
+	void Release();
+
+private:
+	// Allocated by this.
+	uv_poll_t *uvHandle { nullptr };
+	Header *header { nullptr };
+	uint8_t *ring { nullptr };
+	int dataFd { -1 };
+	int spaceFd { -1 };
+	// Data not fitting in the ring yet (producer).
+	std::vector<uint8_t> pending;
+	size_t pendingOffset { 0 };
+	// Others.
+	size_t mapSize { 0 };
+	bool closed { false };
+	bool isClosedByPeer { false };
+	bool hasError { false };
+
+protected:
+	// Passed by argument.
+	size_t bufferSize { 0 };
+	ShmChannel::Role role;
+	// Allocated by this.
+	uint8_t *buffer { nullptr };
+	// Others.
+	size_t bufferDataLen { 0 };
+};
+
+/* Inline methods. */
+
+inline bool ShmChannel::IsClosed() const {
+	return this->closed;
+}
+
+inline void ShmChannel::Write(const std::string &data) {
+	Write(reinterpret_cast<const uint8_t*>(data.c_str()), data.size());
+}
+
+inline size_t ShmChannel::GetCapacity() const {
+	return this->header != nullptr ? this->header->capacity : 0;
+}
+
+inline size_t ShmChannel::GetPendingSize() const {
+	return this->pending.size() - this->pendingOffset;
+}
+
+#endif
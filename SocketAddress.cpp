@@ -0,0 +1,312 @@
+#define UV_CLASS "SocketAddress"
+// #define UV_LOG_DEV_LEVEL 3
+
+#include "SocketAddress.hpp"
+#include "Logger.hpp"
+
+/* Static. */
+
+static inline char* formatUint8(char *p, uint8_t value) {
+	if (value >= 100) {
+		*p++ = static_cast<char>('0' + value / 100);
+		value %= 100;
+		*p++ = static_cast<char>('0' + value / 10);
+	} else if (value >= 10) {
+		*p++ = static_cast<char>('0' + value / 10);
+	}
+
+	*p++ = static_cast<char>('0' + value % 10);
+
+	return p;
+}
+
+/**
+ * Strict dotted quad as inet_pton() accepts it (no leading zeros).
+ */
+static bool parseIpv4(const char *ip, struct in_addr *out) {
+	uint32_t addr { 0 };
+	int octets { 0 };
+
+	while (octets < 4) {
+		uint32_t value { 0 };
+		const char *start = ip;
+
+		while (*ip >= '0' && *ip <= '9') {
+			value = value * 10 + static_cast<uint32_t>(*ip - '0');
+			++ip;
+
+			if (value > 255)
+				return false;
+		}
+
+		if (ip == start || (ip - start > 1 && *start == '0'))
+			return false;
+
+		addr = (addr << 8) | value;
+		++octets;
+
+		if (octets < 4) {
+			if (*ip != '.')
+				return false;
+
+			++ip;
+		}
+	}
+
+	if (*ip != '\0')
+		return false;
+
+	out->s_addr = htonl(addr);
+
+	return true;
+}
+
+/* Static methods. */
+
+/**
+ * Hash of the address and port of a sockaddr_in or sockaddr_in6, so a
+ * received datagram can be looked up without building a SocketAddress.
+ */
+size_t SocketAddress::Hash(const struct sockaddr *addr) {
+
+	// FNV-1a over the address and port.
+	uint64_t hash { 14695981039346656037ull };
+	const uint8_t *bytes;
+	size_t len;
+	uint16_t port;
+
+	switch (addr->sa_family) {
+	case AF_INET: {
+		auto *sin = reinterpret_cast<const struct sockaddr_in*>(addr);
+
+		bytes = reinterpret_cast<const uint8_t*>(&sin->sin_addr);
+		len = sizeof(sin->sin_addr);
+		port = sin->sin_port;
+
+		break;
+	}
+
+	case AF_INET6: {
+		auto *sin6 = reinterpret_cast<const struct sockaddr_in6*>(addr);
+
+		bytes = reinterpret_cast<const uint8_t*>(&sin6->sin6_addr);
+		len = sizeof(sin6->sin6_addr);
+		port = sin6->sin6_port;
+
+		break;
+	}
+
+	default:
+		return 0;
+	}
+
+	for (size_t i { 0 }; i < len; ++i)
+		hash = (hash ^ bytes[i]) * 1099511628211ull;
+
+	hash = (hash ^ (port & 0xff)) * 1099511628211ull;
+	hash = (hash ^ (port >> 8)) * 1099511628211ull;
+
+	return static_cast<size_t>(hash);
+}
+
+/* Instance methods. */
+
+/**
+ * Returns false (and leaves the address empty) if addr is not IPv4 or IPv6.
+ */
+bool SocketAddress::Set(const struct sockaddr *addr) {
+
+	this->ipLen = 0;
+
+	switch (addr->sa_family) {
+	case AF_INET:
+		std::memcpy(&this->addr.sin, addr, sizeof(struct sockaddr_in));
+		return true;
+
+	case AF_INET6:
+		std::memcpy(&this->addr.sin6, addr, sizeof(struct sockaddr_in6));
+		return true;
+
+	default:
+		Clear();
+		return false;
+	}
+}
+
+/**
+ * Sets the IPv4 or IPv6 address given as text. Returns 0 or UV_EINVAL.
+ */
+int SocketAddress::Parse(const char *ip, uint16_t port) {
+
+	Clear();
+
+	if (parseIpv4(ip, &this->addr.sin.sin_addr)) {
+		this->addr.sin.sin_family = AF_INET;
+	} else {
+		// Also parses the scope id (e.g. fe80::1%eth0).
+		int err = uv_ip6_addr(ip, port, &this->addr.sin6);
+
+		if (err != 0) {
+			Clear();
+
+			return err;
+		}
+	}
+
+	SetPort(port);
+
+	return 0;
+}
+
+/**
+ * Writes ip:port ([ip]:port for IPv6) including the null terminator and
+ * returns its length, or 0 if it does not fit.
+ */
+size_t SocketAddress::ToString(char *buffer, size_t size) const {
+
+	size_t ipLen = GetIpLen();
+	bool ipv6 = this->addr.sa.sa_family == AF_INET6;
+	// Brackets, colon, port and null terminator.
+	size_t len = ipLen + (ipv6 ? 2 : 0) + 1 + 5 + 1;
+
+	if (size < len)
+		return 0;
+
+	char *p = buffer;
+
+	if (ipv6)
+		*p++ = '[';
+
+	std::memcpy(p, this->ip, ipLen);
+	p += ipLen;
+
+	if (ipv6)
+		*p++ = ']';
+
+	*p++ = ':';
+
+	char digits[5];
+	int numDigits { 0 };
+	uint16_t port = GetPort();
+
+	do {
+		digits[numDigits++] = static_cast<char>('0' + port % 10);
+		port /= 10;
+	} while (port != 0);
+
+	while (numDigits > 0)
+		*p++ = digits[--numDigits];
+
+	*p = '\0';
+
+	return static_cast<size_t>(p - buffer);
+}
+
+std::string SocketAddress::ToString() const {
+	char buffer[INET6_ADDRSTRLEN + 8];
+
+	return std::string(buffer, ToString(buffer, sizeof(buffer)));
+}
+
+/**
+ * Whether addr has the same family, address and port (and IPv6 scope id).
+ */
+bool SocketAddress::Equals(const struct sockaddr *addr) const {
+
+	if (this->addr.sa.sa_family != addr->sa_family)
+		return false;
+
+	switch (addr->sa_family) {
+	case AF_INET: {
+		auto *sin = reinterpret_cast<const struct sockaddr_in*>(addr);
+
+		return this->addr.sin.sin_port == sin->sin_port
+				&& this->addr.sin.sin_addr.s_addr == sin->sin_addr.s_addr;
+	}
+
+	case AF_INET6: {
+		auto *sin6 = reinterpret_cast<const struct sockaddr_in6*>(addr);
+
+		return this->addr.sin6.sin6_port == sin6->sin6_port
+				&& std::memcmp(&this->addr.sin6.sin6_addr, &sin6->sin6_addr,
+						sizeof(struct in6_addr)) == 0
+				&& this->addr.sin6.sin6_scope_id == sin6->sin6_scope_id;
+	}
+
+	default:
+		return true;
+	}
+}
+
+/**
+ * Orders by family, address, IPv6 scope id and port (not numerically by
+ * address), consistently with Equals().
+ */
+bool SocketAddress::operator<(const SocketAddress &other) const {
+
+	if (this->addr.sa.sa_family != other.addr.sa.sa_family)
+		return this->addr.sa.sa_family < other.addr.sa.sa_family;
+
+	int cmp { 0 };
+
+	switch (this->addr.sa.sa_family) {
+	case AF_INET:
+		cmp = std::memcmp(&this->addr.sin.sin_addr, &other.addr.sin.sin_addr,
+				sizeof(struct in_addr));
+		break;
+
+	case AF_INET6:
+		cmp = std::memcmp(&this->addr.sin6.sin6_addr,
+				&other.addr.sin6.sin6_addr, sizeof(struct in6_addr));
+
+		// The same link-local address on different interfaces.
+		if (cmp == 0
+				&& this->addr.sin6.sin6_scope_id != other.addr.sin6.sin6_scope_id)
+			return this->addr.sin6.sin6_scope_id < other.addr.sin6.sin6_scope_id;
+		break;
+	}
+
+	if (cmp != 0)
+		return cmp < 0;
+
+	return GetPort() < other.GetPort();
+}
+
+void SocketAddress::FormatIp() const {
+
+	switch (this->addr.sa.sa_family) {
+	case AF_INET: {
+		auto *bytes = reinterpret_cast<const uint8_t*>(&this->addr.sin.sin_addr);
+		char *p = this->ip;
+
+		for (int i { 0 }; i < 4; ++i) {
+			if (i != 0)
+				*p++ = '.';
+
+			p = formatUint8(p, bytes[i]);
+		}
+
+		*p = '\0';
+		this->ipLen = static_cast<uint8_t>(p - this->ip);
+
+		break;
+	}
+
+	case AF_INET6: {
+		int err = uv_inet_ntop(AF_INET6, &this->addr.sin6.sin6_addr, this->ip,
+				sizeof(this->ip));
+
+		if (err != 0)
+			UV_ABORT("uv_inet_ntop() failed: %s", uv_strerror(err));
+
+		this->ipLen = static_cast<uint8_t>(std::strlen(this->ip));
+
+		break;
+	}
+
+	default: {
+		this->ip[0] = '\0';
+		// Nothing to format, keep ipLen at 0.
+	}
+	}
+}
@@ -0,0 +1,135 @@
+#ifndef MS_SOCKET_ADDRESS_HPP
+#define MS_SOCKET_ADDRESS_HPP
+
+#include <uv.h>
+#include <cstring> // std::memcmp()
+#include <string>
+
+/**
+ * IPv4 or IPv6 address and port. The IP text is formatted on first use and
+ * kept inline, so getting it does not allocate. Hashable and comparable to be
+ * used as a map key.
+ */
+class SocketAddress {
+public:
+	struct Hasher {
+		size_t operator()(const SocketAddress &address) const {
+			return address.GetHash();
+		}
+	};
+
+public:
+	static size_t Hash(const struct sockaddr *addr);
+
+public:
+	SocketAddress();
+	explicit SocketAddress(const struct sockaddr *addr);
+
+public:
+	bool Set(const struct sockaddr *addr);
+	int Parse(const char *ip, uint16_t port);
+	int Parse(const std::string &ip, uint16_t port);
+	void SetPort(uint16_t port);
+	void Clear();
+	bool IsEmpty() const;
+	int GetFamily() const;
+	const struct sockaddr* GetSockAddr() const;
+	int GetSockAddrLen() const;
+	uint16_t GetPort() const;
+	const char* GetIp() const;
+	size_t GetIpLen() const;
+	size_t ToString(char *buffer, size_t size) const;
+	std::string ToString() const;
+	size_t GetHash() const;
+	bool Equals(const struct sockaddr *addr) const;
+	bool operator==(const SocketAddress &other) const;
+	bool operator!=(const SocketAddress &other) const;
+	bool operator<(const SocketAddress &other) const;
+
+private:
+	void FormatIp() const;
+
+private:
+	union {
+		struct sockaddr sa;
+		struct sockaddr_in sin;
+		struct sockaddr_in6 sin6;
+	} addr;
+	// Formatted IP, valid if ipLen is not 0.
+	mutable char ip[INET6_ADDRSTRLEN];
+	mutable uint8_t ipLen { 0 };
+};
+
+/* Inline methods. */
+
+inline SocketAddress::SocketAddress() {
+	Clear();
+}
+
+inline SocketAddress::SocketAddress(const struct sockaddr *addr) {
+	Set(addr);
+}
+
+inline int SocketAddress::Parse(const std::string &ip, uint16_t port) {
+	return Parse(ip.c_str(), port);
+}
+
+inline void SocketAddress::Clear() {
+	std::memset(&this->addr, 0, sizeof(this->addr));
+	this->addr.sa.sa_family = AF_UNSPEC;
+	this->ipLen = 0;
+}
+
+inline bool SocketAddress::IsEmpty() const {
+	return this->addr.sa.sa_family == AF_UNSPEC;
+}
+
+inline int SocketAddress::GetFamily() const {
+	return this->addr.sa.sa_family;
+}
+
+inline const struct sockaddr* SocketAddress::GetSockAddr() const {
+	return &this->addr.sa;
+}
+
+inline int SocketAddress::GetSockAddrLen() const {
+	return (this->addr.sa.sa_family == AF_INET6) ?
+			sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+}
+
+inline uint16_t SocketAddress::GetPort() const {
+	// Same offset in sockaddr_in and sockaddr_in6.
+	return ntohs(this->addr.sin.sin_port);
+}
+
+inline void SocketAddress::SetPort(uint16_t port) {
+	this->addr.sin.sin_port = htons(port);
+}
+
+inline const char* SocketAddress::GetIp() const {
+	if (this->ipLen == 0)
+		FormatIp();
+
+	return this->ip;
+}
+
+inline size_t SocketAddress::GetIpLen() const {
+	if (this->ipLen == 0)
+		FormatIp();
+
+	return this->ipLen;
+}
+
+inline size_t SocketAddress::GetHash() const {
+	return Hash(&this->addr.sa);
+}
+
+inline bool SocketAddress::operator==(const SocketAddress &other) const {
+	return Equals(&other.addr.sa);
+}
+
+inline bool SocketAddress::operator!=(const SocketAddress &other) const {
+	return !(*this == other);
+}
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef MS_STATIC_TCP_CONNECTION_HPP
+#define MS_STATIC_TCP_CONNECTION_HPP
+
+#include <uv.h>
+#include "TcpConnection.hpp"
+
+/**
+ * TcpConnection whose read path is resolved at compile time (CRTP): libuv
+ * calls Derived's own callbacks and they call Derived::UserOnRead() directly,
+ * so it can be inlined instead of going through UserOnTcpConnectionRead():
+ *
+ *   class EchoConnection : public StaticTcpConnection<EchoConnection> {
+ *   public:
+ *       using StaticTcpConnection::StaticTcpConnection;
+ *       void UserOnRead() { ... this->bufferDataLen = 0; }
+ *   };
+ *
+ * UserOnRead() must be public (or StaticTcpConnection a friend) and behaves
+ * like UserOnTcpConnectionRead(). Anything else, closing included, goes
+ * through TcpConnection as usual, so it can be used wherever a TcpConnection
+ * is (see StaticTcpServer).
+ */
+template<typename Derived>
+class StaticTcpConnection : public TcpConnection {
+public:
+	explicit StaticTcpConnection(size_t bufferSize);
+
+	/* Pure virtual methods inherited from TcpConnection. */
+protected:
+	// Only called if the read callbacks were not used.
+	void UserOnTcpConnectionRead() final;
+
+private:
+	static void onUvReadAlloc(uv_handle_t *handle, size_t suggestedSize,
+			uv_buf_t *buf);
+	static void onUvRead(uv_stream_t *handle, ssize_t nread,
+			const uv_buf_t *buf);
+};
+
+/* Inline methods. */
+
+template<typename Derived>
+inline StaticTcpConnection<Derived>::StaticTcpConnection(size_t bufferSize) :
+		TcpConnection(bufferSize) {
+	SetUvReadCallbacks(&onUvReadAlloc, &onUvRead);
+}
+
+template<typename Derived>
+inline void StaticTcpConnection<Derived>::UserOnTcpConnectionRead() {
+	static_cast<Derived*>(this)->UserOnRead();
+}
+
+/* Inline static methods. */
+
+template<typename Derived>
+inline void StaticTcpConnection<Derived>::onUvReadAlloc(uv_handle_t *handle,
+		size_t suggestedSize, uv_buf_t *buf) {
+	auto *connection = static_cast<TcpConnection*>(handle->data);
+
+	if (!connection)
+		return;
+
+	auto *self = static_cast<StaticTcpConnection*>(connection);
+
+	// The buffer is allocated and has room, else let TcpConnection do it.
+	if (self->buffer == nullptr || self->bufferDataLen >= self->bufferSize) {
+		self->OnUvReadAlloc(suggestedSize, buf);
+
+		return;
+	}
+
+	buf->base = reinterpret_cast<char*>(self->buffer + self->bufferDataLen);
+	buf->len = self->bufferSize - self->bufferDataLen;
+}
+
+template<typename Derived>
+inline void StaticTcpConnection<Derived>::onUvRead(uv_stream_t *handle,
+		ssize_t nread, const uv_buf_t *buf) {
+	auto *connection = static_cast<TcpConnection*>(handle->data);
+
+	if (!connection)
+		return;
+
+	auto *self = static_cast<StaticTcpConnection*>(connection);
+
+	// Closed by the peer, errors and full buffer.
+	if (nread <= 0) {
+		self->OnUvRead(nread, buf);
+
+		return;
+	}
+
+	bool deleted { false };
+
+	self->BeginUvRead(static_cast<size_t>(nread), &deleted);
+
+	static_cast<Derived*>(self)->UserOnRead();
+
+	// Derived may have closed the connection and its owner deleted it.
+	if (deleted)
+		return;
+
+	self->EndUvRead();
+}
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef MS_STATIC_TCP_SERVER_HPP
+#define MS_STATIC_TCP_SERVER_HPP
+
+#include <uv.h>
+#include "TcpServer.hpp"
+
+/**
+ * TcpServer of Connection (usually a StaticTcpConnection) whose events reach
+ * Derived with the connection type known at compile time (CRTP):
+ *
+ *   class EchoServer : public StaticTcpServer<EchoServer, EchoConnection> {
+ *   public:
+ *       using StaticTcpServer::StaticTcpServer;
+ *       bool UserOnNewConnection(EchoConnection *connection) { return true; }
+ *       void UserOnConnectionClosed(EchoConnection *connection) {}
+ *   };
+ *
+ * Both must be public (or StaticTcpServer a friend). These are per connection
+ * events: the per read one is StaticTcpConnection's.
+ */
+template<typename Derived, typename Connection>
+class StaticTcpServer : public TcpServer {
+public:
+	StaticTcpServer(uv_tcp_t *uvHandle, int backlog, size_t bufferSize = 65536);
+	StaticTcpServer(int fd, int backlog, size_t bufferSize = 65536);
+
+	/* Pure virtual methods inherited from TcpServer. */
+protected:
+	void UserOnTcpConnectionAlloc(TcpConnection **connection) final;
+	bool UserOnNewTcpConnection(TcpConnection *connection) final;
+	void UserOnTcpConnectionClosed(TcpConnection *connection) final;
+
+private:
+	// Passed by argument.
+	size_t bufferSize { 0 };
+};
+
+/* Inline methods. */
+
+template<typename Derived, typename Connection>
+inline StaticTcpServer<Derived, Connection>::StaticTcpServer(
+		uv_tcp_t *uvHandle, int backlog, size_t bufferSize) :
+		TcpServer(uvHandle, backlog), bufferSize(bufferSize) {
+}
+
+template<typename Derived, typename Connection>
+inline StaticTcpServer<Derived, Connection>::StaticTcpServer(int fd,
+		int backlog, size_t bufferSize) :
+		TcpServer(fd, backlog), bufferSize(bufferSize) {
+}
+
+template<typename Derived, typename Connection>
+inline void StaticTcpServer<Derived, Connection>::UserOnTcpConnectionAlloc(
+		TcpConnection **connection) {
+	*connection = new Connection(this->bufferSize);
+}
+
+template<typename Derived, typename Connection>
+inline bool StaticTcpServer<Derived, Connection>::UserOnNewTcpConnection(
+		TcpConnection *connection) {
+	return static_cast<Derived*>(this)->UserOnNewConnection(
+			static_cast<Connection*>(connection));
+}
+
+template<typename Derived, typename Connection>
+inline void StaticTcpServer<Derived, Connection>::UserOnTcpConnectionClosed(
+		TcpConnection *connection) {
+	static_cast<Derived*>(this)->UserOnConnectionClosed(
+			static_cast<Connection*>(connection));
+}
+
+#endif
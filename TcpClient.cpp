@@ -5,21 +5,43 @@
 #include "Logger.hpp"
 #include "LibUVErrors.hpp"
 #include "DepLibUV.hpp"
+#include "DnsResolver.hpp"
+#include <algorithm> // std::min()
+#include <cinttypes> // PRIu64, PRIu32
+#include <cmath>     // std::pow()
+#include <random>
+#include <utility>   // std::move()
+
+/* Static. */
+
+static const char* StateToString(TcpClient::State state) {
+	switch (state) {
+	case TcpClient::State::DISCONNECTED:
+		return "disconnected";
+	case TcpClient::State::CONNECTING:
+		return "connecting";
+	case TcpClient::State::CONNECTED:
+		return "connected";
+	case TcpClient::State::RECONNECTING:
+		return "reconnecting";
+	case TcpClient::State::CLOSED:
+		return "closed";
+	}
 
+	return "unknown";
+}
 
-/* Static methods for UV callbacks. */
-inline static void onConnection(uv_connect_t *handle, int status) {
-	auto *client = static_cast<TcpClient*>(handle->data);
-	if (client == nullptr)
-		return;
 
-	client->OnUvConnection(status);
+/* Static methods for UV callbacks. */
+inline static void onConnection(uv_connect_t *req, int status) {
+	auto *attempt = static_cast<TcpClient::ConnectAttempt*>(req->data);
 
+	delete req;
 
-}
+	if (attempt == nullptr)
+		return;
 
-inline static void onClose(uv_handle_t *handle) {
-	delete handle;
+	attempt->client->OnUvConnection(attempt, status);
 }
 
 /* Instance methods. */
@@ -31,82 +53,83 @@ TcpClient::TcpClient() {
 
 TcpClient::~TcpClient() {
 
+	if (this->deletedFlag)
+		*this->deletedFlag = true;
 
 	if (!this->closed)
 		Close();
 }
 
-int TcpClient::Connect(std::string &ip, uint16_t port, int family/* = AF_INET*/) {
-	int err;
-	int flags { 0 };
-	struct sockaddr_storage bindAddr;
-	// Notify the subclass so it provides an allocated derived class of TCPConnection.
-	UserOnTcpConnectionAlloc(&connection);
-	UV_ASSERT(connection != nullptr,
-			"TcpConnection pointer was not allocated by the user");
-	try {
-		connection->Setup(this, &(this->localAddr), this->localIp,
-				this->localPort);
-	} catch (const LibUVError &error) {
-		delete connection;
-		return -1;
-	}
+/**
+ * The family is deduced from ip, the argument is kept for compatibility.
+ */
+int TcpClient::Connect(std::string &ip, uint16_t port, int /*family = AF_INET*/) {
+	SocketAddress remoteAddr;
+
+	if (this->closed)
+		UV_THROW_ERROR("closed");
 
+	if (this->state != State::DISCONNECTED)
+		UV_THROW_ERROR("already connected or connecting");
 
-	switch (family) {
-	case AF_INET: {
-		err = uv_ip4_addr(ip.c_str(), 0,
-				reinterpret_cast<struct sockaddr_in*>(&bindAddr));
+	int err = remoteAddr.Parse(ip, port);
 
-		if (err != 0)
-			UV_ABORT("uv_ip4_addr() failed: %s", uv_strerror(err));
+	if (err != 0) {
+		UV_ERROR("invalid address %s: %s", ip.c_str(), uv_strerror(err));
 
-		break;
+		return err;
 	}
 
-	case AF_INET6: {
-		err = uv_ip6_addr(ip.c_str(), 0,
-				reinterpret_cast<struct sockaddr_in6*>(&bindAddr));
+	this->remoteAddrs.assign(1, remoteAddr);
+	this->remoteHostname.clear();
+	this->reconnectAttempts = 0;
 
-		if (err != 0)
-			UV_ABORT("uv_ip6_addr() failed: %s", uv_strerror(err));
+	return StartConnect();
+}
 
-		// Don't also bind into IPv4 when listening in IPv6.
-		flags |= UV_UDP_IPV6ONLY;
+/**
+ * Connects to the first of the given IPv4 and IPv6 addresses that answers
+ * (Happy Eyeballs, RFC 8305). Addresses are tried in the given order with the
+ * families interleaved, and the next one is started when the previous attempt
+ * fails or has not succeeded after the connection attempt delay, so a
+ * blackholed address only delays the connection by that much.
+ */
+int TcpClient::Connect(const std::vector<std::string> &ips, uint16_t port) {
 
-		break;
-	}
-	}
+	if (this->closed)
+		UV_THROW_ERROR("closed");
 
-	switch (family) {
-	case AF_INET:
-		(reinterpret_cast<struct sockaddr_in*>(&bindAddr))->sin_port =
-				htons(port);
-		break;
+	if (this->state != State::DISCONNECTED)
+		UV_THROW_ERROR("already connected or connecting");
 
-	case AF_INET6:
-		(reinterpret_cast<struct sockaddr_in6*>(&bindAddr))->sin6_port =
-				htons(port);
-		break;
-	}
+	int err = SetRemoteAddresses(ips, port);
 
+	if (err != 0)
+		return err;
 
-	req.data = static_cast<void*>(this);
-	if (err == 0) {
-		err = uv_tcp_connect(&req,
-							 (uv_tcp_t*)(connection->GetUvHandle()),
-							 (const struct sockaddr*) &bindAddr,
-							 static_cast<uv_connect_cb>(onConnection));
-	}
+	this->remoteHostname.clear();
+	this->reconnectAttempts = 0;
 
-	// Set local address.
-	if (!SetLocalAddress(&bindAddr, family)) {
-		uv_close(reinterpret_cast<uv_handle_t*>(connection->GetUvHandle()),
-				static_cast<uv_close_cb>(onClose));
+	return StartConnect();
+}
 
-		UV_THROW_ERROR("error setting local IP and port");
-	}
-	return err;
+/**
+ * Resolves hostname (see DnsResolver) and connects to its addresses as
+ * Connect(ips, port) does. The name is resolved again on every reconnection.
+ */
+int TcpClient::ConnectByName(const std::string &hostname, uint16_t port) {
+
+	if (this->closed)
+		UV_THROW_ERROR("closed");
+
+	if (this->state != State::DISCONNECTED)
+		UV_THROW_ERROR("already connected or connecting");
+
+	this->remoteHostname = hostname;
+	this->remotePort = port;
+	this->reconnectAttempts = 0;
+
+	return StartResolve();
 }
 
 void TcpClient::Close() {
@@ -117,123 +140,547 @@ void TcpClient::Close() {
 
 	this->closed = true;
 
-	connection->GetUvHandle()->data = nullptr;
+	CancelConnectAttempts();
+
+	delete this->connectTimer;
+	this->connectTimer = nullptr;
+
+	delete this->attemptTimer;
+	this->attemptTimer = nullptr;
+
+	delete this->reconnectTimer;
+	this->reconnectTimer = nullptr;
 
 	UV_DEBUG_DEV("closing connection");
 
+	if (this->connection) {
+		auto *connection = this->connection;
+
+		this->connection = nullptr;
+
+		// This closes its UV handle.
+		delete connection;
+	}
 
-	uv_close(reinterpret_cast<uv_handle_t*>(connection->GetUvHandle()),
-			static_cast<uv_close_cb>(onClose));
+	SetState(State::CLOSED);
 }
 
 void TcpClient::Dump() const {
 	UV_DUMP("<TcpClient>");
 	UV_DUMP(
-			"  [TCP, local:%s :%d, status:%s]",
-			this->localIp.c_str(),
-			static_cast<uint16_t>(this->localPort),
-			(!this->closed) ? "open" : "closed");
+			"  [TCP, local:%s :%d, status:%s, connect attempts:%zu, reconnect attempts:%" PRIu32 "]",
+			this->localAddress.GetIp(),
+			this->localAddress.GetPort(),
+			StateToString(this->state),
+			this->connectAttempts.size(),
+			this->reconnectAttempts);
 	UV_DUMP("</TcpClient>");
 }
 
-bool TcpClient::SetLocalAddress(struct sockaddr_storage* addr, int family/* = AF_INET*/) {
+/**
+ * Takes effect on the next failed connect or closed connection.
+ */
+void TcpClient::SetReconnectPolicy(const ReconnectPolicy &policy) {
 
-	int err;
-	int len = sizeof(struct sockaddr_storage);
+	if (policy.multiplier < 1.0 || policy.jitter < 0.0 || policy.jitter > 1.0)
+		UV_THROW_ERROR("invalid reconnect policy");
 
-	err = uv_tcp_getsockname((uv_tcp_t*)connection->GetUvHandle(),
-			reinterpret_cast<struct sockaddr*>(addr), &len);
+	this->reconnectPolicy = policy;
 
-	if (err != 0) {
-		UV_ERROR("uv_tcp_getsockname() failed: %s", uv_strerror(err));
+	if (!policy.enabled && this->reconnectTimer
+			&& this->reconnectTimer->IsActive()) {
+		this->reconnectTimer->Stop();
 
-		return false;
+		SetState(State::DISCONNECTED);
 	}
+}
+
+/**
+ * Bounds the time given to a connect, including all its attempts. 0 disables
+ * it.
+ */
+void TcpClient::SetConnectTimeout(uint64_t timeout) {
+	this->connectTimeout = timeout;
+}
 
-	GetAddressInfo(
-			reinterpret_cast<const struct sockaddr*>(addr), family,
-			this->localIp, this->localPort);
+/**
+ * Time to wait for an attempt before starting the next one in parallel. RFC
+ * 8305 recommends 250 ms.
+ */
+void TcpClient::SetConnectionAttemptDelay(uint64_t delay) {
+	this->connectionAttemptDelay = delay;
+}
 
-	return true;
+/**
+ * Options set in the connection once connected, from the next connect on.
+ */
+void TcpClient::SetSocketOptions(const TcpConnection::SocketOptions &options) {
+	this->socketOptions = options;
+	this->hasSocketOptions = true;
 }
 
-void TcpClient::GetAddressInfo(const struct sockaddr* addr, int& family, std::string& ip, uint16_t& port)
-{
+/**
+ * Fills remoteAddrs in the Happy Eyeballs order: the given order with the
+ * families interleaved, starting with the family of the first address.
+ */
+int TcpClient::SetRemoteAddresses(const std::vector<std::string> &ips,
+		uint16_t port) {
+	std::vector<SocketAddress> addrs4;
+	std::vector<SocketAddress> addrs6;
+	bool ipv6First { false };
+
+	for (auto &ip : ips) {
+		SocketAddress remoteAddr;
+		int err = remoteAddr.Parse(ip, port);
+		bool ipv6 = remoteAddr.GetFamily() == AF_INET6;
+
+		if (err != 0) {
+			UV_WARN_DEV("ignoring invalid address %s: %s", ip.c_str(),
+					uv_strerror(err));
+
+			continue;
+		}
+
+		if (addrs4.empty() && addrs6.empty())
+			ipv6First = ipv6;
+
+		(ipv6 ? addrs6 : addrs4).push_back(remoteAddr);
+	}
 
-	char ipBuffer[INET6_ADDRSTRLEN] = { 0 };
+	if (addrs4.empty() && addrs6.empty()) {
+		UV_ERROR("no valid address to connect to");
+
+		return UV_EINVAL;
+	}
+
+	auto &first = ipv6First ? addrs6 : addrs4;
+	auto &second = ipv6First ? addrs4 : addrs6;
+
+	this->remoteAddrs.clear();
+
+	for (size_t i { 0 }; i < first.size() || i < second.size(); ++i) {
+		if (i < first.size())
+			this->remoteAddrs.push_back(first[i]);
+
+		if (i < second.size())
+			this->remoteAddrs.push_back(second[i]);
+	}
+
+	return 0;
+}
+
+/**
+ * Resolves remoteHostname and then connects to it.
+ */
+int TcpClient::StartResolve() {
 	int err;
+	std::vector<std::string> ips;
+
+	if (DnsResolver::GetCached(this->remoteHostname, err, ips)) {
+		if (err == 0)
+			err = SetRemoteAddresses(ips, this->remotePort);
+
+		if (err == 0)
+			err = StartConnect();
+
+		return err;
+	}
+
+	// NOTE: This may throw.
+	this->resolveId = DnsResolver::Resolve(this->remoteHostname,
+			new DnsResolver::onResolveCallback(
+					[this](int error, const std::vector<std::string> &ips) {
+						this->OnResolved(error, ips);
+					}));
+
+	// The deadline includes the resolution.
+	if (this->connectTimeout != 0) {
+		if (this->connectTimer == nullptr)
+			this->connectTimer = new Timer(this);
+
+		this->connectTimer->Start(this->connectTimeout);
+	}
+
+	SetState(State::CONNECTING);
+
+	return 0;
+}
+
+void TcpClient::OnResolved(int error,
+		const std::vector<std::string> &ips) {
+
+	this->resolveId = 0;
+
+	if (error == 0)
+		error = SetRemoteAddresses(ips, this->remotePort);
+
+	if (error == 0)
+		error = StartConnect();
 
-	switch (addr->sa_family)
-	{
-		case AF_INET:
-		{
-			err = uv_inet_ntop(
-				AF_INET, std::addressof(reinterpret_cast<const struct sockaddr_in*>(addr)->sin_addr), ipBuffer, sizeof(ipBuffer));
+	if (error != 0) {
+		UV_WARN_DEV("cannot connect to %s: %s", this->remoteHostname.c_str(),
+				uv_strerror(error));
 
-			if (err)
-				UV_ABORT("uv_inet_ntop() failed: %s", uv_strerror(err));
+		if (this->connectTimer)
+			this->connectTimer->Stop();
 
-			port = static_cast<uint16_t>(ntohs(reinterpret_cast<const struct sockaddr_in*>(addr)->sin_port));
+		// NOTE: This may delete this.
+		OnConnectFailed(error);
+	}
+}
+
+/**
+ * Opens a connection to remoteAddrs.
+ */
+int TcpClient::StartConnect() {
+
+	this->nextRemoteAddr = 0;
+
+	int err = StartConnectAttempt();
+
+	if (this->connectAttempts.empty())
+		return err;
+
+	// Keep the deadline set while resolving.
+	if (this->connectTimeout != 0) {
+		if (this->connectTimer == nullptr)
+			this->connectTimer = new Timer(this);
 
-			break;
+		if (!this->connectTimer->IsActive())
+			this->connectTimer->Start(this->connectTimeout);
+	}
+
+	SetState(State::CONNECTING);
+
+	return 0;
+}
+
+/**
+ * Starts a connection attempt to the next remote address that accepts it.
+ * Returns the error of the last address tried if none did.
+ */
+int TcpClient::StartConnectAttempt() {
+	int err { UV_EINVAL };
+
+	while (this->nextRemoteAddr < this->remoteAddrs.size()) {
+		auto &remoteAddr = this->remoteAddrs[this->nextRemoteAddr++];
+		TcpConnection *connection { nullptr };
+
+		// Notify the subclass so it provides an allocated derived class of TCPConnection.
+		UserOnTcpConnectionAlloc(&connection);
+		UV_ASSERT(connection != nullptr,
+				"TcpConnection pointer was not allocated by the user");
+		try {
+			connection->Setup(this, &(this->localAddress));
+		} catch (const LibUVError &error) {
+			delete connection;
+			err = -1;
+			continue;
 		}
 
-		case AF_INET6:
-		{
-			err = uv_inet_ntop(
-				AF_INET6, std::addressof(reinterpret_cast<const struct sockaddr_in6*>(addr)->sin6_addr), ipBuffer, sizeof(ipBuffer));
+		auto *attempt = new ConnectAttempt;
+		auto *req = new uv_connect_t;
 
-			if (err)
-				UV_ABORT("uv_inet_ntop() failed: %s", uv_strerror(err));
+		req->data = static_cast<void*>(attempt);
 
-			port = static_cast<uint16_t>(ntohs(reinterpret_cast<const struct sockaddr_in6*>(addr)->sin6_port));
+		err = uv_tcp_connect(req,
+							 (uv_tcp_t*)(connection->GetUvHandle()),
+							 remoteAddr.GetSockAddr(),
+							 static_cast<uv_connect_cb>(onConnection));
+
+		if (err != 0) {
+			UV_WARN_DEV("uv_tcp_connect() failed: %s", uv_strerror(err));
 
-			break;
+			delete req;
+			delete attempt;
+			delete connection;
+			continue;
 		}
 
-		default:
-		{
-			UV_ABORT("unknown network family: %d", static_cast<int>(addr->sa_family));
+		attempt->client = this;
+		attempt->connection = connection;
+		attempt->req = req;
+		this->connectAttempts.push_back(attempt);
+
+		// Race the next address if this one does not answer soon.
+		if (this->nextRemoteAddr < this->remoteAddrs.size()) {
+			if (this->attemptTimer == nullptr)
+				this->attemptTimer = new Timer(this);
+
+			this->attemptTimer->Start(this->connectionAttemptDelay);
 		}
+
+		return 0;
 	}
 
-	family = addr->sa_family;
-	ip.assign(ipBuffer);
+	return err;
 }
 
-inline void TcpClient::OnUvConnection(int status) {
+/**
+ * Aborts the pending resolution and connection attempts, their callbacks are
+ * ignored.
+ */
+void TcpClient::CancelConnectAttempts() {
+
+	if (this->resolveId != 0) {
+		DnsResolver::Cancel(this->resolveId);
+
+		this->resolveId = 0;
+	}
+
+	for (auto *attempt : this->connectAttempts) {
+		attempt->req->data = nullptr;
+
+		// This closes its UV handle, which cancels the request.
+		delete attempt->connection;
+		delete attempt;
+	}
+
+	this->connectAttempts.clear();
+
+	if (this->attemptTimer)
+		this->attemptTimer->Stop();
+}
+
+/**
+ * Called once the connection attempt has been aborted and its connection
+ * deleted. Notifies the subclass and retries if the policy allows it.
+ */
+void TcpClient::OnConnectFailed(int error) {
+
+	bool deleted { false };
+
+	this->deletedFlag = &deleted;
+
+	// Notify the subclass.
+	UserOnTcpConnectFailed(error);
+
+	// The subclass may have deleted this.
+	if (deleted)
+		return;
+
+	this->deletedFlag = nullptr;
 
 	if (this->closed)
 		return;
+
+	ScheduleReconnect();
+}
+
+void TcpClient::ScheduleReconnect() {
+
+	auto &policy = this->reconnectPolicy;
+
+	if (!policy.enabled
+			|| (policy.maxAttempts != 0
+					&& this->reconnectAttempts >= policy.maxAttempts)) {
+		SetState(State::DISCONNECTED);
+
+		return;
+	}
+
+	// Thread-local so loops running in several threads don't share it.
+	static thread_local std::mt19937 generator { std::random_device { }() };
+	std::uniform_real_distribution<double> distribution { 0.0, policy.jitter };
+
+	double delay = std::min(static_cast<double>(policy.maxDelay),
+			static_cast<double>(policy.initialDelay)
+					* std::pow(policy.multiplier, this->reconnectAttempts));
+
+	delay -= delay * distribution(generator);
+
+	this->reconnectAttempts++;
+
+	if (this->reconnectTimer == nullptr)
+		this->reconnectTimer = new Timer(this);
+
+	UV_DEBUG_DEV("reconnecting in %" PRIu64 " ms (attempt %" PRIu32 ")",
+			static_cast<uint64_t>(delay), this->reconnectAttempts);
+
+	this->reconnectTimer->Start(static_cast<uint64_t>(delay));
+
+	SetState(State::RECONNECTING);
+}
+
+/**
+ * The subclass may delete this when notified.
+ */
+void TcpClient::SetState(State state) {
+
+	if (state == this->state)
+		return;
+
+	State previous = this->state;
+
+	this->state = state;
+
+	UserOnTcpClientStateChange(previous, state);
+}
+
+bool TcpClient::SetLocalAddress() {
+
+	int err;
+	struct sockaddr_storage localAddr;
+	int len = sizeof(localAddr);
+
+	err = uv_tcp_getsockname((uv_tcp_t*)connection->GetUvHandle(),
+			reinterpret_cast<struct sockaddr*>(&localAddr), &len);
+
+	if (err != 0) {
+		UV_ERROR("uv_tcp_getsockname() failed: %s", uv_strerror(err));
+
+		return false;
+	}
+
+	return this->localAddress.Set(reinterpret_cast<struct sockaddr*>(&localAddr));
+}
+
+inline void TcpClient::OnUvConnection(ConnectAttempt *attempt, int status) {
+
+	auto *connection = attempt->connection;
+
+	this->connectAttempts.erase(std::find(this->connectAttempts.begin(),
+			this->connectAttempts.end(), attempt));
+
+	delete attempt;
+
 	if (status != 0) {
-		UV_ERROR("error while receiving a new TCP connection: %s",
-				uv_strerror(status));
+		UV_ERROR("error while connecting: %s", uv_strerror(status));
+
+		delete connection;
+
+		// Try the next address at once.
+		if (this->nextRemoteAddr < this->remoteAddrs.size())
+			StartConnectAttempt();
+
+		// Other attempts are still pending.
+		if (!this->connectAttempts.empty())
+			return;
+
+		if (this->connectTimer)
+			this->connectTimer->Stop();
+
+		if (this->attemptTimer)
+			this->attemptTimer->Stop();
+
+		// NOTE: This may delete this.
+		OnConnectFailed(status);
 
 		return;
 	}
 
+	// The first established connection wins.
+	CancelConnectAttempts();
+
+	if (this->connectTimer)
+		this->connectTimer->Stop();
+
+	this->connection = connection;
+
+	// Failed options are not fatal, the connection just keeps the defaults.
+	if (this->hasSocketOptions)
+		connection->ApplySocketOptions(this->socketOptions);
 
 	// Start receiving data.
 	try {
 		// NOTE: This may throw.
 		connection->Start();
 	} catch (const LibUVError &error) {
+		this->connection = nullptr;
+
 		delete connection;
 
+		// NOTE: This may delete this.
+		OnConnectFailed(UV_ECONNABORTED);
+
 		return;
 	}
+
+	SetLocalAddress();
+
+	this->reconnectAttempts = 0;
+
+	bool deleted { false };
+
+	this->deletedFlag = &deleted;
+
+	SetState(State::CONNECTED);
+
+	// The subclass may have deleted this.
+	if (deleted)
+		return;
+
+	this->deletedFlag = nullptr;
+
+	if (this->closed || this->connection == nullptr)
+		return;
+
 	// Notify the subclass only
 	UserOnNewTcpConnection(connection);
 }
 
+void TcpClient::UserOnTcpConnectFailed(int /*error*/) {
+}
+
+void TcpClient::UserOnTcpClientStateChange(State /*previous*/,
+		State /*state*/) {
+}
+
 inline void TcpClient::OnTcpConnectionClosed(TcpConnection *connection) {
 
 
 	UV_DEBUG_DEV("TCP connection closed");
 
+	if (connection == this->connection)
+		this->connection = nullptr;
+
+	bool deleted { false };
+
+	this->deletedFlag = &deleted;
+
 	// Notify the subclass.
 	UserOnTcpConnectionClosed(connection);
 
 	// Delete it.
 	delete connection;
+
+	// The subclass may have deleted this.
+	if (deleted)
+		return;
+
+	this->deletedFlag = nullptr;
+
+	if (this->closed || this->connection != nullptr)
+		return;
+
+	ScheduleReconnect();
+}
+
+inline void TcpClient::OnTimer(Timer *timer) {
+
+	if (timer == this->connectTimer) {
+		UV_WARN_DEV("connect timeout");
+
+		CancelConnectAttempts();
+
+		// NOTE: This may delete this.
+		OnConnectFailed(UV_ETIMEDOUT);
+	} else if (timer == this->attemptTimer) {
+		StartConnectAttempt();
+	} else if (timer == this->reconnectTimer) {
+		int err;
+
+		try {
+			err = this->remoteHostname.empty() ? StartConnect() : StartResolve();
+		} catch (const LibUVError &error) {
+			err = UV_ECONNABORTED;
+		}
+
+		if (err != 0) {
+			UV_WARN_DEV("reconnect failed: %s", uv_strerror(err));
+
+			// NOTE: This may delete this.
+			OnConnectFailed(err);
+		}
+	}
 }
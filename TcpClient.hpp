@@ -5,10 +5,41 @@
 #include <uv.h>
 #include <string>
 #include <unordered_set>
+#include <vector>
 
 #include "TcpConnection.hpp"
+#include "Timer.hpp"
+
+class TcpClient: public TcpConnection::Listener, public Timer::Listener {
+public:
+	enum class State {
+		DISCONNECTED = 1, CONNECTING, CONNECTED, RECONNECTING, CLOSED
+	};
+
+	/**
+	 * Reconnection after a failed connect or a closed connection. The n-th
+	 * retry waits min(maxDelay, initialDelay * multiplier^n) minus a random
+	 * fraction (up to jitter) of it, so clients do not retry in lockstep.
+	 */
+	struct ReconnectPolicy {
+		bool enabled { false };
+		// Delays in ms.
+		uint64_t initialDelay { 100 };
+		uint64_t maxDelay { 30000 };
+		double multiplier { 2.0 };
+		// 0 (none) to 1 (full jitter).
+		double jitter { 1.0 };
+		// Consecutive failed attempts before giving up, 0 for unlimited.
+		uint32_t maxAttempts { 0 };
+	};
+
+	/* A connection being established to one of the remote addresses. */
+	struct ConnectAttempt {
+		TcpClient *client { nullptr };
+		TcpConnection *connection { nullptr };
+		uv_connect_t *req { nullptr };
+	};
 
-class TcpClient: public TcpConnection::Listener {
 public:
 	/**
 	 * uvHandle must be an already initialized and binded uv_tcp_t pointer.
@@ -18,11 +49,20 @@ public:
 
 public:
 	int Connect(std::string &ip, uint16_t port, int family = AF_INET);
+	int Connect(const std::vector<std::string> &ips, uint16_t port);
+	int ConnectByName(const std::string &hostname, uint16_t port);
 	void Close();
 	virtual void Dump() const;
+	void SetReconnectPolicy(const ReconnectPolicy &policy);
+	void SetConnectTimeout(uint64_t timeout);
+	void SetConnectionAttemptDelay(uint64_t delay);
+	void SetSocketOptions(const TcpConnection::SocketOptions &options);
+	State GetState() const;
+	uint32_t GetReconnectAttempts() const;
+	const SocketAddress& GetLocalSocketAddress() const;
 	const struct sockaddr* GetLocalAddress() const;
 	int GetLocalFamily() const;
-	const std::string& GetLocalIp() const;
+	std::string GetLocalIp() const;
 	uint16_t GetLocalPort() const;
 	TcpConnection* GetConnection() const;
 
@@ -30,8 +70,16 @@ protected:
 	void AcceptTcpConnection(TcpConnection* connection);
 
 private:
-	bool SetLocalAddress(struct sockaddr_storage* addr, int family = AF_INET);
-	void GetAddressInfo(const struct sockaddr* addr, int& family, std::string& ip, uint16_t& port);
+	int SetRemoteAddresses(const std::vector<std::string> &ips, uint16_t port);
+	int StartResolve();
+	void OnResolved(int error, const std::vector<std::string> &ips);
+	int StartConnect();
+	int StartConnectAttempt();
+	void CancelConnectAttempts();
+	void OnConnectFailed(int error);
+	void ScheduleReconnect();
+	void SetState(State state);
+	bool SetLocalAddress();
 
 	/* Pure virtual methods that must be implemented by the subclass. */
 protected:
@@ -39,25 +87,53 @@ protected:
 	virtual bool UserOnNewTcpConnection(TcpConnection *connection) = 0;
 	virtual void UserOnTcpConnectionClosed(TcpConnection *connection) = 0;
 
+	/* Virtual methods that may be implemented by the subclass. */
+protected:
+	virtual void UserOnTcpConnectFailed(int error);
+	virtual void UserOnTcpClientStateChange(State previous, State state);
+
 	/* Callbacks fired by UV events. */
 public:
-	void OnUvConnection(int status);
+	void OnUvConnection(ConnectAttempt *attempt, int status);
 
 	/* Methods inherited from TcpConnection::Listener. */
 public:
 	void OnTcpConnectionClosed(TcpConnection *connection) override;
 
+	/* Methods inherited from Timer::Listener. */
+public:
+	void OnTimer(Timer *timer) override;
+
 protected:
-	struct sockaddr_storage localAddr;
-	std::string localIp;
-	uint16_t localPort { 0 };
+	SocketAddress localAddress;
 
 private:
-
+	// Allocated by this.
+	Timer *connectTimer { nullptr };
+	Timer *attemptTimer { nullptr };
+	Timer *reconnectTimer { nullptr };
 	// Others.
 	TcpConnection *connection { nullptr };
-	uv_connect_t req;
 	bool closed { false };
+	State state { State::DISCONNECTED };
+	ReconnectPolicy reconnectPolicy;
+	uint32_t reconnectAttempts { 0 };
+	// Deadline (ms) of a connect, 0 for no limit.
+	uint64_t connectTimeout { 10000 };
+	// Time (ms) before racing the next address while an attempt is pending.
+	uint64_t connectionAttemptDelay { 250 };
+	// Set when connecting by name, resolved on every (re)connect.
+	std::string remoteHostname;
+	uint16_t remotePort { 0 };
+	uint64_t resolveId { 0 };
+	// In connection attempt order.
+	std::vector<SocketAddress> remoteAddrs;
+	size_t nextRemoteAddr { 0 };
+	std::vector<ConnectAttempt*> connectAttempts;
+	TcpConnection::SocketOptions socketOptions;
+	bool hasSocketOptions { false };
+	// Set while a subclass callback that may delete this is running.
+	bool *deletedFlag { nullptr };
 };
 
 /* Inline methods. */
@@ -66,20 +142,32 @@ inline TcpConnection* TcpClient::GetConnection() const {
 	return connection;
 }
 
+inline TcpClient::State TcpClient::GetState() const {
+	return this->state;
+}
+
+inline uint32_t TcpClient::GetReconnectAttempts() const {
+	return this->reconnectAttempts;
+}
+
+inline const SocketAddress& TcpClient::GetLocalSocketAddress() const {
+	return this->localAddress;
+}
+
 inline const struct sockaddr* TcpClient::GetLocalAddress() const {
-	return reinterpret_cast<const struct sockaddr*>(&this->localAddr);
+	return this->localAddress.GetSockAddr();
 }
 
 inline int TcpClient::GetLocalFamily() const {
-	return reinterpret_cast<const struct sockaddr*>(&this->localAddr)->sa_family;
+	return this->localAddress.GetFamily();
 }
 
-inline const std::string& TcpClient::GetLocalIp() const {
-	return this->localIp;
+inline std::string TcpClient::GetLocalIp() const {
+	return std::string(this->localAddress.GetIp(), this->localAddress.GetIpLen());
 }
 
 inline uint16_t TcpClient::GetLocalPort() const {
-	return this->localPort;
+	return this->localAddress.GetPort();
 }
 
 #endif //MS_TCP_CLIENT_HPP
@@ -0,0 +1,423 @@
+#define UV_CLASS "TcpClientPool"
+// #define UV_LOG_DEV_LEVEL 3
+
+#include "TcpClientPool.hpp"
+#include "DepLibUV.hpp"
+#include "LibUVErrors.hpp"
+#include <vector>
+
+/* Client instance methods. */
+
+TcpClientPool::Client::Client(TcpClientPool *pool, Endpoint *endpoint) :
+		pool(pool), endpoint(endpoint) {
+}
+
+void TcpClientPool::Client::UserOnTcpConnectionAlloc(
+		TcpConnection **connection) {
+
+	this->pool->UserOnTcpConnectionAlloc(connection);
+}
+
+bool TcpClientPool::Client::UserOnNewTcpConnection(
+		TcpConnection * /*connection*/) {
+
+	// NOTE: This may delete this.
+	this->pool->OnClientConnected(this);
+
+	return true;
+}
+
+void TcpClientPool::Client::UserOnTcpConnectionClosed(
+		TcpConnection *connection) {
+
+	// NOTE: This deletes this.
+	this->pool->OnClientClosed(this, connection);
+}
+
+void TcpClientPool::Client::UserOnTcpConnectFailed(int error) {
+
+	UV_DEBUG_DEV("connection to %s:%d failed: %s",
+			this->endpoint->ip.c_str(), this->endpoint->port,
+			uv_strerror(error));
+
+	// NOTE: This deletes this.
+	this->pool->OnClientFailed(this);
+}
+
+/* Instance methods. */
+
+TcpClientPool::TcpClientPool(const Options &options) :
+		options(options) {
+
+	if (this->options.healthCheckInterval != 0) {
+		this->healthCheckTimer = new Timer(this);
+		this->healthCheckTimer->Start(this->options.healthCheckInterval,
+				this->options.healthCheckInterval);
+	}
+}
+
+TcpClientPool::~TcpClientPool() {
+
+	if (!this->closed)
+		Close();
+}
+
+/**
+ * Closes every connection, including the ones acquired and not yet released.
+ * Pending Acquire() callbacks are called with nullptr.
+ */
+void TcpClientPool::Close() {
+
+	if (this->closed)
+		return;
+
+	this->closed = true;
+
+	delete this->healthCheckTimer;
+	this->healthCheckTimer = nullptr;
+
+	while (!this->idleClients.empty())
+		DeleteClient(this->idleClients.back());
+
+	while (!this->activeClients.empty())
+		DeleteClient(this->activeClients.begin()->second);
+
+	while (!this->connectingClients.empty()) {
+		auto *client = *this->connectingClients.begin();
+		auto *cb = client->cb;
+
+		client->cb = nullptr;
+
+		DeleteClient(client);
+
+		if (cb) {
+			(*cb)(nullptr);
+			delete cb;
+		}
+	}
+
+	this->endpoints.clear();
+}
+
+/**
+ * Calls cb with a connection to ip:port, or with nullptr if it cannot be
+ * established. The callback is called synchronously if an idle connection is
+ * available. The caller owns the connection until it calls Release() or
+ * Discard(), or until the connection is closed (UserOnTcpConnectionClosed()).
+ */
+void TcpClientPool::Acquire(const std::string &ip, uint16_t port,
+		onAcquireCallback *cb) {
+
+	if (this->closed) {
+		(*cb)(nullptr);
+		delete cb;
+
+		return;
+	}
+
+	auto *endpoint = GetEndpoint(ip, port);
+
+	if (!endpoint->idleClients.empty()) {
+		auto *client = endpoint->idleClients.front();
+		auto *connection = client->GetConnection();
+
+		UnsetIdle(client);
+
+		client->state = Client::State::ACTIVE;
+		this->activeClients[connection] = client;
+		endpoint->numActive++;
+
+		FillMinIdle(endpoint);
+
+		(*cb)(connection);
+		delete cb;
+
+		return;
+	}
+
+	if (Connect(endpoint, cb) == nullptr) {
+		(*cb)(nullptr);
+		delete cb;
+
+		return;
+	}
+
+	FillMinIdle(endpoint);
+}
+
+/**
+ * Returns an acquired connection to the pool. The caller must not use it
+ * anymore, and must leave no pending request on it.
+ */
+void TcpClientPool::Release(TcpConnection *connection) {
+
+	auto it = this->activeClients.find(connection);
+
+	if (it == this->activeClients.end())
+		UV_THROW_ERROR("connection not acquired from this pool");
+
+	auto *client = it->second;
+
+	if (connection->IsClosed()) {
+		DeleteClient(client);
+
+		return;
+	}
+
+	this->activeClients.erase(it);
+	client->endpoint->numActive--;
+
+	SetIdle(client);
+}
+
+/**
+ * Closes an acquired connection instead of returning it to the pool (i.e. it
+ * is in an unknown protocol state).
+ */
+void TcpClientPool::Discard(TcpConnection *connection) {
+
+	auto it = this->activeClients.find(connection);
+
+	if (it == this->activeClients.end())
+		UV_THROW_ERROR("connection not acquired from this pool");
+
+	DeleteClient(it->second);
+}
+
+/**
+ * Opens connections to ip:port until minIdle of them are ready or connecting.
+ */
+void TcpClientPool::Prewarm(const std::string &ip, uint16_t port) {
+
+	if (this->closed)
+		UV_THROW_ERROR("closed");
+
+	FillMinIdle(GetEndpoint(ip, port));
+}
+
+void TcpClientPool::Dump() const {
+	UV_DUMP("<TcpClientPool>");
+	UV_DUMP("  [idle:%zu, active:%zu, connecting:%zu, endpoints:%zu]",
+			this->idleClients.size(), this->activeClients.size(),
+			this->connectingClients.size(), this->endpoints.size());
+	for (auto &kv : this->endpoints) {
+		auto &endpoint = kv.second;
+
+		UV_DUMP("  %s [idle:%zu, active:%zu, connecting:%zu]",
+				kv.first.c_str(), endpoint.idleClients.size(),
+				endpoint.numActive, endpoint.numConnecting);
+	}
+	UV_DUMP("</TcpClientPool>");
+}
+
+TcpClientPool::Endpoint* TcpClientPool::GetEndpoint(const std::string &ip,
+		uint16_t port) {
+
+	std::string key { ip };
+
+	key.append(":").append(std::to_string(port));
+
+	auto it = this->endpoints.find(key);
+
+	if (it != this->endpoints.end())
+		return &it->second;
+
+	auto &endpoint = this->endpoints[key];
+
+	endpoint.ip = ip;
+	endpoint.port = port;
+	endpoint.family = (ip.find(':') != std::string::npos) ? AF_INET6 : AF_INET;
+
+	return &endpoint;
+}
+
+/**
+ * Starts a new connection. Returns nullptr if it cannot be started, in which
+ * case cb is not called.
+ */
+TcpClientPool::Client* TcpClientPool::Connect(Endpoint *endpoint,
+		onAcquireCallback *cb) {
+
+	auto *client = new Client(this, endpoint);
+	std::string ip { endpoint->ip };
+	int err;
+
+	try {
+		err = client->Connect(ip, endpoint->port, endpoint->family);
+	} catch (const LibUVError &error) {
+		err = -1;
+	}
+
+	if (err != 0) {
+		UV_WARN_DEV("cannot connect to %s:%d", endpoint->ip.c_str(),
+				endpoint->port);
+
+		delete client;
+
+		return nullptr;
+	}
+
+	client->cb = cb;
+	this->connectingClients.insert(client);
+	endpoint->numConnecting++;
+
+	return client;
+}
+
+void TcpClientPool::SetIdle(Client *client) {
+
+	auto *endpoint = client->endpoint;
+
+	client->state = Client::State::IDLE;
+	client->lastUsed = DepLibUV::GetTimeMs();
+	client->endpointIdleIt = endpoint->idleClients.insert(
+			endpoint->idleClients.begin(), client);
+	client->idleIt = this->idleClients.insert(this->idleClients.begin(),
+			client);
+
+	// Evict the least recently used ones.
+	while (endpoint->idleClients.size() > this->options.maxIdle)
+		DeleteClient(endpoint->idleClients.back());
+
+	while (this->idleClients.size() > this->options.maxIdleTotal)
+		DeleteClient(this->idleClients.back());
+}
+
+void TcpClientPool::UnsetIdle(Client *client) {
+
+	client->endpoint->idleClients.erase(client->endpointIdleIt);
+	this->idleClients.erase(client->idleIt);
+}
+
+void TcpClientPool::DeleteClient(Client *client) {
+
+	switch (client->state) {
+	case Client::State::CONNECTING:
+		this->connectingClients.erase(client);
+		client->endpoint->numConnecting--;
+		break;
+
+	case Client::State::IDLE:
+		UnsetIdle(client);
+		break;
+
+	case Client::State::ACTIVE:
+		this->activeClients.erase(client->GetConnection());
+		client->endpoint->numActive--;
+		break;
+	}
+
+	// This closes the connection.
+	delete client;
+}
+
+void TcpClientPool::FillMinIdle(Endpoint *endpoint) {
+
+	while (endpoint->idleClients.size() + endpoint->numConnecting
+			< this->options.minIdle) {
+		if (Connect(endpoint, nullptr) == nullptr)
+			break;
+	}
+}
+
+inline void TcpClientPool::OnClientConnected(Client *client) {
+
+	auto *endpoint = client->endpoint;
+	auto *cb = client->cb;
+
+	this->connectingClients.erase(client);
+	endpoint->numConnecting--;
+	client->cb = nullptr;
+
+	// Pre-opened connection.
+	if (cb == nullptr) {
+		SetIdle(client);
+
+		return;
+	}
+
+	auto *connection = client->GetConnection();
+
+	client->state = Client::State::ACTIVE;
+	this->activeClients[connection] = client;
+	endpoint->numActive++;
+
+	(*cb)(connection);
+	delete cb;
+}
+
+inline void TcpClientPool::OnClientFailed(Client *client) {
+
+	auto *cb = client->cb;
+
+	client->cb = nullptr;
+
+	DeleteClient(client);
+
+	if (cb) {
+		(*cb)(nullptr);
+		delete cb;
+	}
+}
+
+inline void TcpClientPool::OnClientClosed(Client *client,
+		TcpConnection *connection) {
+
+	bool active = client->state == Client::State::ACTIVE;
+
+	if (active) {
+		this->activeClients.erase(connection);
+		client->endpoint->numActive--;
+	} else {
+		UnsetIdle(client);
+	}
+
+	delete client;
+
+	// Notify the subclass if the connection was in use.
+	if (active)
+		UserOnTcpConnectionClosed(connection);
+}
+
+bool TcpClientPool::UserOnTcpConnectionHealthCheck(
+		TcpConnection * /*connection*/) {
+	return true;
+}
+
+inline void TcpClientPool::OnTimer(Timer * /*timer*/) {
+
+	uint64_t now = DepLibUV::GetTimeMs();
+	// Least recently used first. Copied since clients may be deleted.
+	std::vector<Client*> clients(this->idleClients.rbegin(),
+			this->idleClients.rend());
+
+	for (auto *client : clients) {
+		auto *endpoint = client->endpoint;
+
+		if (now - client->lastUsed >= this->options.idleTimeout
+				&& endpoint->idleClients.size() > this->options.minIdle) {
+			UV_DEBUG_DEV("closing idle connection to %s:%d",
+					endpoint->ip.c_str(), endpoint->port);
+
+			DeleteClient(client);
+		} else if (!UserOnTcpConnectionHealthCheck(client->GetConnection())) {
+			UV_DEBUG_DEV("closing unhealthy connection to %s:%d",
+					endpoint->ip.c_str(), endpoint->port);
+
+			DeleteClient(client);
+		}
+	}
+
+	for (auto it = this->endpoints.begin(); it != this->endpoints.end();) {
+		auto &endpoint = it->second;
+
+		FillMinIdle(&endpoint);
+
+		// Forget unused endpoints.
+		if (endpoint.idleClients.empty() && endpoint.numConnecting == 0
+				&& endpoint.numActive == 0)
+			it = this->endpoints.erase(it);
+		else
+			++it;
+	}
+}
@@ -0,0 +1,155 @@
+#ifndef MS_TCP_CLIENT_POOL_HPP
+#define MS_TCP_CLIENT_POOL_HPP
+
+#include <uv.h>
+#include <functional>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include "TcpClient.hpp"
+#include "TcpConnection.hpp"
+#include "Timer.hpp"
+
+/**
+ * Pool of upstream TCP connections keyed by ip:port.
+ *
+ * Acquire() hands out an idle connection (the most recently used one) or opens
+ * a new one, and Release() gives it back for reuse. A connection is used by a
+ * single owner between Acquire() and Release(); the pool does not multiplex
+ * requests over the same connection since that depends on the protocol.
+ *
+ * Idle connections are kept reading so a close by the peer removes them from
+ * the pool. They are evicted in LRU order when an endpoint exceeds maxIdle or
+ * the whole pool exceeds maxIdleTotal, and by a periodic health check once idle
+ * for longer than idleTimeout (keeping minIdle of them open per endpoint).
+ */
+class TcpClientPool: public Timer::Listener {
+public:
+	using onAcquireCallback = const std::function<void(TcpConnection *connection)>;
+
+	struct Options {
+		// Idle connections kept open (and pre-opened) per endpoint.
+		size_t minIdle { 0 };
+		// Maximum idle connections per endpoint.
+		size_t maxIdle { 8 };
+		// Maximum idle connections in the pool.
+		size_t maxIdleTotal { 1024 };
+		// Idle time (ms) after which a connection above minIdle is closed.
+		uint64_t idleTimeout { 60000 };
+		// Interval (ms) of the health check, 0 to disable it.
+		uint64_t healthCheckInterval { 5000 };
+	};
+
+private:
+	struct Endpoint;
+
+	class Client: public TcpClient {
+	public:
+		enum class State {
+			CONNECTING = 1, IDLE, ACTIVE
+		};
+
+	public:
+		Client(TcpClientPool *pool, Endpoint *endpoint);
+
+	protected:
+		void UserOnTcpConnectionAlloc(TcpConnection **connection) override;
+		bool UserOnNewTcpConnection(TcpConnection *connection) override;
+		void UserOnTcpConnectionClosed(TcpConnection *connection) override;
+		void UserOnTcpConnectFailed(int error) override;
+
+	public:
+		TcpClientPool *pool { nullptr };
+		Endpoint *endpoint { nullptr };
+		State state { State::CONNECTING };
+		// Set if a caller waits for this connection.
+		onAcquireCallback *cb { nullptr };
+		uint64_t lastUsed { 0 };
+		// Position in Endpoint::idleClients and TcpClientPool::idleClients.
+		std::list<Client*>::iterator endpointIdleIt;
+		std::list<Client*>::iterator idleIt;
+	};
+
+	struct Endpoint {
+		std::string ip;
+		uint16_t port { 0 };
+		int family { AF_INET };
+		// Most recently used first.
+		std::list<Client*> idleClients;
+		size_t numConnecting { 0 };
+		size_t numActive { 0 };
+	};
+
+public:
+	explicit TcpClientPool(const Options &options);
+	TcpClientPool& operator=(const TcpClientPool&) = delete;
+	TcpClientPool(const TcpClientPool&) = delete;
+	virtual ~TcpClientPool();
+
+public:
+	void Close();
+	void Acquire(const std::string &ip, uint16_t port, onAcquireCallback *cb);
+	void Release(TcpConnection *connection);
+	void Discard(TcpConnection *connection);
+	void Prewarm(const std::string &ip, uint16_t port);
+	virtual void Dump() const;
+	size_t GetNumIdle() const;
+	size_t GetNumActive() const;
+	bool IsClosed() const;
+
+private:
+	Endpoint* GetEndpoint(const std::string &ip, uint16_t port);
+	Client* Connect(Endpoint *endpoint, onAcquireCallback *cb);
+	void SetIdle(Client *client);
+	void UnsetIdle(Client *client);
+	void DeleteClient(Client *client);
+	void FillMinIdle(Endpoint *endpoint);
+	void OnClientConnected(Client *client);
+	void OnClientFailed(Client *client);
+	void OnClientClosed(Client *client, TcpConnection *connection);
+
+	/* Pure virtual methods that must be implemented by the subclass. */
+protected:
+	virtual void UserOnTcpConnectionAlloc(TcpConnection **connection) = 0;
+	virtual void UserOnTcpConnectionClosed(TcpConnection *connection) = 0;
+
+	/* Virtual methods that may be implemented by the subclass. */
+protected:
+	// Called by the health check for every idle connection, false closes it.
+	virtual bool UserOnTcpConnectionHealthCheck(TcpConnection *connection);
+
+	/* Methods inherited from Timer::Listener. */
+public:
+	void OnTimer(Timer *timer) override;
+
+private:
+	// Passed by argument.
+	Options options;
+	// Allocated by this.
+	Timer *healthCheckTimer { nullptr };
+	// Others.
+	std::unordered_map<std::string, Endpoint> endpoints;
+	std::unordered_map<TcpConnection*, Client*> activeClients;
+	// Idle clients of all the endpoints, most recently used first.
+	std::list<Client*> idleClients;
+	// Clients waiting for their connection to be established.
+	std::unordered_set<Client*> connectingClients;
+	bool closed { false };
+};
+
+/* Inline methods. */
+
+inline size_t TcpClientPool::GetNumIdle() const {
+	return this->idleClients.size();
+}
+
+inline size_t TcpClientPool::GetNumActive() const {
+	return this->activeClients.size();
+}
+
+inline bool TcpClientPool::IsClosed() const {
+	return this->closed;
+}
+
+#endif
@@ -4,7 +4,51 @@
 #include "TcpConnection.hpp"
 #include "DepLibUV.hpp"
 #include "LibUVErrors.hpp"
-#include <cstring> // std::memcpy()
+#include <algorithm> // std::max()
+#include <cerrno>
+#include <cstring> // std::memcpy(), std::strerror()
+#include <vector>
+#include <netinet/in.h> // IPPROTO_TCP
+#include <netinet/tcp.h> // TCP_*
+#include <sys/socket.h>
+
+/* Static. */
+
+// Closed handles kept for the next connections of the thread.
+static constexpr size_t MaxPooledHandles { 256 };
+
+struct HandlePool {
+	~HandlePool() {
+		for (auto *handle : this->handles)
+			delete handle;
+	}
+
+	std::vector<uv_tcp_t*> handles;
+};
+
+static thread_local HandlePool handlePool;
+
+static uv_tcp_t* allocHandle() {
+
+	if (handlePool.handles.empty())
+		return new uv_tcp_t;
+
+	auto *handle = handlePool.handles.back();
+
+	handlePool.handles.pop_back();
+
+	return handle;
+}
+
+static bool setTcpOption(int fd, int option, int value, const char *name) {
+
+	if (::setsockopt(fd, IPPROTO_TCP, option, &value, sizeof(value)) == 0)
+		return true;
+
+	UV_WARN_DEV("setsockopt(%s) failed: %s", name, std::strerror(errno));
+
+	return false;
+}
 
 /* Static methods for UV callbacks. */
 
@@ -31,14 +75,20 @@ inline static void onWrite(uv_write_t *req, int status) {
 	auto *cb = writeData->cb;
 
 	if (connection)
-		connection->OnUvWrite(status, cb);
+		connection->OnUvWrite(status, writeData->len, cb,
+				writeData->writeListener);
 
 	// Delete the UvWriteData struct and the cb.
 	delete writeData;
 }
 
 inline static void onClose(uv_handle_t *handle) {
-	delete handle;
+	auto *tcpHandle = reinterpret_cast<uv_tcp_t*>(handle);
+
+	if (handlePool.handles.size() < MaxPooledHandles)
+		handlePool.handles.push_back(tcpHandle);
+	else
+		delete tcpHandle;
 }
 
 inline static void onShutdown(uv_shutdown_t *req, int /*status*/) {
@@ -51,27 +101,56 @@ inline static void onShutdown(uv_shutdown_t *req, int /*status*/) {
 			static_cast<uv_close_cb>(onClose));
 }
 
+inline static void onShutdownWrite(uv_shutdown_t *req, int status) {
+	auto *handle = req->handle;
+	auto *connection = static_cast<TcpConnection*>(handle->data);
+
+	delete req;
+
+	// The handle is being closed.
+	if (status == UV_ECANCELED)
+		return;
+
+	if (connection) {
+		connection->OnUvShutdown(status);
+	}
+	// Closed meanwhile, waiting for the queued data to be sent.
+	else {
+		uv_close(reinterpret_cast<uv_handle_t*>(handle),
+				static_cast<uv_close_cb>(onClose));
+	}
+}
+
 /* Instance methods. */
 
 // NOLINTNEXTLINE(cppcoreguidelines-pro-type-member-init)
 TcpConnection::TcpConnection(size_t bufferSize) :
 		bufferSize(bufferSize) {
 
-	this->uvHandle = new uv_tcp_t;
+	this->uvHandle = allocHandle();
 	this->uvHandle->data = static_cast<void*>(this);
+	this->uvAllocCb = static_cast<uv_alloc_cb>(onAlloc);
+	this->uvReadCb = static_cast<uv_read_cb>(onRead);
 
 	// NOTE: Don't allocate the buffer here. Instead wait for the first uv_alloc_cb().
 }
 
 TcpConnection::~TcpConnection() {
 
+	if (this->deletedFlag)
+		*this->deletedFlag = true;
+
 	if (!this->closed)
 		Close();
 
 	delete[] this->buffer;
 }
 
-void TcpConnection::Close() {
+/**
+ * Closes the connection, recording the reason (see GetCloseReason()). The
+ * listener is not notified.
+ */
+void TcpConnection::Close(CloseReason reason) {
 
 	if (this->closed)
 		return;
@@ -79,18 +158,49 @@ void TcpConnection::Close() {
 	int err;
 
 	this->closed = true;
+	this->closeReason = reason;
+
+	// Don't let uv_shutdown() wait for a write queue that is not moving, nor
+	// shut down a socket now used by another process.
+	if (reason == CloseReason::WRITE_TIMEOUT
+			|| reason == CloseReason::DRAIN_TIMEOUT
+			|| reason == CloseReason::HANDOFF)
+		this->hasError = true;
 
 	// Tell the UV handle that the TcpConnection has been closed.
 	this->uvHandle->data = nullptr;
 
+	// Writes parked by the DROP_OLDEST policy will never be sent.
+	while (!this->parkedWrites.empty()) {
+		auto *writeData = this->parkedWrites.front();
+
+		this->parkedWrites.pop_front();
+
+		if (writeData->cb)
+			(*writeData->cb)(false);
+
+		if (writeData->writeListener)
+			writeData->writeListener->OnTcpConnectionWritten(this, false);
+
+		delete writeData;
+	}
+
+	this->parkedWritesLen = 0;
+
 	// Don't read more.
 	err = uv_read_stop(reinterpret_cast<uv_stream_t*>(this->uvHandle));
 
 	if (err != 0)
 		UV_ABORT("uv_read_stop() failed: %s", uv_strerror(err));
 
+	if (this->shutdownPending && !this->hasError) {
+		// Already being shut down by Shutdown(), onShutdownWrite() closes it
+		// once the queued data has been sent.
+	}
 	// If there is no error and the peer didn't close its connection side then close gracefully.
-	if (!this->hasError && !this->isClosedByPeer) {
+	// A connection never started (i.e. still connecting) has nothing to send.
+	else if (this->started && !this->hasError && !this->isClosedByPeer
+			&& !this->writeShutdown) {
 		// Use uv_shutdown() so pending data to be written will be sent to the peer
 		// before closing.
 		auto req = new uv_shutdown_t;
@@ -98,36 +208,81 @@ void TcpConnection::Close() {
 		err = uv_shutdown(req, reinterpret_cast<uv_stream_t*>(this->uvHandle),
 				static_cast<uv_shutdown_cb>(onShutdown));
 
-		if (err != 0)
-			UV_ABORT("uv_shutdown() failed: %s", uv_strerror(err));
+		// Close it at once if it cannot be shut down.
+		if (err != 0) {
+			UV_DEBUG_DEV("uv_shutdown() failed, closing: %s", uv_strerror(err));
+
+			delete req;
+
+			uv_close(reinterpret_cast<uv_handle_t*>(this->uvHandle),
+					static_cast<uv_close_cb>(onClose));
+		}
 	}
 	// Otherwise directly close the socket.
 	else {
 		uv_close(reinterpret_cast<uv_handle_t*>(this->uvHandle),
 				static_cast<uv_close_cb>(onClose));
 	}
+
+	// Notify the subclass.
+	UserOnTcpConnectionClosed();
+}
+
+const char* TcpConnection::CloseReasonToString(CloseReason reason) {
+
+	switch (reason) {
+	case CloseReason::NONE:
+		return "none";
+	case CloseReason::LOCAL:
+		return "local";
+	case CloseReason::PEER_CLOSED:
+		return "peer closed";
+	case CloseReason::READ_ERROR:
+		return "read error";
+	case CloseReason::WRITE_ERROR:
+		return "write error";
+	case CloseReason::WRITE_QUEUE_FULL:
+		return "write queue full";
+	case CloseReason::IDLE_TIMEOUT:
+		return "idle timeout";
+	case CloseReason::READ_TIMEOUT:
+		return "read timeout";
+	case CloseReason::WRITE_TIMEOUT:
+		return "write timeout";
+	case CloseReason::DRAIN_TIMEOUT:
+		return "drain timeout";
+	case CloseReason::HANDOFF:
+		return "handoff";
+	}
+
+	return "unknown";
 }
 
 void TcpConnection::Dump() const {
 	UV_DUMP("<TcpConnection>")
 	;
-	UV_DUMP("  localIp    : %s", this->localIp.c_str())
+	UV_DUMP("  localIp    : %s", this->localAddress ? this->localAddress->GetIp() : "")
 	;
-	UV_DUMP("  localPort  : %d", static_cast<uint16_t>(this->localPort))
+	UV_DUMP("  localPort  : %d", this->localAddress ? this->localAddress->GetPort() : 0)
 	;
-	UV_DUMP("  remoteIp   : %s", this->peerIp.c_str())
+	UV_DUMP("  remoteIp   : %s", this->peerAddress.GetIp())
 	;
-	UV_DUMP("  remotePort : %d", static_cast<uint16_t>(this->peerPort))
+	UV_DUMP("  remotePort : %d", this->peerAddress.GetPort())
 	;
-	UV_DUMP("  closed     : %s", !this->closed ? "open" : "closed")
+	UV_DUMP("  closed     : %s", !this->closed ? "open" :
+			CloseReasonToString(this->closeReason))
+	;
+	UV_DUMP("  reading    : %s", this->readPauseReasons == 0 ? "yes" : "paused")
+	;
+	UV_DUMP("  writeQueue : %zu bytes%s", GetWriteQueueSize(),
+			this->backpressured ? " (backpressured)" : "")
 	;
 	UV_DUMP("</TcpConnection>")
 	;
 }
 
 void TcpConnection::Setup(Listener *listener,
-		struct sockaddr_storage *localAddr, const std::string &localIp,
-		uint16_t localPort) {
+		const SocketAddress *localAddress) {
 
 	// Set the UV handle.
 	int err = uv_tcp_init(DepLibUV::GetLoop(), this->uvHandle);
@@ -143,9 +298,130 @@ void TcpConnection::Setup(Listener *listener,
 	this->listener = listener;
 
 	// Set the local address.
-	this->localAddr = localAddr;
-	this->localIp = localIp;
-	this->localPort = localPort;
+	this->localAddress = localAddress;
+}
+
+/**
+ * Makes a closed connection usable again (to be set up and started as a new
+ * one), keeping its receive buffer. Any state of the subclass is cleared in
+ * UserOnTcpConnectionReset().
+ */
+void TcpConnection::Reset() {
+
+	if (!this->closed)
+		UV_THROW_ERROR("not closed");
+
+	// The previous handle is still being closed by libuv.
+	this->uvHandle = allocHandle();
+	this->uvHandle->data = static_cast<void*>(this);
+
+	this->bufferDataLen = 0;
+	this->peerAddress.Clear();
+	this->listener = nullptr;
+	this->localAddress = nullptr;
+	this->closed = false;
+	this->closeReason = CloseReason::NONE;
+	this->deletedFlag = nullptr;
+	this->started = false;
+	this->readPauseReasons = 0;
+	this->pauseReadingOnFullBuffer = false;
+	this->recvBytes = 0;
+	this->sentBytes = 0;
+	this->isClosedByPeer = false;
+	this->hasError = false;
+	this->readEof = false;
+	this->writeShutdown = false;
+	this->shutdownPending = false;
+	this->backpressureListener = nullptr;
+	this->writeQueuePolicy = WriteQueuePolicy::NONE;
+	this->writeQueueLowWatermark = 0;
+	this->writeQueueHighWatermark = 0;
+	// Writes in flight on the previous handle don't reach this anymore.
+	this->writeQueueSize = 0;
+	this->backpressured = false;
+	this->lastReadAt = 0;
+	this->lastWriteAt = 0;
+	this->writeProgressAt = 0;
+
+	UserOnTcpConnectionReset();
+}
+
+/**
+ * Sets the given options in the socket (already connected). Returns false if
+ * any of them failed, the rest are set anyway.
+ */
+bool TcpConnection::ApplySocketOptions(const SocketOptions &options) {
+
+	auto *handle = reinterpret_cast<uv_handle_t*>(this->uvHandle);
+	bool ok { true };
+	int err;
+	uv_os_fd_t fd;
+
+	err = uv_fileno(handle, &fd);
+
+	if (err != 0) {
+		UV_WARN_DEV("uv_fileno() failed: %s", uv_strerror(err));
+
+		return false;
+	}
+
+	if (options.noDelay) {
+		err = uv_tcp_nodelay(this->uvHandle, 1);
+
+		if (err != 0) {
+			UV_WARN_DEV("uv_tcp_nodelay() failed: %s", uv_strerror(err));
+			ok = false;
+		}
+	}
+
+	if (options.keepAliveDelay != 0) {
+		err = uv_tcp_keepalive(this->uvHandle, 1, options.keepAliveDelay);
+
+		if (err != 0) {
+			UV_WARN_DEV("uv_tcp_keepalive() failed: %s", uv_strerror(err));
+			ok = false;
+		}
+
+		if (options.keepAliveInterval != 0)
+			ok &= setTcpOption(fd, TCP_KEEPINTVL,
+					static_cast<int>(options.keepAliveInterval), "TCP_KEEPINTVL");
+
+		if (options.keepAliveCount != 0)
+			ok &= setTcpOption(fd, TCP_KEEPCNT,
+					static_cast<int>(options.keepAliveCount), "TCP_KEEPCNT");
+	}
+
+	if (options.sendBufferSize != 0) {
+		int value = options.sendBufferSize;
+
+		err = uv_send_buffer_size(handle, &value);
+
+		if (err != 0) {
+			UV_WARN_DEV("uv_send_buffer_size() failed: %s", uv_strerror(err));
+			ok = false;
+		}
+	}
+
+	if (options.recvBufferSize != 0) {
+		int value = options.recvBufferSize;
+
+		err = uv_recv_buffer_size(handle, &value);
+
+		if (err != 0) {
+			UV_WARN_DEV("uv_recv_buffer_size() failed: %s", uv_strerror(err));
+			ok = false;
+		}
+	}
+
+	if (options.notSentLowat != 0)
+		ok &= setTcpOption(fd, TCP_NOTSENT_LOWAT,
+				static_cast<int>(options.notSentLowat), "TCP_NOTSENT_LOWAT");
+
+	if (options.userTimeout != 0)
+		ok &= setTcpOption(fd, TCP_USER_TIMEOUT,
+				static_cast<int>(options.userTimeout), "TCP_USER_TIMEOUT");
+
+	return ok;
 }
 
 void TcpConnection::Start() {
@@ -153,19 +429,83 @@ void TcpConnection::Start() {
 	if (this->closed)
 		return;
 
-	int err = uv_read_start(reinterpret_cast<uv_stream_t*>(this->uvHandle),
-			static_cast<uv_alloc_cb>(onAlloc), static_cast<uv_read_cb>(onRead));
+	this->started = true;
+	this->lastReadAt = uv_now(DepLibUV::GetLoop());
+	this->lastWriteAt = this->lastReadAt;
 
-	if (err != 0)
-		UV_THROW_ERROR("uv_read_start() failed: %s", uv_strerror(err));
+	// Reading may have been paused before starting.
+	if (this->readPauseReasons == 0) {
+		int err = uv_read_start(reinterpret_cast<uv_stream_t*>(this->uvHandle),
+				this->uvAllocCb, this->uvReadCb);
+
+		if (err != 0)
+			UV_THROW_ERROR("uv_read_start() failed: %s", uv_strerror(err));
+	}
 
 	// Get the peer address.
 	if (!SetPeerAddress())
 		UV_THROW_ERROR("error setting peer IP and port");
 }
 
-void TcpConnection::Write(const uint8_t *data, size_t len,
-		TcpConnection::onSendCallback *cb) {
+void TcpConnection::PauseReading(ReadPauseReason reason) {
+
+	if (this->closed)
+		return;
+
+	bool wasPaused = this->readPauseReasons != 0;
+
+	this->readPauseReasons |= static_cast<uint8_t>(reason);
+
+	if (wasPaused || !this->started)
+		return;
+
+	UV_DEBUG_DEV("pausing reading [reason:%d]", static_cast<int>(reason));
+
+	// Let the kernel receive buffer fill so TCP flow control slows the sender.
+	int err = uv_read_stop(reinterpret_cast<uv_stream_t*>(this->uvHandle));
+
+	if (err != 0)
+		UV_THROW_ERROR("uv_read_stop() failed: %s", uv_strerror(err));
+}
+
+void TcpConnection::ResumeReading(ReadPauseReason reason) {
+
+	if (this->closed)
+		return;
+
+	if ((this->readPauseReasons & static_cast<uint8_t>(reason)) == 0)
+		return;
+
+	// Nothing to resume into if the subclass did not free any buffer space.
+	if (reason == ReadPauseReason::BUFFER_FULL
+			&& this->bufferDataLen >= this->bufferSize)
+		return;
+
+	this->readPauseReasons &= ~static_cast<uint8_t>(reason);
+
+	// Nothing more to read once the peer shut down its side.
+	if (this->readPauseReasons != 0 || !this->started || this->readEof)
+		return;
+
+	UV_DEBUG_DEV("resuming reading [reason:%d]", static_cast<int>(reason));
+
+	// Not waiting for the peer while paused.
+	this->lastReadAt = uv_now(DepLibUV::GetLoop());
+
+	int err = uv_read_start(reinterpret_cast<uv_stream_t*>(this->uvHandle),
+			this->uvAllocCb, this->uvReadCb);
+
+	if (err != 0)
+		UV_THROW_ERROR("uv_read_start() failed: %s", uv_strerror(err));
+}
+
+/**
+ * Writes the data, copying what cannot be written right away unless it
+ * belongs to the given payload (may be nullptr).
+ */
+void TcpConnection::WriteData(const uint8_t *data, size_t len,
+		SharedPayload *payload, TcpConnection::onSendCallback *cb,
+		WriteListener *writeListener) {
 
 	if (this->closed) {
 		if (cb) {
@@ -174,6 +514,9 @@ void TcpConnection::Write(const uint8_t *data, size_t len,
 			delete cb;
 		}
 
+		if (writeListener)
+			writeListener->OnTcpConnectionWritten(this, false);
+
 		return;
 	}
 
@@ -184,21 +527,33 @@ void TcpConnection::Write(const uint8_t *data, size_t len,
 			delete cb;
 		}
 
+		if (writeListener)
+			writeListener->OnTcpConnectionWritten(this, false);
+
 		return;
 	}
 
+	// Apply the write queue policy if the high watermark has been reached.
+	if (!AdmitWrite(cb, writeListener))
+		return;
+
 	// First try uv_try_write(). In case it can not directly write all the given
 	// data then build a uv_req_t and use uv_write().
 
 	uv_buf_t buffer = uv_buf_init(
 			reinterpret_cast<char*>(const_cast<uint8_t*>(data)), len);
-	int written = uv_try_write(reinterpret_cast<uv_stream_t*>(this->uvHandle),
-			&buffer, 1);
+	int written { UV_EAGAIN };
+
+	// Don't overtake writes parked by the DROP_OLDEST policy.
+	if (this->parkedWrites.empty())
+		written = uv_try_write(reinterpret_cast<uv_stream_t*>(this->uvHandle),
+				&buffer, 1);
 
 	// All the data was written. Done.
 	if (written == static_cast<int>(len)) {
 		// Update sent bytes.
 		this->sentBytes += written;
+		this->lastWriteAt = uv_now(DepLibUV::GetLoop());
 
 		if (cb) {
 			(*cb)(true);
@@ -206,6 +561,9 @@ void TcpConnection::Write(const uint8_t *data, size_t len,
 			delete cb;
 		}
 
+		if (writeListener)
+			writeListener->OnTcpConnectionWritten(this, true);
+
 		return;
 	}
 	// Cannot write any data at first time. Use uv_write().
@@ -224,7 +582,10 @@ void TcpConnection::Write(const uint8_t *data, size_t len,
 			delete cb;
 		}
 
-		Close();
+		if (writeListener)
+			writeListener->OnTcpConnectionWritten(this, false);
+
+		Close(CloseReason::WRITE_ERROR);
 
 		// Notify the listener.
 		this->listener->OnTcpConnectionClosed(this);
@@ -237,30 +598,20 @@ void TcpConnection::Write(const uint8_t *data, size_t len,
 	// 	static_cast<size_t>(written), len);
 
 	size_t pendingLen = len - written;
-	auto *writeData = new UvWriteData(pendingLen);
+	UvWriteData *writeData;
+
+	if (payload) {
+		writeData = new UvWriteData(payload, written, pendingLen);
+	} else {
+		writeData = new UvWriteData(pendingLen);
+		std::memcpy(writeData->store, data + written, pendingLen);
+	}
 
 	writeData->req.data = static_cast<void*>(writeData);
-	std::memcpy(writeData->store, data + written, pendingLen);
 	writeData->cb = cb;
+	writeData->writeListener = writeListener;
 
-	buffer = uv_buf_init(reinterpret_cast<char*>(writeData->store), pendingLen);
-
-	int err = uv_write(&writeData->req,
-			reinterpret_cast<uv_stream_t*>(this->uvHandle), &buffer, 1,
-			static_cast<uv_write_cb>(onWrite));
-
-	if (err != 0) {
-		UV_WARN_DEV("uv_write() failed: %s", uv_strerror(err));
-
-		if (cb)
-			(*cb)(false);
-
-		// Delete the UvWriteData struct (it will delete the store and cb too).
-		delete writeData;
-	} else {
-		// Update sent bytes.
-		this->sentBytes += pendingLen;
-	}
+	QueueWriteData(writeData);
 }
 
 void TcpConnection::Write(const uint8_t *data1, size_t len1,
@@ -286,10 +637,13 @@ void TcpConnection::Write(const uint8_t *data1, size_t len1,
 		return;
 	}
 
+	// Apply the write queue policy if the high watermark has been reached.
+	if (!AdmitWrite(cb))
+		return;
+
 	size_t totalLen = len1 + len2;
 	uv_buf_t buffers[2];
-	int written { 0 };
-	int err;
+	int written { UV_EAGAIN };
 
 	// First try uv_try_write(). In case it can not directly write all the given
 	// data then build a uv_req_t and use uv_write().
@@ -298,13 +652,17 @@ void TcpConnection::Write(const uint8_t *data1, size_t len1,
 			reinterpret_cast<char*>(const_cast<uint8_t*>(data1)), len1);
 	buffers[1] = uv_buf_init(
 			reinterpret_cast<char*>(const_cast<uint8_t*>(data2)), len2);
-	written = uv_try_write(reinterpret_cast<uv_stream_t*>(this->uvHandle),
-			buffers, 2);
+
+	// Don't overtake writes parked by the DROP_OLDEST policy.
+	if (this->parkedWrites.empty())
+		written = uv_try_write(reinterpret_cast<uv_stream_t*>(this->uvHandle),
+				buffers, 2);
 
 	// All the data was written. Done.
 	if (written == static_cast<int>(totalLen)) {
 		// Update sent bytes.
 		this->sentBytes += written;
+		this->lastWriteAt = uv_now(DepLibUV::GetLoop());
 
 		if (cb) {
 			(*cb)(true);
@@ -330,7 +688,7 @@ void TcpConnection::Write(const uint8_t *data1, size_t len1,
 			delete cb;
 		}
 
-		Close();
+		Close(CloseReason::WRITE_ERROR);
 
 		// Notify the listener.
 		this->listener->OnTcpConnectionClosed(this);
@@ -359,100 +717,348 @@ void TcpConnection::Write(const uint8_t *data1, size_t len1,
 
 	writeData->cb = cb;
 
-	uv_buf_t buffer = uv_buf_init(reinterpret_cast<char*>(writeData->store),
-			pendingLen);
+	QueueWriteData(writeData);
+}
 
-	err = uv_write(&writeData->req,
-			reinterpret_cast<uv_stream_t*>(this->uvHandle), &buffer, 1,
-			static_cast<uv_write_cb>(onWrite));
+/**
+ * The first of the given timeouts that expired at now (see Timeouts), NONE
+ * if none did.
+ */
+TcpConnection::CloseReason TcpConnection::GetExpiredTimeout(
+		const Timeouts &timeouts, uint64_t now) const {
 
-	if (err != 0) {
-		UV_WARN_DEV("uv_write() failed: %s", uv_strerror(err));
+	if (this->closed || !this->started)
+		return CloseReason::NONE;
 
-		if (cb)
-			(*cb)(false);
+	if (timeouts.writeTimeout != 0 && GetWriteQueueSize() != 0
+			&& now - this->writeProgressAt >= timeouts.writeTimeout)
+		return CloseReason::WRITE_TIMEOUT;
 
-		// Delete the UvWriteData struct (it will delete the store and cb too).
-		delete writeData;
-	} else {
+	// Not waiting for the peer while paused.
+	if (timeouts.readTimeout != 0 && this->readPauseReasons == 0
+			&& !this->readEof
+			&& now - this->lastReadAt >= timeouts.readTimeout)
+		return CloseReason::READ_TIMEOUT;
+
+	if (timeouts.idleTimeout != 0
+			&& now - std::max(this->lastReadAt, this->lastWriteAt)
+					>= timeouts.idleTimeout)
+		return CloseReason::IDLE_TIMEOUT;
+
+	return CloseReason::NONE;
+}
+
+void TcpConnection::SetWriteQueueWatermarks(size_t lowWatermark,
+		size_t highWatermark) {
+
+	if (highWatermark != 0 && lowWatermark > highWatermark)
+		UV_THROW_ERROR("low watermark (%zu) greater than high watermark (%zu)",
+				lowWatermark, highWatermark);
+
+	this->writeQueueLowWatermark = lowWatermark;
+	this->writeQueueHighWatermark = highWatermark;
+
+	// A queue already at the new high watermark is backpressured too, so the
+	// listener gets notified once it drops to the low one.
+	if (highWatermark != 0 && GetWriteQueueSize() >= highWatermark)
+		this->backpressured = true;
+}
+
+/**
+ * Writes the data in the receive buffer into the given connection and empties
+ * the buffer. What cannot be written right away is not copied: the buffer
+ * itself is handed over to the write request and a new one is allocated on
+ * the next read.
+ */
+void TcpConnection::Forward(TcpConnection *target) {
+
+	if (this->bufferDataLen == 0)
+		return;
+
+	size_t len = this->bufferDataLen;
+
+	this->bufferDataLen = 0;
+
+	if (target->closed)
+		return;
+
+	if (!target->AdmitWrite(nullptr))
+		return;
+
+	uv_buf_t buffer = uv_buf_init(reinterpret_cast<char*>(this->buffer), len);
+	int written { UV_EAGAIN };
+
+	// Don't overtake writes parked by the DROP_OLDEST policy.
+	if (target->parkedWrites.empty())
+		written = uv_try_write(reinterpret_cast<uv_stream_t*>(target->uvHandle),
+				&buffer, 1);
+
+	// All the data was written. Done.
+	if (written == static_cast<int>(len)) {
 		// Update sent bytes.
-		this->sentBytes += pendingLen;
+		target->sentBytes += written;
+		target->lastWriteAt = uv_now(DepLibUV::GetLoop());
+
+		return;
 	}
+	// Cannot write any data at first time, or error. Use uv_write() which
+	// reports errors asynchronously, so the target is not closed (and maybe
+	// deleted) while this connection is still being read.
+	else if (written < 0) {
+		written = 0;
+	}
+
+	target->sentBytes += written;
+
+	auto *writeData = new UvWriteData(this->buffer, written, len - written);
+
+	writeData->req.data = static_cast<void*>(writeData);
+
+	// The buffer now belongs to the write request.
+	this->buffer = nullptr;
+
+	target->QueueWriteData(writeData);
+}
+
+/**
+ * Shuts down the write side once the queued data has been sent, so the peer
+ * reads EOF while this keeps reading. Nothing may be written afterwards.
+ */
+void TcpConnection::Shutdown() {
+
+	if (this->closed || !this->started || this->writeShutdown)
+		return;
+
+	this->writeShutdown = true;
+
+	// uv_shutdown() waits for the writes given to libuv only.
+	while (!this->parkedWrites.empty()) {
+		auto *writeData = this->parkedWrites.front();
+
+		this->parkedWrites.pop_front();
+		this->parkedWritesLen -= writeData->len;
+
+		SendWriteData(writeData);
+	}
+
+	auto req = new uv_shutdown_t;
+	int err = uv_shutdown(req, reinterpret_cast<uv_stream_t*>(this->uvHandle),
+			static_cast<uv_shutdown_cb>(onShutdownWrite));
+
+	if (err != 0) {
+		UV_WARN_DEV("uv_shutdown() failed: %s", uv_strerror(err));
+
+		delete req;
+
+		return;
+	}
+
+	this->shutdownPending = true;
 }
 
 void TcpConnection::ErrorReceiving() {
 
-	Close();
+	Close(CloseReason::READ_ERROR);
 
 	this->listener->OnTcpConnectionClosed(this);
 }
 
-bool TcpConnection::SetPeerAddress() {
+/**
+ * Like ErrorReceiving() but with PEER_CLOSED, for an owner that knows the peer
+ * is done although it was not read here (see TcpProxy). Pending data is still
+ * sent.
+ */
+void TcpConnection::PeerClosed() {
 
-	int err;
-	int len = sizeof(this->peerAddr);
+	Close(CloseReason::PEER_CLOSED);
 
-	err = uv_tcp_getpeername(this->uvHandle,
-			reinterpret_cast<struct sockaddr*>(&this->peerAddr), &len);
+	this->listener->OnTcpConnectionClosed(this);
+}
 
-	if (err != 0) {
-		UV_ERROR("uv_tcp_getpeername() failed: %s", uv_strerror(err))
-		;
+bool TcpConnection::AdmitWrite(TcpConnection::onSendCallback *cb,
+		WriteListener *writeListener) {
+
+	// No limit or still below it.
+	if (this->writeQueueHighWatermark == 0
+			|| this->writeQueueSize < this->writeQueueHighWatermark)
+		return true;
+
+	switch (this->writeQueuePolicy) {
+	case WriteQueuePolicy::NONE:
+	case WriteQueuePolicy::DROP_OLDEST:
+		return true;
+
+	case WriteQueuePolicy::DROP_NEW: {
+		UV_WARN_DEV("write queue full (%zu bytes), dropping new data",
+				this->writeQueueSize);
+
+		if (cb) {
+			(*cb)(false);
+
+			delete cb;
+		}
+
+		if (writeListener)
+			writeListener->OnTcpConnectionWritten(this, false);
 
 		return false;
 	}
 
-	int family;
+	case WriteQueuePolicy::CLOSE: {
+		UV_WARN_DEV("write queue full (%zu bytes), closing the connection",
+				this->writeQueueSize);
 
-	GetAddressInfo(reinterpret_cast<const struct sockaddr*>(&this->peerAddr),
-			family, this->peerIp, this->peerPort);
+		if (cb) {
+			(*cb)(false);
+
+			delete cb;
+		}
+
+		if (writeListener)
+			writeListener->OnTcpConnectionWritten(this, false);
+
+		// Don't let uv_shutdown() wait for the queue to be flushed.
+		this->hasError = true;
+
+		Close(CloseReason::WRITE_QUEUE_FULL);
+
+		// Notify the listener.
+		this->listener->OnTcpConnectionClosed(this);
+
+		return false;
+	}
+	}
 
 	return true;
 }
 
-void TcpConnection::GetAddressInfo(const struct sockaddr *addr, int &family, std::string &ip, uint16_t &port) {
+void TcpConnection::QueueWriteData(UvWriteData *writeData) {
 
-	char ipBuffer[INET6_ADDRSTRLEN] = { 0 };
-	int err;
+	// With the DROP_OLDEST policy keep the data out of libuv while the high
+	// watermark is exceeded, so it can still be discarded.
+	if (this->writeQueuePolicy == WriteQueuePolicy::DROP_OLDEST
+			&& this->writeQueueHighWatermark != 0
+			&& (!this->parkedWrites.empty()
+					|| this->writeQueueSize >= this->writeQueueHighWatermark)) {
+		ParkWriteData(writeData);
+
+		return;
+	}
+
+	SendWriteData(writeData);
+}
+
+void TcpConnection::SendWriteData(UvWriteData *writeData) {
+
+	uv_buf_t buffer = uv_buf_init(
+			reinterpret_cast<char*>(const_cast<uint8_t*>(writeData->GetData())),
+			writeData->len);
+
+	int err = uv_write(&writeData->req,
+			reinterpret_cast<uv_stream_t*>(this->uvHandle), &buffer, 1,
+			static_cast<uv_write_cb>(onWrite));
+
+	if (err != 0) {
+		UV_WARN_DEV("uv_write() failed: %s", uv_strerror(err));
+
+		if (writeData->cb)
+			(*writeData->cb)(false);
+
+		if (writeData->writeListener)
+			writeData->writeListener->OnTcpConnectionWritten(this, false);
+
+		// Delete the UvWriteData struct (it will delete the store and cb too).
+		delete writeData;
+
+		return;
+	}
+
+	// The write timeout counts from the first write waiting in the queue.
+	if (this->writeQueueSize == 0)
+		this->writeProgressAt = uv_now(DepLibUV::GetLoop());
 
-	switch (addr->sa_family) {
-	case AF_INET: {
-		err =uv_inet_ntop(AF_INET,std::addressof(reinterpret_cast<const struct sockaddr_in*>(addr)->sin_addr),
-						ipBuffer, sizeof(ipBuffer));
+	// Update sent bytes.
+	this->sentBytes += writeData->len;
+	this->writeQueueSize += writeData->len;
 
-		if (err)
-			UV_ABORT("uv_inet_ntop() failed: %s", uv_strerror(err));
+	if (this->writeQueueHighWatermark != 0 && !this->backpressured
+			&& this->writeQueueSize >= this->writeQueueHighWatermark) {
+		UV_DEBUG_DEV("write queue reached the high watermark [queued:%zu]",
+				this->writeQueueSize);
 
-		port = static_cast<uint16_t>(ntohs(
-				reinterpret_cast<const struct sockaddr_in*>(addr)->sin_port));
+		this->backpressured = true;
 
-		break;
+		if (this->backpressureListener)
+			this->backpressureListener->OnTcpConnectionBackpressure(this);
 	}
+}
+
+void TcpConnection::ParkWriteData(UvWriteData *writeData) {
+
+	this->parkedWrites.push_back(writeData);
+	this->parkedWritesLen += writeData->len;
+
+	// Drop the oldest parked data until the queue fits again, but always keep
+	// the newest one.
+	while (this->parkedWrites.size() > 1
+			&& this->writeQueueSize + this->parkedWritesLen
+					> this->writeQueueHighWatermark) {
+		auto *oldest = this->parkedWrites.front();
+
+		this->parkedWrites.pop_front();
+		this->parkedWritesLen -= oldest->len;
 
-	case AF_INET6: {
-		err = uv_inet_ntop(AF_INET6, std::addressof(reinterpret_cast<const struct sockaddr_in6*>(addr)->sin6_addr),
-						ipBuffer, sizeof(ipBuffer));
+		UV_WARN_DEV("write queue full, dropping %zu bytes of old data",
+				oldest->len);
 
-		if (err)
-			UV_ABORT("uv_inet_ntop() failed: %s", uv_strerror(err));
+		if (oldest->cb)
+			(*oldest->cb)(false);
 
-		port = static_cast<uint16_t>(ntohs(
-				reinterpret_cast<const struct sockaddr_in6*>(addr)->sin6_port));
+		if (oldest->writeListener)
+			oldest->writeListener->OnTcpConnectionWritten(this, false);
 
-		break;
+		delete oldest;
 	}
+}
+
+void TcpConnection::FlushParkedWrites() {
+
+	// Wait until the queue drops to the low watermark.
+	if (this->writeQueueSize > this->writeQueueLowWatermark)
+		return;
+
+	while (!this->parkedWrites.empty() && !this->closed
+			&& (this->writeQueueHighWatermark == 0
+					|| this->writeQueueSize < this->writeQueueHighWatermark)) {
+		auto *writeData = this->parkedWrites.front();
 
-	default: {
-		UV_ABORT("unknown network family: %d",
-				static_cast<int>(addr->sa_family));
+		this->parkedWrites.pop_front();
+		this->parkedWritesLen -= writeData->len;
+
+		SendWriteData(writeData);
 	}
+}
+
+bool TcpConnection::SetPeerAddress() {
+
+	int err;
+	struct sockaddr_storage peerAddr;
+	int len = sizeof(peerAddr);
+
+	err = uv_tcp_getpeername(this->uvHandle,
+			reinterpret_cast<struct sockaddr*>(&peerAddr), &len);
+
+	if (err != 0) {
+		UV_ERROR("uv_tcp_getpeername() failed: %s", uv_strerror(err))
+		;
+
+		return false;
 	}
 
-	family = addr->sa_family;
-	ip.assign(ipBuffer);
+	return this->peerAddress.Set(reinterpret_cast<struct sockaddr*>(&peerAddr));
 }
 
-inline void TcpConnection::OnUvReadAlloc(size_t /*suggestedSize*/,
+void TcpConnection::OnUvReadAlloc(size_t /*suggestedSize*/,
 		uv_buf_t *buf) {
 
 	// If this is the first call to onUvReadAlloc() then allocate the receiving buffer now.
@@ -472,30 +1078,46 @@ inline void TcpConnection::OnUvReadAlloc(size_t /*suggestedSize*/,
 	}
 }
 
-inline void TcpConnection::OnUvRead(ssize_t nread, const uv_buf_t* /*buf*/) {
+void TcpConnection::OnUvRead(ssize_t nread, const uv_buf_t* /*buf*/) {
 
 	if (nread == 0)
 		return;
 
 	// Data received.
 	if (nread > 0) {
-		// Update received bytes.
-		this->recvBytes += nread;
+		bool deleted { false };
 
-		// Update the buffer data length.
-		this->bufferDataLen += static_cast<size_t>(nread);
+		BeginUvRead(static_cast<size_t>(nread), &deleted);
 
 		// Notify the subclass.
 		UserOnTcpConnectionRead();
+
+		// The subclass may have closed the connection and its owner deleted it.
+		if (deleted)
+			return;
+
+		EndUvRead();
+	}
+	// No space in the buffer (reading resumed while it was still full).
+	else if (nread == UV_ENOBUFS && this->pauseReadingOnFullBuffer) {
+		PauseReading(ReadPauseReason::BUFFER_FULL);
 	}
 	// Client disconnected.
 	else if (nread == UV_EOF || nread == UV_ECONNRESET) {
+		if (nread == UV_EOF) {
+			this->readEof = true;
+
+			// Kept half-open by the subclass, which may have deleted this.
+			if (UserOnTcpConnectionEof())
+				return;
+		}
+
 		UV_DEBUG_DEV("connection closed by peer, closing server side");
 
 		this->isClosedByPeer = true;
 
 		// Close server side of the connection.
-		Close();
+		Close(CloseReason::PEER_CLOSED);
 
 		// Notify the listener.
 		this->listener->OnTcpConnectionClosed(this);
@@ -508,19 +1130,61 @@ inline void TcpConnection::OnUvRead(ssize_t nread, const uv_buf_t* /*buf*/) {
 		this->hasError = true;
 
 		// Close server side of the connection.
-		Close();
+		Close(CloseReason::READ_ERROR);
 
 		// Notify the listener.
 		this->listener->OnTcpConnectionClosed(this);
 	}
 }
 
-inline void TcpConnection::OnUvWrite(int status,
-		TcpConnection::onSendCallback *cb) {
+inline void TcpConnection::OnUvWrite(int status, size_t len,
+		TcpConnection::onSendCallback *cb, WriteListener *writeListener) {
+
+	bool deleted { false };
+
+	this->writeQueueSize -= len;
+
+	// The callbacks may close this (e.g. a write failing at once) and its
+	// owner delete it.
+	this->deletedFlag = &deleted;
 
 	if (status == 0) {
+		this->lastWriteAt = uv_now(DepLibUV::GetLoop());
+		this->writeProgressAt = this->lastWriteAt;
+
+		FlushParkedWrites();
+
+		if (deleted)
+			return;
+
 		if (cb)
 			(*cb)(true);
+
+		if (deleted)
+			return;
+
+		if (writeListener)
+			writeListener->OnTcpConnectionWritten(this, true);
+
+		if (deleted)
+			return;
+
+		this->deletedFlag = nullptr;
+
+		// The callback may have closed the connection.
+		if (this->closed)
+			return;
+
+		if (this->backpressured
+				&& GetWriteQueueSize() <= this->writeQueueLowWatermark) {
+			UV_DEBUG_DEV("write queue dropped to the low watermark [queued:%zu]",
+					GetWriteQueueSize());
+
+			this->backpressured = false;
+
+			if (this->backpressureListener)
+				this->backpressureListener->OnTcpConnectionWritable(this);
+		}
 	} else {
 		if (status != UV_EPIPE && status != UV_ENOTCONN)
 			this->hasError = true;
@@ -531,8 +1195,31 @@ inline void TcpConnection::OnUvWrite(int status,
 		if (cb)
 			(*cb)(false);
 
-		Close();
+		if (deleted)
+			return;
+
+		if (writeListener)
+			writeListener->OnTcpConnectionWritten(this, false);
+
+		if (deleted)
+			return;
+
+		this->deletedFlag = nullptr;
+
+		// Already closed and its listener notified by the callback.
+		if (this->closed)
+			return;
+
+		Close(CloseReason::WRITE_ERROR);
 
 		this->listener->OnTcpConnectionClosed(this);
 	}
 }
+
+inline void TcpConnection::OnUvShutdown(int status) {
+
+	this->shutdownPending = false;
+
+	if (status != 0)
+		UV_WARN_DEV("uv_shutdown() failed: %s", uv_strerror(status));
+}
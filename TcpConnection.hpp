@@ -3,7 +3,10 @@
 
 #include <uv.h>
 #include <string>
+#include <deque>
 #include <functional>
+#include <cstring> // std::memcpy()
+#include "SocketAddress.hpp"
 class TcpConnection {
 protected:
 
@@ -18,24 +21,196 @@ public:
 		virtual void OnTcpConnectionClosed(TcpConnection *connection) = 0;
 	};
 
+	/**
+	 * Notified when the write queue crosses the high watermark and, later,
+	 * when it drops back to the low watermark.
+	 */
+	class BackpressureListener {
+	public:
+		virtual ~BackpressureListener() = default;
+
+	public:
+		virtual void OnTcpConnectionBackpressure(TcpConnection *connection) = 0;
+		virtual void OnTcpConnectionWritable(TcpConnection *connection) = 0;
+	};
+
+	/**
+	 * Notified when a write given to Write(data, len, writeListener) is done,
+	 * so no onSendCallback is allocated for it. Like the callbacks, not
+	 * notified of the writes still in flight once the connection is closed.
+	 */
+	class WriteListener {
+	public:
+		virtual ~WriteListener() = default;
+
+	public:
+		virtual void OnTcpConnectionWritten(TcpConnection *connection,
+				bool written) = 0;
+	};
+
+	/* What Write() does once the high watermark has been reached. */
+	enum class WriteQueuePolicy : uint8_t {
+		// Keep queueing, just notify the BackpressureListener.
+		NONE = 0,
+		// Reject the new data (its callback is called with false).
+		DROP_NEW,
+		// Hold new data and drop the oldest data not yet given to libuv.
+		DROP_OLDEST,
+		// Close the connection without flushing the queue.
+		CLOSE
+	};
+
+	/**
+	 * Why reading is paused. Reading is resumed once every reason has been
+	 * cleared.
+	 */
+	enum class ReadPauseReason : uint8_t {
+		// Paused by the application.
+		USER = 1 << 0,
+		// The receive buffer is full (see SetPauseReadingOnFullBuffer()). The
+		// subclass resumes it once it has consumed data from the buffer.
+		BUFFER_FULL = 1 << 1,
+		// The connection the data is forwarded to is backpressured.
+		BACKPRESSURE = 1 << 2,
+		// The socket is read with splice() instead (see TcpProxy).
+		SPLICE = 1 << 3
+	};
+
+	/* Why the connection was closed, see GetCloseReason(). */
+	enum class CloseReason : uint8_t {
+		// Not closed.
+		NONE = 0,
+		// Closed by the application.
+		LOCAL,
+		// The peer closed or reset the connection, or PeerClosed() was called.
+		PEER_CLOSED,
+		// Read error, or the subclass called ErrorReceiving().
+		READ_ERROR,
+		WRITE_ERROR,
+		// The write queue reached the high watermark with the CLOSE policy.
+		WRITE_QUEUE_FULL,
+		IDLE_TIMEOUT,
+		READ_TIMEOUT,
+		WRITE_TIMEOUT,
+		// Not closed before the deadline of TcpServer::Drain().
+		DRAIN_TIMEOUT,
+		// Handed over to another process (see UnixStreamSocket::WriteHandle()),
+		// the socket is closed here without shutting it down.
+		HANDOFF
+	};
+
+	/**
+	 * Timeouts in ms, 0 for none. They are checked by the owner of the
+	 * connection (see TcpServer::SetTimeouts()).
+	 */
+	struct Timeouts {
+		// No data received nor sent.
+		uint64_t idleTimeout { 0 };
+		// No data received while reading (not while reading is paused).
+		uint64_t readTimeout { 0 };
+		// Data queued and none of it written.
+		uint64_t writeTimeout { 0 };
+	};
+
+	/**
+	 * Socket options applied by the owner once the connection is established
+	 * (see TcpServer::SetSocketOptions() and TcpClient::SetSocketOptions()).
+	 * 0 keeps the kernel default.
+	 */
+	struct SocketOptions {
+		// TCP_NODELAY, disables Nagle's algorithm.
+		bool noDelay { true };
+		// Idle time (s) before sending keepalive probes, 0 to not send them.
+		uint32_t keepAliveDelay { 0 };
+		// Time (s) between keepalive probes.
+		uint32_t keepAliveInterval { 0 };
+		// Unanswered keepalive probes before dropping the connection.
+		uint32_t keepAliveCount { 0 };
+		// SO_SNDBUF and SO_RCVBUF in bytes (Linux doubles them).
+		int sendBufferSize { 0 };
+		int recvBufferSize { 0 };
+		// TCP_NOTSENT_LOWAT, unsent bytes the kernel accepts before the socket
+		// stops being writable, so the rest waits in the write queue.
+		uint32_t notSentLowat { 0 };
+		// TCP_USER_TIMEOUT (ms), time sent data may remain unacknowledged
+		// before dropping the connection.
+		uint32_t userTimeout { 0 };
+	};
+
+public:
+	static const char* CloseReasonToString(CloseReason reason);
+
+public:
+	/**
+	 * Reference counted data, to write the same data into many connections
+	 * without each of them copying what it cannot write right away. Not thread
+	 * safe, used in the loop thread only.
+	 */
+	class SharedPayload {
+	public:
+		// Copies the data. The caller owns the first reference.
+		SharedPayload(const uint8_t *data, size_t len);
+		SharedPayload& operator=(const SharedPayload&) = delete;
+		SharedPayload(const SharedPayload&) = delete;
+
+	private:
+		~SharedPayload();
+
+	public:
+		void Ref();
+		void Unref();
+		const uint8_t* GetData() const;
+		size_t GetLen() const;
+
+	private:
+		uint8_t *data { nullptr };
+		size_t len { 0 };
+		size_t refCount { 1 };
+	};
+
 public:
 	/* Struct for the data field of uv_req_t when writing into the connection. */
 	struct UvWriteData {
-		explicit UvWriteData(size_t storeSize) {
+		explicit UvWriteData(size_t storeSize) :
+				len(storeSize) {
 			this->store = new uint8_t[storeSize];
 		}
 
+		// Take ownership of an already filled store (allocated with new[]).
+		UvWriteData(uint8_t *store, size_t offset, size_t len) :
+				store(store), offset(offset), len(len) {
+		}
+
+		// Reference the payload instead of copying it.
+		UvWriteData(SharedPayload *payload, size_t offset, size_t len) :
+				payload(payload), offset(offset), len(len) {
+			this->payload->Ref();
+		}
+
 		// Disable copy constructor because of the dynamically allocated data (store).
 		UvWriteData(const UvWriteData&) = delete;
 
 		~UvWriteData() {
 			delete[] this->store;
 			delete this->cb;
+
+			if (this->payload)
+				this->payload->Unref();
+		}
+
+		const uint8_t* GetData() const {
+			return (this->payload ? this->payload->GetData() : this->store)
+					+ this->offset;
 		}
 
 		uv_write_t req;
 		uint8_t *store { nullptr };
+		SharedPayload *payload { nullptr };
+		// Pending data is store[offset, offset + len).
+		size_t offset { 0 };
+		size_t len { 0 };
 		TcpConnection::onSendCallback *cb { nullptr };
+		TcpConnection::WriteListener *writeListener { nullptr };
 	};
 
 public:
@@ -45,41 +220,93 @@ public:
 	virtual ~TcpConnection();
 
 public:
-	void Close();
+	void Close(CloseReason reason = CloseReason::LOCAL);
 	virtual void Dump() const;
-	void Setup(Listener *listener, struct sockaddr_storage *localAddr,
-			const std::string &localIp, uint16_t localPort);
+	void Setup(Listener *listener, const SocketAddress *localAddress);
+	void Reset();
+	bool ApplySocketOptions(const SocketOptions &options);
 	bool IsClosed() const;
+	CloseReason GetCloseReason() const;
 	uv_tcp_t* GetUvHandle() const;
 	void Start();
+	void PauseReading(ReadPauseReason reason = ReadPauseReason::USER);
+	void ResumeReading(ReadPauseReason reason = ReadPauseReason::USER);
+	bool IsReadingPaused() const;
+	void SetPauseReadingOnFullBuffer(bool flag);
 	void Write(const uint8_t *data, size_t len,
 			TcpConnection::onSendCallback *cb);
 	void Write(const uint8_t *data1, size_t len1, const uint8_t *data2,
 			size_t len2, TcpConnection::onSendCallback *cb);
+	void Write(SharedPayload *payload, TcpConnection::onSendCallback *cb);
+	void Write(const uint8_t *data, size_t len, WriteListener &writeListener);
+	void Forward(TcpConnection *target);
+	void Shutdown();
 	void ErrorReceiving();
+	void PeerClosed();
+	const SocketAddress& GetLocalSocketAddress() const;
 	const struct sockaddr* GetLocalAddress() const;
 	int GetLocalFamily() const;
-	const std::string& GetLocalIp() const;
+	std::string GetLocalIp() const;
 	uint16_t GetLocalPort() const;
+	const SocketAddress& GetPeerSocketAddress() const;
 	const struct sockaddr* GetPeerAddress() const;
-	const std::string& GetPeerIp() const;
+	std::string GetPeerIp() const;
 	uint16_t GetPeerPort() const;
 	size_t GetRecvBytes() const;
 	size_t GetSentBytes() const;
+	uint64_t GetId() const;
+	uint64_t GetLastReadTime() const;
+	uint64_t GetLastWriteTime() const;
+	CloseReason GetExpiredTimeout(const Timeouts &timeouts, uint64_t now) const;
+	void SetBackpressureListener(BackpressureListener *backpressureListener);
+	void SetWriteQueueWatermarks(size_t lowWatermark, size_t highWatermark);
+	void SetWriteQueuePolicy(WriteQueuePolicy policy);
+	size_t GetWriteQueueSize() const;
+	bool IsBackpressured() const;
 
 private:
+	void WriteData(const uint8_t *data, size_t len, SharedPayload *payload,
+			TcpConnection::onSendCallback *cb,
+			WriteListener *writeListener = nullptr);
+	bool AdmitWrite(TcpConnection::onSendCallback *cb,
+			WriteListener *writeListener = nullptr);
+	void QueueWriteData(UvWriteData *writeData);
+	void SendWriteData(UvWriteData *writeData);
+	void ParkWriteData(UvWriteData *writeData);
+	void FlushParkedWrites();
 	bool SetPeerAddress();
-	void GetAddressInfo(const struct sockaddr *addr, int &family, std::string &ip, uint16_t &port);
 	/* Callbacks fired by UV events. */
 public:
 	void OnUvReadAlloc(size_t suggestedSize, uv_buf_t *buf);
 	void OnUvRead(ssize_t nread, const uv_buf_t *buf);
-	void OnUvWrite(int status, onSendCallback *cb);
+	void OnUvWrite(int status, size_t len, onSendCallback *cb,
+			WriteListener *writeListener);
+	void OnUvShutdown(int status);
 
 	/* Pure virtual methods that must be implemented by the subclass. */
 protected:
 	virtual void UserOnTcpConnectionRead() = 0;
 
+	/* Virtual methods that may be implemented by the subclass. */
+protected:
+	// Called by Reset() so a reused connection clears its own state.
+	virtual void UserOnTcpConnectionReset() {}
+	// Called at the end of Close(), e.g. to wake up what waits on the
+	// connection. Not called from the destructor.
+	virtual void UserOnTcpConnectionClosed() {}
+	// Called when the peer shuts down its side. Return true to keep the
+	// connection half-open (it may be closed or deleted from here), false to
+	// close it (PEER_CLOSED).
+	virtual bool UserOnTcpConnectionEof() {
+		return false;
+	}
+
+	/* Read path of StaticTcpConnection. */
+protected:
+	void SetUvReadCallbacks(uv_alloc_cb allocCb, uv_read_cb readCb);
+	void BeginUvRead(size_t nread, bool *deleted);
+	void EndUvRead();
+
 protected:
 	// Passed by argument.
 	size_t bufferSize { 0 };
@@ -87,62 +314,169 @@ protected:
 	uint8_t *buffer { nullptr };
 	// Others.
 	size_t bufferDataLen { 0 };
-	std::string localIp;
-	uint16_t localPort { 0 };
-	struct sockaddr_storage peerAddr;
-	std::string peerIp;
-	uint16_t peerPort { 0 };
+	SocketAddress peerAddress;
 
 private:
+	friend class TcpConnectionRegistry;
+
 	// Passed by argument.
 	Listener *listener { nullptr };
 	// Allocated by this.
 	uv_tcp_t *uvHandle { nullptr };
 	// Others.
-	struct sockaddr_storage *localAddr { nullptr };
+	// Owned by the TcpServer or TcpClient.
+	const SocketAddress *localAddress { nullptr };
 	bool closed { false };
+	CloseReason closeReason { CloseReason::NONE };
+	// Set while notifying the subclass so deleting this can be detected.
+	bool *deletedFlag { nullptr };
+	bool started { false };
+	// Bitmask of ReadPauseReason values.
+	uint8_t readPauseReasons { 0 };
+	bool pauseReadingOnFullBuffer { false };
 	size_t recvBytes { 0 };
 	size_t sentBytes { 0 };
 	bool isClosedByPeer { false };
 	bool hasError { false };
+	// The peer shut down its side and the subclass kept the connection open.
+	bool readEof { false };
+	// Shutdown() called, and its uv_shutdown() not completed yet.
+	bool writeShutdown { false };
+	bool shutdownPending { false };
+	// Write queue.
+	BackpressureListener *backpressureListener { nullptr };
+	WriteQueuePolicy writeQueuePolicy { WriteQueuePolicy::NONE };
+	size_t writeQueueLowWatermark { 0 };
+	size_t writeQueueHighWatermark { 0 };
+	// Bytes given to uv_write() and not yet completed.
+	size_t writeQueueSize { 0 };
+	// Writes held back by the DROP_OLDEST policy.
+	std::deque<UvWriteData*> parkedWrites;
+	size_t parkedWritesLen { 0 };
+	bool backpressured { false };
+	// Timeouts, loop times in ms.
+	uint64_t lastReadAt { 0 };
+	uint64_t lastWriteAt { 0 };
+	// Since when the oldest queued write has been waiting.
+	uint64_t writeProgressAt { 0 };
+	// Id in the TcpConnectionRegistry of the owner, 0 if none.
+	uint64_t id { 0 };
+	// Given to uv_read_start(), see SetUvReadCallbacks().
+	uv_alloc_cb uvAllocCb { nullptr };
+	uv_read_cb uvReadCb { nullptr };
 };
 
 /* Inline methods. */
 
+inline TcpConnection::SharedPayload::SharedPayload(const uint8_t *data,
+		size_t len) :
+		data(new uint8_t[len]), len(len) {
+	std::memcpy(this->data, data, len);
+}
+
+inline TcpConnection::SharedPayload::~SharedPayload() {
+	delete[] this->data;
+}
+
+inline void TcpConnection::SharedPayload::Ref() {
+	this->refCount++;
+}
+
+inline void TcpConnection::SharedPayload::Unref() {
+	if (--this->refCount == 0)
+		delete this;
+}
+
+inline const uint8_t* TcpConnection::SharedPayload::GetData() const {
+	return this->data;
+}
+
+inline size_t TcpConnection::SharedPayload::GetLen() const {
+	return this->len;
+}
+
+inline void TcpConnection::Write(const uint8_t *data, size_t len,
+		TcpConnection::onSendCallback *cb) {
+	WriteData(data, len, nullptr, cb);
+}
+
+/**
+ * Writes the payload. What cannot be written right away keeps a reference to
+ * it instead of a copy.
+ */
+inline void TcpConnection::Write(SharedPayload *payload,
+		TcpConnection::onSendCallback *cb) {
+	WriteData(payload->GetData(), payload->GetLen(), payload, cb);
+}
+
+/**
+ * Writes the data and notifies the listener once done, which must outlive the
+ * write (may be at once, from here).
+ */
+inline void TcpConnection::Write(const uint8_t *data, size_t len,
+		TcpConnection::WriteListener &writeListener) {
+	WriteData(data, len, nullptr, nullptr, &writeListener);
+}
+
 inline bool TcpConnection::IsClosed() const {
 	return this->closed;
 }
 
+/**
+ * Set once closed, so it can be read from
+ * Listener::OnTcpConnectionClosed().
+ */
+inline TcpConnection::CloseReason TcpConnection::GetCloseReason() const {
+	return this->closeReason;
+}
+
 inline uv_tcp_t* TcpConnection::GetUvHandle() const {
 	return this->uvHandle;
 }
 
+inline bool TcpConnection::IsReadingPaused() const {
+	return this->readPauseReasons != 0;
+}
+
+inline void TcpConnection::SetPauseReadingOnFullBuffer(bool flag) {
+	this->pauseReadingOnFullBuffer = flag;
+}
+
+inline const SocketAddress& TcpConnection::GetLocalSocketAddress() const {
+	return *this->localAddress;
+}
+
 inline const struct sockaddr* TcpConnection::GetLocalAddress() const {
-	return reinterpret_cast<const struct sockaddr*>(this->localAddr);
+	return this->localAddress->GetSockAddr();
 }
 
 inline int TcpConnection::GetLocalFamily() const {
-	return reinterpret_cast<const struct sockaddr*>(this->localAddr)->sa_family;
+	return this->localAddress->GetFamily();
 }
 
-inline const std::string& TcpConnection::GetLocalIp() const {
-	return this->localIp;
+inline std::string TcpConnection::GetLocalIp() const {
+	return std::string(this->localAddress->GetIp(),
+			this->localAddress->GetIpLen());
 }
 
 inline uint16_t TcpConnection::GetLocalPort() const {
-	return this->localPort;
+	return this->localAddress->GetPort();
+}
+
+inline const SocketAddress& TcpConnection::GetPeerSocketAddress() const {
+	return this->peerAddress;
 }
 
 inline const struct sockaddr* TcpConnection::GetPeerAddress() const {
-	return reinterpret_cast<const struct sockaddr*>(&this->peerAddr);
+	return this->peerAddress.GetSockAddr();
 }
 
-inline const std::string& TcpConnection::GetPeerIp() const {
-	return this->peerIp;
+inline std::string TcpConnection::GetPeerIp() const {
+	return std::string(this->peerAddress.GetIp(), this->peerAddress.GetIpLen());
 }
 
 inline uint16_t TcpConnection::GetPeerPort() const {
-	return this->peerPort;
+	return this->peerAddress.GetPort();
 }
 
 inline size_t TcpConnection::GetRecvBytes() const {
@@ -153,4 +487,64 @@ inline size_t TcpConnection::GetSentBytes() const {
 	return this->sentBytes;
 }
 
+inline uint64_t TcpConnection::GetId() const {
+	return this->id;
+}
+
+inline uint64_t TcpConnection::GetLastReadTime() const {
+	return this->lastReadAt;
+}
+
+inline uint64_t TcpConnection::GetLastWriteTime() const {
+	return this->lastWriteAt;
+}
+
+inline void TcpConnection::SetBackpressureListener(
+		BackpressureListener *backpressureListener) {
+	this->backpressureListener = backpressureListener;
+}
+
+inline void TcpConnection::SetWriteQueuePolicy(WriteQueuePolicy policy) {
+	this->writeQueuePolicy = policy;
+}
+
+inline size_t TcpConnection::GetWriteQueueSize() const {
+	return this->writeQueueSize + this->parkedWritesLen;
+}
+
+inline bool TcpConnection::IsBackpressured() const {
+	return this->backpressured;
+}
+
+/**
+ * Replaces the libuv read callbacks, which must end up in OnUvReadAlloc() and
+ * OnUvRead() or do what they do. Kept by Reset().
+ */
+inline void TcpConnection::SetUvReadCallbacks(uv_alloc_cb allocCb,
+		uv_read_cb readCb) {
+	this->uvAllocCb = allocCb;
+	this->uvReadCb = readCb;
+}
+
+/**
+ * Accounts nread bytes received into the buffer, before notifying the
+ * subclass. deleted is set if this is deleted meanwhile, else EndUvRead()
+ * must follow.
+ */
+inline void TcpConnection::BeginUvRead(size_t nread, bool *deleted) {
+	this->recvBytes += nread;
+	this->lastReadAt = uv_now(this->uvHandle->loop);
+	this->bufferDataLen += nread;
+	this->deletedFlag = deleted;
+}
+
+inline void TcpConnection::EndUvRead() {
+	this->deletedFlag = nullptr;
+
+	// Stop reading instead of handing libuv an empty buffer.
+	if (this->pauseReadingOnFullBuffer && !this->closed
+			&& this->bufferDataLen >= this->bufferSize)
+		PauseReading(ReadPauseReason::BUFFER_FULL);
+}
+
 #endif
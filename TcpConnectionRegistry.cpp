@@ -0,0 +1,110 @@
+#define UV_CLASS "TcpConnectionRegistry"
+// #define UV_LOG_DEV_LEVEL 3
+
+#include "TcpConnectionRegistry.hpp"
+#include "TcpConnection.hpp"
+#include "LibUVErrors.hpp"
+
+/* Static. */
+
+static inline uint64_t makeId(uint32_t slotIndex, uint32_t generation) {
+	return (static_cast<uint64_t>(generation) << 32) | slotIndex;
+}
+
+/* Instance methods. */
+
+/**
+ * Adds the connection (which must not be in a registry) and returns its id,
+ * also set in the connection.
+ */
+uint64_t TcpConnectionRegistry::Add(TcpConnection *connection) {
+
+	uint32_t slotIndex;
+
+	if (this->freeSlot != NoSlot) {
+		slotIndex = this->freeSlot;
+		this->freeSlot = this->slots[slotIndex].index;
+	} else {
+		if (this->slots.size() >= NoSlot)
+			UV_THROW_ERROR("too many connections");
+
+		slotIndex = static_cast<uint32_t>(this->slots.size());
+		this->slots.emplace_back();
+	}
+
+	Slot &slot = this->slots[slotIndex];
+
+	slot.index = static_cast<uint32_t>(this->connections.size());
+
+	this->connections.push_back(connection);
+	this->connectionSlots.push_back(slotIndex);
+
+	connection->id = makeId(slotIndex, slot.generation);
+
+	return connection->id;
+}
+
+/**
+ * Removes the connection if it is in the registry.
+ */
+void TcpConnectionRegistry::Remove(TcpConnection *connection) {
+
+	if (Get(connection->id) != connection)
+		return;
+
+	auto slotIndex = static_cast<uint32_t>(connection->id);
+	Slot &slot = this->slots[slotIndex];
+	uint32_t index = slot.index;
+	uint32_t lastIndex = static_cast<uint32_t>(this->connections.size() - 1);
+
+	// Move the last connection into the hole.
+	if (index != lastIndex) {
+		uint32_t lastSlotIndex = this->connectionSlots[lastIndex];
+
+		this->connections[index] = this->connections[lastIndex];
+		this->connectionSlots[index] = lastSlotIndex;
+		this->slots[lastSlotIndex].index = index;
+	}
+
+	this->connections.pop_back();
+	this->connectionSlots.pop_back();
+
+	// Invalidate the ids given for this slot (0 is skipped so ids are never 0).
+	if (++slot.generation == 0)
+		slot.generation = 1;
+
+	slot.index = this->freeSlot;
+	this->freeSlot = slotIndex;
+
+	connection->id = 0;
+}
+
+/**
+ * Removes every connection (not deleting them).
+ */
+void TcpConnectionRegistry::Clear() {
+
+	while (!this->connections.empty())
+		Remove(this->connections.back());
+}
+
+/**
+ * Gets the ids of the connections, to visit them with Get() while some are
+ * removed: a removed connection is not found anymore and the others are
+ * neither skipped nor visited twice.
+ */
+void TcpConnectionRegistry::GetIds(std::vector<uint64_t> &ids) const {
+
+	ids.clear();
+	ids.reserve(this->connections.size());
+
+	for (auto *connection : this->connections)
+		ids.push_back(connection->id);
+}
+
+void TcpConnectionRegistry::Reserve(size_t size) {
+
+	this->connections.reserve(size);
+	this->connectionSlots.reserve(size);
+	this->slots.reserve(size);
+}
@@ -0,0 +1,86 @@
+#ifndef MS_TCP_CONNECTION_REGISTRY_HPP
+#define MS_TCP_CONNECTION_REGISTRY_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+class TcpConnection;
+
+/**
+ * Set of connections kept in a dense array, so iterating them reads
+ * contiguous memory, plus a slot map giving each one an id to look it up in
+ * O(1). An id is the slot index and the generation of the slot, so the id of
+ * a removed connection is never found again even when its slot is reused.
+ * Ids are never 0.
+ *
+ * The connection keeps its own id (the hook), so removing it does not search.
+ * Removing moves the last connection into its place in the dense array.
+ */
+class TcpConnectionRegistry {
+private:
+	struct Slot {
+		// Incremented when the slot is freed.
+		uint32_t generation { 1 };
+		// Index in the dense array if used, next free slot otherwise.
+		uint32_t index { 0 };
+	};
+
+public:
+	static constexpr uint32_t NoSlot { UINT32_MAX };
+
+public:
+	TcpConnectionRegistry() = default;
+	TcpConnectionRegistry& operator=(const TcpConnectionRegistry&) = delete;
+	TcpConnectionRegistry(const TcpConnectionRegistry&) = delete;
+
+public:
+	uint64_t Add(TcpConnection *connection);
+	void Remove(TcpConnection *connection);
+	TcpConnection* Get(uint64_t id) const;
+	void Clear();
+	size_t GetSize() const;
+	bool IsEmpty() const;
+	TcpConnection* operator[](size_t index) const;
+	void GetIds(std::vector<uint64_t> &ids) const;
+	void Reserve(size_t size);
+
+private:
+	std::vector<TcpConnection*> connections;
+	// Slot index of each connection.
+	std::vector<uint32_t> connectionSlots;
+	std::vector<Slot> slots;
+	uint32_t freeSlot { NoSlot };
+};
+
+/* Inline methods. */
+
+inline size_t TcpConnectionRegistry::GetSize() const {
+	return this->connections.size();
+}
+
+inline bool TcpConnectionRegistry::IsEmpty() const {
+	return this->connections.empty();
+}
+
+inline TcpConnection* TcpConnectionRegistry::Get(uint64_t id) const {
+	auto slotIndex = static_cast<uint32_t>(id);
+	auto generation = static_cast<uint32_t>(id >> 32);
+
+	if (slotIndex >= this->slots.size())
+		return nullptr;
+
+	const Slot &slot = this->slots[slotIndex];
+
+	// Also the case of a free slot, its generation was never given.
+	if (slot.generation != generation)
+		return nullptr;
+
+	return this->connections[slot.index];
+}
+
+inline TcpConnection* TcpConnectionRegistry::operator[](size_t index) const {
+	return this->connections[index];
+}
+
+#endif
@@ -0,0 +1,491 @@
+#define UV_CLASS "TcpProxy"
+// #define UV_LOG_DEV_LEVEL 3
+
+#include "TcpProxy.hpp"
+#include "DepLibUV.hpp"
+#include "LibUVErrors.hpp"
+#include <cerrno>
+#include <cstring> // std::strerror()
+#include <initializer_list>
+#include <fcntl.h>
+#include <sys/socket.h> // shutdown()
+#include <unistd.h>
+
+/* Static. */
+
+// Maximum bytes moved into a pipe per splice() call (default pipe capacity).
+static constexpr size_t SpliceChunkSize { 65536 };
+
+/* Static methods for UV callbacks. */
+
+inline static void onPoll(uv_poll_t *handle, int status, int events) {
+	auto *side = static_cast<TcpProxy::SpliceSide*>(handle->data);
+
+	if (side)
+		side->proxy->OnUvPoll(side, status, events);
+}
+
+inline static void onClose(uv_handle_t *handle) {
+	delete handle;
+}
+
+/* Connection instance methods. */
+
+TcpProxy::Connection::Connection(size_t bufferSize) :
+		TcpConnection(bufferSize) {
+
+	// Don't lose data received before the proxy is created.
+	SetPauseReadingOnFullBuffer(true);
+}
+
+TcpProxy::Connection::~Connection() {
+
+	if (this->proxy)
+		this->proxy->OnConnectionDestroyed(this);
+}
+
+void TcpProxy::Connection::UserOnTcpConnectionRead() {
+
+	if (this->proxy)
+		this->proxy->OnConnectionRead(this);
+}
+
+bool TcpProxy::Connection::UserOnTcpConnectionEof() {
+
+	return this->proxy && this->proxy->OnConnectionEof(this);
+}
+
+/* Instance methods. */
+
+TcpProxy::TcpProxy(Listener *listener, Connection *connection1,
+		Connection *connection2, Mode mode, size_t lowWatermark,
+		size_t highWatermark) :
+		listener(listener), connection1(connection1), connection2(
+				connection2), mode(mode) {
+
+	if (connection1 == nullptr || connection2 == nullptr
+			|| connection1 == connection2)
+		UV_THROW_ERROR("two different connections are required");
+
+	if (connection1->proxy || connection2->proxy)
+		UV_THROW_ERROR("connection already proxied");
+
+#ifndef __linux__
+	if (mode == Mode::SPLICE)
+		UV_THROW_ERROR("splice mode not supported on this platform");
+#endif
+
+	// In SPLICE mode the libuv write queue only holds what was forwarded
+	// before splicing started, which must be sent first: be notified as soon
+	// as it is empty.
+	if (mode == Mode::SPLICE) {
+		lowWatermark = 0;
+		highWatermark = 1;
+	}
+
+	for (auto *connection : { connection1, connection2 }) {
+		connection->proxy = this;
+		connection->eof = false;
+		connection->SetWriteQueueWatermarks(lowWatermark, highWatermark);
+		connection->SetBackpressureListener(this);
+	}
+
+	for (auto *connection : { connection1, connection2 }) {
+		if (connection->IsBackpressured())
+			OnTcpConnectionBackpressure(connection);
+	}
+
+	// Forward the data received before the proxy existed.
+	OnConnectionRead(connection1);
+	OnConnectionRead(connection2);
+
+	if (this->mode == Mode::SPLICE) {
+		try {
+			StartSplice();
+		} catch (const LibUVError &error) {
+			Close();
+
+			throw;
+		}
+	}
+}
+
+TcpProxy::~TcpProxy() {
+
+	if (!this->closed)
+		Close();
+}
+
+/**
+ * Detaches the proxy from both connections, which are left open. Data held in
+ * the splice pipes is discarded.
+ */
+void TcpProxy::Close() {
+
+	if (this->closed)
+		return;
+
+	this->closed = true;
+
+	StopSplice();
+
+	for (auto *connection : { this->connection1, this->connection2 }) {
+		if (connection == nullptr)
+			continue;
+
+		connection->proxy = nullptr;
+		connection->SetBackpressureListener(nullptr);
+		connection->ResumeReading(TcpConnection::ReadPauseReason::BACKPRESSURE);
+		connection->ResumeReading(TcpConnection::ReadPauseReason::SPLICE);
+	}
+}
+
+inline TcpProxy::Connection* TcpProxy::GetPeer(
+		TcpConnection *connection) const {
+	return connection == this->connection1 ?
+			this->connection2 : this->connection1;
+}
+
+inline TcpProxy::SpliceSide* TcpProxy::GetSpliceSide(
+		TcpConnection *connection) {
+	return connection == this->connection1 ?
+			&this->spliceSides[0] : &this->spliceSides[1];
+}
+
+inline void TcpProxy::OnConnectionRead(Connection *connection) {
+
+	if (this->closed)
+		return;
+
+	connection->Forward(GetPeer(connection));
+
+	// Reading may have been paused while waiting for the proxy.
+	connection->ResumeReading(TcpConnection::ReadPauseReason::BUFFER_FULL);
+}
+
+/**
+ * Relays the FIN of the given connection in BUFFER mode. Returns false to let
+ * the connection be closed.
+ */
+bool TcpProxy::OnConnectionEof(Connection *connection) {
+
+	if (this->closed || this->mode != Mode::BUFFER)
+		return false;
+
+	UV_DEBUG_DEV("relaying FIN");
+
+	auto *peer = GetPeer(connection);
+
+	connection->eof = true;
+
+	// Everything received before the FIN has been forwarded, the peer sends
+	// it before its own FIN.
+	peer->Shutdown();
+
+	// Both directions are done, closing one closes the other.
+	if (peer->eof)
+		connection->PeerClosed();
+
+	return true;
+}
+
+void TcpProxy::OnConnectionDestroyed(Connection *connection) {
+
+	if (this->closed)
+		return;
+
+	UV_DEBUG_DEV("proxied connection closed, closing the other side");
+
+	auto *peer = GetPeer(connection);
+
+	// Don't touch the connection being destroyed.
+	if (connection == this->connection1)
+		this->connection1 = nullptr;
+	else
+		this->connection2 = nullptr;
+
+	Close();
+
+	// Close the other side once its pending data has been sent and let its
+	// owner (TcpServer or TcpClient) release it. Not an error of its own.
+	if (!peer->IsClosed())
+		peer->PeerClosed();
+
+	// Notify the listener.
+	this->listener->OnTcpProxyClosed(this);
+}
+
+void TcpProxy::StartSplice() {
+
+#ifdef __linux__
+	int err;
+
+	for (size_t i { 0 }; i < 2; ++i) {
+		auto *side = &this->spliceSides[i];
+		int fd;
+
+		side->proxy = this;
+		side->connection = (i == 0) ? this->connection1 : this->connection2;
+
+		err = uv_fileno(
+				reinterpret_cast<uv_handle_t*>(side->connection->GetUvHandle()),
+				&fd);
+
+		if (err != 0)
+			UV_THROW_ERROR("uv_fileno() failed: %s", uv_strerror(err));
+
+		// Poll our own descriptor so the one owned by libuv is left alone.
+		side->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+
+		if (side->fd == -1)
+			UV_THROW_ERROR("fcntl(F_DUPFD_CLOEXEC) failed: %s",
+					std::strerror(errno));
+
+		if (pipe2(side->pipeFds, O_NONBLOCK | O_CLOEXEC) == -1)
+			UV_THROW_ERROR("pipe2() failed: %s", std::strerror(errno));
+
+		side->uvHandle = new uv_poll_t;
+
+		err = uv_poll_init(DepLibUV::GetLoop(), side->uvHandle, side->fd);
+
+		if (err != 0) {
+			delete side->uvHandle;
+			side->uvHandle = nullptr;
+
+			UV_THROW_ERROR("uv_poll_init() failed: %s", uv_strerror(err));
+		}
+
+		side->uvHandle->data = static_cast<void*>(side);
+
+		// From now on the data does not go through the receive buffer.
+		side->connection->PauseReading(
+				TcpConnection::ReadPauseReason::SPLICE);
+	}
+
+	UpdateSplicePoll(&this->spliceSides[0]);
+	UpdateSplicePoll(&this->spliceSides[1]);
+#endif
+}
+
+void TcpProxy::StopSplice() {
+
+	for (auto &side : this->spliceSides) {
+		if (side.uvHandle) {
+			side.uvHandle->data = nullptr;
+
+			uv_poll_stop(side.uvHandle);
+			uv_close(reinterpret_cast<uv_handle_t*>(side.uvHandle),
+					static_cast<uv_close_cb>(onClose));
+
+			side.uvHandle = nullptr;
+		}
+
+		if (side.fd != -1)
+			close(side.fd);
+
+		for (auto &pipeFd : side.pipeFds) {
+			if (pipeFd != -1)
+				close(pipeFd);
+
+			pipeFd = -1;
+		}
+
+		side.fd = -1;
+		side.events = 0;
+		side.pipeLen = 0;
+	}
+}
+
+/**
+ * Moves data from the pipe of the given side into the socket of the other,
+ * then relays the FIN of the given side once its pipe is empty. Returns false
+ * if the proxy has been closed (and maybe deleted).
+ */
+bool TcpProxy::FlushSplicePipe(SpliceSide *from, SpliceSide *to) {
+
+#ifdef __linux__
+	// Keep the order with data forwarded through libuv before splicing
+	// started. OnTcpConnectionWritable() flushes again once that is sent.
+	if (to->connection->GetWriteQueueSize() != 0)
+		return true;
+
+	if (from->pipeLen != 0) {
+		ssize_t moved = splice(from->pipeFds[0], nullptr, to->fd, nullptr,
+				from->pipeLen, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+		if (moved == -1) {
+			if (errno == EAGAIN || errno == EINTR)
+				return true;
+
+			UV_WARN_DEV("splice() into socket failed, closing: %s",
+					std::strerror(errno));
+
+			FinishSplice(to);
+
+			return false;
+		}
+
+		from->pipeLen -= static_cast<size_t>(moved);
+	}
+
+	// Everything received before the EOF has been sent, pass the EOF on.
+	if (!from->eof || from->pipeLen != 0 || to->shutdown)
+		return true;
+
+	UV_DEBUG_DEV("relaying FIN");
+
+	if (shutdown(to->fd, SHUT_WR) == -1) {
+		UV_WARN_DEV("shutdown() failed, closing: %s", std::strerror(errno));
+
+		FinishSplice(to);
+
+		return false;
+	}
+
+	to->shutdown = true;
+
+	// Both directions are done.
+	if (from->shutdown) {
+		FinishSplice(from);
+
+		return false;
+	}
+#endif
+
+	return true;
+}
+
+void TcpProxy::UpdateSplicePoll(SpliceSide *side) {
+
+	auto *other =
+			(side == &this->spliceSides[0]) ?
+					&this->spliceSides[1] : &this->spliceSides[0];
+	int events { 0 };
+
+	// Read only when the previous chunk has been fully sent to the other side
+	// so a slow receiver throttles the sender.
+	if (!side->eof && side->pipeLen == 0)
+		events |= UV_READABLE;
+
+	// Not while data forwarded through libuv is still queued, the socket
+	// would stay writable with nothing to do until it is sent.
+	if (other->pipeLen != 0 && side->connection->GetWriteQueueSize() == 0)
+		events |= UV_WRITABLE;
+
+	if (events == side->events)
+		return;
+
+	side->events = events;
+
+	if (events == 0) {
+		uv_poll_stop(side->uvHandle);
+
+		return;
+	}
+
+	int err = uv_poll_start(side->uvHandle, events,
+			static_cast<uv_poll_cb>(onPoll));
+
+	if (err != 0)
+		UV_ABORT("uv_poll_start() failed: %s", uv_strerror(err));
+}
+
+/**
+ * Closes the connection of the given side, which closes the other one and
+ * notifies the listener. The reason is PEER_CLOSED if both directions were
+ * shut down, READ_ERROR otherwise.
+ */
+void TcpProxy::FinishSplice(SpliceSide *side) {
+
+	if (this->spliceSides[0].shutdown && this->spliceSides[1].shutdown)
+		side->connection->PeerClosed();
+	else
+		side->connection->ErrorReceiving();
+}
+
+inline void TcpProxy::OnUvPoll(SpliceSide *side, int status, int events) {
+
+#ifdef __linux__
+	auto *other =
+			(side == &this->spliceSides[0]) ?
+					&this->spliceSides[1] : &this->spliceSides[0];
+
+	if (status != 0) {
+		UV_WARN_DEV("poll error, closing: %s", uv_strerror(status));
+
+		FinishSplice(side);
+
+		return;
+	}
+
+	// Send what the other side left in its pipe.
+	if ((events & UV_WRITABLE) != 0 && !FlushSplicePipe(other, side))
+		return;
+
+	if ((events & UV_READABLE) != 0 && side->pipeLen == 0) {
+		ssize_t moved = splice(side->fd, nullptr, side->pipeFds[1], nullptr,
+				SpliceChunkSize, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+		if (moved == 0) {
+			UV_DEBUG_DEV("connection half-closed by peer");
+
+			side->eof = true;
+
+			// Its pipe is empty, relay the FIN now.
+			if (!FlushSplicePipe(side, other))
+				return;
+		} else if (moved == -1) {
+			if (errno != EAGAIN && errno != EINTR) {
+				UV_WARN_DEV("splice() from socket failed, closing: %s",
+						std::strerror(errno));
+
+				FinishSplice(side);
+
+				return;
+			}
+		} else {
+			side->pipeLen += static_cast<size_t>(moved);
+
+			if (!FlushSplicePipe(side, other))
+				return;
+		}
+	}
+
+	UpdateSplicePoll(side);
+	UpdateSplicePoll(other);
+#endif
+}
+
+inline void TcpProxy::OnTcpConnectionBackpressure(TcpConnection *connection) {
+
+	if (this->closed)
+		return;
+
+	GetPeer(connection)->PauseReading(
+			TcpConnection::ReadPauseReason::BACKPRESSURE);
+}
+
+inline void TcpProxy::OnTcpConnectionWritable(TcpConnection *connection) {
+
+	if (this->closed)
+		return;
+
+	GetPeer(connection)->ResumeReading(
+			TcpConnection::ReadPauseReason::BACKPRESSURE);
+
+	// The libuv write queue is empty, splicing into this socket can go on.
+	auto *side = GetSpliceSide(connection);
+
+	if (side->uvHandle == nullptr)
+		return;
+
+	auto *other =
+			(side == &this->spliceSides[0]) ?
+					&this->spliceSides[1] : &this->spliceSides[0];
+
+	if (!FlushSplicePipe(other, side))
+		return;
+
+	UpdateSplicePoll(side);
+	UpdateSplicePoll(other);
+}
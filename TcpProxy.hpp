@@ -0,0 +1,142 @@
+#ifndef MS_TCP_PROXY_HPP
+#define MS_TCP_PROXY_HPP
+
+#include <uv.h>
+#include "TcpConnection.hpp"
+
+/**
+ * Bidirectional pipe between two TcpConnections (typically one accepted by a
+ * TcpServer and one opened by a TcpClient).
+ *
+ * In BUFFER mode the receive buffer of one side is written into the other
+ * side and, if it cannot be written at once, handed over to the write request
+ * instead of being copied. In SPLICE mode (Linux only) the bytes are moved
+ * socket -> pipe -> socket with splice() and never reach user space.
+ *
+ * In both modes a FIN is relayed too: once everything received before it has
+ * been sent, the other socket is shut down for writing while the reverse
+ * direction keeps going, and both connections are closed (PEER_CLOSED) once
+ * both peers have sent theirs. When one connection is closed otherwise, the
+ * other one is closed too (PEER_CLOSED) once its pending data has been sent.
+ *
+ * Backpressure is coupled: a side stops reading while the other side cannot
+ * absorb more data, so TCP flow control throttles the fast peer.
+ */
+class TcpProxy: public TcpConnection::BackpressureListener {
+public:
+	class Listener {
+	public:
+		virtual ~Listener() = default;
+
+	public:
+		virtual void OnTcpProxyClosed(TcpProxy *proxy) = 0;
+	};
+
+	/**
+	 * TcpConnection to be allocated in UserOnTcpConnectionAlloc() for the
+	 * connections to be proxied. Data received before the proxy is created is
+	 * kept in the buffer and forwarded once it is.
+	 */
+	class Connection: public TcpConnection {
+	public:
+		explicit Connection(size_t bufferSize);
+		virtual ~Connection() override;
+
+	protected:
+		void UserOnTcpConnectionRead() override;
+		bool UserOnTcpConnectionEof() override;
+
+	private:
+		friend class TcpProxy;
+
+		TcpProxy *proxy { nullptr };
+		// The peer shut down its side (BUFFER mode).
+		bool eof { false };
+	};
+
+	enum class Mode {
+		BUFFER = 1, SPLICE
+	};
+
+	/* State of one side in SPLICE mode. */
+	struct SpliceSide {
+		TcpProxy *proxy { nullptr };
+		Connection *connection { nullptr };
+		// Our own descriptor of the socket, polled by uvHandle.
+		int fd { -1 };
+		uv_poll_t *uvHandle { nullptr };
+		int events { 0 };
+		// Pipe holding the data read from this side.
+		int pipeFds[2] { -1, -1 };
+		size_t pipeLen { 0 };
+		bool eof { false };
+		// Shut down for writing, everything from the other side was sent.
+		bool shutdown { false };
+	};
+
+public:
+	TcpProxy(Listener *listener, Connection *connection1,
+			Connection *connection2, Mode mode = Mode::BUFFER,
+			size_t lowWatermark = 65536, size_t highWatermark = 262144);
+	TcpProxy& operator=(const TcpProxy&) = delete;
+	TcpProxy(const TcpProxy&) = delete;
+	virtual ~TcpProxy();
+
+public:
+	void Close();
+	bool IsClosed() const;
+	Mode GetMode() const;
+	Connection* GetConnection1() const;
+	Connection* GetConnection2() const;
+
+private:
+	Connection* GetPeer(TcpConnection *connection) const;
+	SpliceSide* GetSpliceSide(TcpConnection *connection);
+	void OnConnectionRead(Connection *connection);
+	bool OnConnectionEof(Connection *connection);
+	void OnConnectionDestroyed(Connection *connection);
+	void StartSplice();
+	void StopSplice();
+	bool FlushSplicePipe(SpliceSide *from, SpliceSide *to);
+	void UpdateSplicePoll(SpliceSide *side);
+	void FinishSplice(SpliceSide *side);
+
+	/* Callbacks fired by UV events. */
+public:
+	void OnUvPoll(SpliceSide *side, int status, int events);
+
+	/* Methods inherited from TcpConnection::BackpressureListener. */
+public:
+	void OnTcpConnectionBackpressure(TcpConnection *connection) override;
+	void OnTcpConnectionWritable(TcpConnection *connection) override;
+
+private:
+	// Passed by argument.
+	Listener *listener { nullptr };
+	Connection *connection1 { nullptr };
+	Connection *connection2 { nullptr };
+	Mode mode { Mode::BUFFER };
+	// Others.
+	SpliceSide spliceSides[2];
+	bool closed { false };
+};
+
+/* Inline methods. */
+
+inline bool TcpProxy::IsClosed() const {
+	return this->closed;
+}
+
+inline TcpProxy::Mode TcpProxy::GetMode() const {
+	return this->mode;
+}
+
+inline TcpProxy::Connection* TcpProxy::GetConnection1() const {
+	return this->connection1;
+}
+
+inline TcpProxy::Connection* TcpProxy::GetConnection2() const {
+	return this->connection2;
+}
+
+#endif
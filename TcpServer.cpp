@@ -2,8 +2,21 @@
 // #define UV_LOG_DEV_LEVEL 3
 
 #include "TcpServer.hpp"
+#include "DepLibUV.hpp"
 #include "Logger.hpp"
 #include "LibUVErrors.hpp"
+#include <algorithm> // std::min(), std::max()
+#include <cmath> // std::ceil()
+
+/* Static. */
+
+// Interval (ms) between checks of the draining connections.
+static constexpr uint64_t DrainCheckInterval { 50 };
+
+// Bounds of the interval between timeout checks, a quarter of the shortest
+// timeout.
+static constexpr uint64_t MinSweepInterval { 100 };
+static constexpr uint64_t MaxSweepInterval { 1000 };
 
 
 /* Static methods for UV callbacks. */
@@ -17,15 +30,44 @@ inline static void onConnection(uv_stream_t *handle, int status) {
 	server->OnUvConnection(status);
 }
 
+inline static void onAcceptCheck(uv_check_t *handle) {
+	static_cast<TcpServer*>(handle->data)->OnUvAcceptCheck();
+}
+
 inline static void onClose(uv_handle_t *handle) {
 	delete handle;
 }
 
+/* Static. */
+
+static uv_tcp_t* openHandle(int fd) {
+
+	auto *uvHandle = new uv_tcp_t;
+	int err = uv_tcp_init(DepLibUV::GetLoop(), uvHandle);
+
+	if (err != 0) {
+		delete uvHandle;
+
+		UV_THROW_ERROR("uv_tcp_init() failed: %s", uv_strerror(err));
+	}
+
+	err = uv_tcp_open(uvHandle, fd);
+
+	if (err != 0) {
+		uv_close(reinterpret_cast<uv_handle_t*>(uvHandle),
+				static_cast<uv_close_cb>(onClose));
+
+		UV_THROW_ERROR("uv_tcp_open() failed: %s", uv_strerror(err));
+	}
+
+	return uvHandle;
+}
+
 /* Instance methods. */
 
 // NOLINTNEXTLINE(cppcoreguidelines-pro-type-member-init)
 TcpServer::TcpServer(uv_tcp_t *uvHandle, int backlog) :
-		uvHandle(uvHandle) {
+		uvHandle(uvHandle), backlog(backlog) {
 
 
 	int err;
@@ -51,6 +93,15 @@ TcpServer::TcpServer(uv_tcp_t *uvHandle, int backlog) :
 	}
 }
 
+/**
+ * Adopts an already bound (and maybe listening) socket, e.g. inherited from
+ * the previous process on a restart (see UnixStreamSocket::AcceptHandleFd()).
+ * The fd is closed with the server.
+ */
+TcpServer::TcpServer(int fd, int backlog) :
+		TcpServer(openHandle(fd), backlog) {
+}
+
 TcpServer::~TcpServer() {
 
 
@@ -66,126 +117,498 @@ void TcpServer::Close() {
 
 	this->closed = true;
 
-	// Tell the UV handle that the TcpServer has been closed.
-	this->uvHandle->data = nullptr;
+	StopAccepting();
+
+	delete this->sweepTimer;
+	this->sweepTimer = nullptr;
 
-	UV_DEBUG_DEV("closing %zu active connections", this->connections.size());
+	delete this->drainTimer;
+	this->drainTimer = nullptr;
+
+	UV_DEBUG_DEV("closing %zu active connections", this->connections.GetSize());
+
+	while (!this->connections.IsEmpty()) {
+		auto *connection = this->connections[this->connections.GetSize() - 1];
+
+		this->connections.Remove(connection);
+		delete connection;
+	}
 
-	for (auto *connection : this->connections) {
+	for (auto *connection : this->pooledConnections) {
 		delete connection;
 	}
 
+	this->pooledConnections.clear();
+}
+
+/**
+ * Stops accepting connections and waits up to timeout ms for the current
+ * ones to be closed:
+ *
+ * - The listening socket is closed, so new connections are refused (and
+ *   go to other servers on the same port, if any).
+ * - UserOnTcpConnectionDrain() is called for every connection. Those for
+ *   which it returns true are closed once their write queue is flushed, the
+ *   others are expected to be closed by the subclass (e.g. once the response
+ *   in progress is sent) with CloseConnection().
+ * - At the deadline the remaining connections are closed without flushing
+ *   them (with CloseReason::DRAIN_TIMEOUT).
+ *
+ * UserOnTcpServerDrained() is called at the end, the server must still be
+ * closed (or deleted).
+ */
+void TcpServer::Drain(uint64_t timeout) {
+
+	if (this->closed)
+		UV_THROW_ERROR("closed");
+
+	if (this->draining)
+		UV_THROW_ERROR("already draining");
+
+	this->draining = true;
+	this->drainDeadline = uv_now(DepLibUV::GetLoop()) + timeout;
+
+	StopAccepting();
+
+	UV_DEBUG_DEV("draining %zu connections", this->connections.GetSize());
+
+	ForEachConnection([this](TcpConnection *connection) {
+		if (UserOnTcpConnectionDrain(connection))
+			this->drainCloseIds.push_back(connection->GetId());
+	});
+
+	if (this->closed)
+		return;
+
+	// Connections already flushed are closed at once.
+	CloseDrainedConnections();
+
+	if (this->closed)
+		return;
+
+	this->drainTimer = new Timer(this);
+	this->drainTimer->Start(0, DrainCheckInterval);
+}
+
+/**
+ * Closes a connection of the server, calls UserOnTcpConnectionClosed() and
+ * releases it. This is how the subclass closes a connection: closing it with
+ * TcpConnection::Close() alone leaves it in the server.
+ */
+void TcpServer::CloseConnection(TcpConnection *connection,
+		TcpConnection::CloseReason reason) {
+
+	if (this->connections.Get(connection->GetId()) != connection)
+		return;
+
+	connection->Close(reason);
+
+	OnTcpConnectionClosed(connection);
+}
+
+void TcpServer::StopAccepting() {
+
+	if (this->uvHandle == nullptr)
+		return;
+
+	// Tell the UV handle that the TcpServer has been closed.
+	this->uvHandle->data = nullptr;
+
 	uv_close(reinterpret_cast<uv_handle_t*>(this->uvHandle),
 			static_cast<uv_close_cb>(onClose));
+	this->uvHandle = nullptr;
+
+	delete this->acceptTimer;
+	this->acceptTimer = nullptr;
+	this->acceptPending = false;
+
+	if (this->acceptCheck != nullptr) {
+		uv_close(reinterpret_cast<uv_handle_t*>(this->acceptCheck),
+				static_cast<uv_close_cb>(onClose));
+		this->acceptCheck = nullptr;
+	}
+}
+
+/**
+ * Closes the connections to be closed once flushed that are.
+ */
+void TcpServer::CloseDrainedConnections() {
+
+	for (size_t i = this->drainCloseIds.size(); i > 0 && !this->closed; --i) {
+		auto *connection = this->connections.Get(this->drainCloseIds[i - 1]);
+
+		// Flushing.
+		if (connection != nullptr && connection->GetWriteQueueSize() != 0)
+			continue;
+
+		this->drainCloseIds[i - 1] = this->drainCloseIds.back();
+		this->drainCloseIds.pop_back();
+
+		// Already closed.
+		if (connection == nullptr)
+			continue;
+
+		connection->Close(TcpConnection::CloseReason::LOCAL);
+
+		OnTcpConnectionClosed(connection);
+	}
+}
+
+void TcpServer::OnDrainTimer() {
+
+	CloseDrainedConnections();
+
+	if (this->closed)
+		return;
+
+	// Those closed by the subclass with TcpConnection::Close() alone.
+	ForEachConnection([this](TcpConnection *connection) {
+		if (connection->IsClosed())
+			OnTcpConnectionClosed(connection);
+	});
+
+	if (this->closed)
+		return;
+
+	size_t numForceClosed { 0 };
+
+	if (!this->connections.IsEmpty()
+			&& uv_now(DepLibUV::GetLoop()) < this->drainDeadline)
+		return;
+
+	UV_DEBUG_DEV("drain done, %zu connections left",
+			this->connections.GetSize());
+
+	while (!this->connections.IsEmpty() && !this->closed) {
+		auto *connection = this->connections[this->connections.GetSize() - 1];
+
+		connection->Close(TcpConnection::CloseReason::DRAIN_TIMEOUT);
+
+		OnTcpConnectionClosed(connection);
+
+		numForceClosed++;
+	}
+
+	if (this->closed)
+		return;
+
+	delete this->drainTimer;
+	this->drainTimer = nullptr;
+	this->drainCloseIds.clear();
+
+	// NOTE: This may delete this.
+	UserOnTcpServerDrained(numForceClosed);
 }
 
 void TcpServer::Dump() const {
 	UV_DUMP("<TcpServer>");
 	UV_DUMP(
-			"  [TCP, local:%s :%d, status:%s, connections:%zu]",
-			this->localIp.c_str(),
-			static_cast<uint16_t>(this->localPort),
-			(!this->closed) ? "open" : "closed",
-			this->connections.size());
+			"  [TCP, local:%s :%d, status:%s, connections:%zu, pooled:%zu]",
+			this->localAddress.GetIp(),
+			this->localAddress.GetPort(),
+			this->closed ? "closed" : this->draining ? "draining" : "open",
+			this->connections.GetSize(),
+			this->pooledConnections.size());
 	UV_DUMP("</TcpServer>");
 }
 
-bool TcpServer::SetLocalAddress() {
+void TcpServer::SetAcceptPolicy(const AcceptPolicy &policy) {
 
+	if (this->closed || this->draining)
+		UV_THROW_ERROR("closed");
 
-	int err;
-	int len = sizeof(this->localAddr);
+	this->acceptPolicy = policy;
 
-	err = uv_tcp_getsockname(this->uvHandle,
-			reinterpret_cast<struct sockaddr*>(&this->localAddr), &len);
+	if (this->acceptPolicy.acceptBurst == 0)
+		this->acceptPolicy.acceptBurst = this->acceptPolicy.acceptRate;
 
-	if (err != 0) {
-		UV_ERROR("uv_tcp_getsockname() failed: %s", uv_strerror(err));
+	this->acceptTokens = this->acceptPolicy.acceptBurst;
+	this->acceptTokensUpdatedAt = uv_now(DepLibUV::GetLoop());
+	this->numAcceptsInIteration = 0;
 
-		return false;
+	bool limited = this->acceptPolicy.maxAcceptsPerIteration != 0
+			|| this->acceptPolicy.acceptRate != 0;
+
+	if (limited && this->acceptTimer == nullptr)
+		this->acceptTimer = new Timer(this);
+
+	if (this->acceptPolicy.maxAcceptsPerIteration != 0
+			&& this->acceptCheck == nullptr) {
+		this->acceptCheck = new uv_check_t;
+		this->acceptCheck->data = static_cast<void*>(this);
+
+		int err = uv_check_init(DepLibUV::GetLoop(), this->acceptCheck);
+
+		if (err != 0) {
+			delete this->acceptCheck;
+			this->acceptCheck = nullptr;
+
+			UV_THROW_ERROR("uv_check_init() failed: %s", uv_strerror(err));
+		}
 	}
 
-	int family;
+	// Accept the waiting connection with the new limits.
+	if (this->acceptTimer != nullptr && this->acceptPending)
+		this->acceptTimer->Start(0);
+}
 
-	GetAddressInfo(
-			reinterpret_cast<const struct sockaddr*>(&this->localAddr), family,
-			this->localIp, this->localPort);
+/**
+ * Calls fn once for every connection. fn may close any connection, or the
+ * server: a connection removed before its turn is not visited and those
+ * accepted meanwhile are not either.
+ */
+void TcpServer::ForEachConnection(
+		const std::function<void(TcpConnection*)> &fn) {
 
-	return true;
+	// By id, as closing a connection moves another one in the registry.
+	std::vector<uint64_t> ids;
+
+	this->connections.GetIds(ids);
+
+	for (auto id : ids) {
+		if (this->closed)
+			break;
+
+		auto *connection = this->connections.Get(id);
+
+		if (connection != nullptr)
+			fn(connection);
+	}
 }
 
-void TcpServer::GetAddressInfo(const struct sockaddr* addr, int& family, std::string& ip, uint16_t& port)
-{
+/**
+ * Writes the data into every connection, or those for which filter returns
+ * true. The data is copied once and shared by the writes that cannot complete
+ * right away. A connection whose write fails is closed (as by
+ * TcpConnection::Write()). Returns the number of connections written.
+ */
+size_t TcpServer::Broadcast(const uint8_t *data, size_t len,
+		const std::function<bool(TcpConnection*)> &filter) {
 
-	char ipBuffer[INET6_ADDRSTRLEN] = { 0 };
-	int err;
+	if (len == 0 || this->connections.IsEmpty())
+		return 0;
 
-	switch (addr->sa_family)
-	{
-		case AF_INET:
-		{
-			err = uv_inet_ntop(
-				AF_INET, std::addressof(reinterpret_cast<const struct sockaddr_in*>(addr)->sin_addr), ipBuffer, sizeof(ipBuffer));
+	auto *payload = new TcpConnection::SharedPayload(data, len);
+	size_t numWritten = Broadcast(payload, filter);
 
-			if (err)
-				UV_ABORT("uv_inet_ntop() failed: %s", uv_strerror(err));
+	payload->Unref();
 
-			port = static_cast<uint16_t>(ntohs(reinterpret_cast<const struct sockaddr_in*>(addr)->sin_port));
+	return numWritten;
+}
 
-			break;
-		}
+/**
+ * Same as above with an existing payload, e.g. to send it through several
+ * servers.
+ */
+size_t TcpServer::Broadcast(TcpConnection::SharedPayload *payload,
+		const std::function<bool(TcpConnection*)> &filter) {
 
-		case AF_INET6:
-		{
-			err = uv_inet_ntop(
-				AF_INET6, std::addressof(reinterpret_cast<const struct sockaddr_in6*>(addr)->sin6_addr), ipBuffer, sizeof(ipBuffer));
+	size_t numWritten { 0 };
 
-			if (err)
-				UV_ABORT("uv_inet_ntop() failed: %s", uv_strerror(err));
+	// A failed write closes the connection, and the subclass maybe others.
+	ForEachConnection([&](TcpConnection *connection) {
+		if (connection->IsClosed() || (filter && !filter(connection)))
+			return;
 
-			port = static_cast<uint16_t>(ntohs(reinterpret_cast<const struct sockaddr_in6*>(addr)->sin6_port));
+		connection->Write(payload, nullptr);
+		numWritten++;
+	});
 
-			break;
-		}
+	return numWritten;
+}
 
-		default:
-		{
-			UV_ABORT("unknown network family: %d", static_cast<int>(addr->sa_family));
-		}
+/**
+ * Keeps up to maxPooledConnections closed connections to reuse them (with
+ * their receive buffer) for the next accepted ones, instead of deleting them
+ * and asking UserOnTcpConnectionAlloc() for new ones. Every connection must
+ * then be allocated with the same class and buffer size, and reset its own
+ * state in UserOnTcpConnectionReset(). 0 (the default) disables the pool.
+ */
+void TcpServer::SetConnectionPoolSize(size_t maxPooledConnections) {
+
+	this->maxPooledConnections = maxPooledConnections;
+
+	while (this->pooledConnections.size() > maxPooledConnections) {
+		delete this->pooledConnections.back();
+
+		this->pooledConnections.pop_back();
 	}
 
-	family = addr->sa_family;
-	ip.assign(ipBuffer);
+	this->pooledConnections.reserve(maxPooledConnections);
 }
 
-inline void TcpServer::OnUvConnection(int status) {
-
+/**
+ * Closes the connections exceeding any of the timeouts, with the timeout as
+ * close reason. Rather than a timer per connection, a single timer checks all
+ * of them every quarter of the shortest timeout (within 100 ms and 1 s), so a
+ * connection is closed up to that late.
+ */
+void TcpServer::SetTimeouts(const TcpConnection::Timeouts &timeouts) {
 
 	if (this->closed)
+		UV_THROW_ERROR("closed");
+
+	this->timeouts = timeouts;
+
+	uint64_t minTimeout { 0 };
+
+	for (uint64_t timeout : { timeouts.idleTimeout, timeouts.readTimeout,
+			timeouts.writeTimeout }) {
+		if (timeout != 0 && (minTimeout == 0 || timeout < minTimeout))
+			minTimeout = timeout;
+	}
+
+	if (minTimeout == 0) {
+		delete this->sweepTimer;
+		this->sweepTimer = nullptr;
+
 		return;
+	}
+
+	uint64_t interval = std::min(std::max(minTimeout / 4, MinSweepInterval),
+			MaxSweepInterval);
+
+	if (this->sweepTimer == nullptr)
+		this->sweepTimer = new Timer(this);
 
+	this->sweepTimer->Start(interval, interval);
+}
+
+/**
+ * Options set in every connection accepted from now on. The buffer sizes are
+ * also set in the listening socket, as accepted sockets negotiate their TCP
+ * window scale with the receive buffer size of the listening one.
+ */
+void TcpServer::SetSocketOptions(const TcpConnection::SocketOptions &options) {
+
+	if (this->closed || this->draining)
+		UV_THROW_ERROR("closed");
+
+	auto *handle = reinterpret_cast<uv_handle_t*>(this->uvHandle);
 	int err;
 
-	if (status != 0) {
-		UV_ERROR("error while receiving a new TCP connection: %s",
-				uv_strerror(status));
+	if (options.recvBufferSize != 0) {
+		int value = options.recvBufferSize;
 
-		return;
+		err = uv_recv_buffer_size(handle, &value);
+
+		if (err != 0)
+			UV_THROW_ERROR("uv_recv_buffer_size() failed: %s", uv_strerror(err));
 	}
 
-	// Notify the subclass so it provides an allocated derived class of TCPConnection.
+	if (options.sendBufferSize != 0) {
+		int value = options.sendBufferSize;
+
+		err = uv_send_buffer_size(handle, &value);
+
+		if (err != 0)
+			UV_THROW_ERROR("uv_send_buffer_size() failed: %s", uv_strerror(err));
+	}
+
+	this->socketOptions = options;
+	this->hasSocketOptions = true;
+}
+
+bool TcpServer::SetLocalAddress() {
+
+
+	int err;
+	struct sockaddr_storage localAddr;
+	int len = sizeof(localAddr);
+
+	err = uv_tcp_getsockname(this->uvHandle,
+			reinterpret_cast<struct sockaddr*>(&localAddr), &len);
+
+	if (err != 0) {
+		UV_ERROR("uv_tcp_getsockname() failed: %s", uv_strerror(err));
+
+		return false;
+	}
+
+	return this->localAddress.Set(reinterpret_cast<struct sockaddr*>(&localAddr));
+}
+
+/**
+ * Whether a connection can be accepted now, otherwise sets the time (ms) to
+ * wait for it.
+ */
+bool TcpServer::CanAccept(uint64_t &delay) {
+
+	if (this->acceptPolicy.maxAcceptsPerIteration != 0
+			&& this->numAcceptsInIteration >= this->acceptPolicy.maxAcceptsPerIteration) {
+		// Next loop iteration (the count is reset after polling).
+		delay = 0;
+
+		return false;
+	}
+
+	if (this->acceptPolicy.acceptRate == 0)
+		return true;
+
+	uint64_t now = uv_now(DepLibUV::GetLoop());
+	double rate = this->acceptPolicy.acceptRate;
+
+	this->acceptTokens += (now - this->acceptTokensUpdatedAt) * rate / 1000;
+	this->acceptTokensUpdatedAt = now;
+
+	if (this->acceptTokens > this->acceptPolicy.acceptBurst)
+		this->acceptTokens = this->acceptPolicy.acceptBurst;
+
+	if (this->acceptTokens < 1) {
+		delay = static_cast<uint64_t>(std::ceil((1 - this->acceptTokens) * 1000 / rate));
+
+		return false;
+	}
+
+	return true;
+}
+
+TcpConnection* TcpServer::AllocConnection() {
+
 	TcpConnection *connection = nullptr;
-	UserOnTcpConnectionAlloc(&connection);
+
+	// Reuse a closed connection if any. It is reset now rather than when
+	// closed, as the code that closed it may still be running then.
+	if (!this->pooledConnections.empty()) {
+		connection = this->pooledConnections.back();
+		this->pooledConnections.pop_back();
+
+		connection->Reset();
+	}
+	// Notify the subclass so it provides an allocated derived class of TCPConnection.
+	else {
+		UserOnTcpConnectionAlloc(&connection);
+	}
 
 	UV_ASSERT(connection != nullptr,
 			"TcpConnection pointer was not allocated by the user");
 
+	return connection;
+}
+
+void TcpServer::AcceptConnection() {
+
+	int err;
+
+	if (this->acceptPolicy.acceptRate != 0)
+		this->acceptTokens -= 1;
+
+	// Reset the count once done with this loop iteration.
+	if (this->acceptPolicy.maxAcceptsPerIteration != 0
+			&& this->numAcceptsInIteration++ == 0) {
+		uv_check_start(this->acceptCheck, static_cast<uv_check_cb>(onAcceptCheck));
+	}
+
+	TcpConnection *connection = AllocConnection();
+
 	try {
-		connection->Setup(this, &(this->localAddr), this->localIp,
-				this->localPort);
+		connection->Setup(this, &(this->localAddress));
 	} catch (const LibUVError &error) {
 		delete connection;
 
+		// Don't leave the connection waiting, libuv would not poll anymore.
+		RejectConnection();
+
 		return;
 	}
 
@@ -193,24 +616,205 @@ inline void TcpServer::OnUvConnection(int status) {
 	err = uv_accept(reinterpret_cast<uv_stream_t*>(this->uvHandle),
 			reinterpret_cast<uv_stream_t*>(connection->GetUvHandle()));
 
-	if (err != 0)
-		UV_ABORT("uv_accept() failed: %s", uv_strerror(err));
+	if (err != 0) {
+		UV_WARN_DEV("uv_accept() failed: %s", uv_strerror(err));
+
+		this->numAcceptErrors++;
+		ReleaseConnection(connection);
+
+		// libuv closed the connection but does not poll anymore.
+		ResumeListening();
+
+		return;
+	}
+
+	// Failed options are not fatal, the connection just keeps the defaults.
+	if (this->hasSocketOptions)
+		connection->ApplySocketOptions(this->socketOptions);
 
 	// Start receiving data.
 	try {
 		// NOTE: This may throw.
 		connection->Start();
 	} catch (const LibUVError &error) {
-		delete connection;
+		ReleaseConnection(connection);
 
 		return;
 	}
 
-	// Notify the subclass and delete the connection if not accepted by the subclass.
+	// Notify the subclass and release the connection if not accepted by the subclass.
 	if (UserOnNewTcpConnection(connection))
-		this->connections.insert(connection);
+		this->connections.Add(connection);
 	else
+		ReleaseConnection(connection);
+}
+
+/**
+ * Adds an established connection given by its fd, e.g. one inherited from
+ * the previous process on a restart, as if it had been accepted. Returns it,
+ * or nullptr if rejected by UserOnNewTcpConnection(). The fd is owned by the
+ * connection unless this throws.
+ */
+TcpConnection* TcpServer::AdoptConnection(int fd) {
+
+	if (this->closed || this->draining)
+		UV_THROW_ERROR("closed");
+
+	TcpConnection *connection = AllocConnection();
+
+	try {
+		connection->Setup(this, &(this->localAddress));
+	} catch (const LibUVError &error) {
+		delete connection;
+
+		throw;
+	}
+
+	int err = uv_tcp_open(connection->GetUvHandle(), fd);
+
+	if (err != 0) {
+		ReleaseConnection(connection);
+
+		UV_THROW_ERROR("uv_tcp_open() failed: %s", uv_strerror(err));
+	}
+
+	if (this->hasSocketOptions)
+		connection->ApplySocketOptions(this->socketOptions);
+
+	try {
+		// NOTE: This may throw.
+		connection->Start();
+	} catch (const LibUVError &error) {
+		ReleaseConnection(connection);
+
+		throw;
+	}
+
+	if (!UserOnNewTcpConnection(connection)) {
+		ReleaseConnection(connection);
+
+		return nullptr;
+	}
+
+	this->connections.Add(connection);
+
+	return connection;
+}
+
+/**
+ * Accepts and closes the connection waiting in libuv.
+ */
+void TcpServer::RejectConnection() {
+
+	auto *uvHandle = new uv_tcp_t;
+	int err = uv_tcp_init(DepLibUV::GetLoop(), uvHandle);
+
+	// This cannot happen (no socket is created).
+	if (err != 0)
+		UV_ABORT("uv_tcp_init() failed: %s", uv_strerror(err));
+
+	err = uv_accept(reinterpret_cast<uv_stream_t*>(this->uvHandle),
+			reinterpret_cast<uv_stream_t*>(uvHandle));
+
+	uv_close(reinterpret_cast<uv_handle_t*>(uvHandle),
+			static_cast<uv_close_cb>(onClose));
+
+	if (err != 0)
+		ResumeListening();
+}
+
+/**
+ * uv_accept() does not poll the socket again if it fails, uv_listen() does.
+ */
+void TcpServer::ResumeListening() {
+
+	int err = uv_listen(reinterpret_cast<uv_stream_t*>(this->uvHandle),
+			this->backlog, static_cast<uv_connection_cb>(onConnection));
+
+	if (err != 0)
+		UV_ERROR("uv_listen() failed, not accepting connections: %s",
+				uv_strerror(err));
+}
+
+/**
+ * Closes the connection and keeps it in the pool if there is room, otherwise
+ * deletes it.
+ */
+void TcpServer::ReleaseConnection(TcpConnection *connection) {
+
+	// The subclass may have closed this from UserOnTcpConnectionClosed().
+	if (this->closed || this->draining
+			|| this->pooledConnections.size() >= this->maxPooledConnections) {
 		delete connection;
+
+		return;
+	}
+
+	connection->Close();
+
+	this->pooledConnections.push_back(connection);
+}
+
+void TcpServer::SweepConnections() {
+
+	uint64_t now = uv_now(DepLibUV::GetLoop());
+
+	// UserOnTcpConnectionClosed() may close other connections.
+	ForEachConnection([this, now](TcpConnection *connection) {
+		auto reason = connection->GetExpiredTimeout(this->timeouts, now);
+
+		if (reason == TcpConnection::CloseReason::NONE)
+			return;
+
+		UV_DEBUG_DEV("closing connection: %s",
+				TcpConnection::CloseReasonToString(reason));
+
+		connection->Close(reason);
+
+		OnTcpConnectionClosed(connection);
+	});
+}
+
+inline void TcpServer::OnUvConnection(int status) {
+
+
+	if (this->closed)
+		return;
+
+	if (status != 0) {
+		this->numAcceptErrors++;
+
+		// libuv already accepted and closed the waiting connections with the fd
+		// it keeps in reserve, so the socket does not stay readable.
+		if (status == UV_EMFILE || status == UV_ENFILE) {
+			UV_WARN_DEV("no file descriptors left, connections dropped: %s",
+					uv_strerror(status));
+		} else {
+			UV_ERROR("error while receiving a new TCP connection: %s",
+					uv_strerror(status));
+		}
+
+		return;
+	}
+
+	uint64_t delay;
+
+	// Leave it waiting, libuv does not poll the socket until it is accepted.
+	if (!CanAccept(delay)) {
+		this->acceptPending = true;
+		this->acceptTimer->Start(delay);
+
+		return;
+	}
+
+	AcceptConnection();
+}
+
+bool TcpServer::UserOnTcpConnectionDrain(TcpConnection * /*connection*/) {
+	return true;
+}
+
+void TcpServer::UserOnTcpServerDrained(size_t /*numForceClosed*/) {
 }
 
 inline void TcpServer::OnTcpConnectionClosed(TcpConnection *connection) {
@@ -218,12 +822,49 @@ inline void TcpServer::OnTcpConnectionClosed(TcpConnection *connection) {
 
 	UV_DEBUG_DEV("TCP connection closed");
 
-	// Remove the TcpConnection from the set.
-	this->connections.erase(connection);
+	// Remove the TcpConnection from the list.
+	this->connections.Remove(connection);
 
 	// Notify the subclass.
 	UserOnTcpConnectionClosed(connection);
 
-	// Delete it.
-	delete connection;
+	// Pool or delete it.
+	ReleaseConnection(connection);
+}
+
+inline void TcpServer::OnUvAcceptCheck() {
+
+	this->numAcceptsInIteration = 0;
+
+	uv_check_stop(this->acceptCheck);
+}
+
+inline void TcpServer::OnTimer(Timer *timer) {
+
+	if (timer == this->sweepTimer) {
+		SweepConnections();
+
+		return;
+	}
+
+	if (timer == this->drainTimer) {
+		OnDrainTimer();
+
+		return;
+	}
+
+	if (!this->acceptPending)
+		return;
+
+	uint64_t delay;
+
+	if (!CanAccept(delay)) {
+		this->acceptTimer->Start(delay);
+
+		return;
+	}
+
+	this->acceptPending = false;
+
+	AcceptConnection();
 }
@@ -4,30 +4,77 @@
 
 #include <uv.h>
 #include <string>
-#include <unordered_set>
+#include <vector>
 
 #include "TcpConnection.hpp"
+#include "TcpConnectionRegistry.hpp"
+#include "Timer.hpp"
+
+class TcpServer: public TcpConnection::Listener, public Timer::Listener {
+public:
+	/**
+	 * Limits on accepting connections. Connections not accepted yet wait in the
+	 * listen backlog (and the kernel drops new ones once it is full), so a
+	 * connection storm does not starve the established connections.
+	 */
+	struct AcceptPolicy {
+		// Connections accepted per loop iteration, 0 for no limit.
+		size_t maxAcceptsPerIteration { 0 };
+		// Connections accepted per second (token bucket), 0 for no limit.
+		uint32_t acceptRate { 0 };
+		// Connections that can be accepted at once after being idle, 0 for
+		// acceptRate.
+		uint32_t acceptBurst { 0 };
+	};
 
-class TcpServer: public TcpConnection::Listener {
 public:
 	/**
 	 * uvHandle must be an already initialized and binded uv_tcp_t pointer.
 	 */
 	TcpServer(uv_tcp_t *uvHandle, int backlog);
+	TcpServer(int fd, int backlog);
 	virtual ~TcpServer() override;
 
 public:
 	void Close();
+	void CloseConnection(TcpConnection *connection,
+			TcpConnection::CloseReason reason = TcpConnection::CloseReason::LOCAL);
+	void Drain(uint64_t timeout);
+	TcpConnection* AdoptConnection(int fd);
+	uv_tcp_t* GetUvHandle() const;
+	bool IsDraining() const;
 	virtual void Dump() const;
+	const SocketAddress& GetLocalSocketAddress() const;
 	const struct sockaddr* GetLocalAddress() const;
 	int GetLocalFamily() const;
-	const std::string& GetLocalIp() const;
+	std::string GetLocalIp() const;
 	uint16_t GetLocalPort() const;
 	size_t GetNumConnections() const;
+	TcpConnection* GetConnection(uint64_t id) const;
+	void ForEachConnection(const std::function<void(TcpConnection*)> &fn);
+	size_t Broadcast(const uint8_t *data, size_t len,
+			const std::function<bool(TcpConnection*)> &filter = nullptr);
+	size_t Broadcast(TcpConnection::SharedPayload *payload,
+			const std::function<bool(TcpConnection*)> &filter = nullptr);
+	void SetConnectionPoolSize(size_t maxPooledConnections);
+	size_t GetNumPooledConnections() const;
+	void SetAcceptPolicy(const AcceptPolicy &policy);
+	void SetTimeouts(const TcpConnection::Timeouts &timeouts);
+	void SetSocketOptions(const TcpConnection::SocketOptions &options);
+	size_t GetNumAcceptErrors() const;
 
 private:
 	bool SetLocalAddress();
-	void GetAddressInfo(const struct sockaddr* addr, int& family, std::string& ip, uint16_t& port);
+	bool CanAccept(uint64_t &delay);
+	TcpConnection* AllocConnection();
+	void AcceptConnection();
+	void RejectConnection();
+	void ResumeListening();
+	void ReleaseConnection(TcpConnection *connection);
+	void SweepConnections();
+	void StopAccepting();
+	void CloseDrainedConnections();
+	void OnDrainTimer();
 
 	/* Pure virtual methods that must be implemented by the subclass. */
 protected:
@@ -35,47 +82,116 @@ protected:
 	virtual bool UserOnNewTcpConnection(TcpConnection *connection) = 0;
 	virtual void UserOnTcpConnectionClosed(TcpConnection *connection) = 0;
 
+	/* Virtual methods that may be implemented by the subclass. */
+protected:
+	// Called by Drain() for every connection. Return true (the default) to
+	// close it once its write queue is flushed, false to close it later (with
+	// CloseConnection()).
+	virtual bool UserOnTcpConnectionDrain(TcpConnection *connection);
+	// Called once drained, numForceClosed being the connections closed at the
+	// deadline. May delete this.
+	virtual void UserOnTcpServerDrained(size_t numForceClosed);
+
 	/* Callbacks fired by UV events. */
 public:
 	void OnUvConnection(int status);
+	void OnUvAcceptCheck();
 
 	/* Methods inherited from TcpConnection::Listener. */
 public:
 	void OnTcpConnectionClosed(TcpConnection *connection) override;
 
+	/* Methods inherited from Timer::Listener. */
+public:
+	void OnTimer(Timer *timer) override;
+
 protected:
-	struct sockaddr_storage localAddr;
-	std::string localIp;
-	uint16_t localPort { 0 };
+	SocketAddress localAddress;
 
 private:
-	// Allocated by this (may be passed by argument).
+	// Allocated by this (may be passed by argument). nullptr once draining.
 	uv_tcp_t *uvHandle { nullptr };
+	// Allocated by this.
+	Timer *acceptTimer { nullptr };
+	Timer *sweepTimer { nullptr };
+	Timer *drainTimer { nullptr };
+	uv_check_t *acceptCheck { nullptr };
 	// Others.
-	std::unordered_set<TcpConnection*> connections;
+	TcpConnectionRegistry connections;
+	// Closed connections to be reset and reused instead of allocating new ones.
+	std::vector<TcpConnection*> pooledConnections;
+	size_t maxPooledConnections { 0 };
 	bool closed { false };
+	int backlog { 0 };
+	AcceptPolicy acceptPolicy;
+	// A connection accepted by libuv waits for uv_accept(), libuv does not
+	// poll the socket meanwhile.
+	bool acceptPending { false };
+	size_t numAcceptsInIteration { 0 };
+	double acceptTokens { 0 };
+	uint64_t acceptTokensUpdatedAt { 0 };
+	size_t numAcceptErrors { 0 };
+	TcpConnection::Timeouts timeouts;
+	TcpConnection::SocketOptions socketOptions;
+	bool hasSocketOptions { false };
+	bool draining { false };
+	uint64_t drainDeadline { 0 };
+	// Connections to close once their write queue is flushed.
+	std::vector<uint64_t> drainCloseIds;
 };
 
 /* Inline methods. */
 
 inline size_t TcpServer::GetNumConnections() const {
-	return this->connections.size();
+	return this->connections.GetSize();
+}
+
+/**
+ * The connection with the given id (see TcpConnection::GetId()), nullptr if
+ * closed.
+ */
+inline TcpConnection* TcpServer::GetConnection(uint64_t id) const {
+	return this->connections.Get(id);
+}
+
+inline size_t TcpServer::GetNumPooledConnections() const {
+	return this->pooledConnections.size();
+}
+
+/**
+ * The listening handle (e.g. to be sent with UnixStreamSocket::WriteHandle()),
+ * nullptr once draining or closed.
+ */
+inline uv_tcp_t* TcpServer::GetUvHandle() const {
+	return this->uvHandle;
+}
+
+inline bool TcpServer::IsDraining() const {
+	return this->draining;
+}
+
+inline size_t TcpServer::GetNumAcceptErrors() const {
+	return this->numAcceptErrors;
+}
+
+inline const SocketAddress& TcpServer::GetLocalSocketAddress() const {
+	return this->localAddress;
 }
 
 inline const struct sockaddr* TcpServer::GetLocalAddress() const {
-	return reinterpret_cast<const struct sockaddr*>(&this->localAddr);
+	return this->localAddress.GetSockAddr();
 }
 
 inline int TcpServer::GetLocalFamily() const {
-	return reinterpret_cast<const struct sockaddr*>(&this->localAddr)->sa_family;
+	return this->localAddress.GetFamily();
 }
 
-inline const std::string& TcpServer::GetLocalIp() const {
-	return this->localIp;
+inline std::string TcpServer::GetLocalIp() const {
+	return std::string(this->localAddress.GetIp(), this->localAddress.GetIpLen());
 }
 
 inline uint16_t TcpServer::GetLocalPort() const {
-	return this->localPort;
+	return this->localAddress.GetPort();
 }
 
 #endif
@@ -39,42 +39,42 @@ private:
 };
 
 #if defined(HAVE_PTHREADS)
-void ThreadRun(void *arg) {
+inline void ThreadRun(void *arg) {
 	Thread::Runnable *runnable = (Thread::Runnable *)arg;
 	runnable->run();
 }
 
-Thread::Thread(Thread::Runnable *runnable) : exitPending(false) {
+inline Thread::Thread(Thread::Runnable *runnable) : exitPending(false) {
 	uv_thread_create(&thread, ThreadRun, (void*)runnable);
 }
 
-Thread::~Thread() {
+inline Thread::~Thread() {
 
 }
 
 
-int Thread::GetId() {
+inline int Thread::GetId() {
 	return (int)uv_thread_self();
 }
 
-int Thread::Join() {
+inline int Thread::Join() {
 	return uv_thread_join(&thread);
 }
 
-int Thread::RequestExit() {
+inline int Thread::RequestExit() {
 	AutoMutex lock(mutex);
 	exitPending = true;
 	return 0;
 }
 
-int Thread::RequestExitAndWait() {
+inline int Thread::RequestExitAndWait() {
 	AutoMutex lock(mutex);
 	exitPending = true;
 	Join();
 	return 0;
 }
 
-bool Thread::IsQuit() {
+inline bool Thread::IsQuit() {
 	AutoMutex lock(mutex);
 	return (exitPending == true);
 }
@@ -4,6 +4,8 @@
 #include "UdpSocket.hpp"
 #include "LibUVErrors.hpp"
 #include "PortManager.hpp"
+#include "DnsResolver.hpp"
+#include <memory>
 
 UdpClient::UdpClient(Listener* listener, std::string &ip, uint16_t port) :
  	 :: UdpSocket(PortManager::BindUdp(ip, port))// This may throw.
@@ -12,7 +14,82 @@ UdpClient::UdpClient(Listener* listener, std::string &ip, uint16_t port) :
 }
 
 UdpClient::~UdpClient() {
-	PortManager::UnbindUdp(this->localIp, this->localPort);
+	for (auto &kv : this->pendingSends) {
+		DnsResolver::Cancel(kv.first);
+
+		if (kv.second) {
+			(*kv.second)(false);
+
+			delete kv.second;
+		}
+	}
+
+	std::string localIp { GetLocalIp() };
+
+	PortManager::UnbindUdp(localIp, GetLocalPort());
+}
+
+/**
+ * Sends the datagram to the first address of hostname (see DnsResolver) in
+ * the family of the socket. The data is copied if the name is not cached.
+ */
+void UdpClient::SendByName(const uint8_t *data, size_t len,
+		const std::string &hostname, uint16_t port, onSendCallback *cb) {
+	int error;
+	std::vector<std::string> ips;
+
+	if (DnsResolver::GetCached(hostname, error, ips)) {
+		SendResolved(data, len, error, ips, port, cb);
+
+		return;
+	}
+
+	auto payload = std::make_shared<std::string>(
+			reinterpret_cast<const char*>(data), len);
+	auto id = std::make_shared<uint64_t>(0);
+
+	// NOTE: This may throw.
+	*id = DnsResolver::Resolve(hostname, new DnsResolver::onResolveCallback(
+			[this, payload, id, port](int error, const std::vector<std::string> &ips) {
+		auto it = this->pendingSends.find(*id);
+		auto *cb = it->second;
+
+		this->pendingSends.erase(it);
+
+		SendResolved(reinterpret_cast<const uint8_t*>(payload->data()),
+				payload->size(), error, ips, port, cb);
+	}));
+
+	this->pendingSends[*id] = cb;
+}
+
+void UdpClient::SendResolved(const uint8_t *data, size_t len, int error,
+		const std::vector<std::string> &ips, uint16_t port,
+		onSendCallback *cb) {
+	int family = GetLocalFamily();
+
+	if (error == 0) {
+		for (auto &ip : ips) {
+			SocketAddress addr;
+
+			if (addr.Parse(ip, port) != 0 || addr.GetFamily() != family)
+				continue;
+
+			Send(data, len, addr.GetSockAddr(), cb);
+
+			return;
+		}
+
+		error = UV_EAI_ADDRFAMILY;
+	}
+
+	UV_WARN_DEV("cannot send the datagram: %s", uv_strerror(error));
+
+	if (cb) {
+		(*cb)(false);
+
+		delete cb;
+	}
 }
 
 void UdpClient::UserOnUdpDatagramReceived(const uint8_t *data, size_t len,
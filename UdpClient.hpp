@@ -1,6 +1,9 @@
 #ifndef UDP_CLIENT_HPP
 #define UDP_CLIENT_HPP
 #include "UdpSocket.hpp"
+#include <string>
+#include <unordered_map>
+#include <vector>
 class UdpClient : public UdpSocket {
 public:
 	class Listener
@@ -16,11 +19,20 @@ public:
 public:
 	UdpClient(Listener *listener, std::string &ip, uint16_t port);
 	virtual ~UdpClient();
+public:
+	void SendByName(const uint8_t *data, size_t len,
+			const std::string &hostname, uint16_t port, onSendCallback *cb);
 public:
 	virtual void UserOnUdpDatagramReceived(const uint8_t *data, size_t len,
 				const struct sockaddr *addr) override;
+private:
+	void SendResolved(const uint8_t *data, size_t len, int error,
+			const std::vector<std::string> &ips, uint16_t port,
+			onSendCallback *cb);
 private:
 	Listener* listener{ nullptr };
+	// Send callbacks of the datagrams waiting for DNS, by resolve id.
+	std::unordered_map<uint64_t, onSendCallback*> pendingSends;
 
 
 };
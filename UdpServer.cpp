@@ -1,22 +1,143 @@
 #define UV_CLASS "UdpServer"
+// #define UV_LOG_DEV_LEVEL 3
 
 #include "UdpServer.hpp"
 #include "UdpSocket.hpp"
+#include "DepLibUV.hpp"
+#include "Logger.hpp"
 #include "LibUVErrors.hpp"
 #include "PortManager.hpp"
 
+/* Static. */
+
+static constexpr size_t InitialNumSlots { 64 };
+
+/* Instance methods. */
+
 UdpServer::UdpServer(Listener* listener, std::string &ip, uint16_t port) :
  	 :: UdpSocket(PortManager::BindUdp(ip, port))// This may throw.
 	, listener(listener){
 
 }
 
+/**
+ * Dispatches the datagrams to sessions. A session is closed once no datagram
+ * is received from its peer for sessionTimeout ms (0 to keep them until
+ * closed).
+ */
+UdpServer::UdpServer(SessionListener* listener, std::string &ip, uint16_t port,
+		uint64_t sessionTimeout) :
+		::UdpSocket(PortManager::BindUdp(ip, port)), // This may throw.
+		sessionListener(listener), sessionTimeout(sessionTimeout) {
+
+	this->slots.resize(InitialNumSlots, nullptr);
+
+	if (this->sessionTimeout != 0)
+		this->sessionTimer = new Timer(this);
+}
+
+UdpServer::UdpServer(Listener* listener, uv_udp_t *uvHandle) :
+		::UdpSocket(uvHandle), // This may throw.
+		listener(listener), portManaged(false) {
+}
+
+UdpServer::UdpServer(SessionListener* listener, uv_udp_t *uvHandle,
+		uint64_t sessionTimeout) :
+		::UdpSocket(uvHandle), // This may throw.
+		sessionListener(listener), sessionTimeout(sessionTimeout),
+		portManaged(false) {
+
+	this->slots.resize(InitialNumSlots, nullptr);
+
+	if (this->sessionTimeout != 0)
+		this->sessionTimer = new Timer(this);
+}
+
 UdpServer::~UdpServer() {
-	PortManager::UnbindUdp(this->localIp, this->localPort);
+	std::string localIp { GetLocalIp() };
+
+	DeleteSessions();
+
+	delete this->sessionTimer;
+
+	if (this->portManaged)
+		PortManager::UnbindUdp(localIp, GetLocalPort());
+}
+
+void UdpServer::Dump() const {
+	UdpSocket::Dump();
+	UV_DUMP("<UdpServer>");
+	UV_DUMP("  sessions : %zu (slots:%zu)", this->numSessions,
+			this->slots.size());
+	UV_DUMP("</UdpServer>");
+}
+
+/**
+ * Returns the session of the given peer, or nullptr.
+ */
+UdpServer::Session* UdpServer::GetSession(const struct sockaddr *addr) const {
+
+	if (this->numSessions == 0)
+		return nullptr;
+
+	return this->slots[FindSlot(addr, SocketAddress::Hash(addr))];
+}
+
+/**
+ * Closes the session, calling OnUdpSessionClosed() and deleting it. A new
+ * datagram from the peer opens a new session.
+ */
+void UdpServer::CloseSession(Session *session) {
+
+	if (session == this->closingSession)
+		return;
+
+	EraseSession(session);
+	RemoveFromIdleList(session);
+
+	this->closingSession = session;
+	this->sessionListener->OnUdpSessionClosed(this, session);
+	this->closingSession = nullptr;
+
+	delete session;
 }
 
 void UdpServer::UserOnUdpDatagramReceived(const uint8_t *data, size_t len,
 				const struct sockaddr *addr) {
+	if (this->sessionListener != nullptr)
+	{
+		size_t hash = SocketAddress::Hash(addr);
+		Session *session = this->slots[FindSlot(addr, hash)];
+
+		if (session == nullptr)
+		{
+			this->sessionListener->OnUdpSessionAlloc(this, addr, &session);
+
+			if (session == nullptr)
+				return;
+
+			session->server = this;
+			session->address.Set(addr);
+			session->hash = hash;
+
+			InsertSession(session);
+		}
+		else
+		{
+			RemoveFromIdleList(session);
+		}
+
+		session->lastActivity = uv_now(DepLibUV::GetLoop());
+		session->recvBytes += len;
+
+		AppendToIdleList(session);
+
+		// NOTE: This may close the session.
+		this->sessionListener->OnUdpSessionPacket(this, session, data, len);
+
+		return;
+	}
+
 	if (this->listener == nullptr)
 	{
 		UV_ERROR("no listener set");
@@ -26,3 +147,166 @@ void UdpServer::UserOnUdpDatagramReceived(const uint8_t *data, size_t len,
 	this->listener->OnUdpSocketPacketReceived(this, data, len, addr);
 
 }
+
+/**
+ * Index of the slot holding the session of addr, or of the empty slot where
+ * it would be inserted.
+ */
+inline size_t UdpServer::FindSlot(const struct sockaddr *addr,
+		size_t hash) const {
+
+	size_t mask = this->slots.size() - 1;
+	size_t idx = hash & mask;
+
+	while (this->slots[idx] != nullptr) {
+		Session *session = this->slots[idx];
+
+		if (session->hash == hash && session->address.Equals(addr))
+			break;
+
+		idx = (idx + 1) & mask;
+	}
+
+	return idx;
+}
+
+void UdpServer::InsertSession(Session *session) {
+
+	// Keep the load factor under 1/2 so probe sequences stay short.
+	if ((this->numSessions + 1) * 2 > this->slots.size())
+		Rehash(this->slots.size() * 2);
+
+	size_t mask = this->slots.size() - 1;
+	size_t idx = session->hash & mask;
+
+	while (this->slots[idx] != nullptr)
+		idx = (idx + 1) & mask;
+
+	this->slots[idx] = session;
+	this->numSessions++;
+}
+
+/**
+ * Backward shift deletion, so no tombstones are left in the table.
+ */
+void UdpServer::EraseSession(Session *session) {
+
+	size_t mask = this->slots.size() - 1;
+	size_t idx = FindSlot(session->address.GetSockAddr(), session->hash);
+
+	if (this->slots[idx] != session)
+		UV_ABORT("session not found");
+
+	this->slots[idx] = nullptr;
+	this->numSessions--;
+
+	size_t next = (idx + 1) & mask;
+
+	while (this->slots[next] != nullptr) {
+		size_t home = this->slots[next]->hash & mask;
+
+		// Move the entry back unless its home slot is in (idx, next].
+		bool stays = (idx <= next) ?
+				(idx < home && home <= next) : (idx < home || home <= next);
+
+		if (!stays) {
+			this->slots[idx] = this->slots[next];
+			this->slots[next] = nullptr;
+			idx = next;
+		}
+
+		next = (next + 1) & mask;
+	}
+}
+
+void UdpServer::Rehash(size_t numSlots) {
+
+	std::vector<Session*> slots(numSlots, nullptr);
+	size_t mask = numSlots - 1;
+
+	for (auto *session : this->slots) {
+		if (session == nullptr)
+			continue;
+
+		size_t idx = session->hash & mask;
+
+		while (slots[idx] != nullptr)
+			idx = (idx + 1) & mask;
+
+		slots[idx] = session;
+	}
+
+	this->slots.swap(slots);
+}
+
+inline void UdpServer::AppendToIdleList(Session *session) {
+
+	session->prev = this->idleTail;
+	session->next = nullptr;
+
+	if (this->idleTail != nullptr)
+		this->idleTail->next = session;
+	else
+		this->idleHead = session;
+
+	this->idleTail = session;
+
+	if (this->sessionTimer != nullptr && !this->sessionTimer->IsActive())
+		this->sessionTimer->Start(this->sessionTimeout);
+}
+
+inline void UdpServer::RemoveFromIdleList(Session *session) {
+
+	if (session->prev != nullptr)
+		session->prev->next = session->next;
+	else
+		this->idleHead = session->next;
+
+	if (session->next != nullptr)
+		session->next->prev = session->prev;
+	else
+		this->idleTail = session->prev;
+
+	session->prev = nullptr;
+	session->next = nullptr;
+}
+
+void UdpServer::DeleteSessions() {
+
+	UV_DEBUG_DEV("closing %zu sessions", this->numSessions);
+
+	// Same as TcpServer with its connections, the listener is not called.
+	while (this->idleHead != nullptr) {
+		Session *session = this->idleHead;
+
+		this->idleHead = session->next;
+
+		delete session;
+	}
+
+	this->idleTail = nullptr;
+	this->numSessions = 0;
+	this->slots.assign(this->slots.size(), nullptr);
+}
+
+/**
+ * Closes the expired sessions, which are at the head of the idle list, and
+ * arms the timer for the next one to expire.
+ */
+inline void UdpServer::OnTimer(Timer * /*timer*/) {
+
+	uint64_t now = uv_now(DepLibUV::GetLoop());
+
+	while (this->idleHead != nullptr
+			&& now - this->idleHead->lastActivity >= this->sessionTimeout) {
+		UV_DEBUG_DEV("session with %s:%d expired",
+				this->idleHead->address.GetIp(), this->idleHead->address.GetPort());
+
+		CloseSession(this->idleHead);
+	}
+
+	if (this->idleHead != nullptr) {
+		this->sessionTimer->Start(
+				this->idleHead->lastActivity + this->sessionTimeout - now);
+	}
+}
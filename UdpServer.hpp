@@ -1,7 +1,17 @@
 #ifndef UDP_SERVER_HPP
 #define UDP_SERVER_HPP
 #include "UdpSocket.hpp"
-class UdpServer : public UdpSocket {
+#include "SocketAddress.hpp"
+#include "Timer.hpp"
+#include <vector>
+
+/**
+ * UDP server. With a Listener every datagram is passed as it is received.
+ * With a SessionListener datagrams are grouped by peer address into Session
+ * objects, looked up in an open addressing hash table keyed by the raw
+ * sockaddr, and a session is closed once idle for sessionTimeout ms.
+ */
+class UdpServer : public UdpSocket, public Timer::Listener {
 public:
 	class Listener
 	{
@@ -13,16 +23,131 @@ public:
 		  UdpSocket* socket, const uint8_t* data, size_t len, const struct sockaddr* remoteAddr) = 0;
 	};
 
+	/* Peer of the server. May be subclassed to keep per peer state. */
+	class Session {
+	public:
+		Session() = default;
+		Session& operator=(const Session&) = delete;
+		Session(const Session&) = delete;
+		virtual ~Session() = default;
+
+	public:
+		void Send(const uint8_t *data, size_t len,
+				UdpSocket::onSendCallback *cb = nullptr);
+		void Close();
+		UdpServer* GetServer() const;
+		const SocketAddress& GetAddress() const;
+		uint64_t GetLastActivity() const;
+		size_t GetRecvBytes() const;
+
+	private:
+		friend class UdpServer;
+
+		UdpServer *server { nullptr };
+		SocketAddress address;
+		size_t hash { 0 };
+		uint64_t lastActivity { 0 };
+		size_t recvBytes { 0 };
+		// Position in the server idle list, least recently active first.
+		Session *prev { nullptr };
+		Session *next { nullptr };
+	};
+
+	class SessionListener
+	{
+	public:
+		virtual ~SessionListener() = default;
+	public:
+		// Allocate a Session (or a subclass of it) for a new peer. Leave it
+		// nullptr to drop the datagram.
+		virtual void OnUdpSessionAlloc(UdpServer *server,
+				const struct sockaddr *remoteAddr, Session **session) = 0;
+		virtual void OnUdpSessionPacket(UdpServer *server, Session *session,
+				const uint8_t *data, size_t len) = 0;
+		// The session is deleted after this.
+		virtual void OnUdpSessionClosed(UdpServer *server, Session *session) = 0;
+	};
+
 public:
 	UdpServer(Listener* listener, std::string &ip, uint16_t port);
+	UdpServer(SessionListener* listener, std::string &ip, uint16_t port,
+			uint64_t sessionTimeout);
+	// uvHandle must be an already initialized and binded uv_udp_t pointer
+	// (i.e. not bound by PortManager, see UdpServerGroup).
+	UdpServer(Listener* listener, uv_udp_t *uvHandle);
+	UdpServer(SessionListener* listener, uv_udp_t *uvHandle,
+			uint64_t sessionTimeout);
 	virtual ~UdpServer();
 public:
+	virtual void Dump() const override;
+	Session* GetSession(const struct sockaddr *addr) const;
+	void CloseSession(Session *session);
+	size_t GetNumSessions() const;
 	virtual void UserOnUdpDatagramReceived(const uint8_t *data, size_t len,
 				const struct sockaddr *addr) override;
 
+private:
+	size_t FindSlot(const struct sockaddr *addr, size_t hash) const;
+	void InsertSession(Session *session);
+	void EraseSession(Session *session);
+	void Rehash(size_t numSlots);
+	void AppendToIdleList(Session *session);
+	void RemoveFromIdleList(Session *session);
+	void DeleteSessions();
+
+	/* Methods inherited from Timer::Listener. */
+public:
+	void OnTimer(Timer *timer) override;
+
 private:
 	// Passed by argument.
 	Listener* listener{ nullptr };
+	SessionListener *sessionListener { nullptr };
+	uint64_t sessionTimeout { 0 };
+	// Allocated by this.
+	Timer *sessionTimer { nullptr };
+	// Others.
+	// Open addressing with linear probing, the size is a power of 2.
+	std::vector<Session*> slots;
+	size_t numSessions { 0 };
+	Session *idleHead { nullptr };
+	Session *idleTail { nullptr };
+	// Session being closed, to ignore CloseSession() on it from the callback.
+	Session *closingSession { nullptr };
+	// Whether the port must be released in PortManager.
+	bool portManaged { true };
 
 };
+
+/* Inline methods. */
+
+inline void UdpServer::Session::Send(const uint8_t *data, size_t len,
+		UdpSocket::onSendCallback *cb) {
+	this->server->Send(data, len, this->address.GetSockAddr(), cb);
+}
+
+inline void UdpServer::Session::Close() {
+	this->server->CloseSession(this);
+}
+
+inline UdpServer* UdpServer::Session::GetServer() const {
+	return this->server;
+}
+
+inline const SocketAddress& UdpServer::Session::GetAddress() const {
+	return this->address;
+}
+
+inline uint64_t UdpServer::Session::GetLastActivity() const {
+	return this->lastActivity;
+}
+
+inline size_t UdpServer::Session::GetRecvBytes() const {
+	return this->recvBytes;
+}
+
+inline size_t UdpServer::GetNumSessions() const {
+	return this->numSessions;
+}
+
 #endif//UDP_SERVER_HPP
@@ -0,0 +1,350 @@
+#define UV_CLASS "UdpServerGroup"
+// #define UV_LOG_DEV_LEVEL 3
+
+#include "UdpServerGroup.hpp"
+#include "DepLibUV.hpp"
+#include "Logger.hpp"
+#include "LibUVErrors.hpp"
+#include "SocketAddress.hpp"
+#include <cerrno>
+#include <cinttypes> // PRIu16
+#include <cstring> // std::strerror()
+#include <linux/filter.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h> // close()
+
+/* Static. */
+
+// Knuth multiplicative hash constant, mixes the source address and port.
+static constexpr uint32_t FlowHashMultiplier { 0x9e3779b1 };
+
+// BPF_STMT() taking the negative SKF_* offsets.
+static inline struct sock_filter bpfStmt(uint16_t code, int32_t k) {
+	struct sock_filter filter = { code, 0, 0, static_cast<uint32_t>(k) };
+
+	return filter;
+}
+
+/* Static methods for UV callbacks. */
+
+inline static void onStop(uv_async_t *handle) {
+	auto *worker = static_cast<UdpServerGroup::Worker*>(handle->data);
+
+	worker->group->OnUvStop(worker);
+}
+
+inline static void onClose(uv_handle_t *handle) {
+	delete handle;
+}
+
+/* Worker instance methods. */
+
+UdpServerGroup::Worker::Worker(UdpServerGroup *group, size_t id, int fd) :
+		group(group), id(id), fd(fd) {
+
+	uv_sem_init(&this->started, 0);
+}
+
+void UdpServerGroup::Worker::run() {
+
+	DepLibUV::ClassInit();
+
+	int err;
+	auto *uvHandle = new uv_udp_t;
+
+	this->stopAsync = new uv_async_t;
+	this->stopAsync->data = static_cast<void*>(this);
+
+	err = uv_async_init(DepLibUV::GetLoop(), this->stopAsync,
+			static_cast<uv_async_cb>(onStop));
+
+	if (err != 0) {
+		delete this->stopAsync;
+		this->stopAsync = nullptr;
+		delete uvHandle;
+
+		this->error.assign("uv_async_init() failed: ").append(uv_strerror(err));
+		::close(this->fd);
+		DepLibUV::ClassDestroy();
+		uv_sem_post(&this->started);
+
+		return;
+	}
+
+	err = uv_udp_init(DepLibUV::GetLoop(), uvHandle);
+
+	if (err == 0) {
+		err = uv_udp_open(uvHandle, this->fd);
+
+		if (err != 0) {
+			::close(this->fd);
+			uv_close(reinterpret_cast<uv_handle_t*>(uvHandle),
+					static_cast<uv_close_cb>(onClose));
+		}
+	} else {
+		::close(this->fd);
+		delete uvHandle;
+	}
+
+	if (err != 0) {
+		this->error.assign("cannot open the socket: ").append(uv_strerror(err));
+	} else {
+		try {
+			this->server = this->group->listener->OnUdpServerGroupWorkerStart(
+					this->group, this->id, uvHandle);
+		} catch (const std::exception &error) {
+			this->error.assign(error.what());
+
+			// UdpSocket closes it if its constructor throws.
+			if (!uv_is_closing(reinterpret_cast<uv_handle_t*>(uvHandle))) {
+				uv_close(reinterpret_cast<uv_handle_t*>(uvHandle),
+						static_cast<uv_close_cb>(onClose));
+			}
+		}
+	}
+
+	if (!this->error.empty()) {
+		uv_close(reinterpret_cast<uv_handle_t*>(this->stopAsync),
+				static_cast<uv_close_cb>(onClose));
+		this->stopAsync = nullptr;
+
+		// Run the close callbacks.
+		DepLibUV::RunLoop();
+		DepLibUV::ClassDestroy();
+		uv_sem_post(&this->started);
+
+		return;
+	}
+
+	uv_sem_post(&this->started);
+
+	// Until OnUvStop() and the listener close everything.
+	DepLibUV::RunLoop();
+	DepLibUV::ClassDestroy();
+}
+
+/* Instance methods. */
+
+/**
+ * Binds the sockets and starts the workers, each one calling
+ * OnUdpServerGroupWorkerStart() before this returns. Throws if any of them
+ * fails. If port is 0 a random one is used for all the sockets.
+ */
+UdpServerGroup::UdpServerGroup(Listener *listener, std::string &ip,
+		uint16_t port, const Options &options) :
+		listener(listener), options(options) {
+
+	if (this->options.numWorkers == 0)
+		UV_THROW_ERROR("numWorkers must be greater than 0");
+
+	SocketAddress bindAddress;
+
+	if (bindAddress.Parse(ip, port) != 0)
+		UV_THROW_ERROR("invalid IP '%s'", ip.c_str());
+
+	int family = bindAddress.GetFamily();
+	std::vector<int> fds;
+
+	// Bind all the sockets first, so socket i is at index i of the group.
+	for (size_t i { 0 }; i < this->options.numWorkers; ++i) {
+		int on { 1 };
+		int fd = ::socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		const char *failed { nullptr };
+
+		if (fd == -1) {
+			failed = "socket()";
+		} else if (::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on))
+				!= 0) {
+			failed = "setsockopt(SO_REUSEPORT)";
+		} else if (family == AF_INET6
+				&& ::setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on))
+				!= 0) {
+			// Don't also bind into IPv4, same as PortManager.
+			failed = "setsockopt(IPV6_V6ONLY)";
+		} else if (::bind(fd, bindAddress.GetSockAddr(),
+				bindAddress.GetSockAddrLen()) != 0) {
+			failed = "bind()";
+		}
+
+		if (failed == nullptr && bindAddress.GetPort() == 0) {
+			struct sockaddr_storage localAddr;
+			socklen_t len = sizeof(localAddr);
+
+			if (::getsockname(fd, reinterpret_cast<struct sockaddr*>(&localAddr),
+					&len) != 0) {
+				failed = "getsockname()";
+			} else {
+				bindAddress.Set(reinterpret_cast<struct sockaddr*>(&localAddr));
+			}
+		}
+
+		if (failed != nullptr) {
+			int error = errno;
+
+			if (fd != -1)
+				::close(fd);
+
+			for (int fd : fds)
+				::close(fd);
+
+			UV_THROW_ERROR("%s failed [ip:%s, port:%" PRIu16 "]: %s", failed,
+					ip.c_str(), bindAddress.GetPort(), std::strerror(error));
+		}
+
+		fds.push_back(fd);
+	}
+
+	this->localPort = bindAddress.GetPort();
+
+	if (this->options.steering != Steering::KERNEL) {
+		try {
+			AttachSteeringProgram(fds[0], family);
+		} catch (const LibUVError &error) {
+			for (int fd : fds)
+				::close(fd);
+
+			throw;
+		}
+	}
+
+	for (size_t i { 0 }; i < fds.size(); ++i) {
+		auto *worker = new Worker(this, i, fds[i]);
+
+		this->workers.push_back(worker);
+
+		worker->thread = new Thread(worker);
+		uv_sem_wait(&worker->started);
+
+		if (!worker->error.empty()) {
+			std::string error { worker->error };
+
+			// The sockets not given to a worker yet.
+			for (size_t j { i + 1 }; j < fds.size(); ++j)
+				::close(fds[j]);
+
+			StopWorkers();
+
+			UV_THROW_ERROR("worker %zu failed: %s", i, error.c_str());
+		}
+	}
+}
+
+UdpServerGroup::~UdpServerGroup() {
+
+	if (!this->closed)
+		Close();
+}
+
+/**
+ * Stops the workers, calling OnUdpServerGroupWorkerStop() in each one, and
+ * waits for their threads to exit.
+ */
+void UdpServerGroup::Close() {
+
+	if (this->closed)
+		return;
+
+	this->closed = true;
+
+	StopWorkers();
+}
+
+void UdpServerGroup::Dump() const {
+	UV_DUMP("<UdpServerGroup>");
+	UV_DUMP("  [UDP, port:%" PRIu16 ", workers:%zu, steering:%s, status:%s]",
+			this->localPort, this->workers.size(),
+			this->options.steering == Steering::FLOW ? "flow" :
+			this->options.steering == Steering::CPU ? "cpu" : "kernel",
+			(!this->closed) ? "open" : "closed");
+	UV_DUMP("</UdpServerGroup>");
+}
+
+/**
+ * Attaches to the group a classic BPF program returning the index of the
+ * socket for each datagram (SO_ATTACH_REUSEPORT_CBPF, Linux >= 4.5).
+ */
+void UdpServerGroup::AttachSteeringProgram(int fd, int family) {
+
+	auto numWorkers = static_cast<uint32_t>(this->options.numWorkers);
+	std::vector<struct sock_filter> code;
+
+	switch (this->options.steering) {
+	case Steering::CPU:
+		code.push_back(bpfStmt(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU));
+		break;
+
+	case Steering::FLOW: {
+		// The datagram is pulled past the UDP header, so read the IP and UDP
+		// headers at SKF_NET_OFF. Assumes an IPv4 header without options.
+		if (family == AF_INET) {
+			// A = source address ^ source port.
+			code.push_back(bpfStmt(BPF_LD | BPF_H | BPF_ABS, SKF_NET_OFF + 20));
+			code.push_back(bpfStmt(BPF_MISC | BPF_TAX, 0));
+			code.push_back(bpfStmt(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 12));
+			code.push_back(bpfStmt(BPF_ALU | BPF_XOR | BPF_X, 0));
+		} else {
+			// A = the four words of the source address ^ source port.
+			code.push_back(bpfStmt(BPF_LD | BPF_H | BPF_ABS, SKF_NET_OFF + 40));
+
+			for (int32_t offset { 8 }; offset < 24; offset += 4) {
+				code.push_back(bpfStmt(BPF_MISC | BPF_TAX, 0));
+				code.push_back(bpfStmt(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + offset));
+				code.push_back(bpfStmt(BPF_ALU | BPF_XOR | BPF_X, 0));
+			}
+		}
+
+		code.push_back(bpfStmt(BPF_ALU | BPF_MUL | BPF_K,
+				static_cast<int32_t>(FlowHashMultiplier)));
+		code.push_back(bpfStmt(BPF_ALU | BPF_RSH | BPF_K, 16));
+		break;
+	}
+
+	case Steering::KERNEL:
+		return;
+	}
+
+	code.push_back(bpfStmt(BPF_ALU | BPF_MOD | BPF_K,
+			static_cast<int32_t>(numWorkers)));
+	code.push_back(bpfStmt(BPF_RET | BPF_A, 0));
+
+	struct sock_fprog program;
+
+	program.len = static_cast<unsigned short>(code.size());
+	program.filter = code.data();
+
+	if (::setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program,
+			sizeof(program)) != 0) {
+		UV_THROW_ERROR("setsockopt(SO_ATTACH_REUSEPORT_CBPF) failed: %s",
+				std::strerror(errno));
+	}
+}
+
+void UdpServerGroup::StopWorkers() {
+
+	for (auto *worker : this->workers) {
+		// Failed to start, the thread already exited.
+		if (worker->stopAsync != nullptr)
+			uv_async_send(worker->stopAsync);
+
+		worker->thread->Join();
+
+		delete worker->thread;
+		uv_sem_destroy(&worker->started);
+		delete worker;
+	}
+
+	this->workers.clear();
+}
+
+inline void UdpServerGroup::OnUvStop(Worker *worker) {
+
+	if (worker->server != nullptr) {
+		this->listener->OnUdpServerGroupWorkerStop(this, worker->id,
+				worker->server);
+		worker->server = nullptr;
+	}
+
+	uv_close(reinterpret_cast<uv_handle_t*>(worker->stopAsync),
+			static_cast<uv_close_cb>(onClose));
+}
@@ -0,0 +1,112 @@
+#ifndef MS_UDP_SERVER_GROUP_HPP
+#define MS_UDP_SERVER_GROUP_HPP
+
+#include <uv.h>
+#include <string>
+#include <vector>
+#include "Thread.hpp"
+#include "UdpServer.hpp"
+
+/**
+ * UDP server on N threads, each one running its own loop with its own
+ * UdpServer. The N sockets are bound to the same ip:port with SO_REUSEPORT so
+ * the kernel spreads the datagrams among them.
+ *
+ * The kernel already sends a given 4-tuple to the same socket while the group
+ * does not change. With steering set, a classic BPF program picks the socket
+ * instead: FLOW hashes the source address and port (so the choice does not
+ * depend on the kernel hash), CPU uses the CPU that received the datagram
+ * (to keep a flow on the core its NIC queue interrupts).
+ *
+ * The sockets do not go through PortManager.
+ */
+class UdpServerGroup {
+public:
+	enum class Steering {
+		KERNEL = 1, FLOW, CPU
+	};
+
+	struct Options {
+		size_t numWorkers { 4 };
+		Steering steering { Steering::KERNEL };
+	};
+
+	class Listener {
+	public:
+		virtual ~Listener() = default;
+
+	public:
+		// Called in the worker thread (with its loop set in DepLibUV). Must
+		// return the UdpServer of the worker for the given socket, created with
+		// a uv_udp_t constructor. May throw.
+		virtual UdpServer* OnUdpServerGroupWorkerStart(UdpServerGroup *group,
+				size_t workerId, uv_udp_t *uvHandle) = 0;
+		// Called in the worker thread when closing the group. Must delete the
+		// server and anything else running on the worker loop.
+		virtual void OnUdpServerGroupWorkerStop(UdpServerGroup *group,
+				size_t workerId, UdpServer *server) = 0;
+	};
+
+	/* Thread running a loop and the UdpServer of a socket of the group. */
+	class Worker: public Thread::Runnable {
+	public:
+		Worker(UdpServerGroup *group, size_t id, int fd);
+
+	public:
+		void run() override;
+
+	public:
+		UdpServerGroup *group { nullptr };
+		size_t id { 0 };
+		int fd { -1 };
+		Thread *thread { nullptr };
+		uv_async_t *stopAsync { nullptr };
+		UdpServer *server { nullptr };
+		// Posted once the worker runs its loop (or fails to).
+		uv_sem_t started;
+		std::string error;
+	};
+
+public:
+	UdpServerGroup(Listener *listener, std::string &ip, uint16_t port,
+			const Options &options);
+	UdpServerGroup& operator=(const UdpServerGroup&) = delete;
+	UdpServerGroup(const UdpServerGroup&) = delete;
+	virtual ~UdpServerGroup();
+
+public:
+	void Close();
+	virtual void Dump() const;
+	uint16_t GetLocalPort() const;
+	size_t GetNumWorkers() const;
+
+private:
+	void AttachSteeringProgram(int fd, int family);
+	void StopWorkers();
+
+	/* Callbacks fired by UV events. */
+public:
+	void OnUvStop(Worker *worker);
+
+private:
+	// Passed by argument.
+	Listener *listener { nullptr };
+	Options options;
+	// Allocated by this.
+	std::vector<Worker*> workers;
+	// Others.
+	uint16_t localPort { 0 };
+	bool closed { false };
+};
+
+/* Inline methods. */
+
+inline uint16_t UdpServerGroup::GetLocalPort() const {
+	return this->localPort;
+}
+
+inline size_t UdpServerGroup::GetNumWorkers() const {
+	return this->workers.size();
+}
+
+#endif
@@ -9,7 +9,8 @@
 /* Static. */
 
 static constexpr size_t ReadBufferSize { 65536 };
-static uint8_t ReadBuffer[ReadBufferSize];
+// Per thread, as each thread runs its own loop.
+static thread_local uint8_t ReadBuffer[ReadBufferSize];
 
 /* Static methods for UV callbacks. */
 
@@ -103,8 +104,8 @@ void UdpSocket::Close() {
 
 void UdpSocket::Dump() const {
 	UV_DUMP("<UdpSocket>");
-	UV_DUMP("  localIp   : %s", this->localIp.c_str());
-	UV_DUMP("  localPort : %d", static_cast<uint16_t>(this->localPort));
+	UV_DUMP("  localIp   : %s", this->localAddress.GetIp());
+	UV_DUMP("  localPort : %d", this->localAddress.GetPort());
 	UV_DUMP("  closed    : %s", !this->closed ? "open" : "closed");
 	UV_DUMP("</UdpSocket>");
 }
@@ -206,10 +207,11 @@ void UdpSocket::Send(const uint8_t *data, size_t len,
 bool UdpSocket::SetLocalAddress() {
 
 	int err;
-	int len = sizeof(this->localAddr);
+	struct sockaddr_storage localAddr;
+	int len = sizeof(localAddr);
 
 	err = uv_udp_getsockname(this->uvHandle,
-			reinterpret_cast<struct sockaddr*>(&this->localAddr), &len);
+			reinterpret_cast<struct sockaddr*>(&localAddr), &len);
 
 	if (err != 0) {
 		UV_ERROR("uv_udp_getsockname() failed: %s", uv_strerror(err));
@@ -217,57 +219,7 @@ bool UdpSocket::SetLocalAddress() {
 		return false;
 	}
 
-	int family;
-
-	GetAddressInfo(
-			reinterpret_cast<const struct sockaddr*>(&this->localAddr), family,
-			this->localIp, this->localPort);
-
-	return true;
-}
-
-
-void UdpSocket::GetAddressInfo(const struct sockaddr* addr, int& family, std::string& ip, uint16_t& port) {
-
-	char ipBuffer[INET6_ADDRSTRLEN] = { 0 };
-	int err;
-
-	switch (addr->sa_family)
-	{
-		case AF_INET:
-		{
-			err = uv_inet_ntop(
-				AF_INET, std::addressof(reinterpret_cast<const struct sockaddr_in*>(addr)->sin_addr), ipBuffer, sizeof(ipBuffer));
-
-			if (err)
-				UV_ABORT("uv_inet_ntop() failed: %s", uv_strerror(err));
-
-			port = static_cast<uint16_t>(ntohs(reinterpret_cast<const struct sockaddr_in*>(addr)->sin_port));
-
-			break;
-		}
-
-		case AF_INET6:
-		{
-			err = uv_inet_ntop(
-				AF_INET6, std::addressof(reinterpret_cast<const struct sockaddr_in6*>(addr)->sin6_addr), ipBuffer, sizeof(ipBuffer));
-
-			if (err)
-				UV_ABORT("uv_inet_ntop() failed: %s", uv_strerror(err));
-
-			port = static_cast<uint16_t>(ntohs(reinterpret_cast<const struct sockaddr_in6*>(addr)->sin6_port));
-
-			break;
-		}
-
-		default:
-		{
-			UV_ABORT("unknown network family: %d", static_cast<int>(addr->sa_family));
-		}
-	}
-
-	family = addr->sa_family;
-	ip.assign(ipBuffer);
+	return this->localAddress.Set(reinterpret_cast<struct sockaddr*>(&localAddr));
 }
 
 inline void UdpSocket::OnUvRecvAlloc(size_t /*suggestedSize*/, uv_buf_t *buf) {
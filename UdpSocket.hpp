@@ -5,6 +5,7 @@
 #include <uv.h>
 #include <string>
 #include <functional>
+#include "SocketAddress.hpp"
 class UdpSocket {
 protected:
 	using onSendCallback = const std::function<void(bool sent)>;
@@ -43,16 +44,16 @@ public:
 	virtual void Dump() const;
 	void Send(const uint8_t *data, size_t len, const struct sockaddr *addr,
 			UdpSocket::onSendCallback *cb);
+	const SocketAddress& GetLocalSocketAddress() const;
 	const struct sockaddr* GetLocalAddress() const;
 	int GetLocalFamily() const;
-	const std::string& GetLocalIp() const;
+	std::string GetLocalIp() const;
 	uint16_t GetLocalPort() const;
 	size_t GetRecvBytes() const;
 	size_t GetSentBytes() const;
 
 private:
 	bool SetLocalAddress();
-	void GetAddressInfo(const struct sockaddr* addr, int& family, std::string& ip, uint16_t& port);
 	/* Callbacks fired by UV events. */
 public:
 	void OnUvRecvAlloc(size_t suggestedSize, uv_buf_t *buf);
@@ -66,9 +67,7 @@ protected:
 			const struct sockaddr *addr) = 0;
 
 protected:
-	struct sockaddr_storage localAddr;
-	std::string localIp;
-	uint16_t localPort { 0 };
+	SocketAddress localAddress;
 
 private:
 	// Allocated by this (may be passed by argument).
@@ -81,20 +80,24 @@ private:
 
 /* Inline methods. */
 
+inline const SocketAddress& UdpSocket::GetLocalSocketAddress() const {
+	return this->localAddress;
+}
+
 inline const struct sockaddr* UdpSocket::GetLocalAddress() const {
-	return reinterpret_cast<const struct sockaddr*>(&this->localAddr);
+	return this->localAddress.GetSockAddr();
 }
 
 inline int UdpSocket::GetLocalFamily() const {
-	return reinterpret_cast<const struct sockaddr*>(&this->localAddr)->sa_family;
+	return this->localAddress.GetFamily();
 }
 
-inline const std::string& UdpSocket::GetLocalIp() const {
-	return this->localIp;
+inline std::string UdpSocket::GetLocalIp() const {
+	return std::string(this->localAddress.GetIp(), this->localAddress.GetIpLen());
 }
 
 inline uint16_t UdpSocket::GetLocalPort() const {
-	return this->localPort;
+	return this->localAddress.GetPort();
 }
 
 inline size_t UdpSocket::GetRecvBytes() const {
@@ -9,7 +9,15 @@
 #include "UnixStreamSocket.hpp"
 #include "DepLibUV.hpp"
 #include "Logger.hpp"
-#include <cstring> // std::memcpy()
+#include "LibUVErrors.hpp"
+#include <cerrno>
+#include <cstdint> // UINT32_MAX
+#include <cstring> // std::memcpy(), std::strerror()
+#include <fcntl.h> // fcntl()
+
+// Digits of the longest netstring length.
+static constexpr size_t MaxNetstringDigits { 10 };
+static constexpr uint64_t MaxNetstringLength { 9999999999 };
 
 /* Static methods for UV callbacks. */
 
@@ -34,6 +42,9 @@ inline static void onWrite(uv_write_t *req, int status) {
 	auto *handle = req->handle;
 	auto *socket = static_cast<UnixStreamSocket*>(handle->data);
 
+	if (writeData->cb)
+		(*writeData->cb)(status == 0);
+
 	// Just notify the UnixStreamSocket when error.
 	if (socket && status != 0)
 		socket->OnUvWriteError(status);
@@ -46,6 +57,13 @@ inline static void onClose(uv_handle_t *handle) {
 	delete handle;
 }
 
+inline static void onPrepare(uv_prepare_t *handle) {
+	auto *socket = static_cast<UnixStreamSocket*>(handle->data);
+
+	if (socket)
+		socket->OnUvPrepare();
+}
+
 inline static void onShutdown(uv_shutdown_t *req, int /*status*/) {
 	auto *handle = req->handle;
 
@@ -58,16 +76,21 @@ inline static void onShutdown(uv_shutdown_t *req, int /*status*/) {
 
 /* Instance methods. */
 
+/**
+ * With ipc the peer must also be in IPC mode, see WriteHandle().
+ */
 UnixStreamSocket::UnixStreamSocket(int fd, size_t bufferSize,
-		UnixStreamSocket::Role role) :
-		bufferSize(bufferSize), role(role) {
+		UnixStreamSocket::Role role, bool ipc) :
+		ipc(ipc), bufferSize(bufferSize), role(role) {
 
 	int err;
 
+	this->baseBufferSize = bufferSize;
+
 	this->uvHandle = new uv_pipe_t;
 	this->uvHandle->data = static_cast<void*>(this);
 
-	err = uv_pipe_init(DepLibUV::GetLoop(), this->uvHandle, 0);
+	err = uv_pipe_init(DepLibUV::GetLoop(), this->uvHandle, ipc ? 1 : 0);
 
 	if (err != 0) {
 		delete this->uvHandle;
@@ -115,10 +138,38 @@ void UnixStreamSocket::Close() {
 	if (this->closed)
 		return;
 
+	// Send the batch first, unless the socket failed. If writing it fails the
+	// socket is just closed below, the subclass is not notified.
+	if (!this->hasError && !this->isClosedByPeer) {
+		this->closing = true;
+
+		FlushBatch();
+
+		this->closing = false;
+	}
+
 	int err;
 
 	this->closed = true;
 
+	for (auto *cb : this->batchCallbacks) {
+		(*cb)(false);
+
+		delete cb;
+	}
+
+	this->batch.clear();
+	this->batchCallbacks.clear();
+
+	if (this->uvPrepareHandle != nullptr) {
+		this->uvPrepareHandle->data = nullptr;
+
+		uv_close(reinterpret_cast<uv_handle_t*>(this->uvPrepareHandle),
+				static_cast<uv_close_cb>(onClose));
+
+		this->uvPrepareHandle = nullptr;
+	}
+
 	// Tell the UV handle that the UnixStreamSocket has been closed.
 	this->uvHandle->data = nullptr;
 
@@ -148,24 +199,145 @@ void UnixStreamSocket::Close() {
 	}
 }
 
-void UnixStreamSocket::Write(const uint8_t *data, size_t len) {
-	if (this->closed)
+void UnixStreamSocket::Write(const uint8_t *data, size_t len,
+		onWriteCallback *cb) {
+
+	uv_buf_t buffer = uv_buf_init(
+			reinterpret_cast<char*>(const_cast<uint8_t*>(data)), len);
+
+	Write(&buffer, 1, cb);
+}
+
+/**
+ * Writes data as one message with the framing set by SetFraming(), sending
+ * the framing along with the data (no copy). A message longer than
+ * maxMessageSize, which the peer would reject, is not sent and cb is called
+ * with false.
+ */
+void UnixStreamSocket::WriteMessage(const uint8_t *data, size_t len,
+		onWriteCallback *cb) {
+
+	// Room for "<length>:" and the snprintf() null.
+	uint8_t header[MaxNetstringDigits + 2];
+	size_t headerLen { 0 };
+	uv_buf_t buffers[3];
+	size_t numBuffers { 2 };
+
+	// Nor one whose length does not fit the header.
+	if (this->framing != Framing::NONE
+			&& (len > this->maxMessageSize
+					|| (this->framing == Framing::NETSTRING
+							&& static_cast<uint64_t>(len) > MaxNetstringLength)
+					|| (this->framing == Framing::LENGTH_PREFIX
+							&& static_cast<uint64_t>(len) > UINT32_MAX))) {
+		UV_ERROR_STD("message too big (%zu bytes), not sent", len);
+
+		if (cb) {
+			(*cb)(false);
+
+			delete cb;
+		}
+
 		return;
+	}
+
+	switch (this->framing) {
+	case Framing::NETSTRING:
+		headerLen = static_cast<size_t>(std::snprintf(
+				reinterpret_cast<char*>(header), sizeof(header), "%zu:", len));
+		buffers[2] = uv_buf_init(const_cast<char*>(","), 1);
+		numBuffers = 3;
+		break;
+
+	case Framing::LENGTH_PREFIX:
+		header[0] = static_cast<uint8_t>(len >> 24);
+		header[1] = static_cast<uint8_t>(len >> 16);
+		header[2] = static_cast<uint8_t>(len >> 8);
+		header[3] = static_cast<uint8_t>(len);
+		headerLen = 4;
+		break;
+
+	case Framing::NONE:
+		Write(data, len, cb);
 
-	if (len == 0)
 		return;
+	}
+
+	buffers[0] = uv_buf_init(reinterpret_cast<char*>(header), headerLen);
+	buffers[1] = uv_buf_init(reinterpret_cast<char*>(const_cast<uint8_t*>(data)),
+			len);
+
+	Write(buffers, numBuffers, cb);
+}
+
+/**
+ * Writes the buffers in order as a single write (iovec). When batching they
+ * are copied into the batch instead, see SetBatching(). cb is called with
+ * whether all the data was written.
+ */
+void UnixStreamSocket::Write(const uv_buf_t *buffers, size_t numBuffers,
+		onWriteCallback *cb) {
+
+	size_t totalLen { 0 };
+
+	for (size_t i = 0; i < numBuffers; ++i)
+		totalLen += buffers[i].len;
+
+	if (this->closed || totalLen == 0) {
+		if (cb) {
+			(*cb)(false);
+
+			delete cb;
+		}
+
+		return;
+	}
+
+	if (this->batching) {
+		for (size_t i = 0; i < numBuffers; ++i) {
+			auto *base = reinterpret_cast<const uint8_t*>(buffers[i].base);
+
+			this->batch.insert(this->batch.end(), base, base + buffers[i].len);
+		}
+
+		if (cb)
+			this->batchCallbacks.push_back(cb);
+
+		if (this->batch.size() >= this->maxBatchSize)
+			FlushBatch();
+		else if (!uv_is_active(reinterpret_cast<uv_handle_t*>(this->uvPrepareHandle)))
+			uv_prepare_start(this->uvPrepareHandle,
+					static_cast<uv_prepare_cb>(onPrepare));
+
+		return;
+	}
+
+	WriteBuffers(buffers, numBuffers, totalLen, cb);
+}
+
+/**
+ * Writes the buffers right away. If it fails the socket is closed and the
+ * subclass notified (which may delete this), unless called from Close(), and
+ * false is returned.
+ */
+bool UnixStreamSocket::WriteBuffers(const uv_buf_t *buffers,
+		size_t numBuffers, size_t totalLen, onWriteCallback *cb) {
 
 	// First try uv_try_write(). In case it can not directly send all the given data
 	// then build a uv_req_t and use uv_write().
 
-	uv_buf_t buffer = uv_buf_init(
-			reinterpret_cast<char*>(const_cast<uint8_t*>(data)), len);
 	int written = uv_try_write(reinterpret_cast<uv_stream_t*>(this->uvHandle),
-			&buffer, 1);
+			buffers, numBuffers);
 
 	// All the data was written. Done.
-	if (written == static_cast<int>(len)) {
-		return;
+	if (written == static_cast<int>(totalLen)) {
+		if (cb) {
+			(*cb)(true);
+
+			delete cb;
+		}
+
+		return true;
 	}
 	// Cannot write any data at first time. Use uv_write().
 	else if (written == UV_EAGAIN || written == UV_ENOSYS) {
@@ -177,21 +349,53 @@ void UnixStreamSocket::Write(const uint8_t *data, size_t len) {
 		UV_ERROR_STD("uv_try_write() failed, closing the socket: %s",
 				uv_strerror(written));
 
+		if (cb) {
+			(*cb)(false);
+
+			delete cb;
+		}
+
+		// Flushing the batch from Close(), which closes the socket.
+		if (this->closing) {
+			this->hasError = true;
+
+			return false;
+		}
+
 		Close();
 
 		// Notify the subclass.
 		UserOnUnixStreamSocketClosed();
 
-		return;
+		return false;
 	}
 
-	size_t pendingLen = len - written;
+	size_t pendingLen = totalLen - written;
 	auto *writeData = new UvWriteData(pendingLen);
+	size_t skip = static_cast<size_t>(written);
+	size_t storeLen { 0 };
 
 	writeData->req.data = static_cast<void*>(writeData);
-	std::memcpy(writeData->store, data + written, pendingLen);
+	writeData->cb = cb;
+
+	// Copy what was not written, skipping the written bytes.
+	for (size_t i = 0; i < numBuffers; ++i) {
+		size_t len = buffers[i].len;
+
+		if (skip >= len) {
+			skip -= len;
+
+			continue;
+		}
+
+		std::memcpy(writeData->store + storeLen, buffers[i].base + skip,
+				len - skip);
+		storeLen += len - skip;
+		skip = 0;
+	}
 
-	buffer = uv_buf_init(reinterpret_cast<char*>(writeData->store), pendingLen);
+	uv_buf_t buffer = uv_buf_init(reinterpret_cast<char*>(writeData->store),
+			pendingLen);
 
 	int err = uv_write(&writeData->req,
 			reinterpret_cast<uv_stream_t*>(this->uvHandle), &buffer, 1,
@@ -200,9 +404,250 @@ void UnixStreamSocket::Write(const uint8_t *data, size_t len) {
 	if (err != 0) {
 		UV_ERROR_STD("uv_write() failed: %s", uv_strerror(err));
 
+		if (writeData->cb)
+			(*writeData->cb)(false);
+
 		// Delete the UvSendData struct.
 		delete writeData;
 	}
+
+	return true;
+}
+
+/**
+ * In batching mode the written data is gathered and sent with one write per
+ * loop iteration (from a uv_prepare_t, before the loop polls) or as soon as
+ * maxBatchSize bytes are gathered, so many small messages cost one syscall.
+ * Disabling it flushes the batch.
+ */
+void UnixStreamSocket::SetBatching(bool enabled, size_t maxBatchSize) {
+
+	if (this->closed)
+		return;
+
+	this->maxBatchSize = maxBatchSize;
+
+	if (enabled == this->batching)
+		return;
+
+	if (!enabled) {
+		this->batching = false;
+
+		FlushBatch();
+
+		return;
+	}
+
+	if (this->uvPrepareHandle == nullptr) {
+		this->uvPrepareHandle = new uv_prepare_t;
+		this->uvPrepareHandle->data = static_cast<void*>(this);
+
+		int err = uv_prepare_init(DepLibUV::GetLoop(), this->uvPrepareHandle);
+
+		if (err != 0) {
+			delete this->uvPrepareHandle;
+			this->uvPrepareHandle = nullptr;
+
+			UV_THROW_ERROR_STD("uv_prepare_init() failed: %s", uv_strerror(err));
+		}
+	}
+
+	this->batching = true;
+}
+
+/**
+ * With a framing the consumer gets each message with
+ * UserOnUnixStreamMessage() instead of UserOnUnixStreamRead(), as a view into
+ * the buffer, and the producer sends them with WriteMessage(). A message
+ * bigger than the buffer grows it, up to maxMessageSize, and a bigger or
+ * malformed one closes the socket.
+ */
+void UnixStreamSocket::SetFraming(Framing framing, size_t maxMessageSize) {
+	this->framing = framing;
+	this->maxMessageSize = maxMessageSize;
+}
+
+/**
+ * Writes the batch now. Returns false if that failed, closing the socket (see
+ * WriteBuffers()).
+ */
+bool UnixStreamSocket::FlushBatch() {
+
+	// Also when batching has just been disabled.
+	if (this->batch.empty())
+		return true;
+
+	uv_prepare_stop(this->uvPrepareHandle);
+
+	std::vector<uint8_t> data;
+	std::vector<onWriteCallback*> callbacks;
+	onWriteCallback *cb { nullptr };
+
+	data.swap(this->batch);
+	callbacks.swap(this->batchCallbacks);
+
+	if (!callbacks.empty()) {
+		// Call all the callbacks of the batch once written.
+		cb = new onWriteCallback([callbacks](bool written) {
+			for (auto *callback : callbacks) {
+				(*callback)(written);
+
+				delete callback;
+			}
+		});
+	}
+
+	uv_buf_t buffer = uv_buf_init(reinterpret_cast<char*>(data.data()),
+			data.size());
+
+	// Directly, not into the batch again. This may be deleted afterwards.
+	return WriteBuffers(&buffer, 1, data.size(), cb);
+}
+
+/**
+ * Sends the data (at least one byte) along with the socket of the given TCP,
+ * UDP or pipe handle (IPC mode only). The peer gets a new fd for the same
+ * socket, see AcceptHandleFd(). The handle must be kept open until cb is
+ * called.
+ */
+void UnixStreamSocket::WriteHandle(const uint8_t *data, size_t len,
+		uv_handle_t *handle, onWriteCallback *cb) {
+
+	if (this->closed || !this->ipc || len == 0) {
+		if (cb) {
+			(*cb)(false);
+
+			delete cb;
+		}
+
+		if (!this->ipc)
+			UV_THROW_ERROR_STD("not in IPC mode");
+
+		return;
+	}
+
+	// Keep the order of the batched data. If that fails this is closed and
+	// may have been deleted.
+	if (!FlushBatch()) {
+		if (cb) {
+			(*cb)(false);
+
+			delete cb;
+		}
+
+		return;
+	}
+
+	auto *writeData = new UvWriteData(len);
+
+	writeData->req.data = static_cast<void*>(writeData);
+	writeData->cb = cb;
+	std::memcpy(writeData->store, data, len);
+
+	uv_buf_t buffer = uv_buf_init(reinterpret_cast<char*>(writeData->store), len);
+
+	int err = uv_write2(&writeData->req,
+			reinterpret_cast<uv_stream_t*>(this->uvHandle), &buffer, 1,
+			reinterpret_cast<uv_stream_t*>(handle),
+			static_cast<uv_write_cb>(onWrite));
+
+	if (err != 0) {
+		UV_ERROR_STD("uv_write2() failed: %s", uv_strerror(err));
+
+		if (writeData->cb)
+			(*writeData->cb)(false);
+
+		delete writeData;
+	}
+}
+
+/**
+ * Number of received handles not accepted yet. They come with the data read
+ * so this is to be checked in UserOnUnixStreamRead().
+ */
+size_t UnixStreamSocket::GetPendingHandleCount() const {
+
+	if (this->closed || !this->ipc)
+		return 0;
+
+	return static_cast<size_t>(uv_pipe_pending_count(this->uvHandle));
+}
+
+/**
+ * Takes the next received handle, returning a new fd (owned by the caller)
+ * for its socket and setting its type (UV_TCP, UV_UDP or UV_NAMED_PIPE). A TCP
+ * fd may be given to TcpServer(int fd, int backlog) if listening or to
+ * TcpServer::AdoptConnection() if connected. Throws if there is none.
+ */
+int UnixStreamSocket::AcceptHandleFd(uv_handle_type *type) {
+
+	if (GetPendingHandleCount() == 0)
+		UV_THROW_ERROR_STD("no pending handle");
+
+	*type = uv_pipe_pending_type(this->uvHandle);
+
+	uv_handle_t *handle;
+	int err;
+
+	switch (*type) {
+	case UV_TCP:
+		handle = reinterpret_cast<uv_handle_t*>(new uv_tcp_t);
+		err = uv_tcp_init(DepLibUV::GetLoop(),
+				reinterpret_cast<uv_tcp_t*>(handle));
+		break;
+
+	case UV_UDP:
+		handle = reinterpret_cast<uv_handle_t*>(new uv_udp_t);
+		err = uv_udp_init(DepLibUV::GetLoop(),
+				reinterpret_cast<uv_udp_t*>(handle));
+		break;
+
+	case UV_NAMED_PIPE:
+		handle = reinterpret_cast<uv_handle_t*>(new uv_pipe_t);
+		err = uv_pipe_init(DepLibUV::GetLoop(),
+				reinterpret_cast<uv_pipe_t*>(handle), 0);
+		break;
+
+	default:
+		UV_THROW_ERROR_STD("unexpected pending handle type %d",
+				static_cast<int>(*type));
+	}
+
+	if (err != 0) {
+		delete handle;
+
+		UV_THROW_ERROR_STD("handle init failed: %s", uv_strerror(err));
+	}
+
+	// libuv takes the received fd here, as the socket of the handle.
+	err = uv_accept(reinterpret_cast<uv_stream_t*>(this->uvHandle),
+			reinterpret_cast<uv_stream_t*>(handle));
+
+	int fd { -1 };
+	int error { 0 };
+
+	if (err == 0) {
+		uv_os_fd_t handleFd;
+
+		err = uv_fileno(handle, &handleFd);
+
+		// Keep our own fd, the one of the handle is closed with it.
+		if (err == 0) {
+			fd = fcntl(handleFd, F_DUPFD_CLOEXEC, 0);
+			error = errno;
+		}
+	}
+
+	uv_close(handle, static_cast<uv_close_cb>(onClose));
+
+	if (err != 0)
+		UV_THROW_ERROR_STD("uv_accept() failed: %s", uv_strerror(err));
+
+	if (fd == -1)
+		UV_THROW_ERROR_STD("fcntl(F_DUPFD_CLOEXEC) failed: %s",
+				std::strerror(error));
+
+	return fd;
 }
 
 inline void UnixStreamSocket::OnUvReadAlloc(size_t /*suggestedSize*/,
@@ -212,6 +657,17 @@ inline void UnixStreamSocket::OnUvReadAlloc(size_t /*suggestedSize*/,
 	if (this->buffer == nullptr)
 		this->buffer = new uint8_t[this->bufferSize];
 
+	// Move the unfinished message to the start of the buffer, only once the
+	// remaining space gets short.
+	if (this->bufferReadPos != 0
+			&& this->bufferSize - this->bufferDataLen < this->bufferSize / 2) {
+		std::memmove(this->buffer, this->buffer + this->bufferReadPos,
+				this->bufferDataLen - this->bufferReadPos);
+
+		this->bufferDataLen -= this->bufferReadPos;
+		this->bufferReadPos = 0;
+	}
+
 	// Tell UV to write after the last data byte in the buffer.
 	buf->base = reinterpret_cast<char*>(this->buffer + this->bufferDataLen);
 
@@ -235,6 +691,12 @@ inline void UnixStreamSocket::OnUvRead(ssize_t nread, const uv_buf_t* /*buf*/) {
 		// Update the buffer data length.
 		this->bufferDataLen += static_cast<size_t>(nread);
 
+		if (this->framing != Framing::NONE) {
+			ReadMessages();
+
+			return;
+		}
+
 		// Notify the subclass.
 		UserOnUnixStreamRead();
 	}
@@ -262,6 +724,124 @@ inline void UnixStreamSocket::OnUvRead(ssize_t nread, const uv_buf_t* /*buf*/) {
 	}
 }
 
+/**
+ * Notifies each complete message in the buffer, then keeps the unfinished one
+ * (from bufferReadPos) until more data comes.
+ */
+void UnixStreamSocket::ReadMessages() {
+
+	while (!this->closed) {
+		const uint8_t *data = this->buffer + this->bufferReadPos;
+		size_t dataLen = this->bufferDataLen - this->bufferReadPos;
+		size_t headerLen { 0 };
+		size_t trailerLen { 0 };
+		size_t messageLen { 0 };
+
+		if (this->framing == Framing::NETSTRING) {
+			// Parse "<length>:".
+			while (headerLen < dataLen && data[headerLen] >= '0'
+					&& data[headerLen] <= '9' && headerLen < MaxNetstringDigits) {
+				messageLen = messageLen * 10 + (data[headerLen] - '0');
+				headerLen++;
+			}
+
+			if (headerLen == dataLen) {
+				headerLen = 0;
+			} else if (headerLen == 0 || data[headerLen] != ':'
+					|| (data[0] == '0' && headerLen > 1)) {
+				OnFramingError("invalid netstring length");
+
+				return;
+			} else {
+				headerLen++;
+				trailerLen = 1;
+			}
+		} else if (dataLen >= 4) {
+			messageLen = (static_cast<size_t>(data[0]) << 24)
+					| (static_cast<size_t>(data[1]) << 16)
+					| (static_cast<size_t>(data[2]) << 8)
+					| static_cast<size_t>(data[3]);
+			headerLen = 4;
+		}
+
+		// Header not complete yet.
+		if (headerLen == 0) {
+			if (this->bufferReadPos == 0 && this->bufferDataLen == this->bufferSize)
+				OnFramingError("no available space in the buffer for the length");
+
+			break;
+		}
+
+		if (messageLen > this->maxMessageSize) {
+			OnFramingError("message too big");
+
+			return;
+		}
+
+		size_t frameLen = headerLen + messageLen + trailerLen;
+
+		// Message not complete yet. Make room for it if it is that big.
+		if (dataLen < frameLen) {
+			if (frameLen > this->bufferSize) {
+				auto *buffer = new uint8_t[frameLen];
+
+				std::memcpy(buffer, data, dataLen);
+
+				delete[] this->buffer;
+
+				this->buffer = buffer;
+				this->bufferSize = frameLen;
+				this->bufferDataLen = dataLen;
+				this->bufferReadPos = 0;
+			}
+
+			break;
+		}
+
+		if (trailerLen != 0 && data[frameLen - 1] != ',') {
+			OnFramingError("invalid netstring end");
+
+			return;
+		}
+
+		this->bufferReadPos += frameLen;
+
+		// Notify the subclass.
+		UserOnUnixStreamMessage(data + headerLen, messageLen);
+	}
+
+	if (this->closed || this->bufferReadPos != this->bufferDataLen)
+		return;
+
+	// All read, no need to move anything.
+	this->bufferReadPos = 0;
+	this->bufferDataLen = 0;
+
+	// Back to the given size after a big message.
+	if (this->bufferSize != this->baseBufferSize) {
+		delete[] this->buffer;
+
+		this->buffer = nullptr;
+		this->bufferSize = this->baseBufferSize;
+	}
+}
+
+inline void UnixStreamSocket::OnFramingError(const char *error) {
+	UV_ERROR_STD("%s, closing the pipe", error);
+
+	this->hasError = true;
+
+	// Close the socket.
+	Close();
+
+	// Notify the subclass.
+	UserOnUnixStreamSocketClosed();
+}
+
+inline void UnixStreamSocket::OnUvPrepare() {
+	FlushBatch();
+}
+
 inline void UnixStreamSocket::OnUvWriteError(int error) {
 	if (error != UV_EPIPE && error != UV_ENOTCONN)
 		this->hasError = true;
@@ -2,10 +2,20 @@
 #define MS_UNIX_STREAM_SOCKET_HPP
 
 #include <uv.h>
+#include <functional>
 #include <string>
-
+#include <vector>
+
+/**
+ * Stream over a Unix socket. In IPC mode socket handles (their fds, with
+ * SCM_RIGHTS) can be sent along with the data, e.g. to hand the listening
+ * socket of a TcpServer over to a new process. Small writes can be batched
+ * into one write per loop iteration, see SetBatching().
+ */
 class UnixStreamSocket {
 public:
+	using onWriteCallback = const std::function<void(bool written)>;
+
 	/* Struct for the data field of uv_req_t when writing data. */
 	struct UvWriteData {
 		explicit UvWriteData(size_t storeSize) {
@@ -17,18 +27,25 @@ public:
 
 		~UvWriteData() {
 			delete[] this->store;
+			delete this->cb;
 		}
 
 		uv_write_t req;
 		uint8_t *store { nullptr };
+		onWriteCallback *cb { nullptr };
 	};
 
 	enum class Role {
 		PRODUCER = 1, CONSUMER
 	};
 
+	enum class Framing {
+		NONE = 0, NETSTRING, LENGTH_PREFIX
+	};
+
 public:
-	UnixStreamSocket(int fd, size_t bufferSize, UnixStreamSocket::Role role);
+	UnixStreamSocket(int fd, size_t bufferSize, UnixStreamSocket::Role role,
+			bool ipc = false);
 	UnixStreamSocket& operator=(const UnixStreamSocket&) = delete;
 	UnixStreamSocket(const UnixStreamSocket&) = delete;
 	virtual ~UnixStreamSocket();
@@ -36,13 +53,26 @@ public:
 public:
 	void Close();
 	bool IsClosed() const;
-	void Write(const uint8_t *data, size_t len);
-	void Write(const std::string &data);
+	void Write(const uint8_t *data, size_t len, onWriteCallback *cb = nullptr);
+	void Write(const std::string &data, onWriteCallback *cb = nullptr);
+	void Write(const uv_buf_t *buffers, size_t numBuffers,
+			onWriteCallback *cb = nullptr);
+	void WriteMessage(const uint8_t *data, size_t len,
+			onWriteCallback *cb = nullptr);
+	void SetBatching(bool enabled, size_t maxBatchSize = 65536);
+	bool IsBatching() const;
+	bool FlushBatch();
+	void SetFraming(Framing framing, size_t maxMessageSize = 4194304);
+	void WriteHandle(const uint8_t *data, size_t len, uv_handle_t *handle,
+			onWriteCallback *cb = nullptr);
+	size_t GetPendingHandleCount() const;
+	int AcceptHandleFd(uv_handle_type *type);
 
 	/* Callbacks fired by UV events. */
 public:
 	void OnUvReadAlloc(size_t suggestedSize, uv_buf_t *buf);
 	void OnUvRead(ssize_t nread, const uv_buf_t *buf);
+	void OnUvPrepare();
 	void OnUvWriteError(int error);
 
 	/* Pure virtual methods that must be implemented by the subclass. */
@@ -50,11 +80,36 @@ protected:
 	virtual void UserOnUnixStreamRead() = 0;
 	virtual void UserOnUnixStreamSocketClosed() = 0;
 
+	/* Virtual methods that may be implemented by the subclass. */
+protected:
+	// With a framing, see SetFraming(). data is valid during the call only.
+	virtual void UserOnUnixStreamMessage(const uint8_t* /*data*/,
+			size_t /*len*/) {
+	}
+
+private:
+	bool WriteBuffers(const uv_buf_t *buffers, size_t numBuffers,
+			size_t totalLen, onWriteCallback *cb);
+	void ReadMessages();
+	void OnFramingError(const char *error);
+
 private:
 	// Allocated by this.
 	uv_pipe_t *uvHandle { nullptr };
+	uv_prepare_t *uvPrepareHandle { nullptr };
+	// Data and callbacks of the writes not sent yet when batching.
+	std::vector<uint8_t> batch;
+	std::vector<onWriteCallback*> batchCallbacks;
 	// Others.
 	bool closed { false };
+	// Set while Close() flushes the batch.
+	bool closing { false };
+	bool ipc { false };
+	bool batching { false };
+	size_t maxBatchSize { 65536 };
+	Framing framing { Framing::NONE };
+	size_t maxMessageSize { 4194304 };
+	size_t baseBufferSize { 0 };
 	bool isClosedByPeer { false };
 	bool hasError { false };
 
@@ -66,6 +121,8 @@ protected:
 	uint8_t *buffer { nullptr };
 	// Others.
 	size_t bufferDataLen { 0 };
+	// Start of the message being read when framing.
+	size_t bufferReadPos { 0 };
 };
 
 /* Inline methods. */
@@ -74,8 +131,13 @@ inline bool UnixStreamSocket::IsClosed() const {
 	return this->closed;
 }
 
-inline void UnixStreamSocket::Write(const std::string &data) {
-	Write(reinterpret_cast<const uint8_t*>(data.c_str()), data.size());
+inline void UnixStreamSocket::Write(const std::string &data,
+		onWriteCallback *cb) {
+	Write(reinterpret_cast<const uint8_t*>(data.c_str()), data.size(), cb);
+}
+
+inline bool UnixStreamSocket::IsBatching() const {
+	return this->batching;
 }
 
 #endif
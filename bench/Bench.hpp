@@ -0,0 +1,453 @@
+#ifndef MS_BENCH_HPP
+#define MS_BENCH_HPP
+
+#include <uv.h> // uv_version_string()
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm> // std::min(), std::max()
+#include <cmath> // std::sqrt(), std::pow()
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * Minimal benchmark harness. Each bench_X.cpp registers a function with
+ * BENCH(), which runs its cases and reports them with Report(). Results are
+ * printed as a table and, with --json=FILE, written in the JSON format of
+ * Google Benchmark so its tools (e.g. compare.py) can track them:
+ *
+ *   ./bench_uvutils [--filter=SUBSTRING] [--quick] [--json=FILE|-]
+ *
+ * --quick runs smaller cases, e.g. in CI.
+ */
+class Bench {
+public:
+	using Function = void (*)(Bench &bench);
+
+	/* One case, a "benchmarks" entry in the JSON output. */
+	struct Result {
+		Result& Counter(const std::string &name, double value) {
+			this->counters.emplace_back(name, value);
+
+			return *this;
+		}
+
+		std::string name;
+		uint64_t iterations { 0 };
+		// Per iteration.
+		double realTimeNs { 0 };
+		double cpuTimeNs { 0 };
+		// Written as extra keys, like Google Benchmark user counters.
+		std::vector<std::pair<std::string, double>> counters;
+		// Set if skipped.
+		std::string error;
+	};
+
+public:
+	static bool Register(const char *name, Function fn);
+	static int Main(int argc, char *argv[]);
+	static uint64_t GetCpuTimeNs();
+
+public:
+	bool IsQuick() const;
+	Result& Report(const std::string &name, uint64_t iterations,
+			uint64_t elapsedNs, uint64_t cpuNs);
+	void Skip(const std::string &name, const std::string &reason);
+
+private:
+	static std::vector<std::pair<std::string, Function>>& GetRegistry();
+	static void PrintResult(FILE *out, const Result &result);
+	static bool WriteJson(FILE *out, bool quick,
+			const std::vector<Result> &results);
+
+private:
+	void PrintResults();
+
+private:
+	bool quick { false };
+	FILE *out { stdout };
+	std::vector<Result> results;
+	size_t numPrinted { 0 };
+};
+
+#define BENCH(fn) static bool benchRegistered_##fn = Bench::Register(#fn, fn)
+
+/**
+ * Latency histogram with log-linear buckets: 64 per power of two, so values
+ * (ns) are within 1.6% whatever their magnitude, in fixed memory.
+ */
+class Histogram {
+private:
+	static constexpr unsigned SubBucketBits { 6 };
+	static constexpr uint64_t SubBucketCount { 1u << SubBucketBits };
+	static constexpr size_t NumBuckets { (64 - SubBucketBits + 1)
+			<< SubBucketBits };
+
+public:
+	Histogram() : buckets(NumBuckets, 0) {}
+
+public:
+	void Record(uint64_t value);
+	uint64_t GetCount() const;
+	uint64_t GetMin() const;
+	uint64_t GetMax() const;
+	double GetMean() const;
+	double GetStdDeviation() const;
+	uint64_t GetPercentile(double percentile) const;
+	// Adds the percentiles (p50, p90, p99, p999), mean and max in ns.
+	void AddCounters(Bench::Result &result) const;
+	void PrintPercentileDistribution(FILE *out, double scale) const;
+
+private:
+	static size_t GetIndex(uint64_t value);
+	static uint64_t GetValue(size_t index);
+	uint64_t FindPercentile(double percentile, uint64_t &numBelow) const;
+
+private:
+	std::vector<uint64_t> buckets;
+	uint64_t count { 0 };
+	uint64_t min { UINT64_MAX };
+	uint64_t max { 0 };
+	double sum { 0 };
+	double sumSquares { 0 };
+};
+
+/* Inline static methods. */
+
+inline std::vector<std::pair<std::string, Bench::Function>>&
+Bench::GetRegistry() {
+	static std::vector<std::pair<std::string, Function>> registry;
+
+	return registry;
+}
+
+inline bool Bench::Register(const char *name, Function fn) {
+	GetRegistry().emplace_back(name, fn);
+
+	return true;
+}
+
+inline int Bench::Main(int argc, char *argv[]) {
+	Bench bench;
+	std::string filter;
+	const char *jsonPath { nullptr };
+
+	for (int i = 1; i < argc; ++i) {
+		if (strncmp(argv[i], "--filter=", 9) == 0) {
+			filter = argv[i] + 9;
+		} else if (strcmp(argv[i], "--quick") == 0) {
+			bench.quick = true;
+		} else if (strncmp(argv[i], "--json=", 7) == 0) {
+			jsonPath = argv[i] + 7;
+		} else {
+			fprintf(stderr,
+					"usage: %s [--filter=SUBSTRING] [--quick] [--json=FILE|-]\n",
+					argv[0]);
+
+			return 1;
+		}
+	}
+
+	// The table goes to stderr if the JSON goes to stdout.
+	if (jsonPath && strcmp(jsonPath, "-") == 0)
+		bench.out = stderr;
+
+	for (auto &entry : GetRegistry()) {
+		if (!filter.empty() && entry.first.find(filter) == std::string::npos)
+			continue;
+
+		entry.second(bench);
+		bench.PrintResults();
+	}
+
+	if (!jsonPath)
+		return 0;
+
+	FILE *json = bench.out == stderr ? stdout : fopen(jsonPath, "w");
+
+	if (!json) {
+		perror("fopen");
+
+		return 1;
+	}
+
+	bool ok = WriteJson(json, bench.quick, bench.results);
+
+	if (json != stdout)
+		ok = fclose(json) == 0 && ok;
+
+	return ok ? 0 : 1;
+}
+
+/**
+ * CPU time used by the process so far, all threads included (the other end
+ * of the loopback benchmarks too).
+ */
+inline uint64_t Bench::GetCpuTimeNs() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+
+	return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+inline void Bench::PrintResult(FILE *out, const Result &result) {
+	if (!result.error.empty()) {
+		fprintf(out, "%-36s skipped: %s\n", result.name.c_str(),
+				result.error.c_str());
+
+		return;
+	}
+
+	fprintf(out, "%-36s %12.1f ns %12.1f ns cpu %12llu", result.name.c_str(),
+			result.realTimeNs, result.cpuTimeNs,
+			static_cast<unsigned long long>(result.iterations));
+
+	for (auto &counter : result.counters)
+		fprintf(out, " %s=%.4g", counter.first.c_str(), counter.second);
+
+	fprintf(out, "\n");
+	fflush(out);
+}
+
+inline bool Bench::WriteJson(FILE *out, bool quick,
+		const std::vector<Result> &results) {
+	char date[64] { 0 };
+	char hostname[256] { 0 };
+	time_t now = time(nullptr);
+
+	strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", localtime(&now));
+	gethostname(hostname, sizeof(hostname) - 1);
+
+	fprintf(out, "{\n  \"context\": {\n");
+	fprintf(out, "    \"date\": \"%s\",\n", date);
+	fprintf(out, "    \"host_name\": \"%s\",\n", hostname);
+	fprintf(out, "    \"executable\": \"bench_uvutils\",\n");
+	fprintf(out, "    \"num_cpus\": %ld,\n", sysconf(_SC_NPROCESSORS_ONLN));
+	fprintf(out, "    \"libuv_version\": \"%s\",\n", uv_version_string());
+	fprintf(out, "    \"quick\": %s\n", quick ? "true" : "false");
+	fprintf(out, "  },\n  \"benchmarks\": [");
+
+	for (size_t i = 0; i < results.size(); ++i) {
+		auto &result = results[i];
+
+		fprintf(out, "%s\n    {\n", i == 0 ? "" : ",");
+		fprintf(out, "      \"name\": \"%s\",\n", result.name.c_str());
+		fprintf(out, "      \"run_name\": \"%s\",\n", result.name.c_str());
+		fprintf(out, "      \"run_type\": \"iteration\",\n");
+
+		if (!result.error.empty()) {
+			fprintf(out, "      \"error_occurred\": true,\n");
+			fprintf(out, "      \"error_message\": \"%s\"\n    }",
+					result.error.c_str());
+
+			continue;
+		}
+
+		fprintf(out, "      \"iterations\": %llu,\n",
+				static_cast<unsigned long long>(result.iterations));
+		fprintf(out, "      \"real_time\": %.3f,\n", result.realTimeNs);
+		fprintf(out, "      \"cpu_time\": %.3f,\n", result.cpuTimeNs);
+		fprintf(out, "      \"time_unit\": \"ns\"");
+
+		for (auto &counter : result.counters)
+			fprintf(out, ",\n      \"%s\": %.6g", counter.first.c_str(),
+					counter.second);
+
+		fprintf(out, "\n    }");
+	}
+
+	fprintf(out, "\n  ]\n}\n");
+
+	return ferror(out) == 0;
+}
+
+/* Inline methods. */
+
+inline bool Bench::IsQuick() const {
+	return this->quick;
+}
+
+/**
+ * Records a case of iterations taking elapsedNs in total, cpuNs of them on
+ * the CPU (see GetCpuTimeNs()). Counters can be added to the returned result.
+ */
+inline Bench::Result& Bench::Report(const std::string &name,
+		uint64_t iterations, uint64_t elapsedNs, uint64_t cpuNs) {
+	Result result;
+
+	// The previous one has its counters now.
+	PrintResults();
+
+	result.name = name;
+	result.iterations = iterations;
+	result.realTimeNs = iterations != 0
+			? static_cast<double>(elapsedNs) / iterations : 0;
+	result.cpuTimeNs = iterations != 0
+			? static_cast<double>(cpuNs) / iterations : 0;
+
+	this->results.push_back(std::move(result));
+
+	return this->results.back();
+}
+
+inline void Bench::Skip(const std::string &name, const std::string &reason) {
+	Result result;
+
+	result.name = name;
+	result.error = reason;
+
+	this->results.push_back(std::move(result));
+	PrintResults();
+}
+
+inline void Bench::PrintResults() {
+	for (; this->numPrinted < this->results.size(); ++this->numPrinted)
+		PrintResult(this->out, this->results[this->numPrinted]);
+}
+
+inline size_t Histogram::GetIndex(uint64_t value) {
+	if (value < SubBucketCount)
+		return static_cast<size_t>(value);
+
+	unsigned msb = 63 - __builtin_clzll(value);
+	unsigned shift = msb - SubBucketBits;
+
+	return ((shift + 1) << SubBucketBits)
+			+ ((value >> shift) & (SubBucketCount - 1));
+}
+
+// Middle of the bucket.
+inline uint64_t Histogram::GetValue(size_t index) {
+	if (index < SubBucketCount)
+		return index;
+
+	unsigned shift = (index >> SubBucketBits) - 1;
+	uint64_t lower = (SubBucketCount | (index & (SubBucketCount - 1))) << shift;
+
+	return lower + ((uint64_t { 1 } << shift) >> 1);
+}
+
+inline void Histogram::Record(uint64_t value) {
+	this->buckets[GetIndex(value)]++;
+	this->count++;
+	this->sum += value;
+	this->sumSquares += static_cast<double>(value) * value;
+
+	if (value < this->min)
+		this->min = value;
+
+	if (value > this->max)
+		this->max = value;
+}
+
+inline uint64_t Histogram::GetCount() const {
+	return this->count;
+}
+
+inline uint64_t Histogram::GetMin() const {
+	return this->count != 0 ? this->min : 0;
+}
+
+inline uint64_t Histogram::GetMax() const {
+	return this->max;
+}
+
+inline double Histogram::GetMean() const {
+	return this->count != 0 ? this->sum / this->count : 0;
+}
+
+inline double Histogram::GetStdDeviation() const {
+	if (this->count == 0)
+		return 0;
+
+	double mean = GetMean();
+	double variance = this->sumSquares / this->count - mean * mean;
+
+	return variance > 0 ? std::sqrt(variance) : 0;
+}
+
+inline uint64_t Histogram::GetPercentile(double percentile) const {
+	uint64_t numBelow;
+
+	return FindPercentile(percentile, numBelow);
+}
+
+// numBelow is set to the number of values up to the returned one.
+inline uint64_t Histogram::FindPercentile(double percentile,
+		uint64_t &numBelow) const {
+	numBelow = 0;
+
+	if (this->count == 0)
+		return 0;
+
+	auto rank = static_cast<uint64_t>(percentile / 100 * this->count + 0.5);
+
+	if (rank == 0)
+		rank = 1;
+
+	for (size_t i = 0; i < this->buckets.size(); ++i) {
+		numBelow += this->buckets[i];
+
+		if (numBelow >= rank)
+			return std::min(std::max(GetValue(i), this->min), this->max);
+	}
+
+	return this->max;
+}
+
+inline void Histogram::AddCounters(Bench::Result &result) const {
+	result.Counter("p50_ns", GetPercentile(50))
+			.Counter("p90_ns", GetPercentile(90))
+			.Counter("p99_ns", GetPercentile(99))
+			.Counter("p999_ns", GetPercentile(99.9))
+			.Counter("mean_ns", GetMean())
+			.Counter("max_ns", GetMax());
+}
+
+/**
+ * Prints the percentile distribution in the text format of HdrHistogram
+ * (read by its plotter), values divided by scale (e.g. 1e6 for ms).
+ */
+inline void Histogram::PrintPercentileDistribution(FILE *out,
+		double scale) const {
+	static constexpr int TicksPerHalfDistance { 5 };
+
+	fprintf(out, "%12s %14s %10s %14s\n\n", "Value", "Percentile",
+			"TotalCount", "1/(1-Percentile)");
+
+	// Ticks get closer as the percentile halves its distance to 100.
+	for (int halving = 0; this->count != 0; ++halving) {
+		double lower = 100 * (1 - std::pow(0.5, halving));
+		double upper = 100 * (1 - std::pow(0.5, halving + 1));
+
+		for (int tick = 0; tick < TicksPerHalfDistance; ++tick) {
+			double percentile = lower + (upper - lower) * tick
+					/ TicksPerHalfDistance;
+			uint64_t numBelow;
+			uint64_t value = FindPercentile(percentile, numBelow);
+
+			fprintf(out, "%12.3f %2.12f %10llu %14.2f\n", value / scale,
+					percentile / 100, static_cast<unsigned long long>(numBelow),
+					1 / (1 - percentile / 100));
+		}
+
+		if (1 / (1 - upper / 100) > this->count)
+			break;
+	}
+
+	fprintf(out, "%12.3f %2.12f %10llu\n", GetMax() / scale, 1.0,
+			static_cast<unsigned long long>(this->count));
+	fprintf(out, "#[Mean    = %12.3f, StdDeviation   = %12.3f]\n",
+			GetMean() / scale, GetStdDeviation() / scale);
+	fprintf(out, "#[Max     = %12.3f, Total count    = %12llu]\n",
+			GetMax() / scale, static_cast<unsigned long long>(this->count));
+	fprintf(out, "#[Buckets = %12zu, SubBuckets     = %12llu]\n",
+			NumBuckets >> SubBucketBits,
+			static_cast<unsigned long long>(SubBucketCount));
+}
+
+#endif
@@ -0,0 +1,66 @@
+#define UV_CLASS "Bench"
+#define UV_LOG_DEV_LEVEL 3
+
+#include "Bench.hpp"
+#include "DepLibUV.hpp"
+#include "Logger.hpp"
+#include <fcntl.h>
+#include <unistd.h>
+
+// Cost of the logging macros when enabled, writing to /dev/null. Disabled
+// ones (UV_DEBUG_DEV without UV_LOG_DEV_LEVEL 3...) expand to nothing.
+
+#define NumLogs 200000
+
+static void BenchLogger(Bench &bench) {
+	int numLogs = bench.IsQuick() ? NumLogs / 10 : NumLogs;
+	int devNull = open("/dev/null", O_WRONLY);
+	int savedStdout = dup(STDOUT_FILENO);
+	int savedStderr = dup(STDERR_FILENO);
+	uint64_t elapsedNs[3];
+	uint64_t cpuNs[3];
+
+	fflush(stdout);
+	fflush(stderr);
+	dup2(devNull, STDOUT_FILENO);
+	dup2(devNull, STDERR_FILENO);
+
+	uint64_t startNs = DepLibUV::GetTimeNs();
+	uint64_t cpuStartNs = Bench::GetCpuTimeNs();
+
+	for (int i = 0; i < numLogs; ++i)
+		UV_DEBUG_DEV("connection closed [id:%d, reason:%s]", i, "peer closed");
+
+	elapsedNs[0] = DepLibUV::GetTimeNs() - startNs;
+	cpuNs[0] = Bench::GetCpuTimeNs() - cpuStartNs;
+	startNs = DepLibUV::GetTimeNs();
+	cpuStartNs = Bench::GetCpuTimeNs();
+
+	for (int i = 0; i < numLogs; ++i)
+		UV_WARN_DEV("read error [id:%d]: %s", i, "connection reset by peer");
+
+	elapsedNs[1] = DepLibUV::GetTimeNs() - startNs;
+	cpuNs[1] = Bench::GetCpuTimeNs() - cpuStartNs;
+	startNs = DepLibUV::GetTimeNs();
+	cpuStartNs = Bench::GetCpuTimeNs();
+
+	for (int i = 0; i < numLogs; ++i)
+		UV_ERROR("uv_write() failed [id:%d]: %s", i, "broken pipe");
+
+	elapsedNs[2] = DepLibUV::GetTimeNs() - startNs;
+	cpuNs[2] = Bench::GetCpuTimeNs() - cpuStartNs;
+
+	fflush(stdout);
+	fflush(stderr);
+	dup2(savedStdout, STDOUT_FILENO);
+	dup2(savedStderr, STDERR_FILENO);
+	close(savedStdout);
+	close(savedStderr);
+	close(devNull);
+
+	bench.Report("Logger/DebugDev", numLogs, elapsedNs[0], cpuNs[0]);
+	bench.Report("Logger/WarnDev", numLogs, elapsedNs[1], cpuNs[1]);
+	bench.Report("Logger/Error", numLogs, elapsedNs[2], cpuNs[2]);
+}
+
+BENCH(BenchLogger);
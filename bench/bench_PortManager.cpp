@@ -0,0 +1,74 @@
+#include "Bench.hpp"
+#include "DepLibUV.hpp"
+#include "PortManager.hpp"
+#include <string>
+#include <vector>
+
+// Latency of binding a port with PortManager, which picks a random port and
+// retries on collisions, so it gets slower as its range fills up.
+
+static void onClose(uv_handle_t *handle) {
+	delete handle;
+}
+
+static void benchBind(Bench &bench, bool tcp, size_t n) {
+	std::string ip("127.0.0.1");
+	std::vector<uv_handle_t*> handles;
+	std::vector<uint16_t> ports;
+	Histogram histogram;
+	uint64_t totalNs { 0 };
+	uint64_t totalCpuNs { 0 };
+
+	for (size_t i = 0; i < n; ++i) {
+		uint64_t startNs = DepLibUV::GetTimeNs();
+		uint64_t cpuStartNs = Bench::GetCpuTimeNs();
+		uv_handle_t *handle = tcp
+				? reinterpret_cast<uv_handle_t*>(PortManager::BindTcp(ip))
+				: reinterpret_cast<uv_handle_t*>(PortManager::BindUdp(ip));
+		uint64_t elapsedNs = DepLibUV::GetTimeNs() - startNs;
+		uint64_t cpuNs = Bench::GetCpuTimeNs() - cpuStartNs;
+		struct sockaddr_storage addr;
+		int len = sizeof(addr);
+
+		histogram.Record(elapsedNs);
+		totalNs += elapsedNs;
+		totalCpuNs += cpuNs;
+
+		if (tcp)
+			uv_tcp_getsockname(reinterpret_cast<uv_tcp_t*>(handle),
+					reinterpret_cast<struct sockaddr*>(&addr), &len);
+		else
+			uv_udp_getsockname(reinterpret_cast<uv_udp_t*>(handle),
+					reinterpret_cast<struct sockaddr*>(&addr), &len);
+
+		handles.push_back(handle);
+		ports.push_back(
+				ntohs(reinterpret_cast<struct sockaddr_in*>(&addr)->sin_port));
+	}
+
+	auto &result = bench.Report(std::string("PortManager/Bind")
+			+ (tcp ? "Tcp/" : "Udp/") + std::to_string(n), n, totalNs,
+			totalCpuNs);
+
+	histogram.AddCounters(result);
+
+	for (size_t i = 0; i < n; ++i) {
+		uv_close(handles[i], onClose);
+
+		if (tcp)
+			PortManager::UnbindTcp(ip, ports[i]);
+		else
+			PortManager::UnbindUdp(ip, ports[i]);
+	}
+
+	DepLibUV::RunLoop();
+}
+
+static void BenchPortManager(Bench &bench) {
+	size_t n = bench.IsQuick() ? 100 : 1000;
+
+	benchBind(bench, true, n);
+	benchBind(bench, false, n);
+}
+
+BENCH(BenchPortManager);
@@ -0,0 +1,244 @@
+#include "Bench.hpp"
+#include "DepLibUV.hpp"
+#include "PortManager.hpp"
+#include "TcpClient.hpp"
+#include "TcpServer.hpp"
+#include "Timer.hpp"
+#include <sys/resource.h>
+#include <string>
+#include <vector>
+
+// Echo over loopback with n connections, the clients and the server running
+// in the same loop. Each connection sends a MessageSize message and sends the
+// next one once the echo is back, for Duration ms after all are connected:
+// round trips per second and their latency.
+
+#define MessageSize 64
+#define Duration 2000
+#define QuickDuration 300
+
+class EchoRun;
+
+class EchoConnection : public TcpConnection {
+public:
+	EchoConnection(size_t bufferSize) : TcpConnection(bufferSize) {}
+	void UserOnTcpConnectionRead() override {
+		Write(this->buffer, this->bufferDataLen, nullptr);
+		this->bufferDataLen = 0;
+	}
+};
+
+class EchoServer : public TcpServer {
+public:
+	EchoServer(uv_tcp_t *uvHandle) : TcpServer(uvHandle, 4096) {}
+	void UserOnTcpConnectionAlloc(TcpConnection **connection) override {
+		*connection = new EchoConnection(65536);
+	}
+	bool UserOnNewTcpConnection(TcpConnection * /*connection*/) override {
+		return true;
+	}
+	void UserOnTcpConnectionClosed(TcpConnection * /*connection*/) override {}
+};
+
+class PingConnection : public TcpConnection {
+public:
+	PingConnection(EchoRun *run) : TcpConnection(65536), run(run) {}
+	void Ping();
+	void UserOnTcpConnectionRead() override;
+
+	EchoRun *run;
+	uint64_t sentAt { 0 };
+	size_t received { 0 };
+};
+
+class PingClient : public TcpClient {
+public:
+	PingClient(EchoRun *run) : run(run) {}
+	void UserOnTcpConnectionAlloc(TcpConnection **connection) override {
+		*connection = new PingConnection(this->run);
+	}
+	bool UserOnNewTcpConnection(TcpConnection *connection) override;
+	void UserOnTcpConnectionClosed(TcpConnection * /*connection*/) override {}
+	void UserOnTcpConnectFailed(int error) override;
+
+	EchoRun *run;
+};
+
+class EchoRun : public Timer::Listener {
+public:
+	EchoRun(size_t numConnections, uint64_t duration) :
+			numConnections(numConnections), duration(duration) {
+		std::string ip("127.0.0.1");
+
+		this->server = new EchoServer(PortManager::BindTcp(ip));
+		this->timer = new Timer(this);
+		this->connectStartNs = DepLibUV::GetTimeNs();
+
+		for (size_t i = 0; i < numConnections; ++i) {
+			auto *client = new PingClient(this);
+
+			this->clients.push_back(client);
+
+			if (client->Connect(ip, this->server->GetLocalPort()) != 0)
+				OnConnectFailed();
+		}
+	}
+	~EchoRun() override {
+		for (auto *client : this->clients)
+			delete client;
+
+		delete this->server;
+		delete this->timer;
+	}
+
+	void OnConnected(PingConnection *connection) {
+		this->connections.push_back(connection);
+		CheckConnected();
+	}
+
+	void OnConnectFailed() {
+		this->numFailed++;
+		CheckConnected();
+	}
+
+	void CheckConnected() {
+		if (this->connections.size() + this->numFailed < this->numConnections)
+			return;
+
+		this->connectNs = DepLibUV::GetTimeNs() - this->connectStartNs;
+
+		if (this->numFailed != 0) {
+			Stop();
+
+			return;
+		}
+
+		this->running = true;
+		this->startNs = DepLibUV::GetTimeNs();
+		this->cpuStartNs = Bench::GetCpuTimeNs();
+		this->timer->Start(this->duration);
+
+		for (auto *connection : this->connections)
+			connection->Ping();
+	}
+
+	void OnTimer(Timer * /*timer*/) override {
+		this->elapsedNs = DepLibUV::GetTimeNs() - this->startNs;
+		this->cpuNs = Bench::GetCpuTimeNs() - this->cpuStartNs;
+		Stop();
+	}
+
+	void Stop() {
+		this->running = false;
+		this->timer->Close();
+
+		for (auto *client : this->clients)
+			client->Close();
+
+		this->server->Close();
+	}
+
+	size_t numConnections;
+	uint64_t duration;
+	EchoServer *server;
+	Timer *timer;
+	std::vector<PingClient*> clients;
+	std::vector<PingConnection*> connections;
+	size_t numFailed { 0 };
+	bool running { false };
+	uint64_t connectStartNs { 0 };
+	uint64_t connectNs { 0 };
+	uint64_t startNs { 0 };
+	uint64_t elapsedNs { 0 };
+	uint64_t cpuStartNs { 0 };
+	uint64_t cpuNs { 0 };
+	uint64_t roundTrips { 0 };
+	Histogram histogram;
+};
+
+void PingConnection::Ping() {
+	static const uint8_t message[MessageSize] { 0 };
+
+	this->sentAt = DepLibUV::GetTimeNs();
+	this->received = 0;
+	Write(message, sizeof(message), nullptr);
+}
+
+void PingConnection::UserOnTcpConnectionRead() {
+	this->received += this->bufferDataLen;
+	this->bufferDataLen = 0;
+
+	if (this->received < MessageSize || !this->run->running)
+		return;
+
+	this->run->histogram.Record(DepLibUV::GetTimeNs() - this->sentAt);
+	this->run->roundTrips++;
+	Ping();
+}
+
+bool PingClient::UserOnNewTcpConnection(TcpConnection *connection) {
+	this->run->OnConnected(static_cast<PingConnection*>(connection));
+
+	return true;
+}
+
+void PingClient::UserOnTcpConnectFailed(int /*error*/) {
+	this->run->OnConnectFailed();
+}
+
+// Each connection takes a client and a server fd.
+static size_t getMaxConnections() {
+	struct rlimit limit;
+
+	if (getrlimit(RLIMIT_NOFILE, &limit) != 0)
+		return 0;
+
+	limit.rlim_cur = limit.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &limit);
+	getrlimit(RLIMIT_NOFILE, &limit);
+
+	return limit.rlim_cur > 64 ? (limit.rlim_cur - 64) / 2 : 0;
+}
+
+static void BenchTcpEcho(Bench &bench) {
+	std::vector<size_t> sizes { 1, 10, 100, 1000, 10000 };
+	uint64_t duration = bench.IsQuick() ? QuickDuration : Duration;
+	size_t maxConnections = getMaxConnections();
+
+	if (bench.IsQuick())
+		sizes.pop_back();
+
+	for (size_t n : sizes) {
+		std::string name = "TcpEcho/Connections/" + std::to_string(n);
+
+		if (n > maxConnections) {
+			bench.Skip(name, "RLIMIT_NOFILE allows "
+					+ std::to_string(maxConnections) + " connections");
+
+			continue;
+		}
+
+		auto *run = new EchoRun(n, duration);
+
+		DepLibUV::RunLoop();
+
+		if (run->numFailed != 0) {
+			bench.Skip(name, std::to_string(run->numFailed)
+					+ " connections failed");
+		} else {
+			auto &result = bench.Report(name, run->roundTrips, run->elapsedNs,
+					run->cpuNs);
+			double seconds = run->elapsedNs / 1e9;
+
+			result.Counter("items_per_second", run->roundTrips / seconds)
+					.Counter("bytes_per_second",
+							run->roundTrips * MessageSize * 2 / seconds)
+					.Counter("connect_ms", run->connectNs / 1e6);
+			run->histogram.AddCounters(result);
+		}
+
+		delete run;
+	}
+}
+
+BENCH(BenchTcpEcho);
@@ -0,0 +1,93 @@
+#include "Bench.hpp"
+#include "DepLibUV.hpp"
+#include "Timer.hpp"
+#include <string>
+#include <vector>
+
+// Cost per timer of Timer operations with n timers in the loop (libuv keeps
+// them in a heap, so it grows with n).
+
+class CountingListener : public Timer::Listener {
+public:
+	void OnTimer(Timer * /*timer*/) override {
+		this->fired++;
+	}
+	size_t fired { 0 };
+};
+
+static void BenchTimer(Bench &bench) {
+	std::vector<size_t> sizes { 1000, 10000, 100000, 1000000 };
+
+	if (bench.IsQuick())
+		sizes.pop_back();
+
+	for (size_t n : sizes) {
+		std::string suffix = "/" + std::to_string(n);
+		CountingListener listener;
+		std::vector<Timer*> timers(n);
+		uint64_t startNs = DepLibUV::GetTimeNs();
+		uint64_t cpuStartNs = Bench::GetCpuTimeNs();
+
+		for (size_t i = 0; i < n; ++i)
+			timers[i] = new Timer(&listener);
+
+		bench.Report("Timer/Create" + suffix, n, DepLibUV::GetTimeNs() - startNs,
+				Bench::GetCpuTimeNs() - cpuStartNs);
+
+		// Far and unordered timeouts, as for connection timeouts.
+		startNs = DepLibUV::GetTimeNs();
+		cpuStartNs = Bench::GetCpuTimeNs();
+
+		for (size_t i = 0; i < n; ++i)
+			timers[i]->Start(3600000 + (i * 7919) % n);
+
+		bench.Report("Timer/Start" + suffix, n, DepLibUV::GetTimeNs() - startNs,
+				Bench::GetCpuTimeNs() - cpuStartNs);
+
+		startNs = DepLibUV::GetTimeNs();
+		cpuStartNs = Bench::GetCpuTimeNs();
+
+		for (size_t i = 0; i < n; ++i)
+			timers[i]->Restart();
+
+		bench.Report("Timer/Restart" + suffix, n,
+				DepLibUV::GetTimeNs() - startNs,
+				Bench::GetCpuTimeNs() - cpuStartNs);
+
+		startNs = DepLibUV::GetTimeNs();
+		cpuStartNs = Bench::GetCpuTimeNs();
+
+		for (size_t i = 0; i < n; ++i)
+			timers[i]->Stop();
+
+		bench.Report("Timer/Stop" + suffix, n, DepLibUV::GetTimeNs() - startNs,
+				Bench::GetCpuTimeNs() - cpuStartNs);
+
+		// All due at once, fired by one loop iteration.
+		for (size_t i = 0; i < n; ++i)
+			timers[i]->Start(0);
+
+		startNs = DepLibUV::GetTimeNs();
+		cpuStartNs = Bench::GetCpuTimeNs();
+		DepLibUV::RunLoop();
+
+		bench.Report("Timer/Fire" + suffix, listener.fired,
+				DepLibUV::GetTimeNs() - startNs,
+				Bench::GetCpuTimeNs() - cpuStartNs);
+
+		// Deleting closes the handles, freed by the loop.
+		startNs = DepLibUV::GetTimeNs();
+		cpuStartNs = Bench::GetCpuTimeNs();
+
+		for (size_t i = 0; i < n; ++i)
+			delete timers[i];
+
+		DepLibUV::RunLoop();
+
+		bench.Report("Timer/Destroy" + suffix, n,
+				DepLibUV::GetTimeNs() - startNs,
+				Bench::GetCpuTimeNs() - cpuStartNs);
+	}
+}
+
+BENCH(BenchTimer);
@@ -0,0 +1,126 @@
+#include "Bench.hpp"
+#include "DepLibUV.hpp"
+#include "PortManager.hpp"
+#include "Timer.hpp"
+#include "UdpSocket.hpp"
+#include <string>
+
+// Datagrams per second sent with UdpSocket::Send() and received by another
+// UdpSocket over loopback. At most Window datagrams are in flight, so the
+// receive buffer does not overflow; losses are counted and the window
+// refilled if nothing arrived for a tick.
+
+#define Window 256
+#define TickInterval 10
+
+class Receiver;
+
+class Sender : public UdpSocket {
+public:
+	Sender(uv_udp_t *uvHandle) : UdpSocket(uvHandle) {}
+	void UserOnUdpDatagramReceived(const uint8_t * /*data*/, size_t /*len*/,
+			const struct sockaddr * /*addr*/) override {}
+};
+
+class Receiver : public UdpSocket, public Timer::Listener {
+public:
+	Receiver(uv_udp_t *uvHandle, Sender *sender, size_t size, uint64_t total) :
+			UdpSocket(uvHandle), sender(sender), data(size, 'x'), total(total) {
+		this->timer = new Timer(this);
+	}
+	~Receiver() override {
+		delete this->timer;
+	}
+
+	void Run() {
+		this->startNs = DepLibUV::GetTimeNs();
+		this->cpuStartNs = Bench::GetCpuTimeNs();
+		this->timer->Start(TickInterval, TickInterval);
+		Fill();
+	}
+
+	void UserOnUdpDatagramReceived(const uint8_t * /*data*/, size_t /*len*/,
+			const struct sockaddr * /*addr*/) override {
+		if (++this->received + this->lost == this->total) {
+			Finish();
+
+			return;
+		}
+
+		Fill();
+	}
+
+	void OnTimer(Timer * /*timer*/) override {
+		if (this->received != this->lastReceived) {
+			this->lastReceived = this->received;
+
+			return;
+		}
+
+		// Nothing for a tick, the datagrams in flight were dropped.
+		this->lost += this->sent - this->received - this->lost;
+
+		if (this->received + this->lost >= this->total)
+			Finish();
+		else
+			Fill();
+	}
+
+	void Fill() {
+		while (this->sent < this->total
+				&& this->sent - this->received - this->lost < Window) {
+			this->sender->Send(reinterpret_cast<const uint8_t*>(this->data.data()),
+					this->data.size(), GetLocalAddress(), nullptr);
+			this->sent++;
+		}
+	}
+
+	void Finish() {
+		this->elapsedNs = DepLibUV::GetTimeNs() - this->startNs;
+		this->cpuNs = Bench::GetCpuTimeNs() - this->cpuStartNs;
+		this->timer->Close();
+		this->sender->Close();
+		Close();
+	}
+
+	Sender *sender;
+	Timer *timer;
+	std::string data;
+	uint64_t total;
+	uint64_t sent { 0 };
+	uint64_t received { 0 };
+	uint64_t lastReceived { 0 };
+	uint64_t lost { 0 };
+	uint64_t startNs { 0 };
+	uint64_t elapsedNs { 0 };
+	uint64_t cpuStartNs { 0 };
+	uint64_t cpuNs { 0 };
+};
+
+static void BenchUdpSocket(Bench &bench) {
+	uint64_t total = bench.IsQuick() ? 100000 : 1000000;
+
+	for (size_t size : { 64, 1200 }) {
+		std::string ip("127.0.0.1");
+		auto *sender = new Sender(PortManager::BindUdp(ip));
+		auto *receiver = new Receiver(PortManager::BindUdp(ip), sender, size,
+				total);
+
+		receiver->Run();
+		DepLibUV::RunLoop();
+
+		auto &result = bench.Report("UdpSocket/SendRecv/" + std::to_string(size),
+				receiver->received, receiver->elapsedNs, receiver->cpuNs);
+
+		result.Counter("items_per_second",
+				receiver->received / (receiver->elapsedNs / 1e9))
+				.Counter("bytes_per_second",
+						receiver->received * size / (receiver->elapsedNs / 1e9))
+				.Counter("lost", receiver->lost);
+
+		delete receiver;
+		delete sender;
+	}
+}
+
+BENCH(BenchUdpSocket);
@@ -0,0 +1,12 @@
+#include "Bench.hpp"
+#include "DepLibUV.hpp"
+
+int main(int argc, char *argv[]) {
+	DepLibUV::ClassInit();
+
+	int ret = Bench::Main(argc, argv);
+
+	DepLibUV::ClassDestroy();
+
+	return ret;
+}
@@ -0,0 +1,774 @@
+#include "Bench.hpp"
+#include "DepLibUV.hpp"
+#include "PortManager.hpp"
+#include "TcpClient.hpp"
+#include "TcpServer.hpp"
+#include "Timer.hpp"
+#include "UdpServer.hpp"
+#include "UdpSocket.hpp"
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <deque>
+#include <random>
+#include <string>
+#include <vector>
+
+// Open-loop load generator against an echo server, over TCP connections or
+// UDP sockets. Messages are sent on a schedule (the rate) whatever the
+// responses, and their latency is measured from when they were due, not from
+// when they could be sent: a stalled server shows up in the latency instead
+// of slowing the generator down (no coordinated omission). The messages due
+// are sent every TickInterval ms, which bounds the sending delay included.
+//
+// Without --port it forks its own echo server on the host, so it runs over
+// loopback; with --server it is that echo server. See usage().
+
+#define TickInterval 1
+#define DrainTimeout 2000
+#define MaxTcpMessageSize (1024 * 1024)
+#define MaxUdpMessageSize 65507
+// Sequence number at the start of the UDP datagrams.
+#define UdpHeaderSize 8
+// UDP datagrams waiting for their echo, by sequence number.
+#define UdpRingSize (1 << 20)
+
+static void usage(const char *name) {
+	fprintf(stderr,
+			"usage: %s [options]\n"
+			"  --proto=tcp|udp        transport (tcp)\n"
+			"  --host=IP              echo server address (127.0.0.1)\n"
+			"  --port=N               echo server port, none to fork one\n"
+			"  --server               only run the echo server on --host and --port\n"
+			"  --connections=N        connections, or UDP sockets (10)\n"
+			"  --rate=N               messages per second, all connections (1000)\n"
+			"  --arrival=uniform|poisson\n"
+			"                         time between messages (uniform)\n"
+			"  --size=SPEC            message size in bytes (64):\n"
+			"                           N, MIN-MAX (uniform), exp:MEAN or\n"
+			"                           SIZE:WEIGHT,SIZE:WEIGHT,... (mix)\n"
+			"  --duration=S           sending time in seconds (10)\n"
+			"  --warmup=S             first seconds not recorded (1)\n"
+			"  --hdr=FILE             latency distribution (ms) in HdrHistogram\n"
+			"                         format, - for stdout\n"
+			"  --seed=N               random seed (1)\n", name);
+}
+
+/* Message sizes to send, see usage(). */
+class SizeDistribution {
+public:
+	enum class Type {
+		FIXED, UNIFORM, EXPONENTIAL, MIX
+	};
+
+public:
+	bool Parse(const std::string &spec, size_t minSize, size_t maxSize) {
+		char *end;
+
+		if (spec.compare(0, 4, "exp:") == 0) {
+			this->type = Type::EXPONENTIAL;
+			this->mean = strtod(spec.c_str() + 4, &end);
+
+			if (*end != '\0' || this->mean < 1)
+				return false;
+		} else if (spec.find(':') != std::string::npos) {
+			const char *p = spec.c_str();
+
+			this->type = Type::MIX;
+
+			while (*p) {
+				size_t size = strtoul(p, &end, 10);
+
+				if (*end != ':')
+					return false;
+
+				double weight = strtod(end + 1, &end);
+
+				if (weight <= 0 || (*end != ',' && *end != '\0'))
+					return false;
+
+				this->sizes.push_back(size);
+				this->weights.push_back(weight);
+				p = *end == ',' ? end + 1 : end;
+			}
+		} else {
+			this->min = strtoul(spec.c_str(), &end, 10);
+			this->max = this->min;
+
+			if (*end == '-') {
+				this->type = Type::UNIFORM;
+				this->max = strtoul(end + 1, &end, 10);
+			}
+
+			if (*end != '\0' || this->max < this->min)
+				return false;
+		}
+
+		this->minSize = minSize;
+		this->maxSize = maxSize;
+
+		for (size_t size : this->sizes) {
+			if (size < minSize || size > maxSize)
+				return false;
+		}
+
+		if (this->type == Type::MIX) {
+			this->mix = std::discrete_distribution<size_t>(
+					this->weights.begin(), this->weights.end());
+		}
+
+		return this->type == Type::MIX || this->type == Type::EXPONENTIAL
+				|| (this->min >= minSize && this->max <= maxSize);
+	}
+
+	size_t Next(std::mt19937_64 &random) {
+		switch (this->type) {
+		case Type::FIXED:
+			return this->min;
+
+		case Type::UNIFORM:
+			return std::uniform_int_distribution<size_t>(this->min,
+					this->max)(random);
+
+		case Type::EXPONENTIAL: {
+			auto size = static_cast<size_t>(std::exponential_distribution<double>(
+					1 / this->mean)(random));
+
+			return std::min(std::max(size, this->minSize), this->maxSize);
+		}
+
+		case Type::MIX:
+			return this->sizes[this->mix(random)];
+		}
+
+		return this->min;
+	}
+
+private:
+	Type type { Type::FIXED };
+	size_t min { 0 };
+	size_t max { 0 };
+	double mean { 0 };
+	std::vector<size_t> sizes;
+	std::vector<double> weights;
+	std::discrete_distribution<size_t> mix;
+	size_t minSize { 0 };
+	size_t maxSize { 0 };
+};
+
+struct Options {
+	bool udp { false };
+	std::string host { "127.0.0.1" };
+	uint16_t port { 0 };
+	bool server { false };
+	size_t connections { 10 };
+	double rate { 1000 };
+	bool poisson { false };
+	std::string size { "64" };
+	double duration { 10 };
+	double warmup { 1 };
+	const char *hdrPath { nullptr };
+	uint64_t seed { 1 };
+};
+
+/* Echo server. */
+
+class EchoConnection : public TcpConnection {
+public:
+	EchoConnection() : TcpConnection(65536) {}
+	void UserOnTcpConnectionRead() override {
+		Write(this->buffer, this->bufferDataLen, nullptr);
+		this->bufferDataLen = 0;
+	}
+};
+
+class TcpEchoServer : public TcpServer {
+public:
+	TcpEchoServer(uv_tcp_t *uvHandle) : TcpServer(uvHandle, 4096) {}
+	void UserOnTcpConnectionAlloc(TcpConnection **connection) override {
+		*connection = new EchoConnection();
+	}
+	bool UserOnNewTcpConnection(TcpConnection * /*connection*/) override {
+		return true;
+	}
+	void UserOnTcpConnectionClosed(TcpConnection * /*connection*/) override {}
+};
+
+class UdpEchoListener : public UdpServer::Listener {
+public:
+	void OnUdpSocketPacketReceived(UdpSocket *socket, const uint8_t *data,
+			size_t len, const struct sockaddr *remoteAddr) override {
+		socket->Send(data, len, remoteAddr, nullptr);
+	}
+};
+
+// Runs the echo server, writing its port into portFd if not -1.
+static int runServer(const Options &options, int portFd) {
+	std::string ip(options.host);
+	UdpEchoListener udpListener;
+	uint16_t port;
+
+	DepLibUV::ClassInit();
+
+	if (options.udp) {
+		uv_udp_t *uvHandle = options.port != 0
+				? PortManager::BindUdp(ip, options.port) : PortManager::BindUdp(ip);
+
+		port = (new UdpServer(&udpListener, uvHandle))->GetLocalPort();
+	} else {
+		uv_tcp_t *uvHandle = options.port != 0
+				? PortManager::BindTcp(ip, options.port) : PortManager::BindTcp(ip);
+
+		port = (new TcpEchoServer(uvHandle))->GetLocalPort();
+	}
+
+	if (portFd != -1) {
+		if (write(portFd, &port, sizeof(port)) != sizeof(port))
+			return 1;
+
+		close(portFd);
+	} else {
+		printf("%s echo server on %s port %u\n", options.udp ? "udp" : "tcp",
+				ip.c_str(), port);
+		fflush(stdout);
+	}
+
+	// Until killed.
+	DepLibUV::RunLoop();
+
+	return 0;
+}
+
+/* Generator. */
+
+class LoadGenerator;
+
+// A message waiting for its echo.
+struct Pending {
+	uint64_t intendedNs { 0 };
+	uint64_t sentNs { 0 };
+	// TCP: bytes of its echo not received yet. UDP: sequence number + 1, 0
+	// once echoed.
+	uint64_t remaining { 0 };
+};
+
+class LoadConnection : public TcpConnection {
+public:
+	LoadConnection(LoadGenerator *generator) :
+			TcpConnection(65536), generator(generator) {}
+	void Send(const uint8_t *data, size_t len, uint64_t intendedNs);
+	void UserOnTcpConnectionRead() override;
+
+	LoadGenerator *generator;
+	// Echoed in order.
+	std::deque<Pending> pending;
+};
+
+class LoadClient : public TcpClient {
+public:
+	LoadClient(LoadGenerator *generator) : generator(generator) {}
+	void UserOnTcpConnectionAlloc(TcpConnection **connection) override {
+		*connection = new LoadConnection(this->generator);
+	}
+	bool UserOnNewTcpConnection(TcpConnection *connection) override;
+	void UserOnTcpConnectionClosed(TcpConnection *connection) override;
+	void UserOnTcpConnectFailed(int error) override;
+
+	LoadGenerator *generator;
+};
+
+class LoadSocket : public UdpSocket {
+public:
+	LoadSocket(uv_udp_t *uvHandle, LoadGenerator *generator) :
+			UdpSocket(uvHandle), generator(generator) {}
+	void UserOnUdpDatagramReceived(const uint8_t *data, size_t len,
+			const struct sockaddr *addr) override;
+
+	LoadGenerator *generator;
+};
+
+class LoadGenerator : public Timer::Listener {
+public:
+	enum class State {
+		CONNECTING, SENDING, DRAINING, DONE
+	};
+
+public:
+	LoadGenerator(const Options &options, SizeDistribution &sizes) :
+			options(options), sizes(sizes), random(options.seed),
+			payload(options.udp ? MaxUdpMessageSize : MaxTcpMessageSize, 'x') {
+		this->timer = new Timer(this);
+
+		if (this->options.udp)
+			this->udpPending.resize(UdpRingSize);
+	}
+	~LoadGenerator() override {
+		for (auto *client : this->clients)
+			delete client;
+
+		for (auto *socket : this->sockets)
+			delete socket;
+
+		delete this->timer;
+	}
+
+	bool Start() {
+		std::string ip(this->options.host);
+
+		if (this->options.udp) {
+			int err = this->options.host.find(':') != std::string::npos
+					? uv_ip6_addr(ip.c_str(), this->options.port,
+							reinterpret_cast<struct sockaddr_in6*>(&this->serverAddr))
+					: uv_ip4_addr(ip.c_str(), this->options.port,
+							reinterpret_cast<struct sockaddr_in*>(&this->serverAddr));
+
+			if (err != 0) {
+				fprintf(stderr, "invalid host: %s\n", uv_strerror(err));
+				Finish();
+
+				return false;
+			}
+
+			for (size_t i = 0; i < this->options.connections; ++i) {
+				std::string localIp(this->options.host);
+
+				this->sockets.push_back(
+						new LoadSocket(PortManager::BindUdp(localIp), this));
+			}
+
+			StartSending();
+
+			return true;
+		}
+
+		for (size_t i = 0; i < this->options.connections; ++i) {
+			auto *client = new LoadClient(this);
+
+			this->clients.push_back(client);
+
+			if (client->Connect(ip, this->options.port) != 0) {
+				fprintf(stderr, "connect failed\n");
+				Finish();
+
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	void OnConnected(LoadConnection *connection) {
+		this->connections.push_back(connection);
+
+		if (this->connections.size() == this->options.connections)
+			StartSending();
+	}
+
+	void OnConnectFailed(int error) {
+		fprintf(stderr, "connect failed: %s\n", uv_strerror(error));
+		this->numErrors++;
+		Finish();
+	}
+
+	void OnClosed(LoadConnection *connection) {
+		if (this->state == State::DONE)
+			return;
+
+		fprintf(stderr, "connection closed by the server\n");
+		this->numErrors++;
+		this->numLost += connection->pending.size();
+		connection->pending.clear();
+	}
+
+	void OnEcho(const Pending &pending) {
+		uint64_t nowNs = DepLibUV::GetTimeNs();
+
+		this->numReceived++;
+
+		if (pending.intendedNs < this->recordFromNs)
+			return;
+
+		this->latency.Record(nowNs - pending.intendedNs);
+		this->serviceTime.Record(nowNs - pending.sentNs);
+	}
+
+	void OnUdpEcho(const uint8_t *data, size_t len) {
+		uint64_t seq;
+
+		if (len < UdpHeaderSize)
+			return;
+
+		std::memcpy(&seq, data, sizeof(seq));
+
+		auto &pending = this->udpPending[seq % UdpRingSize];
+
+		// Late (already counted as lost) or duplicated.
+		if (pending.remaining != seq + 1)
+			return;
+
+		pending.remaining = 0;
+		OnEcho(pending);
+	}
+
+	void OnTimer(Timer * /*timer*/) override {
+		uint64_t nowNs = DepLibUV::GetTimeNs();
+
+		if (this->state == State::SENDING) {
+			while (this->nextNs <= nowNs && this->nextNs < this->endNs) {
+				SendNext(this->nextNs);
+				ScheduleNext();
+			}
+
+			if (nowNs < this->endNs)
+				return;
+
+			this->state = State::DRAINING;
+			this->sendEndNs = nowNs;
+			this->drainEndNs = nowNs + DrainTimeout * 1000000ull;
+		}
+
+		if (this->state == State::DRAINING
+				&& (this->numReceived + this->numLost >= this->numSent
+						|| nowNs >= this->drainEndNs))
+			Finish();
+	}
+
+	void Print() {
+		double seconds = (this->sendEndNs - this->startNs) / 1e9;
+		uint64_t numLost = this->numSent - this->numReceived;
+
+		printf("%s %s:%u, %zu %s, %.0f msg/s %s, sizes %s, %.1f s\n",
+				this->options.udp ? "udp" : "tcp", this->options.host.c_str(),
+				this->options.port, this->options.connections,
+				this->options.udp ? "sockets" : "connections", this->options.rate,
+				this->options.poisson ? "poisson" : "uniform",
+				this->options.size.c_str(), seconds);
+		printf("  sent %llu (%.0f msg/s, %.2f MB/s), received %llu, lost %llu,"
+				" errors %zu\n",
+				static_cast<unsigned long long>(this->numSent),
+				this->numSent / seconds, this->bytesSent / seconds / 1e6,
+				static_cast<unsigned long long>(this->numReceived),
+				static_cast<unsigned long long>(numLost), this->numErrors);
+		PrintLatency("latency (from due time)", this->latency);
+		PrintLatency("service time (from sent)", this->serviceTime);
+	}
+
+	bool PrintHdr(const char *path) {
+		FILE *out = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+
+		if (!out) {
+			perror("fopen");
+
+			return false;
+		}
+
+		this->latency.PrintPercentileDistribution(out, 1e6);
+
+		return out == stdout || fclose(out) == 0;
+	}
+
+	bool HasSent() const {
+		return this->startNs != 0;
+	}
+
+	size_t GetNumErrors() const {
+		return this->numErrors;
+	}
+
+private:
+	void StartSending() {
+		this->state = State::SENDING;
+		this->startNs = DepLibUV::GetTimeNs();
+		this->nextNs = this->startNs;
+		this->recordFromNs = this->startNs
+				+ static_cast<uint64_t>(this->options.warmup * 1e9);
+		this->endNs = this->startNs
+				+ static_cast<uint64_t>(this->options.duration * 1e9);
+		this->timer->Start(TickInterval, TickInterval);
+	}
+
+	void ScheduleNext() {
+		this->numScheduled++;
+
+		// From the start, so rounding does not drift.
+		if (this->options.poisson)
+			this->nextOffsetNs += std::exponential_distribution<double>(
+					this->options.rate)(this->random) * 1e9;
+		else
+			this->nextOffsetNs = this->numScheduled * 1e9 / this->options.rate;
+
+		this->nextNs = this->startNs
+				+ static_cast<uint64_t>(this->nextOffsetNs + 0.5);
+	}
+
+	// Round robin over the connections.
+	void SendNext(uint64_t intendedNs) {
+		size_t size = this->sizes.Next(this->random);
+		size_t index = this->numSent % this->options.connections;
+
+		this->numSent++;
+		this->bytesSent += size;
+
+		if (!this->options.udp) {
+			this->connections[index]->Send(this->payload.data(), size,
+					intendedNs);
+
+			return;
+		}
+
+		uint64_t seq = this->numSent - 1;
+		auto &pending = this->udpPending[seq % UdpRingSize];
+
+		// Overwriting one still waiting, it is lost.
+		if (pending.remaining != 0)
+			this->numLost++;
+
+		pending.intendedNs = intendedNs;
+		pending.sentNs = DepLibUV::GetTimeNs();
+		pending.remaining = seq + 1;
+		std::memcpy(this->payload.data(), &seq, sizeof(seq));
+
+		this->sockets[index]->Send(this->payload.data(), size,
+				reinterpret_cast<const struct sockaddr*>(&this->serverAddr),
+				nullptr);
+	}
+
+	void Finish() {
+		if (this->state == State::DONE)
+			return;
+
+		this->state = State::DONE;
+		this->timer->Close();
+
+		for (auto *client : this->clients)
+			client->Close();
+
+		for (auto *socket : this->sockets)
+			socket->Close();
+	}
+
+	static void PrintLatency(const char *name, const Histogram &histogram) {
+		printf("  %-26s p50 %.3f  p90 %.3f  p99 %.3f  p99.9 %.3f  p99.99 %.3f"
+				"  max %.3f ms (%llu recorded)\n", name,
+				histogram.GetPercentile(50) / 1e6,
+				histogram.GetPercentile(90) / 1e6,
+				histogram.GetPercentile(99) / 1e6,
+				histogram.GetPercentile(99.9) / 1e6,
+				histogram.GetPercentile(99.99) / 1e6, histogram.GetMax() / 1e6,
+				static_cast<unsigned long long>(histogram.GetCount()));
+	}
+
+private:
+	const Options &options;
+	SizeDistribution &sizes;
+	std::mt19937_64 random;
+	std::vector<uint8_t> payload;
+	Timer *timer { nullptr };
+	State state { State::CONNECTING };
+	// TCP.
+	std::vector<LoadClient*> clients;
+	std::vector<LoadConnection*> connections;
+	// UDP.
+	std::vector<LoadSocket*> sockets;
+	struct sockaddr_storage serverAddr;
+	std::vector<Pending> udpPending;
+	// Schedule.
+	uint64_t startNs { 0 };
+	uint64_t nextNs { 0 };
+	uint64_t numScheduled { 0 };
+	double nextOffsetNs { 0 };
+	uint64_t recordFromNs { 0 };
+	uint64_t endNs { 0 };
+	uint64_t sendEndNs { 0 };
+	uint64_t drainEndNs { 0 };
+	// Results.
+	uint64_t numSent { 0 };
+	uint64_t bytesSent { 0 };
+	uint64_t numReceived { 0 };
+	uint64_t numLost { 0 };
+	size_t numErrors { 0 };
+	Histogram latency;
+	Histogram serviceTime;
+};
+
+void LoadConnection::Send(const uint8_t *data, size_t len,
+		uint64_t intendedNs) {
+	Pending pending;
+
+	pending.intendedNs = intendedNs;
+	pending.sentNs = DepLibUV::GetTimeNs();
+	pending.remaining = len;
+
+	this->pending.push_back(pending);
+	Write(data, len, nullptr);
+}
+
+void LoadConnection::UserOnTcpConnectionRead() {
+	size_t len = this->bufferDataLen;
+
+	this->bufferDataLen = 0;
+
+	while (len != 0 && !this->pending.empty()) {
+		auto &pending = this->pending.front();
+		size_t taken = std::min<size_t>(len, pending.remaining);
+
+		pending.remaining -= taken;
+		len -= taken;
+
+		if (pending.remaining != 0)
+			break;
+
+		this->generator->OnEcho(pending);
+		this->pending.pop_front();
+	}
+}
+
+bool LoadClient::UserOnNewTcpConnection(TcpConnection *connection) {
+	this->generator->OnConnected(static_cast<LoadConnection*>(connection));
+
+	return true;
+}
+
+void LoadClient::UserOnTcpConnectionClosed(TcpConnection *connection) {
+	this->generator->OnClosed(static_cast<LoadConnection*>(connection));
+}
+
+void LoadClient::UserOnTcpConnectFailed(int error) {
+	this->generator->OnConnectFailed(error);
+}
+
+void LoadSocket::UserOnUdpDatagramReceived(const uint8_t *data, size_t len,
+		const struct sockaddr * /*addr*/) {
+	this->generator->OnUdpEcho(data, len);
+}
+
+static bool parseOptions(int argc, char *argv[], Options &options) {
+	for (int i = 1; i < argc; ++i) {
+		std::string arg(argv[i]);
+		size_t eq = arg.find('=');
+		std::string name = arg.substr(0, eq);
+		const char *value = eq != std::string::npos ? argv[i] + eq + 1 : "";
+
+		if (name == "--proto" && (arg == "--proto=tcp" || arg == "--proto=udp"))
+			options.udp = arg == "--proto=udp";
+		else if (name == "--host")
+			options.host = value;
+		else if (name == "--port")
+			options.port = static_cast<uint16_t>(atoi(value));
+		else if (arg == "--server")
+			options.server = true;
+		else if (name == "--connections" && atoi(value) > 0)
+			options.connections = static_cast<size_t>(atoi(value));
+		else if (name == "--rate" && atof(value) > 0)
+			options.rate = atof(value);
+		else if (arg == "--arrival=uniform" || arg == "--arrival=poisson")
+			options.poisson = arg == "--arrival=poisson";
+		else if (name == "--size")
+			options.size = value;
+		else if (name == "--duration" && atof(value) > 0)
+			options.duration = atof(value);
+		else if (name == "--warmup" && atof(value) >= 0)
+			options.warmup = atof(value);
+		else if (name == "--hdr")
+			options.hdrPath = value;
+		else if (name == "--seed")
+			options.seed = strtoull(value, nullptr, 10);
+		else
+			return false;
+	}
+
+	return true;
+}
+
+int main(int argc, char *argv[]) {
+	Options options;
+	SizeDistribution sizes;
+	pid_t serverPid { 0 };
+
+	if (!parseOptions(argc, argv, options)) {
+		usage(argv[0]);
+
+		return 1;
+	}
+
+	if (options.server)
+		return runServer(options, -1);
+
+	if (options.warmup >= options.duration) {
+		fprintf(stderr, "--warmup must be shorter than --duration\n");
+
+		return 1;
+	}
+
+	if (!sizes.Parse(options.size, options.udp ? UdpHeaderSize : 1,
+			options.udp ? MaxUdpMessageSize : MaxTcpMessageSize)) {
+		fprintf(stderr, "invalid --size: %s\n", options.size.c_str());
+
+		return 1;
+	}
+
+	// Each connection takes a fd, and another one in the forked server.
+	struct rlimit limit;
+
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+
+	if (options.port == 0) {
+		int fds[2];
+
+		if (pipe(fds) != 0) {
+			perror("pipe");
+
+			return 1;
+		}
+
+		serverPid = fork();
+
+		if (serverPid == 0) {
+			close(fds[0]);
+
+			return runServer(options, fds[1]);
+		}
+
+		close(fds[1]);
+
+		if (read(fds[0], &options.port, sizeof(options.port))
+				!= sizeof(options.port)) {
+			fprintf(stderr, "echo server failed\n");
+			waitpid(serverPid, nullptr, 0);
+
+			return 1;
+		}
+
+		close(fds[0]);
+	}
+
+	DepLibUV::ClassInit();
+
+	auto *generator = new LoadGenerator(options, sizes);
+	bool started = generator->Start();
+
+	DepLibUV::RunLoop();
+
+	int ret = started && generator->GetNumErrors() == 0 ? 0 : 1;
+
+	if (generator->HasSent())
+		generator->Print();
+
+	if (generator->HasSent() && options.hdrPath
+			&& !generator->PrintHdr(options.hdrPath))
+		ret = 1;
+
+	delete generator;
+	DepLibUV::ClassDestroy();
+
+	if (serverPid > 0) {
+		kill(serverPid, SIGTERM);
+		waitpid(serverPid, nullptr, 0);
+	}
+
+	return ret;
+}
@@ -0,0 +1,110 @@
+#include "DepLibUV.hpp"
+#include "PortManager.hpp"
+#include "TcpServer.hpp"
+#include "Coroutine.hpp"
+#include <stdio.h>
+#include <string.h>
+
+// An echo server whose connections are coroutines, and a coroutine client
+// writing NumMessages messages and reading their echo one by one.
+
+#define NumMessages 10000
+
+class EchoServer : public TcpServer {
+public:
+	EchoServer(uv_tcp_t *uvHandle) : TcpServer(uvHandle, 128) {}
+	void UserOnTcpConnectionAlloc(TcpConnection **connection) override {
+		*connection = new CoTcpConnection(65536);
+	}
+	bool UserOnNewTcpConnection(TcpConnection *connection) override {
+		Echo(static_cast<CoTcpConnection*>(connection));
+		return true;
+	}
+	void UserOnTcpConnectionClosed(TcpConnection * /*connection*/) override {
+		printf("server: connection closed\n");
+	}
+
+	static CoTask Echo(CoTcpConnection *connection) {
+		for (;;) {
+			auto data = co_await connection->Read();
+
+			if (data.len == 0 || !co_await connection->Write(data.data, data.len))
+				co_return;
+		}
+	}
+};
+
+CoTask Run(CoTcpClient *client, EchoServer *server, uint16_t port) {
+	CoTcpConnection *connection = co_await client->Connect("127.0.0.1", port);
+
+	if (!connection) {
+		printf("client: connect failed\n");
+		client->Close();
+		server->Close();
+		co_return;
+	}
+
+	char message[64];
+	size_t echoed = 0;
+	uint64_t startNs = DepLibUV::GetTimeNs();
+
+	for (int i = 0; i < NumMessages; ++i) {
+		snprintf(message, sizeof(message), "message %d", i);
+
+		size_t len = strlen(message);
+
+		if (!co_await connection->Write(reinterpret_cast<uint8_t*>(message), len))
+			break;
+
+		// Read until the whole echo is back.
+		size_t received = 0;
+
+		while (received < len) {
+			auto data = co_await connection->Read();
+
+			if (data.len == 0 || memcmp(data.data, message + received, data.len) != 0)
+				break;
+
+			received += data.len;
+		}
+
+		if (received != len)
+			break;
+
+		echoed++;
+	}
+
+	uint64_t elapsedNs = DepLibUV::GetTimeNs() - startNs;
+
+	printf("client: %zu/%d messages echoed, %.1f ms, %.0f round trips/s\n",
+			echoed, NumMessages, elapsedNs / 1e6, echoed / (elapsedNs / 1e9));
+
+	co_await CoSleep(100);
+
+	printf("client: closing\n");
+	client->Close();
+
+	co_await CoSleep(100);
+
+	server->Close();
+}
+
+int main() {
+	DepLibUV::ClassInit();
+
+	std::string ip("127.0.0.1");
+	uv_tcp_t *uvHandle = PortManager::BindTcp(ip);
+	auto *server = new EchoServer(uvHandle);
+	auto *client = new CoTcpClient();
+
+	printf("server: listening on port %u\n", server->GetLocalPort());
+
+	Run(client, server, server->GetLocalPort());
+	DepLibUV::RunLoop();
+
+	delete client;
+	delete server;
+	DepLibUV::ClassDestroy();
+
+	return 0;
+}
@@ -0,0 +1,36 @@
+#include "DepLibUV.hpp"
+#include "DnsResolver.hpp"
+#include <stdio.h>
+
+// Resolves the names given as arguments (localhost by default) twice, the
+// second time from the cache.
+
+static void resolve(const std::string &hostname) {
+	uint64_t id = DnsResolver::Resolve(hostname,
+			new DnsResolver::onResolveCallback([hostname](int error,
+					const std::vector<std::string> &ips) {
+		if (error != 0) {
+			printf("%s: %s\n", hostname.c_str(), uv_strerror(error));
+			return;
+		}
+		for (auto &ip : ips)
+			printf("%s: %s\n", hostname.c_str(), ip.c_str());
+	}));
+	printf("%s: %s\n", hostname.c_str(), id == 0 ? "cached" : "resolving");
+}
+
+int main(int argc, char *argv[]) {
+	DepLibUV::ClassInit();
+	std::vector<std::string> hostnames;
+	for (int i = 1; i < argc; i++)
+		hostnames.push_back(argv[i]);
+	if (hostnames.empty())
+		hostnames.push_back("localhost");
+	for (auto &hostname : hostnames)
+		resolve(hostname);
+	DepLibUV::RunLoop();
+	for (auto &hostname : hostnames)
+		resolve(hostname);
+
+	return 0;
+}
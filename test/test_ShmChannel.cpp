@@ -0,0 +1,165 @@
+#include "DepLibUV.hpp"
+#include "ShmChannel.hpp"
+#include "UnixStreamSocket.hpp"
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// A child process writes NumMessages messages of MessageSize bytes over a
+// UnixStreamSocket, then over one batching its writes and then over a
+// ShmChannel, and the parent reads them.
+
+#define NumMessages 200000
+#define MessageSize 64
+
+struct Stats {
+	void Read(size_t len) {
+		if (this->bytes == 0)
+			this->startNs = DepLibUV::GetTimeNs();
+
+		this->bytes += len;
+		this->reads++;
+	}
+
+	void Print(const char *name) {
+		uint64_t elapsedNs = DepLibUV::GetTimeNs() - this->startNs;
+
+		printf("%-26s %zu bytes in %zu reads, %.1f ms, %.0f msg/s\n", name,
+				this->bytes, this->reads, elapsedNs / 1e6,
+				(this->bytes / MessageSize) / (elapsedNs / 1e9));
+	}
+
+	uint64_t startNs { 0 };
+	size_t bytes { 0 };
+	size_t reads { 0 };
+};
+
+class SocketConsumer : public UnixStreamSocket {
+public:
+	SocketConsumer(int fd, const char *name) :
+			UnixStreamSocket(fd, 65536, Role::CONSUMER), name(name) {}
+	void UserOnUnixStreamRead() override {
+		stats.Read(this->bufferDataLen);
+		this->bufferDataLen = 0;
+	}
+	void UserOnUnixStreamSocketClosed() override {
+		stats.Print(this->name);
+	}
+	const char *name;
+	Stats stats;
+};
+
+class SocketProducer : public UnixStreamSocket {
+public:
+	SocketProducer(int fd) : UnixStreamSocket(fd, 65536, Role::PRODUCER) {}
+	void UserOnUnixStreamRead() override {}
+	void UserOnUnixStreamSocketClosed() override {}
+};
+
+class ShmConsumer : public ShmChannel {
+public:
+	ShmConsumer(const Fds &fds) : ShmChannel(fds, 65536, Role::CONSUMER) {}
+	void UserOnShmChannelRead() override {
+		stats.Read(this->bufferDataLen);
+		this->bufferDataLen = 0;
+	}
+	void UserOnShmChannelClosed() override {
+		stats.Print("ShmChannel");
+	}
+	Stats stats;
+};
+
+class ShmProducer : public ShmChannel {
+public:
+	ShmProducer(const Fds &fds) : ShmChannel(fds, 65536, Role::PRODUCER) {}
+	void UserOnShmChannelRead() override {}
+	void UserOnShmChannelClosed() override {
+		printf("consumer closed\n");
+	}
+};
+
+int main() {
+	int fds[2];
+	int batchFds[2];
+	ShmChannel::Fds shmFds = ShmChannel::CreateFds(1 << 20);
+	uint8_t message[MessageSize];
+
+	memset(message, 'x', sizeof(message));
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0
+			|| socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, batchFds) != 0) {
+		perror("socketpair");
+
+		return 1;
+	}
+
+	pid_t pid = fork();
+
+	if (pid == 0) {
+		close(fds[0]);
+		close(batchFds[0]);
+		DepLibUV::ClassInit();
+
+		auto *socketProducer = new SocketProducer(fds[1]);
+
+		for (int i = 0; i < NumMessages; ++i)
+			socketProducer->Write(message, sizeof(message));
+
+		socketProducer->Close();
+		DepLibUV::RunLoop();
+
+		auto *batchProducer = new SocketProducer(batchFds[1]);
+
+		batchProducer->SetBatching(true);
+
+		for (int i = 0; i < NumMessages; ++i)
+			batchProducer->Write(message, sizeof(message));
+
+		batchProducer->Close();
+		DepLibUV::RunLoop();
+
+		auto *shmProducer = new ShmProducer(shmFds);
+
+		ShmChannel::CloseFds(shmFds);
+
+		for (int i = 0; i < NumMessages; ++i)
+			shmProducer->Write(message, sizeof(message));
+
+		shmProducer->Close();
+		DepLibUV::RunLoop();
+
+		delete socketProducer;
+		delete batchProducer;
+		delete shmProducer;
+
+		return 0;
+	}
+
+	close(fds[1]);
+	close(batchFds[1]);
+	DepLibUV::ClassInit();
+
+	auto *socketConsumer = new SocketConsumer(fds[0], "UnixStreamSocket");
+
+	DepLibUV::RunLoop();
+
+	auto *batchConsumer = new SocketConsumer(batchFds[0],
+			"UnixStreamSocket batching");
+
+	DepLibUV::RunLoop();
+
+	auto *shmConsumer = new ShmConsumer(shmFds);
+
+	ShmChannel::CloseFds(shmFds);
+	DepLibUV::RunLoop();
+
+	delete socketConsumer;
+	delete batchConsumer;
+	delete shmConsumer;
+
+	waitpid(pid, nullptr, 0);
+
+	return 0;
+}
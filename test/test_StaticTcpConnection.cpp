@@ -0,0 +1,129 @@
+#include "DepLibUV.hpp"
+#include "PortManager.hpp"
+#include "StaticTcpConnection.hpp"
+#include "StaticTcpServer.hpp"
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+// Microbenchmark of the read path: once a connection is accepted, its libuv
+// read callbacks are called NumReads times with MessageSize bytes, as libuv
+// would for small messages, for a TcpConnection (virtual call per read) and a
+// StaticTcpConnection (inlined).
+
+#define NumReads 20000000
+#define MessageSize 64
+
+// What both connections do with the data.
+static inline void consume(uint8_t *buffer, size_t &bufferDataLen,
+		uint64_t &sum) {
+	sum += buffer[0] + bufferDataLen;
+	bufferDataLen = 0;
+}
+
+class VirtualConnection : public TcpConnection {
+public:
+	VirtualConnection(size_t bufferSize) : TcpConnection(bufferSize) {}
+	void UserOnTcpConnectionRead() override {
+		consume(this->buffer, this->bufferDataLen, this->sum);
+	}
+	uint64_t sum { 0 };
+};
+
+class StaticConnection : public StaticTcpConnection<StaticConnection> {
+public:
+	StaticConnection(size_t bufferSize) : StaticTcpConnection(bufferSize) {}
+	void UserOnRead() {
+		consume(this->buffer, this->bufferDataLen, this->sum);
+	}
+	uint64_t sum { 0 };
+};
+
+// Calls the read callbacks libuv was given, as it does.
+static void runReads(const char *name, TcpConnection *connection) {
+	auto *handle = reinterpret_cast<uv_stream_t*>(connection->GetUvHandle());
+	uv_buf_t buf;
+	uint64_t startNs = DepLibUV::GetTimeNs();
+
+	for (int i = 0; i < NumReads; ++i) {
+		handle->alloc_cb(reinterpret_cast<uv_handle_t*>(handle), 65536, &buf);
+		buf.base[0] = static_cast<char>(i);
+		handle->read_cb(handle, MessageSize, &buf);
+	}
+
+	uint64_t elapsedNs = DepLibUV::GetTimeNs() - startNs;
+
+	printf("%-20s %d reads, %.1f ms, %.2f ns/read, %zu bytes\n", name,
+			NumReads, elapsedNs / 1e6, static_cast<double>(elapsedNs) / NumReads,
+			connection->GetRecvBytes());
+}
+
+class VirtualServer : public TcpServer {
+public:
+	VirtualServer(uv_tcp_t *uvHandle) : TcpServer(uvHandle, 128) {}
+	void UserOnTcpConnectionAlloc(TcpConnection **connection) override {
+		*connection = new VirtualConnection(65536);
+	}
+	bool UserOnNewTcpConnection(TcpConnection *connection) override {
+		runReads("TcpConnection", connection);
+		Close();
+		return false;
+	}
+	void UserOnTcpConnectionClosed(TcpConnection * /*connection*/) override {}
+};
+
+class StaticServer : public StaticTcpServer<StaticServer, StaticConnection> {
+public:
+	StaticServer(uv_tcp_t *uvHandle) : StaticTcpServer(uvHandle, 128) {}
+	bool UserOnNewConnection(StaticConnection *connection) {
+		runReads("StaticTcpConnection", connection);
+		Close();
+		return false;
+	}
+	void UserOnConnectionClosed(StaticConnection * /*connection*/) {}
+};
+
+// Connects to the server, accepted once the loop runs.
+static int connectTo(TcpServer *server) {
+	struct sockaddr_in addr;
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(server->GetLocalPort());
+	inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+
+	if (connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0)
+		perror("connect");
+
+	return fd;
+}
+
+int main() {
+	DepLibUV::ClassInit();
+
+	std::string ip("127.0.0.1");
+
+	for (int i = 0; i < 2; ++i) {
+		auto *virtualServer = new VirtualServer(PortManager::BindTcp(ip));
+		int fd = connectTo(virtualServer);
+
+		DepLibUV::RunLoop();
+		close(fd);
+		delete virtualServer;
+
+		auto *staticServer = new StaticServer(PortManager::BindTcp(ip));
+
+		fd = connectTo(staticServer);
+		DepLibUV::RunLoop();
+		close(fd);
+		delete staticServer;
+	}
+
+	DepLibUV::ClassDestroy();
+
+	return 0;
+}
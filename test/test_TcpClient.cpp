@@ -44,6 +44,7 @@ public:
 	void UserOnTcpConnectionAlloc(TcpConnection **connection) override;
 	bool UserOnNewTcpConnection(TcpConnection *connection) override;
 	void UserOnTcpConnectionClosed(TcpConnection *connection) override;
+	void UserOnTcpClientStateChange(State previous, State state) override;
 };
 TcpClientTest *tcpClientTest = new TcpClientTest();
 
@@ -83,6 +84,11 @@ void TcpClientTest::UserOnTcpConnectionClosed(TcpConnection *connection) {
 
 }
 
+void TcpClientTest::UserOnTcpClientStateChange(State previous, State state) {
+	printf("state %d -> %d, reconnect attempts %u\n", (int)previous, (int)state,
+			GetReconnectAttempts());
+}
+
 class TimerTest : public Timer::Listener {
 	virtual void OnTimer(Timer *timer);
 
@@ -96,6 +102,11 @@ void TimerTest::OnTimer(Timer* timer) {
 int main() {
 	DepLibUV::ClassInit();
 	std::string ip = "127.0.0.1";
+	// Keep retrying until the server is up.
+	TcpClient::ReconnectPolicy policy;
+	policy.enabled = true;
+	tcpClientTest->SetReconnectPolicy(policy);
+	tcpClientTest->SetConnectTimeout(2000);
 	tcpClientTest->Connect(ip, 8000);
 	TimerTest *timerTest = new TimerTest();
 	Timer *timer = new Timer(timerTest);
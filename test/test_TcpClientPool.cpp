@@ -0,0 +1,92 @@
+#include "DepLibUV.hpp"
+#include "TcpClientPool.hpp"
+#include "TcpConnection.hpp"
+#include "Timer.hpp"
+#include <stdio.h>
+#include <string.h>
+
+// Sends a request every 100ms to the echo server listening on 127.0.0.1:8000
+// (see echoServer.c or test_TcpServer) reusing the pooled connections.
+
+class MyTcpConnection : public TcpConnection {
+public:
+	MyTcpConnection(size_t size);
+	void UserOnTcpConnectionRead() override;
+};
+
+class TcpClientPoolTest : public TcpClientPool {
+public:
+	explicit TcpClientPoolTest(const Options &options);
+public:
+	void UserOnTcpConnectionAlloc(TcpConnection **connection) override;
+	void UserOnTcpConnectionClosed(TcpConnection *connection) override;
+};
+
+TcpClientPoolTest *tcpClientPoolTest = nullptr;
+
+MyTcpConnection::MyTcpConnection(size_t size) :
+	:: TcpConnection(size) {
+
+}
+
+void MyTcpConnection::UserOnTcpConnectionRead() {
+	printf("response received [local port:%d] %.*s\n", GetLocalPort(),
+			static_cast<int>(this->bufferDataLen), this->buffer);
+	this->bufferDataLen = 0;
+
+	// Done with it, let the next request reuse it.
+	tcpClientPoolTest->Release(this);
+}
+
+TcpClientPoolTest::TcpClientPoolTest(const Options &options) :
+	TcpClientPool(options) {
+
+}
+
+void TcpClientPoolTest::UserOnTcpConnectionAlloc(TcpConnection **connection) {
+	*connection = new MyTcpConnection((size_t)(4096));
+	printf("opening a new upstream connection\n");
+}
+
+void TcpClientPoolTest::UserOnTcpConnectionClosed(TcpConnection *connection) {
+	printf("upstream connection closed while in use\n");
+}
+
+class TimerTest : public Timer::Listener {
+public:
+	int count { 0 };
+	virtual void OnTimer(Timer *timer);
+};
+
+void TimerTest::OnTimer(Timer *timer) {
+	if (++this->count == 50) {
+		tcpClientPoolTest->Dump();
+		tcpClientPoolTest->Close();
+		timer->Stop();
+		return;
+	}
+
+	tcpClientPoolTest->Acquire("127.0.0.1", 8000,
+			new TcpClientPool::onAcquireCallback([](TcpConnection *connection) {
+		if (connection == nullptr) {
+			printf("cannot connect\n");
+			return;
+		}
+		const char *request = "hello";
+		connection->Write((const uint8_t *)request, strlen(request), NULL);
+	}));
+}
+
+int main() {
+	DepLibUV::ClassInit();
+	TcpClientPool::Options options;
+	options.minIdle = 2;
+	options.maxIdle = 4;
+	tcpClientPoolTest = new TcpClientPoolTest(options);
+	TimerTest *timerTest = new TimerTest();
+	Timer *timer = new Timer(timerTest);
+	timer->Start(100, 100);
+	DepLibUV::RunLoop();
+
+	return 0;
+}
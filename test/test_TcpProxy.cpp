@@ -0,0 +1,92 @@
+#include "DepLibUV.hpp"
+#include "PortManager.hpp"
+#include "TcpServer.hpp"
+#include "TcpClient.hpp"
+#include "TcpProxy.hpp"
+#include <stdio.h>
+#include <string.h>
+
+// Relays every connection accepted on 127.0.0.1:8001 to the echo server
+// listening on 127.0.0.1:8000 (see echoServer.c or test_TcpServer).
+
+class UpstreamClient : public TcpClient {
+public:
+	explicit UpstreamClient(TcpProxy::Connection *downstream);
+public:
+	void UserOnTcpConnectionAlloc(TcpConnection **connection) override;
+	bool UserOnNewTcpConnection(TcpConnection *connection) override;
+	void UserOnTcpConnectionClosed(TcpConnection *connection) override;
+private:
+	TcpProxy::Connection *downstream { nullptr };
+};
+
+class ProxyServerTest : public TcpServer, public TcpProxy::Listener {
+public:
+	ProxyServerTest(std::string ip, uint16_t port);
+public:
+	void UserOnTcpConnectionAlloc(TcpConnection **connection) override;
+	bool UserOnNewTcpConnection(TcpConnection *connection) override;
+	void UserOnTcpConnectionClosed(TcpConnection *connection) override;
+	void OnTcpProxyClosed(TcpProxy *proxy) override;
+};
+
+ProxyServerTest *proxyServerTest = nullptr;
+
+UpstreamClient::UpstreamClient(TcpProxy::Connection *downstream) :
+	downstream(downstream) {
+
+}
+
+void UpstreamClient::UserOnTcpConnectionAlloc(TcpConnection **connection) {
+	*connection = new TcpProxy::Connection((size_t)(65536));
+}
+
+bool UpstreamClient::UserOnNewTcpConnection(TcpConnection *connection) {
+	printf("upstream connected, start relaying\n");
+	// Use TcpProxy::Mode::SPLICE to relay with splice() on Linux.
+	new TcpProxy(proxyServerTest, this->downstream,
+			static_cast<TcpProxy::Connection *>(connection));
+	return true;
+}
+
+void UpstreamClient::UserOnTcpConnectionClosed(TcpConnection *connection) {
+	printf("upstream connection closed, sent %zu recv %zu\n",
+			connection->GetSentBytes(), connection->GetRecvBytes());
+}
+
+ProxyServerTest::ProxyServerTest(std::string ip, uint16_t port) :
+				::TcpServer(PortManager::BindTcp(ip, port), 256){
+
+}
+
+void ProxyServerTest::UserOnTcpConnectionAlloc(TcpConnection **connection) {
+	*connection = new TcpProxy::Connection((size_t)(65536));
+}
+
+bool ProxyServerTest::UserOnNewTcpConnection(TcpConnection *connection) {
+	std::string upstreamIp = "127.0.0.1";
+	auto *upstream = new UpstreamClient(static_cast<TcpProxy::Connection *>(connection));
+
+	// Data received meanwhile waits in the connection buffer.
+	upstream->Connect(upstreamIp, 8000);
+	return true;
+}
+
+void ProxyServerTest::UserOnTcpConnectionClosed(TcpConnection *connection) {
+	printf("downstream connection closed, sent %zu recv %zu\n",
+			connection->GetSentBytes(), connection->GetRecvBytes());
+}
+
+void ProxyServerTest::OnTcpProxyClosed(TcpProxy *proxy) {
+	printf("proxy closed\n");
+	delete proxy;
+}
+
+int main() {
+	DepLibUV::ClassInit();
+	proxyServerTest = new ProxyServerTest("127.0.0.1", 8001);
+	printf("proxy listening on %s port %d\n", proxyServerTest->GetLocalIp().c_str(),
+			proxyServerTest->GetLocalPort());
+	DepLibUV::RunLoop();
+	return 0;
+}
@@ -33,6 +33,7 @@ public:
 	MyTcpConnection(size_t size);
 	virtual ~MyTcpConnection();
 	void UserOnTcpConnectionRead() override;
+	void UserOnTcpConnectionReset() override;
 private:
 	size_t msgStart{ 0 }; // Where the latest frame starts.
 
@@ -180,6 +181,11 @@ void MyTcpConnection::UserOnTcpConnectionRead() {
 
 }
 
+void MyTcpConnection::UserOnTcpConnectionReset() {
+	printf("UserOnTcpConnectionReset\n");
+	this->msgStart = 0;
+}
+
 //这里不用关心释放问题
 void TcpServerTest::UserOnTcpConnectionAlloc(TcpConnection **connection) {
 	MyTcpConnection *newTcpConnection = new MyTcpConnection((size_t)(4096));
@@ -193,7 +199,8 @@ bool TcpServerTest::UserOnNewTcpConnection(TcpConnection *connection) {
 	return true;
 }
 void TcpServerTest::UserOnTcpConnectionClosed(TcpConnection *connection) {
-	printf("UserOnTcpConnectionClosed enter, TcpConnection %#x \n", connection);
+	printf("UserOnTcpConnectionClosed enter, TcpConnection %#x reason %s\n", connection,
+			TcpConnection::CloseReasonToString(connection->GetCloseReason()));
 
 
 
@@ -210,6 +217,29 @@ int main() {
 	uint16_t port {tcpServerTest->GetLocalPort() };
 
 	printf("server info:%s port %d\n", ip.c_str(), port);
+
+	// Accept at most 16 connections per loop iteration and 100 per second.
+	TcpServer::AcceptPolicy acceptPolicy;
+	acceptPolicy.maxAcceptsPerIteration = 16;
+	acceptPolicy.acceptRate = 100;
+	tcpServerTest->SetAcceptPolicy(acceptPolicy);
+
+	// Reuse up to 64 closed connections.
+	tcpServerTest->SetConnectionPoolSize(64);
+
+	// Close connections idle for 60 seconds.
+	TcpConnection::Timeouts timeouts;
+	timeouts.idleTimeout = 60000;
+	tcpServerTest->SetTimeouts(timeouts);
+
+	// No Nagle, keepalive after 30 seconds idle, dead peers dropped after 10
+	// seconds of unacknowledged data.
+	TcpConnection::SocketOptions socketOptions;
+	socketOptions.noDelay = true;
+	socketOptions.keepAliveDelay = 30;
+	socketOptions.userTimeout = 10000;
+	tcpServerTest->SetSocketOptions(socketOptions);
+
 	DepLibUV::RunLoop();
 	return 0;
 }
@@ -0,0 +1,184 @@
+#include "DepLibUV.hpp"
+#include "PortManager.hpp"
+#include "TcpServer.hpp"
+#include "TcpConnection.hpp"
+#include "Timer.hpp"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <set>
+#include <vector>
+
+// Checks TcpServer::Drain() and exits (0 if it behaves): some connections are
+// closed once flushed, the others later by the subclass, either with
+// CloseConnection() or with TcpConnection::Close() alone, and one is closed
+// by another one's UserOnTcpConnectionDrain(). The drain must end as soon as
+// they are all closed, long before its deadline, with none force closed.
+
+#define NUM_CONNECTIONS 8
+#define DRAIN_TIMEOUT 3000 // ms
+#define LATE_CLOSE_DELAY 100 // ms
+
+class DrainConnection : public TcpConnection {
+public:
+	DrainConnection() : TcpConnection(4096) {}
+	void UserOnTcpConnectionRead() override {
+		this->bufferDataLen = 0;
+	}
+};
+
+class DrainServer : public TcpServer {
+public:
+	DrainServer(uv_tcp_t *uvHandle) : TcpServer(uvHandle, 256) {}
+public:
+	void UserOnTcpConnectionAlloc(TcpConnection **connection) override {
+		*connection = new DrainConnection();
+	}
+	bool UserOnNewTcpConnection(TcpConnection * /*connection*/) override {
+		return true;
+	}
+	void UserOnTcpConnectionClosed(TcpConnection *connection) override {
+		// Its id is 0 once removed from the server.
+		this->closedConnections.insert(connection);
+
+		if (connection->GetCloseReason() != TcpConnection::CloseReason::LOCAL)
+			this->numBadReasons++;
+	}
+	bool UserOnTcpConnectionDrain(TcpConnection *connection) override;
+	void UserOnTcpServerDrained(size_t numForceClosed) override;
+	void CloseLateConnections();
+
+public:
+	// Connections to close later, the first half with TcpConnection::Close().
+	std::vector<uint64_t> lateIds;
+	std::set<TcpConnection*> visited;
+	std::set<TcpConnection*> closedConnections;
+	size_t numVisits { 0 };
+	size_t numBadReasons { 0 };
+	bool drained { false };
+	size_t numForceClosed { 0 };
+	uint64_t drainStart { 0 };
+	uint64_t drainTime { 0 };
+};
+
+bool DrainServer::UserOnTcpConnectionDrain(TcpConnection *connection) {
+	this->numVisits++;
+	this->visited.insert(connection);
+
+	// The first one also closes another one, not visited yet.
+	if (this->visited.size() == 1) {
+		ForEachConnection([this, connection](TcpConnection *other) {
+			if (other != connection && this->closedConnections.empty())
+				CloseConnection(other);
+		});
+	}
+
+	if (this->visited.size() % 2 == 0)
+		return true;
+
+	this->lateIds.push_back(connection->GetId());
+
+	return false;
+}
+
+void DrainServer::UserOnTcpServerDrained(size_t numForceClosed) {
+	this->drained = true;
+	this->numForceClosed = numForceClosed;
+	this->drainTime = uv_now(DepLibUV::GetLoop()) - this->drainStart;
+}
+
+void DrainServer::CloseLateConnections() {
+	for (size_t i = 0; i < this->lateIds.size(); ++i) {
+		auto *connection = GetConnection(this->lateIds[i]);
+
+		if (connection == nullptr)
+			continue;
+
+		if (i < this->lateIds.size() / 2)
+			connection->Close();
+		else
+			CloseConnection(connection);
+	}
+}
+
+class LateCloseListener : public Timer::Listener {
+public:
+	void OnTimer(Timer * /*timer*/) override {
+		this->server->CloseLateConnections();
+	}
+public:
+	DrainServer *server { nullptr };
+};
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			printf("check failed at line %d: %s\n", __LINE__, #cond); \
+			ok = false; \
+		} \
+	} while (0)
+
+int main() {
+	DepLibUV::ClassInit();
+
+	std::string ip = "127.0.0.1";
+	auto *server = new DrainServer(PortManager::BindTcp(ip));
+	struct sockaddr_in addr;
+	std::vector<int> fds;
+	bool ok { true };
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(server->GetLocalPort());
+	addr.sin_addr.s_addr = inet_addr(ip.c_str());
+
+	for (size_t i = 0; i < NUM_CONNECTIONS; ++i) {
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+		if (connect(fd, reinterpret_cast<struct sockaddr*>(&addr),
+				sizeof(addr)) != 0) {
+			perror("connect");
+
+			return 1;
+		}
+
+		fds.push_back(fd);
+	}
+
+	while (server->GetNumConnections() < NUM_CONNECTIONS)
+		uv_run(DepLibUV::GetLoop(), UV_RUN_ONCE);
+
+	server->drainStart = uv_now(DepLibUV::GetLoop());
+	server->Drain(DRAIN_TIMEOUT);
+
+	LateCloseListener lateCloseListener;
+	Timer lateCloseTimer(&lateCloseListener);
+
+	lateCloseListener.server = server;
+	lateCloseTimer.Start(LATE_CLOSE_DELAY);
+
+	while (!server->drained)
+		uv_run(DepLibUV::GetLoop(), UV_RUN_ONCE);
+
+	CHECK(server->numForceClosed == 0);
+	CHECK(server->drainTime < DRAIN_TIMEOUT / 2);
+	CHECK(server->GetNumConnections() == 0);
+	CHECK(server->closedConnections.size() == NUM_CONNECTIONS);
+	CHECK(server->visited.size() == NUM_CONNECTIONS - 1);
+	CHECK(server->numVisits == NUM_CONNECTIONS - 1);
+	CHECK(server->numBadReasons == 0);
+
+	printf("drain check %s (%zu ms, %zu connections closed, %zu force closed)\n",
+			ok ? "passed" : "FAILED", static_cast<size_t>(server->drainTime),
+			server->closedConnections.size(), server->numForceClosed);
+
+	delete server;
+
+	for (int fd : fds)
+		close(fd);
+
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,252 @@
+#include "DepLibUV.hpp"
+#include "PortManager.hpp"
+#include "TcpServer.hpp"
+#include "TcpConnection.hpp"
+#include "Timer.hpp"
+#include "UnixStreamSocket.hpp"
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Echo server on 127.0.0.1:8003 restarted without dropping connections: run
+// it, connect (e.g. python3 tcpcli.py), then run it again. The new process
+// gets the listening socket and the open connections over
+// /tmp/test_TcpServerHandoff.sock and the old one exits.
+//
+// Messages: "L" with the listening socket, "C" with each connection and "E"
+// at the end. The new process closes the handoff socket on "E" and the old
+// one waits for it, since handles still in flight when it exits are lost.
+
+static const char *HandoffPath = "/tmp/test_TcpServerHandoff.sock";
+
+class EchoConnection : public TcpConnection {
+public:
+	EchoConnection() : TcpConnection(4096) {}
+	void UserOnTcpConnectionRead() override;
+};
+
+class EchoServer : public TcpServer {
+public:
+	EchoServer(uv_tcp_t *uvHandle) : TcpServer(uvHandle, 256) {}
+	EchoServer(int fd) : TcpServer(fd, 256) {}
+public:
+	void UserOnTcpConnectionAlloc(TcpConnection **connection) override;
+	bool UserOnNewTcpConnection(TcpConnection *connection) override;
+	void UserOnTcpConnectionClosed(TcpConnection *connection) override;
+	bool UserOnTcpConnectionDrain(TcpConnection *connection) override;
+	void UserOnTcpServerDrained(size_t numForceClosed) override;
+public:
+	// Set while handing the server over.
+	UnixStreamSocket *handoffSocket { nullptr };
+};
+
+// Sends the sockets to the new process (old process side) or gets them
+// (new process side).
+class HandoffSocket : public UnixStreamSocket {
+public:
+	HandoffSocket(int fd) : UnixStreamSocket(fd, 1024, Role::CONSUMER, true) {}
+	void UserOnUnixStreamRead() override;
+	void UserOnUnixStreamSocketClosed() override;
+};
+
+// Waits for a new process on HandoffPath.
+class HandoffListener : public Timer::Listener {
+public:
+	void OnTimer(Timer *timer) override;
+public:
+	int fd { -1 };
+};
+
+static EchoServer *echoServer { nullptr };
+
+void EchoConnection::UserOnTcpConnectionRead() {
+	printf("[%d] recv %zu bytes from %s:%d\n", getpid(), this->bufferDataLen,
+			GetPeerIp().c_str(), GetPeerPort());
+
+	Write(this->buffer, this->bufferDataLen, nullptr);
+
+	this->bufferDataLen = 0;
+}
+
+void EchoServer::UserOnTcpConnectionAlloc(TcpConnection **connection) {
+	*connection = new EchoConnection();
+}
+
+bool EchoServer::UserOnNewTcpConnection(TcpConnection *connection) {
+	printf("[%d] new connection from %s:%d\n", getpid(),
+			connection->GetPeerIp().c_str(), connection->GetPeerPort());
+
+	return true;
+}
+
+void EchoServer::UserOnTcpConnectionClosed(TcpConnection *connection) {
+	printf("[%d] connection closed: %s\n", getpid(),
+			TcpConnection::CloseReasonToString(connection->GetCloseReason()));
+}
+
+bool EchoServer::UserOnTcpConnectionDrain(TcpConnection *connection) {
+	uint64_t id = connection->GetId();
+
+	// Hand the connection over too, and close it here once sent.
+	this->handoffSocket->WriteHandle(reinterpret_cast<const uint8_t*>("C"), 1,
+			reinterpret_cast<uv_handle_t*>(connection->GetUvHandle()),
+			new UnixStreamSocket::onWriteCallback([this, id](bool written) {
+				TcpConnection *connection = GetConnection(id);
+
+				if (written && connection != nullptr)
+					CloseConnection(connection,
+							TcpConnection::CloseReason::HANDOFF);
+			}));
+
+	return false;
+}
+
+void EchoServer::UserOnTcpServerDrained(size_t numForceClosed) {
+	printf("[%d] handed over, %zu connections force closed\n", getpid(),
+			numForceClosed);
+
+	// Exit once the new process closes the handoff socket.
+	this->handoffSocket->Write(reinterpret_cast<const uint8_t*>("E"), 1);
+	Close();
+}
+
+void HandoffSocket::UserOnUnixStreamRead() {
+	uv_handle_type type;
+
+	while (GetPendingHandleCount() != 0) {
+		int fd = AcceptHandleFd(&type);
+
+		if (type != UV_TCP) {
+			close(fd);
+
+			continue;
+		}
+
+		// The listening socket comes first, then the connections.
+		if (echoServer == nullptr) {
+			echoServer = new EchoServer(fd);
+
+			printf("[%d] took over %s:%d\n", getpid(),
+					echoServer->GetLocalIp().c_str(), echoServer->GetLocalPort());
+		} else {
+			echoServer->AdoptConnection(fd);
+		}
+	}
+
+	bool end = memchr(this->buffer, 'E', this->bufferDataLen) != nullptr;
+
+	this->bufferDataLen = 0;
+
+	if (end) {
+		printf("[%d] took over %zu connections\n", getpid(),
+				echoServer->GetNumConnections());
+
+		Close();
+	}
+}
+
+void HandoffSocket::UserOnUnixStreamSocketClosed() {
+	printf("[%d] handoff socket closed\n", getpid());
+}
+
+void HandoffListener::OnTimer(Timer *timer) {
+	int fd = accept4(this->fd, nullptr, nullptr, SOCK_CLOEXEC);
+
+	if (fd == -1)
+		return;
+
+	printf("[%d] new process, handing over\n", getpid());
+
+	close(this->fd);
+	timer->Stop();
+
+	auto *handoffSocket = new HandoffSocket(fd);
+
+	echoServer->handoffSocket = handoffSocket;
+
+	// Send the listening socket, then stop accepting and send the connections.
+	handoffSocket->WriteHandle(reinterpret_cast<const uint8_t*>("L"), 1,
+			reinterpret_cast<uv_handle_t*>(echoServer->GetUvHandle()),
+			new UnixStreamSocket::onWriteCallback([](bool written) {
+				if (written)
+					echoServer->Drain(5000);
+			}));
+}
+
+static int connectHandoff() {
+	struct sockaddr_un addr;
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, HandoffPath, sizeof(addr.sun_path) - 1);
+
+	if (connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0) {
+		close(fd);
+
+		return -1;
+	}
+
+	return fd;
+}
+
+static int listenHandoff() {
+	struct sockaddr_un addr;
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, HandoffPath, sizeof(addr.sun_path) - 1);
+	unlink(HandoffPath);
+
+	if (bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0
+			|| listen(fd, 1) != 0) {
+		perror("handoff socket");
+		close(fd);
+
+		return -1;
+	}
+
+	return fd;
+}
+
+int main() {
+	DepLibUV::ClassInit();
+
+	HandoffSocket *takeoverSocket { nullptr };
+	int fd = connectHandoff();
+
+	// Take over from the running process.
+	if (fd != -1) {
+		takeoverSocket = new HandoffSocket(fd);
+
+		while (echoServer == nullptr && !takeoverSocket->IsClosed())
+			uv_run(DepLibUV::GetLoop(), UV_RUN_ONCE);
+	}
+
+	if (echoServer == nullptr) {
+		std::string ip = "127.0.0.1";
+
+		echoServer = new EchoServer(PortManager::BindTcp(ip, 8003));
+
+		printf("[%d] listening on %s:%d\n", getpid(),
+				echoServer->GetLocalIp().c_str(), echoServer->GetLocalPort());
+	}
+
+	// Wait for the next process.
+	HandoffListener handoffListener;
+	Timer handoffTimer(&handoffListener);
+
+	handoffListener.fd = listenHandoff();
+	handoffTimer.Start(100, 100);
+
+	DepLibUV::RunLoop();
+
+	delete takeoverSocket;
+	delete echoServer->handoffSocket;
+	delete echoServer;
+
+	return 0;
+}
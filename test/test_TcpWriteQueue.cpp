@@ -0,0 +1,445 @@
+#include "DepLibUV.hpp"
+#include "PortManager.hpp"
+#include "TcpServer.hpp"
+#include "TcpConnection.hpp"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <functional>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+// Checks the write queue of TcpConnection against a peer that does not read
+// and exits (0 if it behaves): the backpressure and writable notifications,
+// what the DROP_NEW, DROP_OLDEST and CLOSE policies do past the high
+// watermark, and the read pause reasons.
+
+#define CHUNK_SIZE 16384
+#define NUM_CHUNKS 32
+#define LOW_WATERMARK 16384
+#define HIGH_WATERMARK 65536
+#define SOCKET_BUFFER_SIZE 4096
+#define READ_BUFFER_SIZE 1024
+
+class QueueConnection : public TcpConnection {
+public:
+	QueueConnection() : TcpConnection(READ_BUFFER_SIZE) {}
+	void UserOnTcpConnectionRead() override {
+		if (!this->keepData)
+			this->bufferDataLen = 0;
+	}
+	void Consume() {
+		this->bufferDataLen = 0;
+	}
+
+public:
+	// Leave the data in the buffer so it fills.
+	bool keepData { false };
+};
+
+class QueueServer : public TcpServer, public TcpConnection::BackpressureListener {
+public:
+	QueueServer(uv_tcp_t *uvHandle) : TcpServer(uvHandle, 256) {}
+public:
+	void UserOnTcpConnectionAlloc(TcpConnection **connection) override {
+		*connection = new QueueConnection();
+	}
+	bool UserOnNewTcpConnection(TcpConnection *connection) override {
+		this->connection = static_cast<QueueConnection*>(connection);
+
+		return true;
+	}
+	void UserOnTcpConnectionClosed(TcpConnection *connection) override {
+		this->numClosed++;
+		this->closeReason = connection->GetCloseReason();
+
+		if (connection == this->connection)
+			this->connection = nullptr;
+	}
+	void OnTcpConnectionBackpressure(TcpConnection * /*connection*/) override {
+		this->numBackpressure++;
+	}
+	void OnTcpConnectionWritable(TcpConnection * /*connection*/) override {
+		this->numWritable++;
+	}
+
+public:
+	// The last accepted connection, until closed.
+	QueueConnection *connection { nullptr };
+	size_t numClosed { 0 };
+	TcpConnection::CloseReason closeReason { TcpConnection::CloseReason::NONE };
+	size_t numBackpressure { 0 };
+	size_t numWritable { 0 };
+};
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			printf("check failed at line %d: %s\n", __LINE__, #cond); \
+			return false; \
+		} \
+	} while (0)
+
+// Outcome of a write: -1 until its callback is called.
+enum { PENDING = -1, DROPPED = 0, SENT = 1 };
+
+// Runs the loop until done() or timeoutMs.
+static bool waitFor(const std::function<bool()> &done, uint64_t timeoutMs) {
+	uint64_t deadline = uv_hrtime() + timeoutMs * 1000000;
+
+	while (!done()) {
+		if (uv_hrtime() > deadline)
+			return false;
+
+		uv_run(DepLibUV::GetLoop(), UV_RUN_NOWAIT);
+		usleep(1000);
+	}
+
+	return true;
+}
+
+// Connects a client with a small receive buffer and waits for the server side.
+static int connectClient(QueueServer *server, const struct sockaddr_in &addr) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	int size = SOCKET_BUFFER_SIZE;
+
+	server->connection = nullptr;
+
+	if (fd == -1
+			|| setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) != 0
+			|| connect(fd, reinterpret_cast<const struct sockaddr*>(&addr),
+					sizeof(addr)) != 0) {
+		perror("connect");
+
+		if (fd != -1)
+			close(fd);
+
+		return -1;
+	}
+
+	if (!waitFor([server] { return server->connection != nullptr; }, 1000)) {
+		close(fd);
+
+		return -1;
+	}
+
+	return fd;
+}
+
+// Closes the client and waits for the server side to notice.
+static bool disconnectClient(QueueServer *server, int fd) {
+	size_t numClosed = server->numClosed;
+
+	close(fd);
+
+	return server->connection == nullptr
+			|| waitFor([server, numClosed] {
+				return server->numClosed == numClosed + 1;
+			}, 1000);
+}
+
+// Reads what the server sent until len bytes were received.
+static bool readClient(int fd, std::string &received, size_t len) {
+	char buffer[65536];
+
+	return waitFor([&] {
+		ssize_t nread;
+
+		while ((nread = recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0)
+			received.append(buffer, nread);
+
+		return received.size() >= len;
+	}, 3000) && received.size() == len;
+}
+
+// Writes chunk i, filled with the byte i, recording its outcome.
+static void writeChunk(TcpConnection *connection, std::vector<int> &results,
+		size_t i) {
+	std::vector<uint8_t> data(CHUNK_SIZE, static_cast<uint8_t>(i));
+
+	connection->Write(data.data(), data.size(),
+			new std::function<void(bool)>([&results, i](bool sent) {
+				results[i] = sent ? SENT : DROPPED;
+			}));
+}
+
+// The data of the sent chunks, in order.
+static std::string sentData(const std::vector<int> &results) {
+	std::string data;
+
+	for (size_t i = 0; i < results.size(); ++i) {
+		if (results[i] == SENT)
+			data.append(CHUNK_SIZE, static_cast<char>(i));
+	}
+
+	return data;
+}
+
+static size_t count(const std::vector<int> &results, int result) {
+	size_t n { 0 };
+
+	for (int r : results) {
+		if (r == result)
+			n++;
+	}
+
+	return n;
+}
+
+static void setUp(QueueServer *server, TcpConnection::WriteQueuePolicy policy) {
+	server->numBackpressure = 0;
+	server->numWritable = 0;
+	server->connection->SetBackpressureListener(server);
+	server->connection->SetWriteQueueWatermarks(LOW_WATERMARK, HIGH_WATERMARK);
+	server->connection->SetWriteQueuePolicy(policy);
+}
+
+// Everything is queued and sent once the peer reads.
+static bool checkNone(QueueServer *server, const struct sockaddr_in &addr) {
+	std::vector<int> results(NUM_CHUNKS, PENDING);
+	std::string received;
+	int fd = connectClient(server, addr);
+
+	CHECK(fd != -1);
+
+	setUp(server, TcpConnection::WriteQueuePolicy::NONE);
+
+	for (size_t i = 0; i < NUM_CHUNKS; ++i)
+		writeChunk(server->connection, results, i);
+
+	CHECK(server->connection->IsBackpressured());
+	CHECK(server->numBackpressure == 1);
+	CHECK(server->numWritable == 0);
+	CHECK(count(results, DROPPED) == 0);
+	CHECK(server->connection->GetWriteQueueSize() > HIGH_WATERMARK);
+
+	CHECK(readClient(fd, received, NUM_CHUNKS * CHUNK_SIZE));
+	CHECK(waitFor([&] { return count(results, SENT) == NUM_CHUNKS; }, 1000));
+	CHECK(received == sentData(results));
+	CHECK(!server->connection->IsBackpressured());
+	CHECK(server->numBackpressure == 1);
+	CHECK(server->numWritable == 1);
+	CHECK(server->connection->GetWriteQueueSize() == 0);
+
+	CHECK(disconnectClient(server, fd));
+
+	return true;
+}
+
+// Writes past the high watermark fail at once, the queued ones are sent.
+static bool checkDropNew(QueueServer *server, const struct sockaddr_in &addr) {
+	std::vector<int> results(NUM_CHUNKS + 1, PENDING);
+	std::string received;
+	int fd = connectClient(server, addr);
+
+	CHECK(fd != -1);
+
+	setUp(server, TcpConnection::WriteQueuePolicy::DROP_NEW);
+
+	for (size_t i = 0; i < NUM_CHUNKS; ++i) {
+		bool full = server->connection->GetWriteQueueSize() >= HIGH_WATERMARK;
+
+		writeChunk(server->connection, results, i);
+
+		if (full)
+			CHECK(results[i] == DROPPED);
+	}
+
+	CHECK(server->connection->IsBackpressured());
+	CHECK(server->numBackpressure == 1);
+	CHECK(count(results, DROPPED) > 0);
+	CHECK(server->connection->GetWriteQueueSize() < HIGH_WATERMARK + CHUNK_SIZE);
+
+	size_t len = (NUM_CHUNKS - count(results, DROPPED)) * CHUNK_SIZE;
+
+	CHECK(readClient(fd, received, len));
+	CHECK(waitFor([&] { return count(results, PENDING) == 1; }, 1000));
+	CHECK(server->numWritable == 1);
+
+	// Accepted again once writable.
+	writeChunk(server->connection, results, NUM_CHUNKS);
+
+	CHECK(readClient(fd, received, len + CHUNK_SIZE));
+	CHECK(waitFor([&] { return results[NUM_CHUNKS] == SENT; }, 1000));
+	CHECK(received == sentData(results));
+	CHECK(server->numBackpressure == 1);
+
+	CHECK(disconnectClient(server, fd));
+
+	return true;
+}
+
+// Writes past the high watermark wait, replacing each other, so the newest is
+// sent after the queued ones.
+static bool checkDropOldest(QueueServer *server,
+		const struct sockaddr_in &addr) {
+	std::vector<int> results(NUM_CHUNKS, PENDING);
+	std::string received;
+	int fd = connectClient(server, addr);
+
+	CHECK(fd != -1);
+
+	setUp(server, TcpConnection::WriteQueuePolicy::DROP_OLDEST);
+
+	for (size_t i = 0; i < NUM_CHUNKS; ++i) {
+		writeChunk(server->connection, results, i);
+
+		CHECK(server->connection->GetWriteQueueSize()
+				< HIGH_WATERMARK + 2 * CHUNK_SIZE);
+	}
+
+	CHECK(server->connection->IsBackpressured());
+	CHECK(server->numBackpressure == 1);
+	CHECK(count(results, DROPPED) > 0);
+	CHECK(results[NUM_CHUNKS - 1] == PENDING);
+
+	// Only the oldest ones are dropped.
+	size_t firstDropped = 0;
+
+	while (results[firstDropped] != DROPPED)
+		firstDropped++;
+
+	for (size_t i = firstDropped; i < NUM_CHUNKS - 1; ++i)
+		CHECK(results[i] == DROPPED);
+
+	size_t len = (NUM_CHUNKS - count(results, DROPPED)) * CHUNK_SIZE;
+
+	CHECK(readClient(fd, received, len));
+	CHECK(waitFor([&] { return count(results, PENDING) == 0; }, 1000));
+	CHECK(results[NUM_CHUNKS - 1] == SENT);
+	CHECK(received == sentData(results));
+	CHECK(server->numBackpressure == 1);
+	CHECK(server->numWritable == 1);
+
+	CHECK(disconnectClient(server, fd));
+
+	return true;
+}
+
+// The first write past the high watermark closes the connection.
+static bool checkClose(QueueServer *server, const struct sockaddr_in &addr) {
+	std::vector<int> results(NUM_CHUNKS, PENDING);
+	size_t numClosed = server->numClosed;
+	int fd = connectClient(server, addr);
+	size_t i;
+
+	CHECK(fd != -1);
+
+	setUp(server, TcpConnection::WriteQueuePolicy::CLOSE);
+
+	for (i = 0; i < NUM_CHUNKS && server->connection != nullptr; ++i)
+		writeChunk(server->connection, results, i);
+
+	CHECK(server->connection == nullptr);
+	CHECK(server->numClosed == numClosed + 1);
+	CHECK(server->closeReason == TcpConnection::CloseReason::WRITE_QUEUE_FULL);
+	CHECK(server->numBackpressure == 1);
+	CHECK(results[i - 1] == DROPPED);
+	CHECK(count(results, DROPPED) == 1);
+
+	close(fd);
+
+	return true;
+}
+
+// Reading resumes once every pause reason is cleared, and a full buffer only
+// once the subclass consumed it.
+static bool checkReadPause(QueueServer *server,
+		const struct sockaddr_in &addr) {
+	std::vector<char> data(3 * READ_BUFFER_SIZE, 'x');
+	int fd = connectClient(server, addr);
+
+	CHECK(fd != -1);
+
+	QueueConnection *connection = server->connection;
+
+	connection->PauseReading(TcpConnection::ReadPauseReason::USER);
+	connection->PauseReading(TcpConnection::ReadPauseReason::BACKPRESSURE);
+
+	CHECK(connection->IsReadingPaused());
+	CHECK(send(fd, data.data(), 100, 0) == 100);
+	CHECK(!waitFor([connection] { return connection->GetRecvBytes() != 0; }, 100));
+
+	connection->ResumeReading(TcpConnection::ReadPauseReason::BACKPRESSURE);
+
+	CHECK(connection->IsReadingPaused());
+	CHECK(!waitFor([connection] { return connection->GetRecvBytes() != 0; }, 100));
+
+	connection->ResumeReading(TcpConnection::ReadPauseReason::USER);
+
+	CHECK(!connection->IsReadingPaused());
+	CHECK(waitFor([connection] { return connection->GetRecvBytes() == 100; },
+			1000));
+
+	// Fill the buffer.
+	connection->SetPauseReadingOnFullBuffer(true);
+	connection->keepData = true;
+
+	CHECK(send(fd, data.data(), data.size(), 0)
+			== static_cast<ssize_t>(data.size()));
+	CHECK(waitFor([connection] {
+		return connection->GetRecvBytes() == 100 + READ_BUFFER_SIZE;
+	}, 1000));
+	CHECK(connection->IsReadingPaused());
+
+	// Still full.
+	connection->ResumeReading(TcpConnection::ReadPauseReason::BUFFER_FULL);
+
+	CHECK(connection->IsReadingPaused());
+
+	connection->Consume();
+	connection->ResumeReading(TcpConnection::ReadPauseReason::BUFFER_FULL);
+
+	CHECK(!connection->IsReadingPaused());
+	CHECK(waitFor([connection] {
+		return connection->GetRecvBytes() == 100 + 2 * READ_BUFFER_SIZE;
+	}, 1000));
+	CHECK(connection->IsReadingPaused());
+
+	connection->keepData = false;
+	connection->Consume();
+	connection->ResumeReading(TcpConnection::ReadPauseReason::BUFFER_FULL);
+
+	CHECK(waitFor([connection] {
+		return connection->GetRecvBytes() == 100 + 3 * READ_BUFFER_SIZE;
+	}, 1000));
+	CHECK(!connection->IsReadingPaused());
+
+	CHECK(disconnectClient(server, fd));
+
+	return true;
+}
+
+int main() {
+	DepLibUV::ClassInit();
+
+	std::string ip = "127.0.0.1";
+	auto *server = new QueueServer(PortManager::BindTcp(ip));
+	TcpConnection::SocketOptions options;
+	struct sockaddr_in addr;
+	bool ok { true };
+
+	// Small socket buffers, so the write queue fills quickly.
+	options.sendBufferSize = SOCKET_BUFFER_SIZE;
+	server->SetSocketOptions(options);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(server->GetLocalPort());
+	addr.sin_addr.s_addr = inet_addr(ip.c_str());
+
+	ok = checkNone(server, addr) && checkDropNew(server, addr)
+			&& checkDropOldest(server, addr) && checkClose(server, addr)
+			&& checkReadPause(server, addr);
+
+	printf("write queue check %s (%zu connections closed)\n",
+			ok ? "passed" : "FAILED", server->numClosed);
+
+	delete server;
+
+	return ok ? 0 : 1;
+}
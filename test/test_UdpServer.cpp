@@ -1,6 +1,18 @@
 #include "DepLibUV.hpp"
 #include "UdpServer.hpp"
 #include "UdpSocket.hpp"
+#include <arpa/inet.h>
+#include <functional>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+// Without argument checks the sessions of UdpServer and exits (0 if they
+// behave). With "serve" runs a server on 127.0.0.1:8000 and an echo server
+// with sessions on 127.0.0.1:8001 (e.g. python3 udpcli.py).
 
 class UdpServerTest : public UdpServer::Listener {
 public:
@@ -8,9 +20,9 @@ public:
 	  UdpSocket* socket, const uint8_t* data, size_t len, const struct sockaddr* remoteAddr) override;
 };
 
-void UdpServerTest::OnUdpSocketPacketReceived(UdpSocket* socket,
+void UdpServerTest::OnUdpSocketPacketReceived(UdpSocket* /*socket*/,
 		const uint8_t* data,
-		size_t len,
+		size_t /*len*/,
 		const struct sockaddr* remoteAddr) {
 	printf("recv from [%s:%d] message %s\n", inet_ntoa(((struct sockaddr_in*)remoteAddr)->sin_addr),
 			((struct sockaddr_in*)remoteAddr)->sin_port, data);
@@ -18,13 +30,265 @@ void UdpServerTest::OnUdpSocketPacketReceived(UdpSocket* socket,
 
 }
 
-int main() {
+// Echo server with a session per peer, closed after 10 seconds without data.
+class UdpSessionServerTest : public UdpServer::SessionListener {
+public:
+	class EchoSession : public UdpServer::Session {
+	public:
+		size_t numPackets { 0 };
+	};
+
+public:
+	virtual void OnUdpSessionAlloc(UdpServer *server,
+			const struct sockaddr *remoteAddr, UdpServer::Session **session) override;
+	virtual void OnUdpSessionPacket(UdpServer *server, UdpServer::Session *session,
+			const uint8_t *data, size_t len) override;
+	virtual void OnUdpSessionClosed(UdpServer *server,
+			UdpServer::Session *session) override;
+};
+
+void UdpSessionServerTest::OnUdpSessionAlloc(UdpServer * /*server*/,
+		const struct sockaddr * /*remoteAddr*/, UdpServer::Session **session) {
+	*session = new EchoSession();
+}
+
+void UdpSessionServerTest::OnUdpSessionPacket(UdpServer *server,
+		UdpServer::Session *session, const uint8_t *data, size_t len) {
+	auto *echoSession = static_cast<EchoSession*>(session);
+
+	echoSession->numPackets++;
+
+	printf("session [%s] packet %zu (%zu bytes), sessions:%zu\n",
+			session->GetAddress().ToString().c_str(), echoSession->numPackets,
+			len, server->GetNumSessions());
+
+	session->Send(data, len);
+}
+
+void UdpSessionServerTest::OnUdpSessionClosed(UdpServer * /*server*/,
+		UdpServer::Session *session) {
+	printf("session [%s] closed after %zu packets\n",
+			session->GetAddress().ToString().c_str(),
+			static_cast<EchoSession*>(session)->numPackets);
+}
+
+/* Sessions check. */
+
+// More peers than the initial 64 slots, so the table is rehashed.
+#define CHECK_NUM_PEERS 200
+#define CHECK_SESSION_TIMEOUT 300 // ms
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			printf("check failed at line %d: %s\n", __LINE__, #cond); \
+			return false; \
+		} \
+	} while (0)
+
+class UdpSessionCheck : public UdpServer::SessionListener {
+public:
+	virtual void OnUdpSessionAlloc(UdpServer * /*server*/,
+			const struct sockaddr * /*remoteAddr*/,
+			UdpServer::Session **session) override {
+		*session = new UdpServer::Session();
+	}
+	virtual void OnUdpSessionPacket(UdpServer * /*server*/,
+			UdpServer::Session * /*session*/, const uint8_t * /*data*/,
+			size_t /*len*/) override {
+		this->numPackets++;
+	}
+	virtual void OnUdpSessionClosed(UdpServer * /*server*/,
+			UdpServer::Session * /*session*/) override {
+		this->numClosed++;
+	}
+
+public:
+	size_t numPackets { 0 };
+	size_t numClosed { 0 };
+};
+
+// A client socket on its own local port.
+struct Peer {
+	int fd { -1 };
+	struct sockaddr_in addr;
+	// Whether the server should have a session for it.
+	bool open { false };
+};
+
+static bool sendFrom(Peer &peer, const struct sockaddr_in &serverAddr) {
+	peer.open = true;
+
+	return sendto(peer.fd, "ping", 4, 0,
+			reinterpret_cast<const struct sockaddr*>(&serverAddr),
+			sizeof(serverAddr)) == 4;
+}
+
+// Runs the loop until done() or timeoutMs.
+static bool waitFor(const std::function<bool()> &done, uint64_t timeoutMs) {
+	uint64_t deadline = uv_hrtime() + timeoutMs * 1000000;
+
+	while (!done()) {
+		if (uv_hrtime() > deadline)
+			return false;
+
+		uv_run(DepLibUV::GetLoop(), UV_RUN_NOWAIT);
+		usleep(1000);
+	}
+
+	return true;
+}
+
+// Every open peer has its session, the others none.
+static bool checkLookups(UdpServer *server, const std::vector<Peer> &peers) {
+	size_t numOpen { 0 };
+
+	for (auto &peer : peers) {
+		auto *addr = reinterpret_cast<const struct sockaddr*>(&peer.addr);
+		auto *session = server->GetSession(addr);
+
+		if (peer.open) {
+			CHECK(session != nullptr && session->GetAddress().Equals(addr));
+			numOpen++;
+		} else {
+			CHECK(session == nullptr);
+		}
+	}
+
+	CHECK(server->GetNumSessions() == numOpen);
+
+	return true;
+}
+
+static bool checkSessions(UdpServer *server, UdpSessionCheck &check,
+		std::vector<Peer> &peers, const struct sockaddr_in &serverAddr) {
+	// A session per peer.
+	for (auto &peer : peers)
+		CHECK(sendFrom(peer, serverAddr));
+
+	CHECK(waitFor([&] { return check.numPackets == CHECK_NUM_PEERS; }, 1000));
+	CHECK(checkLookups(server, peers));
+
+	// Close half of them in mixed order (7 and 200 are coprime), the others
+	// must still be found after each backward shift.
+	for (size_t i = 0; i < CHECK_NUM_PEERS / 2; ++i) {
+		auto &peer = peers[(i * 7) % CHECK_NUM_PEERS];
+		auto *session = server->GetSession(
+				reinterpret_cast<const struct sockaddr*>(&peer.addr));
+
+		CHECK(session != nullptr);
+
+		session->Close();
+		peer.open = false;
+
+		CHECK(checkLookups(server, peers));
+	}
+
+	CHECK(check.numClosed == CHECK_NUM_PEERS / 2);
+
+	// Keep every other session alive, the rest expires.
+	usleep(CHECK_SESSION_TIMEOUT / 2 * 1000);
+
+	size_t numAlive { 0 };
+	std::vector<Peer*> expiring;
+
+	for (auto &peer : peers) {
+		if (!peer.open)
+			continue;
+
+		if (numAlive++ % 2 == 0) {
+			CHECK(sendFrom(peer, serverAddr));
+		} else {
+			expiring.push_back(&peer);
+		}
+	}
+
+	numAlive -= expiring.size();
+
+	CHECK(waitFor([&] { return server->GetNumSessions() == numAlive; },
+			CHECK_SESSION_TIMEOUT * 2));
+
+	for (auto *peer : expiring)
+		peer->open = false;
+
+	CHECK(checkLookups(server, peers));
+
+	// Then the others.
+	CHECK(waitFor([&] { return server->GetNumSessions() == 0; },
+			CHECK_SESSION_TIMEOUT * 2));
+
+	for (auto &peer : peers)
+		peer.open = false;
+
+	CHECK(checkLookups(server, peers));
+	CHECK(check.numClosed == CHECK_NUM_PEERS);
+
+	// A closed peer gets a new session.
+	size_t numPackets = check.numPackets;
+
+	CHECK(sendFrom(peers[0], serverAddr));
+	CHECK(waitFor([&] { return check.numPackets == numPackets + 1; }, 1000));
+	CHECK(checkLookups(server, peers));
+
+	return true;
+}
+
+static int runCheck() {
+	UdpSessionCheck check;
+	std::string ip = "127.0.0.1";
+	auto *server = new UdpServer(&check, ip, 8001, CHECK_SESSION_TIMEOUT);
+	struct sockaddr_in serverAddr;
+	std::vector<Peer> peers(CHECK_NUM_PEERS);
+	bool ok;
+
+	memset(&serverAddr, 0, sizeof(serverAddr));
+	serverAddr.sin_family = AF_INET;
+	serverAddr.sin_port = htons(server->GetLocalPort());
+	serverAddr.sin_addr.s_addr = inet_addr(ip.c_str());
+
+	for (auto &peer : peers) {
+		socklen_t len = sizeof(peer.addr);
+
+		memset(&peer.addr, 0, sizeof(peer.addr));
+		peer.addr.sin_family = AF_INET;
+		peer.addr.sin_addr.s_addr = inet_addr(ip.c_str());
+		peer.fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+		if (peer.fd == -1
+				|| bind(peer.fd, reinterpret_cast<struct sockaddr*>(&peer.addr),
+						sizeof(peer.addr)) != 0
+				|| getsockname(peer.fd,
+						reinterpret_cast<struct sockaddr*>(&peer.addr), &len) != 0) {
+			perror("peer socket");
+
+			return 1;
+		}
+	}
+
+	ok = checkSessions(server, check, peers, serverAddr);
+
+	printf("sessions check %s (%zu packets, %zu sessions closed)\n",
+			ok ? "passed" : "FAILED", check.numPackets, check.numClosed);
+
+	delete server;
+
+	for (auto &peer : peers)
+		close(peer.fd);
+
+	return ok ? 0 : 1;
+}
+
+int main(int argc, char *argv[]) {
 	DepLibUV::ClassInit();
+
+	if (argc < 2 || strcmp(argv[1], "serve") != 0)
+		return runCheck();
+
 	auto *udpServerTest = new UdpServerTest();
 	std::string ip = "127.0.0.1";
-	auto *udpServer = new UdpServer(udpServerTest, ip, 8000);
+	new UdpServer(udpServerTest, ip, 8000);
+	auto *udpSessionServerTest = new UdpSessionServerTest();
+	new UdpServer(udpSessionServerTest, ip, 8001, 10000);
 	DepLibUV::RunLoop();
 	return 0;
 }
-
-
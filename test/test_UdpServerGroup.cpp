@@ -0,0 +1,76 @@
+#include "DepLibUV.hpp"
+#include "UdpServer.hpp"
+#include "UdpServerGroup.hpp"
+#include <stdio.h>
+#include <unistd.h>
+
+// Echo server on 127.0.0.1:8002 running 4 workers, each datagram source
+// always handled by the same worker (e.g. python3 udpcli.py with that port).
+
+class WorkerServer : public UdpServer::Listener {
+public:
+	explicit WorkerServer(size_t workerId);
+public:
+	virtual void OnUdpSocketPacketReceived(
+	  UdpSocket* socket, const uint8_t* data, size_t len, const struct sockaddr* remoteAddr) override;
+private:
+	size_t workerId { 0 };
+};
+
+class UdpServerGroupTest : public UdpServerGroup::Listener {
+public:
+	UdpServer* OnUdpServerGroupWorkerStart(UdpServerGroup *group,
+			size_t workerId, uv_udp_t *uvHandle) override;
+	void OnUdpServerGroupWorkerStop(UdpServerGroup *group, size_t workerId,
+			UdpServer *server) override;
+};
+
+WorkerServer::WorkerServer(size_t workerId) :
+	workerId(workerId) {
+
+}
+
+void WorkerServer::OnUdpSocketPacketReceived(UdpSocket* socket,
+		const uint8_t* data, size_t len, const struct sockaddr* remoteAddr) {
+	SocketAddress address(remoteAddr);
+
+	printf("worker %zu recv from [%s] %zu bytes\n", this->workerId,
+			address.ToString().c_str(), len);
+
+	socket->Send(data, len, remoteAddr, nullptr);
+}
+
+UdpServer* UdpServerGroupTest::OnUdpServerGroupWorkerStart(
+		UdpServerGroup *group, size_t workerId, uv_udp_t *uvHandle) {
+	printf("worker %zu started\n", workerId);
+
+	// Runs in the worker thread, on its own loop.
+	return new UdpServer(new WorkerServer(workerId), uvHandle);
+}
+
+void UdpServerGroupTest::OnUdpServerGroupWorkerStop(UdpServerGroup *group,
+		size_t workerId, UdpServer *server) {
+	printf("worker %zu stopped\n", workerId);
+
+	delete server;
+}
+
+int main() {
+	DepLibUV::ClassInit();
+	auto *udpServerGroupTest = new UdpServerGroupTest();
+	std::string ip = "127.0.0.1";
+	UdpServerGroup::Options options;
+
+	options.numWorkers = 4;
+	options.steering = UdpServerGroup::Steering::FLOW;
+
+	auto *udpServerGroup = new UdpServerGroup(udpServerGroupTest, ip, 8002,
+			options);
+
+	udpServerGroup->Dump();
+
+	sleep(30);
+
+	delete udpServerGroup;
+	return 0;
+}
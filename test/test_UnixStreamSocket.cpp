@@ -0,0 +1,509 @@
+#include "DepLibUV.hpp"
+#include "UnixStreamSocket.hpp"
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Checks UnixStreamSocket over socketpairs and exits (0 if it behaves).
+//
+// Writes: iovec writes sent at once, partially (the rest is copied skipping
+// the bytes already written) or queued behind a pending one, their callbacks,
+// batching, and WriteHandle() when flushing the batch closes the socket and
+// the subclass deletes it.
+//
+// Framing: messages split anywhere (the header too), the buffer growing for a
+// big message and back afterwards, the unfinished message moved to the start
+// of the buffer only once space gets short, malformed frames, and
+// WriteMessage() refusing messages the peer would reject.
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			printf("check failed at line %d: %s\n", __LINE__, #cond); \
+			return false; \
+		} \
+	} while (0)
+
+class Writer : public UnixStreamSocket {
+public:
+	Writer(int fd, bool ipc = false) :
+			UnixStreamSocket(fd, 4096, Role::PRODUCER, ipc) {}
+	void UserOnUnixStreamRead() override {}
+	void UserOnUnixStreamSocketClosed() override {
+		this->numClosed++;
+
+		if (this->deleteOnClose)
+			delete this;
+	}
+
+public:
+	size_t numClosed { 0 };
+	bool deleteOnClose { false };
+};
+
+class Reader : public UnixStreamSocket {
+public:
+	Reader(int fd, size_t bufferSize) :
+			UnixStreamSocket(fd, bufferSize, Role::CONSUMER) {}
+	void UserOnUnixStreamRead() override {}
+	void UserOnUnixStreamSocketClosed() override {
+		this->numClosed++;
+	}
+	void UserOnUnixStreamMessage(const uint8_t *data, size_t len) override {
+		this->messages.emplace_back(reinterpret_cast<const char*>(data), len);
+	}
+	size_t GetBufferSize() const {
+		return this->bufferSize;
+	}
+	size_t GetBufferReadPos() const {
+		return this->bufferReadPos;
+	}
+	size_t GetBufferDataLen() const {
+		return this->bufferDataLen;
+	}
+
+public:
+	std::vector<std::string> messages;
+	size_t numClosed { 0 };
+};
+
+// Runs the loop until done() or timeoutMs.
+static bool waitFor(const std::function<bool()> &done, uint64_t timeoutMs) {
+	uint64_t deadline = uv_hrtime() + timeoutMs * 1000000;
+
+	while (!done()) {
+		if (uv_hrtime() > deadline)
+			return false;
+
+		uv_run(DepLibUV::GetLoop(), UV_RUN_NOWAIT);
+	}
+
+	return true;
+}
+
+// Reads len bytes from the (non blocking) fd while running the loop.
+static bool readAll(int fd, std::string &data, size_t len) {
+	char buffer[65536];
+
+	return waitFor([&] {
+		ssize_t nread = read(fd, buffer, sizeof(buffer));
+
+		if (nread > 0)
+			data.append(buffer, static_cast<size_t>(nread));
+
+		return data.size() >= len;
+	}, 5000) && data.size() == len;
+}
+
+// Sends the bytes and runs the loop until the reader has read them.
+static bool sendRaw(int fd, int readerFd, const std::string &data) {
+	if (write(fd, data.data(), data.size()) != static_cast<ssize_t>(data.size()))
+		return false;
+
+	return waitFor([readerFd] {
+		int pending { 0 };
+
+		ioctl(readerFd, FIONREAD, &pending);
+
+		return pending == 0;
+	}, 1000);
+}
+
+static std::string makePart(size_t len, size_t seed) {
+	std::string part(len, '\0');
+
+	for (size_t i = 0; i < len; ++i)
+		part[i] = static_cast<char>((i * 31 + seed) % 251);
+
+	return part;
+}
+
+// Buffers over the parts, and what the reader must get.
+static std::string toBuffers(const std::vector<std::string> &parts,
+		std::vector<uv_buf_t> &buffers) {
+	std::string all;
+
+	buffers.clear();
+
+	for (auto &part : parts) {
+		buffers.push_back(uv_buf_init(const_cast<char*>(part.data()),
+				part.size()));
+		all += part;
+	}
+
+	return all;
+}
+
+static UnixStreamSocket::onWriteCallback* recordCallback(
+		std::vector<int> &results, int id) {
+	return new UnixStreamSocket::onWriteCallback([&results, id](bool written) {
+		results.push_back(written ? id : -id);
+	});
+}
+
+static bool checkWrites(int fds[2]) {
+	// Small enough for the large writes to be sent partially.
+	int sendBufferSize = 16384;
+
+	setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &sendBufferSize,
+			sizeof(sendBufferSize));
+
+	auto *writer = new Writer(fds[0]);
+	std::vector<int> results;
+	std::vector<uv_buf_t> buffers;
+	std::string expected;
+	std::string received;
+
+	// Written at once, the callback too.
+	std::vector<std::string> small { "ab", "", "cde", makePart(100, 1) };
+
+	expected = toBuffers(small, buffers);
+	writer->Write(buffers.data(), buffers.size(), recordCallback(results, 1));
+
+	CHECK(results == std::vector<int>({ 1 }));
+	CHECK(readAll(fds[1], received, expected.size()));
+	CHECK(received == expected);
+
+	// Nothing to write.
+	std::vector<std::string> empty { "", "" };
+
+	toBuffers(empty, buffers);
+	writer->Write(buffers.data(), buffers.size(), recordCallback(results, 2));
+
+	CHECK(results == std::vector<int>({ 1, -2 }));
+
+	// Sent partially, the written bytes ending inside some buffer, and the
+	// second write queued behind the first. Odd sizes so they don't end on a
+	// buffer boundary. The parts are copied, they can go away now.
+	std::vector<std::string> large1 { makePart(7, 2), makePart(100003, 3),
+			makePart(1, 4), makePart(300007, 5), makePart(13, 6) };
+	std::vector<std::string> large2 { makePart(50021, 7), makePart(3, 8) };
+
+	results.clear();
+	received.clear();
+	expected = toBuffers(large1, buffers);
+	writer->Write(buffers.data(), buffers.size(), recordCallback(results, 3));
+	expected += toBuffers(large2, buffers);
+	writer->Write(buffers.data(), buffers.size(), recordCallback(results, 4));
+	large1.clear();
+	large2.clear();
+
+	CHECK(results.empty());
+	CHECK(readAll(fds[1], received, expected.size()));
+	CHECK(received == expected);
+	CHECK(waitFor([&] { return results.size() == 2; }, 1000));
+	CHECK(results == std::vector<int>({ 3, 4 }));
+
+	// Batched into one write, each callback called once it is sent.
+	results.clear();
+	received.clear();
+	expected.clear();
+	writer->SetBatching(true);
+
+	for (int i = 0; i < 10; ++i) {
+		std::vector<std::string> parts { makePart(i + 1, i), "|" };
+
+		expected += toBuffers(parts, buffers);
+		writer->Write(buffers.data(), buffers.size(),
+				recordCallback(results, 10 + i));
+	}
+
+	CHECK(results.empty());
+	CHECK(readAll(fds[1], received, expected.size()));
+	CHECK(received == expected);
+	CHECK(results.size() == 10);
+
+	for (int i = 0; i < 10; ++i)
+		CHECK(results[i] == 10 + i);
+
+	// Closed, the callback still called.
+	results.clear();
+	writer->Close();
+	writer->Write(reinterpret_cast<const uint8_t*>("x"), 1,
+			recordCallback(results, 20));
+
+	CHECK(results == std::vector<int>({ -20 }));
+	CHECK(writer->numClosed == 0);
+
+	delete writer;
+
+	return true;
+}
+
+static bool checkWriteHandleFlushError(int fds[2], int handleFds[2]) {
+	auto *writer = new Writer(fds[0], true);
+	uv_pipe_t handle;
+	std::vector<int> results;
+
+	uv_pipe_init(DepLibUV::GetLoop(), &handle, 0);
+	uv_pipe_open(&handle, handleFds[0]);
+
+	// Batched data waits, then the peer goes away: sending the batch first
+	// fails, closes the socket and the subclass deletes it.
+	writer->deleteOnClose = true;
+	writer->SetBatching(true);
+	writer->Write(reinterpret_cast<const uint8_t*>("batched"), 7,
+			recordCallback(results, 1));
+	close(fds[1]);
+	writer->WriteHandle(reinterpret_cast<const uint8_t*>("h"), 1,
+			reinterpret_cast<uv_handle_t*>(&handle),
+			recordCallback(results, 2));
+
+	CHECK(results == std::vector<int>({ -1, -2 }));
+
+	bool closed { false };
+
+	handle.data = &closed;
+	uv_close(reinterpret_cast<uv_handle_t*>(&handle), [](uv_handle_t *h) {
+		*static_cast<bool*>(h->data) = true;
+	});
+
+	CHECK(waitFor([&] { return closed; }, 1000));
+
+	return true;
+}
+
+static bool checkNetstring(int fds[2]) {
+	auto *reader = new Reader(fds[0], 64);
+
+	reader->SetFraming(UnixStreamSocket::Framing::NETSTRING, 1000);
+
+	// Split in the header, the data and before the end.
+	CHECK(sendRaw(fds[1], fds[0], "1"));
+	CHECK(sendRaw(fds[1], fds[0], "2:hello"));
+	CHECK(sendRaw(fds[1], fds[0], " world!"));
+	CHECK(reader->messages.empty());
+	CHECK(sendRaw(fds[1], fds[0], ","));
+	CHECK(reader->messages == std::vector<std::string>({ "hello world!" }));
+	CHECK(reader->GetBufferReadPos() == 0 && reader->GetBufferDataLen() == 0);
+
+	// Several at once, an empty one too.
+	reader->messages.clear();
+
+	CHECK(sendRaw(fds[1], fds[0], "0:,3:abc,"));
+	CHECK(reader->messages == std::vector<std::string>({ "", "abc" }));
+
+	// The unfinished message stays where it is while there is room after it.
+	reader->messages.clear();
+
+	CHECK(sendRaw(fds[1], fds[0], "3:abc,5:12"));
+	CHECK(reader->GetBufferReadPos() == 6 && reader->GetBufferDataLen() == 10);
+	CHECK(sendRaw(fds[1], fds[0], "3"));
+	CHECK(reader->GetBufferReadPos() == 6 && reader->GetBufferDataLen() == 11);
+	CHECK(sendRaw(fds[1], fds[0], "45,"));
+	CHECK(reader->messages == std::vector<std::string>({ "abc", "12345" }));
+
+	// And is moved to the start once less than half the buffer is left.
+	reader->messages.clear();
+
+	CHECK(sendRaw(fds[1], fds[0],
+			"10:0123456789,10:0123456789,10:0123456789,10:01234"));
+	CHECK(reader->messages.size() == 3);
+	CHECK(reader->GetBufferReadPos() == 42 && reader->GetBufferDataLen() == 50);
+	CHECK(sendRaw(fds[1], fds[0], "56"));
+	CHECK(reader->GetBufferReadPos() == 0 && reader->GetBufferDataLen() == 10);
+	CHECK(sendRaw(fds[1], fds[0], "789,"));
+	CHECK(reader->messages.size() == 4 && reader->messages[3] == "0123456789");
+
+	// Bigger than the buffer, which grows for it and shrinks back.
+	std::string big = makePart(200, 9);
+
+	reader->messages.clear();
+
+	CHECK(sendRaw(fds[1], fds[0], "200:" + big.substr(0, 100)));
+	CHECK(reader->GetBufferSize() == 4 + 200 + 1);
+	CHECK(sendRaw(fds[1], fds[0], big.substr(100) + ","));
+	CHECK(reader->messages == std::vector<std::string>({ big }));
+	CHECK(reader->GetBufferSize() == 64);
+	CHECK(reader->numClosed == 0);
+
+	delete reader;
+
+	return true;
+}
+
+static bool checkLengthPrefix(int fds[2]) {
+	auto *reader = new Reader(fds[0], 64);
+
+	reader->SetFraming(UnixStreamSocket::Framing::LENGTH_PREFIX, 1000);
+
+	// Split in the header and in the data.
+	CHECK(sendRaw(fds[1], fds[0], std::string("\0\0", 2)));
+	CHECK(sendRaw(fds[1], fds[0], std::string("\0\5hel", 5)));
+	CHECK(reader->messages.empty());
+	CHECK(sendRaw(fds[1], fds[0], "lo"));
+	CHECK(reader->messages == std::vector<std::string>({ "hello" }));
+
+	// Empty.
+	reader->messages.clear();
+
+	CHECK(sendRaw(fds[1], fds[0], std::string("\0\0\0\0", 4)));
+	CHECK(reader->messages == std::vector<std::string>({ "" }));
+
+	// Bigger than the buffer.
+	std::string big = makePart(300, 10);
+
+	reader->messages.clear();
+
+	CHECK(sendRaw(fds[1], fds[0],
+			std::string("\0\0\1\x2c", 4) + big.substr(0, 100)));
+	CHECK(reader->GetBufferSize() == 4 + 300);
+	CHECK(sendRaw(fds[1], fds[0], big.substr(100)));
+	CHECK(reader->messages == std::vector<std::string>({ big }));
+	CHECK(reader->GetBufferSize() == 64);
+	CHECK(reader->numClosed == 0);
+
+	delete reader;
+
+	return true;
+}
+
+// The frame closes the reading socket, without any message.
+static bool checkRejected(UnixStreamSocket::Framing framing,
+		const std::string &data) {
+	int fds[2];
+
+	CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+	auto *reader = new Reader(fds[0], 64);
+
+	reader->SetFraming(framing, 1000);
+
+	CHECK(sendRaw(fds[1], fds[0], data));
+	CHECK(reader->IsClosed() && reader->numClosed == 1);
+	CHECK(reader->messages.empty());
+
+	delete reader;
+	close(fds[1]);
+
+	return true;
+}
+
+static bool checkWriteMessage(int fds[2]) {
+	auto *reader = new Reader(fds[0], 64);
+	auto *writer = new Writer(fds[1]);
+	std::string big = makePart(101, 11);
+	std::vector<int> results;
+
+	reader->SetFraming(UnixStreamSocket::Framing::LENGTH_PREFIX, 100);
+	writer->SetFraming(UnixStreamSocket::Framing::LENGTH_PREFIX, 100);
+
+	writer->WriteMessage(reinterpret_cast<const uint8_t*>("abc"), 3,
+			recordCallback(results, 1));
+
+	CHECK(waitFor([&] { return reader->messages.size() == 1; }, 1000));
+	CHECK(reader->messages[0] == "abc");
+
+	// More than the peer accepts is not sent.
+	writer->WriteMessage(reinterpret_cast<const uint8_t*>(big.data()),
+			big.size(), recordCallback(results, 2));
+
+	// Nor what the header cannot hold (the data is not read).
+	if (sizeof(size_t) > 4) {
+		writer->SetFraming(UnixStreamSocket::Framing::LENGTH_PREFIX, SIZE_MAX);
+		writer->WriteMessage(reinterpret_cast<const uint8_t*>(big.data()),
+				static_cast<size_t>(UINT32_MAX) + 1, recordCallback(results, 3));
+		writer->SetFraming(UnixStreamSocket::Framing::NETSTRING, SIZE_MAX);
+		writer->WriteMessage(reinterpret_cast<const uint8_t*>(big.data()),
+				static_cast<size_t>(10000000000), recordCallback(results, 4));
+	}
+
+	CHECK(sendRaw(fds[1], fds[0], ""));
+	CHECK(reader->messages.size() == 1 && !reader->IsClosed());
+
+	if (sizeof(size_t) > 4)
+		CHECK(results == std::vector<int>({ 1, -2, -3, -4 }));
+	else
+		CHECK(results == std::vector<int>({ 1, -2 }));
+
+	delete writer;
+	delete reader;
+
+	return true;
+}
+
+int main() {
+	DepLibUV::ClassInit();
+
+	// Writing to a closed peer fails instead of killing the process.
+	signal(SIGPIPE, SIG_IGN);
+
+	int fds[2];
+	int handleFds[2];
+	bool ok { true };
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) != 0) {
+		perror("socketpair");
+
+		return 1;
+	}
+
+	if (!checkWrites(fds))
+		ok = false;
+
+	close(fds[1]);
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0
+			|| socketpair(AF_UNIX, SOCK_STREAM, 0, handleFds) != 0) {
+		perror("socketpair");
+
+		return 1;
+	}
+
+	if (!checkWriteHandleFlushError(fds, handleFds))
+		ok = false;
+
+	close(handleFds[1]);
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+		perror("socketpair");
+
+		return 1;
+	}
+
+	if (!checkNetstring(fds))
+		ok = false;
+
+	close(fds[1]);
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+		perror("socketpair");
+
+		return 1;
+	}
+
+	if (!checkLengthPrefix(fds))
+		ok = false;
+
+	close(fds[1]);
+
+	// Leading zero, bad end, not a length, too big.
+	if (!checkRejected(UnixStreamSocket::Framing::NETSTRING, "01:a,")
+			|| !checkRejected(UnixStreamSocket::Framing::NETSTRING, "1:ab")
+			|| !checkRejected(UnixStreamSocket::Framing::NETSTRING, "x:")
+			|| !checkRejected(UnixStreamSocket::Framing::NETSTRING, "1001:")
+			|| !checkRejected(UnixStreamSocket::Framing::LENGTH_PREFIX,
+					std::string("\0\0\3\xe9", 4)))
+		ok = false;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+		perror("socketpair");
+
+		return 1;
+	}
+
+	if (!checkWriteMessage(fds))
+		ok = false;
+
+	printf("UnixStreamSocket check %s\n", ok ? "passed" : "FAILED");
+
+	return ok ? 0 : 1;
+}